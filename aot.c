@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lc3.h"
+#include "vm.h"
+#include "aot.h"
+
+void aot_load(vm* vm, const aot_program* p) {
+    /*
+        This function loads the images held by a translated program into the memory of a machine that has not run yet.
+    */
+
+    for (int i = 0; i < p->image_count; ++i) {
+        const aot_image* image = &p->images[i];
+        for (uint32_t k = 0; k < image->length; ++k) {
+            vm_poke(vm, (uint16_t)(image->origin + k), image->words[k]);
+        }
+    }
+}
+
+void aot_written(const aot_program* p, uint16_t address) {
+    /*
+        This function marks the translated block that holds an address as dirty, after a store changed the word at the address.
+        The blocks are sorted and don't overlap, so the block is found with a binary search.
+    */
+
+    int lo = 0, hi = p->block_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (address < p->block_start[mid]) {
+            hi = mid - 1;
+        } else if (address > p->block_end[mid]) {
+            lo = mid + 1;
+        } else {
+            p->dirty[mid] = 1;
+            return;
+        }
+    }
+}
+
+static void check_code(vm* vm, const aot_program* p) {
+    // mark the blocks whose words are not the words of the images any more, after the interpreter ran a slice of the program
+    for (int i = 0; i < p->image_count; ++i) {
+        const aot_image* image = &p->images[i];
+        for (uint32_t k = 0; k < image->length; ++k) {
+            uint16_t a = (uint16_t)(image->origin + k);
+            if (aot_code(p, a) && vm_peek(vm, a) != image->words[k]) aot_written(p, a);
+        }
+    }
+}
+
+static int store_address(vm* vm, uint16_t* address) {
+    // the address written by the instruction at the PC, if it is a store (read without the side effects of the devices)
+    uint16_t pc = vm->reg[R_PC];
+    uint16_t instr = vm_peek(vm, pc);
+    decoded_instr d;
+    decode_instr(instr, &d);
+    switch (d.handler) {
+        case H_ST: *address = pc + 1 + d.imm; return 1;
+        case H_STR: *address = vm->reg[d.r2] + d.imm; return 1;
+        case H_STI: *address = vm_peek(vm, (uint16_t)(pc + 1 + d.imm)); return 1;
+    }
+    return 0;
+}
+
+int aot_run(vm* vm, const aot_program* p, uint64_t budget) {
+    /*
+        This function runs a machine loaded with a translated program (aot_load) for at most budget instructions, and returns like vm_run.
+        The translated blocks run the program, and the interpreter runs what they stop at, one instruction at a time.
+        A store run by the interpreter is checked like a store of a translated block: when it changes the word of a block,
+        the block is interpreted from then on. While the keyboard interrupt is enabled, the interrupts can only be taken by
+        the interpreter, so it runs the program by slices of AOT_SLICE instructions, and the words of all the blocks are checked
+        after every slice.
+    */
+
+    if (!vm->running) return vm->illegal ? VM_ILLEGAL : VM_HALTED;
+    vm_update_interrupts(vm);
+    uint64_t left = budget;
+    while (left) {
+        if (!vm->interrupts) {
+            uint32_t executed = p->run(vm, left > UINT32_MAX ? UINT32_MAX : (uint32_t)left);
+            vm->instructions += executed;
+            left -= executed;
+            if (executed) continue;
+
+            // the interpreter runs the instruction the translated blocks stopped at
+            uint16_t address, old = 0;
+            int store = store_address(vm, &address);
+            if (store) old = vm_peek(vm, address);
+            uint64_t before = vm->instructions;
+            int result = vm_run(vm, 1);
+            if (store && aot_code(p, address) && vm_peek(vm, address) != old) aot_written(p, address);
+            if (result != VM_BUDGET) return result;
+            left -= vm->instructions - before;
+        } else {
+            uint64_t slice = left < AOT_SLICE ? left : AOT_SLICE;
+            uint64_t before = vm->instructions;
+            int result = vm_run(vm, slice);
+            check_code(vm, p);
+            if (result != VM_BUDGET) return result;
+            left -= vm->instructions - before;
+        }
+    }
+    return VM_BUDGET;
+}
@@ -0,0 +1,63 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Ahead-of-time translated programs.
+    The translator (translate.c, built as lc3aot) reads the images of a program, recovers its control flow graph from PC 0x3000,
+    and writes a C file in which every basic block it found is a block of C code, with the registers in local variables.
+    Compiled with aot_main.c and linked with liblc3vm, the C file is a native program for those images only (see make %.aot).
+
+    The translated code runs the instructions the way the handlers define them (handlers.h), and goes back to the interpreter
+    for what it can't do on its own: the traps other than TRAP_OUT, the stores to the I/O page and the loads of the I/O page
+    by an idle loop (which then waits for a key, see H_LDI_POLL), RTI and the reserved opcode,
+    jumps to an address that is not the start of a translated block (an indirect JMP or JSRR, code that was not found),
+    and the blocks whose words were overwritten (self-modifying code). The interpreter runs one instruction at a time
+    until the PC reaches a translated block again, and it runs the program while the keyboard interrupt is enabled.
+
+    A translated program holds its images, so it starts without reading a file.
+    The dirty flags of the blocks are in the program: a translated program runs one machine at a time.
+*/
+
+// Number of instructions the interpreter runs at a time while the keyboard interrupt is enabled
+#define AOT_SLICE 100000
+
+// An image of the program: its origin and its words
+typedef struct
+{
+    uint16_t origin;
+    uint32_t length;
+    const uint16_t* words;
+} aot_image;
+
+typedef struct
+{
+    const char* name;           // the image files it was translated from
+    const aot_image* images;
+    int image_count;
+    const uint16_t* block_start; // the first and last address of every translated block, sorted
+    const uint16_t* block_end;
+    int block_count;
+    const uint8_t* code;        // one bit per address, set when the address is in a translated block
+    uint8_t* dirty;             // one per block, set once a word of the block was changed: the block is interpreted from then on
+    /*
+        Runs the translated blocks from reg[R_PC], for at most budget instructions, and returns the number of instructions executed.
+        It returns when it reaches something the translation doesn't run, with reg[R_PC] on it: 0 means the interpreter
+        has to run the instruction at the PC.
+    */
+    uint32_t (*run)(vm* vm, uint32_t budget);
+} aot_program;
+
+static inline int aot_code(const aot_program* p, uint16_t address) {
+    // the address holds an instruction of a translated block
+    return (p->code[address >> 3] >> (address & 7)) & 1;
+}
+
+void aot_load(vm* vm, const aot_program* p);
+void aot_written(const aot_program* p, uint16_t address);
+int aot_run(vm* vm, const aot_program* p, uint64_t budget);
+
+#endif
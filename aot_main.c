@@ -0,0 +1,133 @@
+/*
+    The program of an ahead-of-time translation (see aot.h): it runs the images the C file of lc3aot was translated from,
+    attached to the console like ./main, or headless with --headless like ./main --headless.
+
+    Headless, the keyboard reads the --input file (or the standard input) one key at a time when the program asks for one,
+    so a run with the same input executes the same instructions as ./main --headless, and prints the same output.
+    The run stops when the program halts, after --limit instructions, or at an illegal instruction, and a line like
+        status=halted instructions=1234 seconds=0.001
+    is printed to the standard error.
+
+    Usage: PROGRAM [--headless [--input=FILE] [--limit=INSTRUCTIONS]]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+#include "vm.h"
+#include "aot.h"
+#include "input.h"
+#include "output.h"
+#include "utils.h"
+
+extern const aot_program aot_translated; // the C file written by lc3aot
+
+static int console_key_ready(void* user) { return input_available(); }
+static int console_read_key(void* user) { return input_getc(); }
+static void console_wait_key(void* user) { input_wait(); }
+
+static vm* console_vm;
+
+static void flush_console() {
+    if (console_vm) output_flush(&console_vm->out);
+}
+
+#define NO_KEY (-2)
+
+// The keyboard of a headless machine, a MR_KBSR poll waits for the next byte (like stream_io in main.c)
+typedef struct
+{
+    FILE* input;
+    int next;
+} stream_io;
+
+static int stream_key_ready(void* user) {
+    stream_io* s = user;
+    if (s->next == NO_KEY) s->next = getc(s->input);
+    return 1;
+}
+
+static int stream_read_key(void* user) {
+    stream_io* s = user;
+    int c = s->next;
+    s->next = NO_KEY;
+    return c == NO_KEY ? getc(s->input) : c;
+}
+
+static int run_headless(vm* vm, const char* input_path, uint64_t limit) {
+    stream_io s = { stdin, NO_KEY };
+    if (input_path && !(s.input = fopen(input_path, "rb"))) {
+        printf("failed to read input: %s\n", input_path);
+        exit(1);
+    }
+    vm_io io = { stream_key_ready, stream_read_key, output_write_stdout, &s };
+    vm_set_io(vm, &io);
+
+    double start = clock_seconds();
+    int result = aot_run(vm, &aot_translated, limit ? limit : UINT64_MAX);
+    double seconds = clock_seconds() - start;
+    output_flush(&vm->out);
+
+    // the same status line as ./main --headless (see run_headless in main.c)
+    const char* name = result == VM_HALTED ? "halted" : result == VM_ILLEGAL ? "illegal" : "budget";
+    fprintf(stderr, "status=%s instructions=%llu pc=x%04X", name, (unsigned long long)vm->instructions, vm->reg[R_PC]);
+    if (result == VM_ILLEGAL) fprintf(stderr, " instr=x%04X", vm_peek(vm, vm->reg[R_PC]));
+    fprintf(stderr, " seconds=%.3f\n", seconds);
+    if (s.input != stdin) fclose(s.input);
+    return result == VM_HALTED ? 0 : result == VM_ILLEGAL ? 5 : 3; // the exit statuses of ./main --headless
+}
+
+int main(int argc, const char* argv[]) {
+    int headless = 0;
+    const char* input_path = NULL;
+    uint64_t limit = 0;
+    for (int j = 1; j < argc; ++j) {
+        if (strcmp(argv[j], "--headless") == 0) {
+            headless = 1;
+        } else if (strncmp(argv[j], "--input=", 8) == 0) {
+            input_path = argv[j] + 8;
+        } else if (strncmp(argv[j], "--limit=", 8) == 0) {
+            limit = strtoull(argv[j] + 8, NULL, 10);
+        } else {
+            printf("%s [--headless [--input=FILE] [--limit=INSTRUCTIONS]]\n", argv[0]);
+            printf("runs %s, translated ahead of time\n", aot_translated.name);
+            exit(2);
+        }
+    }
+
+    vm_io io = { console_key_ready, console_read_key, output_write_stdout, NULL, console_wait_key };
+    vm* vm = vm_create(&io);
+    if (!vm) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    aot_load(vm, &aot_translated);
+
+    if (headless) {
+        int status = run_headless(vm, input_path, limit);
+        vm_destroy(vm);
+        return status;
+    }
+
+    signal(SIGINT, handle_interrupt);
+    console_vm = vm;
+    atexit(flush_console);
+    disable_input_buffering();
+    input_start();
+
+    int result = aot_run(vm, &aot_translated, UINT64_MAX);
+    if (result == VM_ILLEGAL) {
+        output_flush(&vm->out);
+        restore_input_buffering();
+        fprintf(stderr, "illegal instruction x%04X at x%04X\n", vm_peek(vm, vm->reg[R_PC]), vm->reg[R_PC]);
+        abort();
+    }
+
+    console_vm = NULL;
+    vm_destroy(vm);
+    restore_input_buffering();
+}
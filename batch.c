@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lc3.h"
+#include "vm.h"
+#include "output.h"
+#include "routine.h"
+#include "batch.h"
+
+/*
+    The vectors of lanes: VEC_LANES 16-bit lanes, with the operations the instructions need.
+    They are 16 lanes with AVX2 and 8 with SSE2 or NEON, depending on what the compiler targets (-mavx2 for AVX2),
+    and a single lane without vector instructions.
+*/
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define VEC_LANES 16
+static inline vec v_load(const uint16_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void v_store(uint16_t* p, vec x) { _mm256_storeu_si256((__m256i*)p, x); }
+static inline vec v_set(uint16_t x) { return _mm256_set1_epi16((short)x); }
+static inline vec v_add(vec a, vec b) { return _mm256_add_epi16(a, b); }
+static inline vec v_and(vec a, vec b) { return _mm256_and_si256(a, b); }
+static inline vec v_or(vec a, vec b) { return _mm256_or_si256(a, b); }
+static inline vec v_xor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+static inline vec v_andnot(vec m, vec a) { return _mm256_andnot_si256(m, a); }
+static inline vec v_eq(vec a, vec b) { return _mm256_cmpeq_epi16(a, b); }
+static inline vec v_sign(vec a) { return _mm256_srai_epi16(a, 15); }
+static inline vec v_min(vec a, vec b) { return _mm256_min_epu16(a, b); }
+#elif defined(__SSE2__) || defined(_M_X64)
+typedef __m128i vec;
+#define VEC_LANES 8
+static inline vec v_load(const uint16_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void v_store(uint16_t* p, vec x) { _mm_storeu_si128((__m128i*)p, x); }
+static inline vec v_set(uint16_t x) { return _mm_set1_epi16((short)x); }
+static inline vec v_add(vec a, vec b) { return _mm_add_epi16(a, b); }
+static inline vec v_and(vec a, vec b) { return _mm_and_si128(a, b); }
+static inline vec v_or(vec a, vec b) { return _mm_or_si128(a, b); }
+static inline vec v_xor(vec a, vec b) { return _mm_xor_si128(a, b); }
+static inline vec v_andnot(vec m, vec a) { return _mm_andnot_si128(m, a); }
+static inline vec v_eq(vec a, vec b) { return _mm_cmpeq_epi16(a, b); }
+static inline vec v_sign(vec a) { return _mm_srai_epi16(a, 15); }
+static inline vec v_min(vec a, vec b) {
+    // SSE2 only has the signed minimum: the sign bits are flipped around it
+    vec s = _mm_set1_epi16((short)0x8000);
+    return _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(a, s), _mm_xor_si128(b, s)), s);
+}
+#elif defined(__ARM_NEON)
+typedef uint16x8_t vec;
+#define VEC_LANES 8
+static inline vec v_load(const uint16_t* p) { return vld1q_u16(p); }
+static inline void v_store(uint16_t* p, vec x) { vst1q_u16(p, x); }
+static inline vec v_set(uint16_t x) { return vdupq_n_u16(x); }
+static inline vec v_add(vec a, vec b) { return vaddq_u16(a, b); }
+static inline vec v_and(vec a, vec b) { return vandq_u16(a, b); }
+static inline vec v_or(vec a, vec b) { return vorrq_u16(a, b); }
+static inline vec v_xor(vec a, vec b) { return veorq_u16(a, b); }
+static inline vec v_andnot(vec m, vec a) { return vbicq_u16(a, m); }
+static inline vec v_eq(vec a, vec b) { return vceqq_u16(a, b); }
+static inline vec v_sign(vec a) { return vreinterpretq_u16_s16(vshrq_n_s16(vreinterpretq_s16_u16(a), 15)); }
+static inline vec v_min(vec a, vec b) { return vminq_u16(a, b); }
+#else
+typedef uint16_t vec;
+#define VEC_LANES 1
+static inline vec v_load(const uint16_t* p) { return *p; }
+static inline void v_store(uint16_t* p, vec x) { *p = x; }
+static inline vec v_set(uint16_t x) { return x; }
+static inline vec v_add(vec a, vec b) { return a + b; }
+static inline vec v_and(vec a, vec b) { return a & b; }
+static inline vec v_or(vec a, vec b) { return a | b; }
+static inline vec v_xor(vec a, vec b) { return a ^ b; }
+static inline vec v_andnot(vec m, vec a) { return a & ~m; }
+static inline vec v_eq(vec a, vec b) { return a == b ? 0xFFFF : 0; }
+static inline vec v_sign(vec a) { return a >> 15 ? 0xFFFF : 0; }
+static inline vec v_min(vec a, vec b) { return a < b ? a : b; }
+#endif
+
+static inline vec v_sel(vec m, vec a, vec b) {
+    // a in the lanes of the mask m, b in the others
+    return v_or(v_and(m, a), v_andnot(m, b));
+}
+
+struct vm_batch
+{
+    int count;                         // number of lanes
+    int width;                         // count rounded up to a whole number of vectors: the length of the arrays of lanes
+    vm** lanes;
+    uint16_t* reg[R_COUNT];            // the registers of the lanes, reg[r][lane]
+    uint16_t* live;                    // 0xFFFF for the lanes running in lockstep
+    uint16_t* group;                   // 0xFFFF for the lanes that execute the current step
+    uint16_t* steps;                   // instructions executed in lockstep by every lane since they were last counted
+    uint16_t* left;                    // instructions every lane can still execute before they are counted again
+    uint64_t* executed;                // instructions executed by every lane during batch_run
+    uint64_t* polls;                   // reads of MR_KBSR without a key by every lane during batch_run
+    int* result;                       // why every lane stopped (VM_BUDGET while it can run)
+    int* alone;                        // the lane enabled the keyboard interrupt, and runs alone on the interpreter
+    int running;                       // number of lanes running in lockstep
+    uint8_t written[MEMORY_MAX];       // a lane stored to the address, so the lanes may hold different words there
+    decoded_instr decoded[MEMORY_MAX]; // the instruction at the addresses no lane wrote, decoded once for all the lanes
+};
+
+static void compare_memory(vm_batch* b, int lane) {
+    // mark the addresses where a lane and lane 0 hold different words (every lane for lane 0), only the pages they don't share are read
+    if (lane == 0) {
+        for (int i = 1; i < b->count; ++i) compare_memory(b, i);
+        return;
+    }
+    vm* first = b->lanes[0];
+    vm* other = b->lanes[lane];
+    for (int p = 0; p < VM_PAGES; ++p) {
+        if (first->pages[p] == other->pages[p]) continue;
+        for (int w = 0; w < VM_PAGE_WORDS; ++w) {
+            if (first->pages[p]->words[w] != other->pages[p]->words[w]) b->written[(p << VM_PAGE_SHIFT) | w] = 1;
+        }
+    }
+}
+
+static void forget_owned_pages(vm_batch* b, int lane) {
+    /*
+        This function drops the instructions decoded for the batch on the pages the lane doesn't share with another machine.
+        A lane only writes in place to the pages it owns, so they hold every store it made while it ran alone,
+        including the stores compare_memory can't see: any store in a batch of one lane, and the stores every lane made alike.
+    */
+
+    const vm* vm = b->lanes[lane];
+    for (int p = 0; p < VM_PAGES; ++p) {
+        if (atomic_load_explicit(&vm->pages[p]->refs, memory_order_relaxed) != 1) continue;
+        for (int w = 0; w < VM_PAGE_WORDS; ++w) b->decoded[(p << VM_PAGE_SHIFT) | w].handler = H_NONE;
+    }
+}
+
+vm_batch* batch_create(vm* const* lanes, int count) {
+    /*
+        This function creates a batch of lanes, the machines of the array lanes, which should run the same program.
+        The machines belong to the caller, and are only run by batch_run until the batch is freed.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm_batch* b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    b->count = count;
+    b->width = (count + VEC_LANES - 1) / VEC_LANES * VEC_LANES;
+    int ok = (b->lanes = calloc(count, sizeof(*b->lanes))) != NULL;
+    for (int r = 0; r < R_COUNT; ++r) ok = ok && (b->reg[r] = calloc(b->width, sizeof(uint16_t)));
+    ok = ok && (b->live = calloc(b->width, sizeof(uint16_t))) && (b->group = calloc(b->width, sizeof(uint16_t)));
+    ok = ok && (b->steps = calloc(b->width, sizeof(uint16_t))) && (b->left = calloc(b->width, sizeof(uint16_t)));
+    ok = ok && (b->executed = calloc(count, sizeof(uint64_t))) && (b->polls = calloc(count, sizeof(uint64_t)));
+    ok = ok && (b->result = calloc(count, sizeof(int))) && (b->alone = calloc(count, sizeof(int)));
+    if (!ok) {
+        batch_free(b);
+        return NULL;
+    }
+    memcpy(b->lanes, lanes, count * sizeof(*lanes));
+    if (count) compare_memory(b, 0);
+    return b;
+}
+
+void batch_free(vm_batch* b) {
+    // the lanes are not destroyed
+    if (!b) return;
+    free(b->lanes);
+    for (int r = 0; r < R_COUNT; ++r) free(b->reg[r]);
+    free(b->live);
+    free(b->group);
+    free(b->steps);
+    free(b->left);
+    free(b->executed);
+    free(b->polls);
+    free(b->result);
+    free(b->alone);
+    free(b);
+}
+
+int batch_result(const vm_batch* b, int lane) {
+    // why the lane stopped during the last batch_run, like vm_run: VM_BUDGET if it can still run
+    return b->result[lane];
+}
+
+static void load_lane(vm_batch* b, int lane) {
+    for (int r = 0; r < R_COUNT; ++r) b->reg[r][lane] = b->lanes[lane]->reg[r];
+}
+
+static void save_lane(vm_batch* b, int lane) {
+    for (int r = 0; r < R_COUNT; ++r) b->lanes[lane]->reg[r] = b->reg[r][lane];
+}
+
+static void count_lane(vm_batch* b, int lane) {
+    // add the instructions the lane executed in lockstep to its instruction count
+    b->lanes[lane]->instructions += b->steps[lane];
+    b->executed[lane] += b->steps[lane];
+    b->steps[lane] = 0;
+}
+
+static void stop_lane(vm_batch* b, int lane, int result) {
+    // take a lane out of the lockstep, with its registers back in its machine
+    count_lane(b, lane);
+    save_lane(b, lane);
+    b->live[lane] = 0;
+    b->running--;
+    b->result[lane] = result;
+}
+
+static void fold(vm_batch* b, uint64_t budget) {
+    /*
+        This function counts the instructions every lane executed in lockstep, before their 16-bit counters overflow,
+        stops the lanes that executed budget instructions, and the lanes that spent most of them polling an empty MR_KBSR
+        when they park on input (see VM_IDLE_POLL_RATIO). The other lanes can execute BATCH_FOLD more instructions
+        (or what is left of their budget) before the next fold.
+    */
+
+    for (int i = 0; i < b->count; ++i) {
+        count_lane(b, i);
+        if (!b->live[i]) continue;
+        vm* vm = b->lanes[i];
+        if (b->executed[i] >= budget) {
+            stop_lane(b, i, VM_BUDGET);
+        } else if (vm->park_on_input && b->polls[i] && b->polls[i] * VM_IDLE_POLL_RATIO >= b->executed[i]) {
+            stop_lane(b, i, VM_BLOCKED);
+        } else {
+            b->left[i] = budget - b->executed[i] < BATCH_FOLD ? (uint16_t)(budget - b->executed[i]) : BATCH_FOLD;
+        }
+    }
+}
+
+static uint16_t lane_read(vm_batch* b, int lane, uint16_t address) {
+    // a load of a lane, which goes to its devices in the I/O page like engine_read in vm.c
+    vm* vm = b->lanes[lane];
+    if (address < VM_IO_BASE) return vm_peek(vm, address);
+    vm->io_instructions = vm->instructions + b->steps[lane];
+    uint64_t polls = vm->empty_polls;
+    uint16_t val = vm_io_read(vm, address);
+    b->polls[lane] += vm->empty_polls - polls;
+    return val;
+}
+
+static void lane_write(vm_batch* b, int lane, uint16_t address, uint16_t val) {
+    // a store of a lane, after which the lanes may hold different words at the address
+    mem_write(b->lanes[lane], address, val);
+    b->written[address] = 1;
+}
+
+static uint16_t next_group(vm_batch* b, int* leader) {
+    /*
+        This function finds the lanes of the next step: the running lanes at the smallest PC, among those that can still
+        execute an instruction before the next fold. It returns the PC and sets leader to the first lane of the group,
+        or to -1 when no lane can execute an instruction.
+    */
+
+    vec ones = v_set(0xFFFF);
+    vec zero = v_set(0);
+    vec low = ones;
+    for (int k = 0; k < b->width; k += VEC_LANES) {
+        // the lanes that don't run count as 0xFFFF
+        vec can = v_andnot(v_eq(v_load(b->left + k), zero), v_load(b->live + k));
+        v_store(b->group + k, can);
+        low = v_min(low, v_or(v_load(b->reg[R_PC] + k), v_xor(can, ones)));
+    }
+    uint16_t lows[VEC_LANES];
+    v_store(lows, low);
+    uint16_t pc = 0xFFFF;
+    for (int i = 0; i < VEC_LANES; ++i) if (lows[i] < pc) pc = lows[i];
+
+    vec at = v_set(pc);
+    for (int k = 0; k < b->width; k += VEC_LANES) {
+        v_store(b->group + k, v_and(v_eq(v_load(b->reg[R_PC] + k), at), v_load(b->group + k)));
+    }
+    int i = 0;
+    while (i < b->count && !b->group[i]) ++i;
+    *leader = i < b->count ? i : -1;
+    return pc;
+}
+
+static void vector_step(vm_batch* b, const decoded_instr* d, uint16_t pc) {
+    /*
+        This function executes an instruction without memory access (an operate instruction, LEA, BR, JMP, JSR or JSRR)
+        for the lanes of the group, a vector of lanes at a time, the way its handler does (handlers.h).
+        The other lanes keep their registers.
+    */
+
+    int h = d->handler;
+    vec ones = v_set(0xFFFF);
+    vec next = v_set(pc + 1);
+    vec imm = v_set(d->imm);
+    vec target = v_set(pc + 1 + d->imm);
+    // the condition codes a BR tests, as masks
+    vec test_n = v_set(d->r1 & FL_NEG ? 0xFFFF : 0);
+    vec test_z = v_set(d->r1 & FL_ZRO ? 0xFFFF : 0);
+    vec test_p = v_set(d->r1 & FL_POS ? 0xFFFF : 0);
+    int sets = h != H_BR && h != H_JMP && h != H_JSR && h != H_JSRR; // writes a register and the condition codes
+
+    for (int k = 0; k < b->width; k += VEC_LANES) {
+        vec g = v_load(b->group + k);
+        vec result = ones;
+        vec new_pc = next;
+        switch (h) {
+            case H_ADD_REG: result = v_add(v_load(b->reg[d->r2] + k), v_load(b->reg[d->r3] + k)); break;
+            case H_ADD_IMM: result = v_add(v_load(b->reg[d->r2] + k), imm); break;
+            case H_AND_REG: result = v_and(v_load(b->reg[d->r2] + k), v_load(b->reg[d->r3] + k)); break;
+            case H_AND_IMM: result = v_and(v_load(b->reg[d->r2] + k), imm); break;
+            case H_NOT: result = v_xor(v_load(b->reg[d->r2] + k), ones); break;
+            case H_LEA: result = target; break;
+            case H_BR:
+                {
+                    // the flags of the last result of every lane (see cond_flags)
+                    vec cond = v_load(b->reg[R_COND] + k);
+                    vec neg = v_sign(cond);
+                    vec zero = v_eq(cond, v_set(0));
+                    vec pos = v_andnot(v_or(neg, zero), ones);
+                    vec taken = v_or(v_or(v_and(neg, test_n), v_and(zero, test_z)), v_and(pos, test_p));
+                    new_pc = v_sel(taken, target, next);
+                }
+                break;
+            case H_JSR:
+                v_store(b->reg[R_R7] + k, v_sel(g, next, v_load(b->reg[R_R7] + k)));
+                new_pc = target;
+                break;
+            case H_JSRR:
+                // like the handler, the base register is read after R7 was written
+                v_store(b->reg[R_R7] + k, v_sel(g, next, v_load(b->reg[R_R7] + k)));
+                new_pc = v_load(b->reg[d->r2] + k);
+                break;
+            case H_JMP: new_pc = v_load(b->reg[d->r2] + k); break;
+        }
+        if (sets) {
+            v_store(b->reg[d->r1] + k, v_sel(g, result, v_load(b->reg[d->r1] + k)));
+            v_store(b->reg[R_COND] + k, v_sel(g, result, v_load(b->reg[R_COND] + k)));
+        }
+        v_store(b->reg[R_PC] + k, v_sel(g, new_pc, v_load(b->reg[R_PC] + k)));
+        v_store(b->steps + k, v_add(v_load(b->steps + k), v_and(g, v_set(1))));
+        v_store(b->left + k, v_add(v_load(b->left + k), g)); // g is -1 in the lanes of the group
+    }
+}
+
+static void memory_step(vm_batch* b, const decoded_instr* d, uint16_t pc) {
+    /*
+        This function executes a load, a store, TRAP_OUT, TRAP_PUTS or TRAP_PUTSP for the lanes of the group, one lane at a time.
+        The address of LD and ST, and the pointer of LDI and STI, are the same in every lane: when no lane wrote it,
+        it holds the same word in every lane, which is read once.
+        A lane whose store to the I/O page enabled the keyboard interrupt leaves the lockstep.
+    */
+
+    uint16_t next = pc + 1;
+    uint16_t fixed = next + d->imm;
+    int shared = fixed < VM_IO_BASE && !b->written[fixed];
+    uint16_t word = shared ? vm_peek(b->lanes[0], fixed) : 0;
+    uint16_t** reg = b->reg;
+
+    for (int i = 0; i < b->count; ++i) {
+        if (!b->group[i]) continue;
+        uint16_t address = 0;
+        int store = 0;
+        switch (d->handler) {
+            case H_LD:
+                reg[d->r1][i] = reg[R_COND][i] = shared ? word : lane_read(b, i, fixed);
+                break;
+            case H_LDR:
+                reg[d->r1][i] = reg[R_COND][i] = lane_read(b, i, reg[d->r2][i] + d->imm);
+                break;
+            case H_LDI:
+                address = shared ? word : lane_read(b, i, fixed);
+                reg[d->r1][i] = reg[R_COND][i] = lane_read(b, i, address);
+                break;
+            case H_ST:
+                address = fixed;
+                store = 1;
+                lane_write(b, i, address, reg[d->r1][i]);
+                break;
+            case H_STR:
+                address = reg[d->r2][i] + d->imm;
+                store = 1;
+                lane_write(b, i, address, reg[d->r1][i]);
+                break;
+            case H_STI:
+                address = shared ? word : lane_read(b, i, fixed);
+                store = 1;
+                lane_write(b, i, address, reg[d->r1][i]);
+                break;
+            case H_TRAP:
+                reg[R_R7][i] = next;
+                if (d->imm == TRAP_OUT) output_putc(&b->lanes[i]->out, (char)reg[R_R0][i]);
+                else trap_puts(b->lanes[i], reg[R_R0][i], d->imm == TRAP_PUTSP);
+                break;
+        }
+        reg[R_PC][i] = next;
+        b->steps[i]++;
+        b->left[i]--;
+        if (store && address >= VM_IO_BASE && b->lanes[i]->interrupts) {
+            stop_lane(b, i, VM_BUDGET);
+            b->alone[i] = 1;
+        }
+    }
+}
+
+static void routine_step(vm_batch* b, const decoded_instr* d, uint16_t pc, uint64_t budget) {
+    /*
+        This function executes a JSR to a guest library routine (see routine.h) for the lanes of the group, one lane at a time:
+        in every lane whose registers and budget allow it, the routine runs natively, and the lane is at the return address;
+        the other lanes are at the start of the routine, which they execute in lockstep like any code.
+        The instructions of a lane are counted before the call, since a routine can take more of them than the 16-bit counters hold.
+    */
+
+    for (int i = 0; i < b->count; ++i) {
+        if (!b->group[i]) continue;
+        vm* vm = b->lanes[i];
+        count_lane(b, i);
+        save_lane(b, i);
+        vm->reg[R_R7] = pc + 1;
+        vm->reg[R_PC] = pc + 1 + d->imm;
+        vm->instructions++;
+        b->executed[i]++;
+        uint64_t cost = routine_cost(vm, d->r3);
+        if (cost && cost <= budget - b->executed[i]) {
+            // the words the routine stores to (MEMCPY and MEMSET from R0 to where R0 ends, STRCPY up to its zero word)
+            uint16_t from = vm->reg[R_R0];
+            routine_call(vm, d->r3, cost);
+            vm->instructions += cost;
+            b->executed[i] += cost;
+            if (d->r3 == ROUTINE_MEMCPY || d->r3 == ROUTINE_MEMSET || d->r3 == ROUTINE_STRCPY) {
+                uint16_t to = vm->reg[R_R0] + (d->r3 == ROUTINE_STRCPY);
+                for (uint16_t a = from; a != to; ++a) b->written[a] = 1;
+            }
+        }
+        load_lane(b, i);
+        b->left[i] = budget - b->executed[i] < BATCH_FOLD ? (uint16_t)(budget - b->executed[i]) : BATCH_FOLD;
+    }
+}
+
+static void scalar_step(vm_batch* b) {
+    /*
+        This function has the interpreter execute the instruction of the group (a trap other than the output ones, RTI, the reserved opcode,
+        or an instruction of the I/O page, whose fetch reads the devices) in every lane of the group. An exception pushes the PSR and the PC onto the supervisor stack of the lane, which is a store.
+    */
+
+    for (int i = 0; i < b->count; ++i) {
+        if (!b->group[i]) continue;
+        vm* vm = b->lanes[i];
+        count_lane(b, i);
+        save_lane(b, i);
+        uint16_t psr = vm->psr;
+        uint64_t before = vm->instructions;
+        int result = vm_run(vm, 1);
+        b->executed[i] += vm->instructions - before;
+        b->left[i]--;
+        load_lane(b, i);
+        if ((psr & PSR_USER) && !(vm->psr & PSR_USER)) {
+            b->written[vm->reg[R_R6]] = 1;
+            b->written[(uint16_t)(vm->reg[R_R6] + 1)] = 1;
+        }
+        if (result != VM_BUDGET || vm->interrupts) {
+            stop_lane(b, i, result);
+            b->alone[i] = result == VM_BUDGET;
+        }
+    }
+}
+
+static void decode_lane(const vm* vm, uint16_t pc, uint16_t instr, decoded_instr* d) {
+    // decode an instruction of the batch, with the handler of a native routine for a JSR to one, like decode_at in vm.c
+    decode_instr(instr, d);
+#ifndef NO_ROUTINES
+    int routine;
+    if (d->handler == H_JSR && (routine = routine_find(vm, (uint16_t)(pc + 1 + d->imm))) >= 0) {
+        d->handler = H_JSR_NATIVE;
+        d->r3 = (uint8_t)routine;
+    }
+#endif
+}
+
+uint64_t batch_run(vm_batch* b, uint64_t budget) {
+    /*
+        This function runs every lane of a batch for at most budget instructions, like vm_run, and returns the number of instructions
+        they executed together. A lane stops when it executed budget instructions, halts, reaches an illegal instruction,
+        or waits for a key when it parks on input (batch_result tells which), and batch_run returns once no lane runs. The lanes that run alone on the interpreter are run after the others.
+        A lane stopped by a wait for a key runs again with the next batch_run.
+    */
+
+    b->running = 0;
+    for (int i = 0; i < b->count; ++i) {
+        vm* vm = b->lanes[i];
+        b->executed[i] = b->polls[i] = b->steps[i] = b->live[i] = 0;
+        if (!vm->running) {
+            b->result[i] = vm->illegal ? VM_ILLEGAL : VM_HALTED;
+            continue;
+        }
+        b->result[i] = VM_BUDGET;
+        vm->started = 1;
+        vm->waiting_input = 0;
+        vm->empty_polls = 0;
+        vm_update_interrupts(vm);
+        load_lane(b, i);
+        if (vm->interrupts) {
+            b->alone[i] = 1;
+            continue;
+        }
+        if (b->alone[i]) {
+            // the stores of a lane that ran alone were not seen by the batch
+            b->alone[i] = 0;
+            forget_owned_pages(b, i);
+            compare_memory(b, i);
+        }
+        b->live[i] = 0xFFFF;
+        b->running++;
+    }
+
+    fold(b, budget);
+    while (b->running) {
+        int leader;
+        uint16_t pc = next_group(b, &leader);
+        if (leader < 0) {
+            fold(b, budget);
+            continue;
+        }
+        decoded_instr d;
+        if (pc >= VM_IO_BASE) {
+            scalar_step(b);
+            continue;
+        }
+        if (b->written[pc]) {
+            // the lanes may hold different instructions here: the step only runs the lanes holding the instruction of the leader
+            uint16_t instr = vm_peek(b->lanes[leader], pc);
+            for (int i = leader + 1; i < b->count; ++i) {
+                if (b->group[i] && vm_peek(b->lanes[i], pc) != instr) b->group[i] = 0;
+            }
+            decode_lane(b->lanes[leader], pc, instr, &d);
+        } else {
+            if (b->decoded[pc].handler == H_NONE) decode_lane(b->lanes[0], pc, vm_peek(b->lanes[0], pc), &b->decoded[pc]);
+            d = b->decoded[pc];
+        }
+
+        switch (d.handler) {
+            case H_LD: case H_LDR: case H_LDI: case H_ST: case H_STR: case H_STI:
+                memory_step(b, &d, pc);
+                break;
+            case H_TRAP:
+                if (d.imm == TRAP_OUT || d.imm == TRAP_PUTS || d.imm == TRAP_PUTSP) {
+                    memory_step(b, &d, pc);
+                } else {
+                    scalar_step(b);
+                }
+                break;
+            case H_JSR_NATIVE:
+                routine_step(b, &d, pc, budget);
+                break;
+            case H_RTI: case H_ILLEGAL:
+                scalar_step(b);
+                break;
+            default:
+                vector_step(b, &d, pc);
+                break;
+        }
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < b->count; ++i) {
+        if (b->alone[i] && b->executed[i] < budget) {
+            vm* vm = b->lanes[i];
+            uint64_t before = vm->instructions;
+            b->result[i] = vm_run(vm, budget - b->executed[i]);
+            b->executed[i] += vm->instructions - before;
+        }
+        total += b->executed[i];
+    }
+    return total;
+}
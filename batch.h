@@ -0,0 +1,39 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Lockstep execution of many machines running the same program, like the copies of a game played by bots.
+
+    A batch runs a group of machines, its lanes, whose registers it holds as structure of arrays: reg[r][lane].
+    At every step, the batch takes the smallest PC of its running lanes, and the lanes at that PC execute its instruction together:
+    it is decoded once, and its register and branch work is done for all the lanes at once with vector instructions
+    (AVX2, SSE2 or NEON, whatever the compiler targets), the lanes at other PCs being masked out.
+    Lanes that took different branches are at different PCs, and join again when they reach the same PC: the lanes behind
+    always run first (the smallest PC), so they catch up with the lanes ahead at the next shared address, like the end of a loop.
+
+    Loads and stores go to the memory of every lane, whose pages are usually shared (the lanes are forks of one machine, see snapshot.h),
+    so the code and the data that no lane wrote stay in one copy. An address no lane has stored to holds the same word in every lane:
+    its instruction is decoded once for the batch, and a load of it is one read. The output traps (TRAP_OUT, TRAP_PUTS and TRAP_PUTSP)
+    are written lane by lane too, and the other traps, RTI and the reserved opcode are run by the interpreter, lane by lane.
+    A JSR to a guest library routine (see routine.h) runs the routine natively, lane by lane, in the lanes whose registers and budget
+    allow it (routine_cost), and the other lanes interpret it in lockstep: the lanes stay in the batch, and meet again at the return address.
+    A lane that enables the keyboard interrupt leaves the lockstep and runs alone on the interpreter while the interrupt is enabled.
+
+    The lanes are plain machines (no debugger or profiler), and the host does not write their memory while they are in a batch.
+*/
+
+// The batch checks the lanes blocked on input and counts their instructions every BATCH_FOLD steps
+#define BATCH_FOLD 0x7FFF
+
+typedef struct vm_batch vm_batch;
+
+vm_batch* batch_create(vm* const* lanes, int count);
+void batch_free(vm_batch* b);
+uint64_t batch_run(vm_batch* b, uint64_t budget);
+int batch_result(const vm_batch* b, int lane);
+
+#endif
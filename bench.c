@@ -0,0 +1,224 @@
+/*
+    The benchmark runs LC-3 programs without a terminal and measures the speed of the dispatch engines.
+
+    Every program is given with a script of keys: the keys are fed to TRAP_GETC, TRAP_IN and MR_KBDR one after the other,
+    and the run ends when the program halts, or waits for a key after the last one (see park_on_input), or reaches --limit.
+    The same run is done with every engine, --repeat times, and the fastest time is kept.
+    A short run is measured by repeating it for BENCH_MIN_SECONDS and dividing the time by the number of runs.
+    The scripted input makes every run execute the same instructions, so the engines must agree on the number of instructions
+    and of output bytes: the benchmark fails if they don't.
+    After the engines, the superinstructions of every program are listed (see vm_fusions) with the number of times the switch engine
+    executed each of them, and the share of the instructions they executed, then the guest library routines it ran natively (see routine.h)
+    if there are any.
+    With --pmu, every engine runs every program once more with the performance counters of the host (see pmu.h),
+    which are listed per LC-3 instruction after the superinstructions: host cycles, instructions, branch mispredicts
+    and L1 instruction cache misses. The timed runs are not measured, so their times don't include reading the counters.
+
+    Usage: lc3bench [--repeat=N] [--limit=INSTRUCTIONS] [--pmu] image-file1 keys-file1 [image-file2 keys-file2] ...
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "snapshot.h"
+#include "pmu.h"
+#include "utils.h"
+
+// Number of instructions run by one call of vm_run. A program polling MR_KBSR after the last key is stopped after at most one slice.
+#define BENCH_SLICE 10000
+
+// A measure runs the program again and again until it took at least this long, so that short programs are timed too
+#define BENCH_MIN_SECONDS 0.2
+
+// The scripted keyboard and the console of a machine
+typedef struct
+{
+    const char* keys;
+    size_t len;
+    size_t pos;
+    uint64_t output; // number of bytes written to the console
+} bench_io;
+
+static int bench_key_ready(void* user) {
+    bench_io* b = user;
+    return b->pos < b->len;
+}
+
+static int bench_read_key(void* user) {
+    bench_io* b = user;
+    return b->pos < b->len ? (unsigned char)b->keys[b->pos++] : EOF;
+}
+
+static void bench_write(void* user, const char* buf, size_t n) {
+    bench_io* b = user;
+    b->output += n;
+}
+
+static char* read_file(const char* path, size_t* size) {
+    // read a whole file into memory, NULL if it can't be read
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    size_t cap = 4096, len = 0;
+    char* data = malloc(cap);
+    size_t n;
+    while (data && (n = fread(data + len, 1, cap - len, file)) > 0) {
+        len += n;
+        if (len == cap) data = realloc(data, cap *= 2);
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+typedef struct
+{
+    uint64_t instructions;
+    uint64_t output;
+    double seconds;
+    int engine; // the engine that ran, which is not the one asked for when the JIT is not available
+    uint64_t fusions[FUSION_COUNT];
+    uint64_t routines[ROUTINE_COUNT];
+} bench_result;
+
+static bench_result bench_run(vm* image, int engine, const char* keys, size_t len, uint64_t limit, vm_pmu* pmu) {
+    /*
+        This function runs a fork of a loaded machine with an engine and the keys of a script, and measures the run,
+        with the performance counters pmu if it is not NULL.
+    */
+
+    bench_io b = { keys, len, 0, 0 };
+    vm_io io = { bench_key_ready, bench_read_key, bench_write, &b };
+    vm* vm = vm_fork(image, &io);
+    if (!vm) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    vm->engine = engine;
+    vm->park_on_input = 1;
+    vm->pmu = pmu;
+
+    bench_result r;
+    double start = clock_seconds();
+    while (vm->instructions < limit) {
+        uint64_t budget = limit - vm->instructions;
+        if (vm_run(vm, budget < BENCH_SLICE ? budget : BENCH_SLICE) != VM_BUDGET) break;
+    }
+    r.seconds = clock_seconds() - start;
+    r.instructions = vm->instructions;
+    r.engine = vm->engine;
+    memcpy(r.fusions, vm->fusions, sizeof(r.fusions));
+    memcpy(r.routines, vm->routines, sizeof(r.routines));
+    vm_destroy(vm); // writes the output that is still buffered
+    r.output = b.output;
+    return r;
+}
+
+int main(int argc, const char* argv[]) {
+    static const char* engine_names[] = { "switch", "threaded", "jit" };
+    int repeat = 3;
+    uint64_t limit = 1000000000;
+    int measure = 0;
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; ++first) {
+        if (strncmp(argv[first], "--repeat=", 9) == 0) {
+            repeat = atoi(argv[first] + 9);
+        } else if (strncmp(argv[first], "--limit=", 8) == 0) {
+            limit = strtoull(argv[first] + 8, NULL, 10);
+        } else if (strcmp(argv[first], "--pmu") == 0) {
+            measure = 1;
+        } else {
+            printf("unknown option: %s\n", argv[first]);
+            exit(2);
+        }
+    }
+    if (first == argc || (argc - first) % 2 != 0 || repeat < 1) {
+        printf("lc3bench [--repeat=N] [--limit=INSTRUCTIONS] [--pmu] image-file1 keys-file1 [image-file2 keys-file2] ...\n");
+        exit(2);
+    }
+
+    int failed = 0;
+    printf("%-20s %-9s %14s %10s %10s %12s %8s\n", "image", "engine", "instructions", "seconds", "MIPS", "output", "speedup");
+    for (int j = first; j < argc; j += 2) {
+        const char* image_path = argv[j];
+        size_t len;
+        char* keys = read_file(argv[j + 1], &len);
+        if (!keys) {
+            printf("failed to read keys: %s\n", argv[j + 1]);
+            exit(1);
+        }
+        vm_io io = { bench_key_ready, bench_read_key, bench_write, NULL };
+        vm* image = vm_create(&io);
+        if (!image) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        if (!read_image(image, image_path)) {
+            printf("failed to load image: %s\n", image_path);
+            exit(1);
+        }
+        const char* name = strrchr(image_path, '/') ? strrchr(image_path, '/') + 1 : image_path;
+
+        bench_result base = { 0 };
+        for (int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+            bench_result best = { 0 };
+            for (int r = 0; r < repeat; ++r) {
+                bench_result result = bench_run(image, engine, keys, len, limit, NULL);
+                int runs = 1;
+                double total = result.seconds;
+                while (total < BENCH_MIN_SECONDS) {
+                    total += bench_run(image, engine, keys, len, limit, NULL).seconds;
+                    ++runs;
+                }
+                result.seconds = total / runs;
+                if (r == 0 || result.seconds < best.seconds) best = result;
+            }
+            if (best.engine != engine) continue; // the engine is not available on this host
+            if (engine == ENGINE_SWITCH) base = best;
+
+            double mips = best.seconds > 0 ? best.instructions / best.seconds / 1e6 : 0.0;
+            printf("%-20s %-9s %14llu %10.3f %10.1f %12llu %7.2fx\n", name, engine_names[engine], (unsigned long long)best.instructions,
+                best.seconds, mips, (unsigned long long)best.output, best.seconds > 0 ? base.seconds / best.seconds : 0.0);
+            if (best.instructions != base.instructions || best.output != base.output) {
+                printf("%s: the %s engine does not run like the switch engine\n", name, engine_names[engine]);
+                failed = 1;
+            }
+        }
+        printf("\n%-20s %-24s %14s %10s\n", "image", "superinstruction", "executed", "share");
+        for (int f = 0; f < FUSION_COUNT; ++f) {
+            uint64_t fired = base.fusions[f];
+            double share = base.instructions ? 100.0 * fired * vm_fusions[f].length / base.instructions : 0.0;
+            printf("%-20s %-24s %14llu %9.2f%%\n", name, vm_fusions[f].name, (unsigned long long)fired, share);
+        }
+        printf("\n");
+        uint64_t calls = 0;
+        for (int r = 0; r < ROUTINE_COUNT; ++r) calls += base.routines[r];
+        if (calls) {
+            // the guest library routines of the program that the switch engine ran natively
+            printf("%-20s %-24s %14s\n", "image", "native routine", "calls");
+            for (int r = 0; r < ROUTINE_COUNT; ++r) {
+                printf("%-20s %-24s %14llu\n", name, vm_routines[r].name, (unsigned long long)base.routines[r]);
+            }
+            printf("\n");
+        }
+        if (measure) {
+            // one more run per engine, with the counters of the host
+            vm_pmu* pmu = pmu_open();
+            if (!pmu) {
+                printf("not enough memory\n");
+                exit(1);
+            }
+            for (int engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) bench_run(image, engine, keys, len, limit, pmu);
+            printf("%s\n", name);
+            pmu_report(stdout, pmu);
+            printf("\n");
+            pmu_close(pmu);
+        }
+        fflush(stdout);
+        vm_destroy(image);
+        free(keys);
+    }
+    return failed;
+}
@@ -0,0 +1,180 @@
+; An arithmetic benchmark: a program that spends its time in the guest library routines the machine runs natively (see routine.h).
+; It multiplies every pair of numbers from 1 to N twice, divides the products by 37, fills and copies buffers and strings,
+; and prints a checksum of the results as a decimal number, which it computes with the same division routine.
+; bench/arith.obj is this program assembled; it reads no keys, so its keys file (bench/arith.keys) is empty.
+
+        .ORIG x3000
+
+MAIN    AND R5, R5, #0          ; R5: the checksum, left alone by the routines like R6
+
+        ; the products and the quotients
+        LD R0, N
+        ST R0, I
+ILOOP   LD R0, N
+        ST R0, J
+JLOOP   LD R0, I
+        LD R1, J
+        JSR MUL                 ; R2 = I * J
+        ADD R5, R5, R2
+        LD R0, I
+        LD R1, J
+        JSR MULSA               ; R2 = I * J
+        ADD R5, R5, R2
+        ADD R0, R2, #0
+        LD R1, DIVISOR
+        JSR DIV                 ; R2 = I * J / 37, R0 = I * J % 37
+        ADD R5, R5, R2
+        ADD R5, R5, R0
+        LD R0, J
+        ADD R0, R0, #-1
+        ST R0, J
+        BRp JLOOP
+        LD R0, I
+        ADD R0, R0, #-1
+        ST R0, I
+        BRp ILOOP
+
+        ; the buffers and the strings
+        LD R0, ROUNDS
+        ST R0, K
+KLOOP   LD R0, BUF1P
+        ADD R1, R5, #0
+        LD R2, SIZE
+        JSR MEMSET              ; BUF1 = the checksum
+        LD R0, BUF2P
+        LD R1, BUF1P
+        LD R2, SIZE
+        JSR MEMCPY              ; BUF2 = BUF1, R0 = the end of BUF2
+        ADD R5, R5, R0
+        LD R0, BUF3P
+        LEA R1, TEXT
+        JSR STRCPY              ; BUF3 = TEXT
+        LD R0, BUF3P
+        JSR STRLEN              ; R1 = the length of BUF3
+        ADD R5, R5, R1
+        LD R0, K
+        ADD R0, R0, #-1
+        ST R0, K
+        BRp KLOOP
+
+        ; the checksum, without its sign bit, in decimal
+        LEA R0, TEXT
+        PUTS
+        LD R0, MASK
+        AND R0, R5, R0
+        LEA R3, DEND
+        ST R3, PTR
+DLOOP   LD R1, TEN
+        JSR DIV                 ; R2 = R0 / 10, R0 = the last digit
+        LD R4, ZERO
+        ADD R0, R0, R4
+        LD R3, PTR
+        ADD R3, R3, #-1
+        STR R0, R3, #0
+        ST R3, PTR
+        ADD R0, R2, #0
+        BRp DLOOP
+        LD R0, PTR
+        PUTS
+        LEA R0, NEWLINE
+        PUTS
+        HALT
+
+N       .FILL #150
+DIVISOR .FILL #37
+TEN     .FILL #10
+ZERO    .FILL x30
+MASK    .FILL x7FFF
+ROUNDS  .FILL #200
+SIZE    .FILL #256
+BUF1P   .FILL BUF1
+BUF2P   .FILL BUF2
+BUF3P   .FILL BUF3
+I       .FILL #0
+J       .FILL #0
+K       .FILL #0
+PTR     .FILL #0
+DIGITS  .BLKW #5
+DEND    .FILL #0
+TEXT    .STRINGZ "checksum: "
+NEWLINE .FILL x0A
+        .FILL #0
+
+; The library routines, the code routine.h recognizes
+
+; R2 = R0 * R1, by repeated addition
+MUL     AND R2, R2, #0
+        ADD R1, R1, #0
+        BRz MULEND
+MULLOOP ADD R2, R2, R0
+        ADD R1, R1, #-1
+        BRnp MULLOOP
+MULEND  RET
+
+; R2 = R0 * R1, by shift and add
+MULSA   AND R2, R2, #0
+        AND R3, R3, #0
+        ADD R3, R3, #1
+MSLOOP  AND R4, R1, R3
+        BRz MSSKIP
+        ADD R2, R2, R0
+MSSKIP  ADD R0, R0, R0
+        ADD R3, R3, R3
+        BRnp MSLOOP
+        RET
+
+; R2 = R0 / R1, R0 = R0 % R1, by repeated subtraction
+DIV     AND R2, R2, #0
+        NOT R3, R1
+        ADD R3, R3, #1
+DIVLOOP ADD R0, R0, R3
+        BRn DIVEND
+        ADD R2, R2, #1
+        BRnzp DIVLOOP
+DIVEND  ADD R0, R0, R1
+        RET
+
+; copy R2 words from R1 to R0
+MEMCPY  ADD R2, R2, #0
+        BRz MCEND
+MCLOOP  LDR R3, R1, #0
+        STR R3, R0, #0
+        ADD R0, R0, #1
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRnp MCLOOP
+MCEND   RET
+
+; store R1 to R2 words from R0
+MEMSET  ADD R2, R2, #0
+        BRz MSEND
+MSETLP  STR R1, R0, #0
+        ADD R0, R0, #1
+        ADD R2, R2, #-1
+        BRnp MSETLP
+MSEND   RET
+
+; R1 = the length of the string at R0
+STRLEN  ADD R2, R0, #0
+        AND R1, R1, #0
+SLLOOP  LDR R3, R2, #0
+        BRz SLEND
+        ADD R1, R1, #1
+        ADD R2, R2, #1
+        BRnzp SLLOOP
+SLEND   RET
+
+; copy the string at R1 to R0
+STRCPY  LDR R2, R1, #0
+        STR R2, R0, #0
+        BRz SCEND
+        ADD R0, R0, #1
+        ADD R1, R1, #1
+        BRnzp STRCPY
+SCEND   RET
+
+BUF1    .BLKW #256
+BUF2    .BLKW #256
+BUF3    .BLKW #32
+
+        .END
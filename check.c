@@ -0,0 +1,746 @@
+/*
+    The checks of make check: every way of running a program must run it like the switch engine.
+
+    Every program is given with a script of keys: the keys are fed to TRAP_GETC, TRAP_IN and MR_KBDR one after the other,
+    then the keyboard reads EOF, like ./main --headless at the end of its input, and the run ends when the program halts
+    or reaches --limit. The program is run with the switch engine, then with the threaded engine, the JIT, the switch engine
+    with check_routines (see routine.h) and in lockstep (see batch.h), and every run must end with the same result,
+    the same number of instructions, the same PC and the same console output, byte for byte.
+    A run with check_routines must also find no native routine call that differs from the interpreter.
+    The lanes of the lockstep run each skip a different number of keys at the start of the script, so that they take different paths,
+    and every lane is compared with a run of the switch engine on its own keys.
+    A run is also stopped halfway, written to a checkpoint and resumed from it in a fresh fork of the machine, and another run is
+    hibernated a third of the way and resumed by vm_run (see checkpoint.h): both must end like the run that was never stopped.
+    The input of a run is recorded, and the recording is replayed without the keys (see replay.h): the replay must not diverge
+    and must end like the switch engine. It then seeks back halfway, where its registers and memory must be those of a run stopped there,
+    and runs to the end again, writing the rest of the output.
+    The first CHECK_TRACE instructions are run traced (see trace.h), and the trace file is decoded by lc3trace: every record it prints
+    must be the instruction a machine stepping one instruction at a time executes, with the register and the memory word it left.
+    A client of the GDB remote protocol debugs a fork of the machine through debug_gdb on a free port of the local host:
+    it steps, stops at a breakpoint and at a watchpoint, reads and writes registers and memory, and interrupts the machine,
+    and every reply must hold what a machine stepping one instruction at a time did.
+
+    The checkpoints, recordings and traces are written to a directory made for the run in $TMPDIR.
+    The ahead-of-time translations are checked against ./main --headless by the check target of the Makefile.
+
+    Usage: lc3check [--limit=INSTRUCTIONS] [--lanes=N] [--lc3trace=PATH] image-file1 keys-file1 [image-file2 keys-file2] ...
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "snapshot.h"
+#include "batch.h"
+#include "output.h"
+#include "checkpoint.h"
+#include "replay.h"
+#include "trace.h"
+#include "debug.h"
+#include "thread.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Number of instructions run by one call of vm_run
+#define CHECK_SLICE 100000
+// Number of instructions traced and decoded by lc3trace, at most
+#define CHECK_TRACE 200000
+// Number of instructions the GDB client runs before its breakpoint, and the most it looks ahead for a store to watch
+#define CHECK_GDB_BREAK 1000
+#define CHECK_GDB_WATCH 1000000
+
+// The scripted keyboard and the console of a machine
+typedef struct
+{
+    const char* keys;
+    size_t len;
+    size_t pos;
+    char* output;      // everything written to the console
+    size_t output_len;
+    size_t output_cap;
+} check_io;
+
+static int check_key_ready(void* user) { return 1; } // EOF after the last key
+
+static int check_read_key(void* user) {
+    check_io* c = user;
+    return c->pos < c->len ? (unsigned char)c->keys[c->pos++] : EOF;
+}
+
+static void check_write(void* user, const char* buf, size_t n) {
+    check_io* c = user;
+    if (c->output_len + n > c->output_cap) {
+        size_t cap = c->output_cap ? c->output_cap : 4096;
+        while (cap < c->output_len + n) cap *= 2;
+        if (!(c->output = realloc(c->output, cap))) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        c->output_cap = cap;
+    }
+    memcpy(c->output + c->output_len, buf, n);
+    c->output_len += n;
+}
+
+static char* read_file(const char* path, size_t* size) {
+    // read a whole file into memory, NULL if it can't be read
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    size_t cap = 4096, len = 0;
+    char* data = malloc(cap);
+    size_t n;
+    while (data && (n = fread(data + len, 1, cap - len, file)) > 0) {
+        len += n;
+        if (len == cap) data = realloc(data, cap *= 2);
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+// How a run ended
+typedef struct
+{
+    int result;
+    uint64_t instructions;
+    uint16_t pc;
+    int engine;          // the engine that ran, which is not the one asked for when the JIT is not available
+    uint64_t mismatches; // native routine calls that differed from the interpreter, with check_routines
+    check_io io;         // the console output of the run
+} check_run;
+
+static vm* fork_machine(vm* image, check_io* c, const char* keys, size_t len) {
+    // a fork of the loaded machine, reading the keys of the script
+    *c = (check_io){ keys, len, 0, NULL, 0, 0 };
+    vm_io io = { check_key_ready, check_read_key, check_write, c };
+    vm* vm = vm_fork(image, &io);
+    if (!vm) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    return vm;
+}
+
+static void end_run(check_run* r, vm* vm, int result) {
+    // record how the machine stopped, and destroy it (which writes the output that is still buffered)
+    r->result = result;
+    r->instructions = vm->instructions;
+    r->pc = vm->reg[R_PC];
+    r->engine = vm->engine;
+    r->mismatches = vm->routine_mismatches;
+    vm_destroy(vm);
+}
+
+static int run_until(vm* vm, uint64_t limit) {
+    // run the machine until it halts or has executed limit instructions in all, and return the result of the last vm_run
+    int result = VM_BUDGET;
+    while (result == VM_BUDGET && vm->instructions < limit) {
+        uint64_t budget = limit - vm->instructions;
+        result = vm_run(vm, budget < CHECK_SLICE ? budget : CHECK_SLICE);
+    }
+    return result;
+}
+
+static int replay_until(vm_recording* rec, uint64_t limit) {
+    // run_until for a recorded or replayed machine
+    int result = VM_BUDGET;
+    while (result == VM_BUDGET && rec->vm->instructions < limit) {
+        uint64_t budget = limit - rec->vm->instructions;
+        result = replay_run(rec, budget < CHECK_SLICE ? budget : CHECK_SLICE);
+    }
+    return result;
+}
+
+static void run_engine(check_run* r, vm* image, int engine, int check_routines, const char* keys, size_t len, uint64_t limit) {
+    // run a fork of the loaded machine with an engine, until it halts or reaches the limit
+    vm* vm = fork_machine(image, &r->io, keys, len);
+    vm->engine = engine;
+    vm->check_routines = check_routines;
+    end_run(r, vm, run_until(vm, limit));
+}
+
+static int compare(const char* name, const char* what, const check_run* run, const check_run* base) {
+    // print the line of a run, and return 1 if it did not run like the switch engine
+    static const char* result_names[] = { "halted", "budget", "blocked", "illegal", "break", "error" };
+    int same = run->result == base->result && run->instructions == base->instructions && run->pc == base->pc
+        && run->io.output_len == base->io.output_len && (!base->io.output_len || memcmp(run->io.output, base->io.output, base->io.output_len) == 0)
+        && run->mismatches == 0;
+    printf("%-20s %-16s %-8s %14llu   x%04X %12zu  %s\n", name, what, result_names[run->result], (unsigned long long)run->instructions,
+        run->pc, run->io.output_len, same ? "ok" : "FAILED");
+    if (run->mismatches) printf("%s: %llu native routine calls differed from the interpreter\n", name, (unsigned long long)run->mismatches);
+    return !same;
+}
+
+static int check_lockstep(vm* image, const char* name, const char* keys, size_t len, uint64_t limit, int lanes) {
+    /*
+        This function runs lanes forks of the loaded machine in lockstep, lane i without the first i keys of the script,
+        and compares every lane with a run of the switch engine on the same keys. It returns 1 if a lane differs.
+    */
+
+    vm** vms = calloc(lanes, sizeof(*vms));
+    check_run* runs = calloc(lanes, sizeof(*runs));
+    if (!vms || !runs) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < lanes; ++i) {
+        size_t skip = (size_t)i < len ? (size_t)i : len;
+        vms[i] = fork_machine(image, &runs[i].io, keys + skip, len - skip);
+    }
+    vm_batch* b = batch_create(vms, lanes);
+    if (!b) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    batch_run(b, limit);
+
+    int failed = 0;
+    for (int i = 0; i < lanes; ++i) {
+        end_run(&runs[i], vms[i], batch_result(b, i));
+        size_t skip = (size_t)i < len ? (size_t)i : len;
+        check_run base;
+        run_engine(&base, image, ENGINE_SWITCH, 0, keys + skip, len - skip, limit);
+        char what[32];
+        snprintf(what, sizeof(what), "lockstep lane %d", i);
+        failed |= compare(name, what, &runs[i], &base);
+        free(base.io.output);
+        free(runs[i].io.output);
+    }
+    batch_free(b);
+    free(runs);
+    free(vms);
+    return failed;
+}
+
+static int check_checkpoint(vm* image, const vm_snapshot* loaded, const char* name, const char* keys, size_t len, uint64_t limit,
+    const check_run* base, const char* path) {
+    /*
+        This function runs a fork of the loaded machine for half of the limit, writes its checkpoint to path with the keys it has not read,
+        and resumes the checkpoint in another fork, which runs to the limit. Another fork is hibernated to path after a third of the limit,
+        and resumed by vm_run. It returns 1 if a resumed run doesn't end like the run of the switch engine, base.
+    */
+
+    check_io first;
+    vm* vm = fork_machine(image, &first, keys, len);
+    output_set_policy(&vm->out, "halt"); // the console output stays in the buffer, so that the checkpoint holds some
+    run_until(vm, limit / 2);
+    if (!checkpoint_save(vm, loaded, keys + first.pos, len - first.pos, path)) {
+        printf("failed to write checkpoint: %s\n", path);
+        exit(1);
+    }
+    vm->out.len = 0; // in the checkpoint
+    vm_destroy(vm);
+
+    check_run resumed;
+    vm = fork_machine(image, &resumed.io, NULL, 0);
+    char* input;
+    size_t input_len;
+    if (!checkpoint_load(vm, loaded, path, &input, &input_len)) {
+        printf("failed to read checkpoint: %s\n", path);
+        exit(1);
+    }
+    remove(path);
+    // the resumed run reads the keys the first one left, and its output follows the output of the first one
+    resumed.io = (check_io){ input, input_len, 0, first.output, first.output_len, first.output_cap };
+    end_run(&resumed, vm, run_until(vm, limit));
+    int failed = compare(name, "checkpoint", &resumed, base);
+    free(resumed.io.output);
+    free(input);
+
+    check_run hibernated;
+    vm = fork_machine(image, &hibernated.io, keys, len);
+    output_set_policy(&vm->out, "halt");
+    run_until(vm, limit / 3);
+    if (!checkpoint_hibernate(vm, loaded, path)) {
+        printf("failed to write checkpoint: %s\n", path);
+        exit(1);
+    }
+    end_run(&hibernated, vm, run_until(vm, limit));
+    failed |= compare(name, "hibernate", &hibernated, base);
+    free(hibernated.io.output);
+    return failed;
+}
+
+static int check_replay(vm* image, const char* name, const char* keys, size_t len, uint64_t limit, const check_run* base, const char* path) {
+    /*
+        This function records the input of a fork of the loaded machine to path, replays it on a fork without keys,
+        with a snapshot every eighth of the limit, then seeks the replay back to half of the instructions of base and runs it to the end again.
+        It returns 1 if a run doesn't end like the run of the switch engine, base, if the replay diverged,
+        or if the machine after the seek isn't a machine stopped there.
+    */
+
+    check_run recorded;
+    vm* vm = fork_machine(image, &recorded.io, keys, len);
+    vm_recording* rec = replay_record(vm);
+    if (!rec) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    int result = replay_until(rec, limit);
+    if (!replay_save(rec, path)) {
+        printf("failed to write recording: %s\n", path);
+        exit(1);
+    }
+    replay_free(rec);
+    end_run(&recorded, vm, result);
+    int failed = compare(name, "record", &recorded, base);
+    free(recorded.io.output);
+
+    check_run replayed;
+    vm = fork_machine(image, &replayed.io, NULL, 0);
+    if (!(rec = replay_play(vm, path, limit / 8 ? limit / 8 : 1))) {
+        printf("failed to read recording: %s\n", path);
+        exit(1);
+    }
+    remove(path);
+    result = replay_until(rec, limit);
+    output_flush(&vm->out);
+    check_run played = replayed; // the end of the replay, before it seeks back
+    played.result = result;
+    played.instructions = vm->instructions;
+    played.pc = vm->reg[R_PC];
+    played.mismatches = 0;
+    failed |= compare(name, "replay", &played, base);
+    if (rec->diverged) {
+        printf("%s: the replay diverged at instruction %llu\n", name, (unsigned long long)rec->diverged_at);
+        failed = 1;
+    }
+
+    uint64_t target = base->instructions / 2;
+    check_run stopped;
+    struct vm* reference = fork_machine(image, &stopped.io, keys, len);
+    run_until(reference, target);
+    replay_seek(rec, target);
+    int same = vm->instructions == reference->instructions && memcmp(vm->reg, reference->reg, sizeof(vm->reg)) == 0;
+    for (uint32_t a = 0; same && a < VM_IO_BASE; ++a) same = vm_peek(vm, (uint16_t)a) == vm_peek(reference, (uint16_t)a);
+    if (!same) {
+        printf("%s: the replay did not seek to the machine after %llu instructions\n", name, (unsigned long long)target);
+        failed = 1;
+    }
+    end_run(&stopped, reference, VM_BUDGET);
+
+    // the seek dropped the output of the run stopped halfway, which is the start of the output of base
+    replayed.io.output_len = 0;
+    result = replay_until(rec, limit);
+    replay_free(rec);
+    end_run(&replayed, vm, result);
+    check_run rest = *base;
+    size_t skipped = stopped.io.output_len < base->io.output_len ? stopped.io.output_len : base->io.output_len;
+    rest.io.output = base->io.output + skipped;
+    rest.io.output_len = base->io.output_len - skipped;
+    failed |= compare(name, "replay seek", &replayed, &rest);
+    free(stopped.io.output);
+    free(replayed.io.output);
+    return failed;
+}
+
+static int record_matches(const char* line, vm* vm) {
+    /*
+        This function steps the machine one instruction and returns 1 if the line printed by lc3trace for that instruction,
+        its instruction count, its address, the instruction, and the register and the memory word it left, is what the machine did.
+            Example:                  105  x3004  x6040  LDR R0, R1, #0          R0=x0048  load  [x4000]=x0048
+    */
+
+    unsigned long long count;
+    unsigned pc, instr, reg, value, address, data;
+    if (sscanf(line, "%llu x%x x%x", &count, &pc, &instr) != 3) return 0;
+    int same = pc == vm->reg[R_PC] && instr == vm_peek(vm, vm->reg[R_PC]);
+    uint64_t before = vm->instructions;
+    vm_run(vm, 1);
+    same = same && vm->instructions == before + 1 && count == vm->instructions;
+    const char* changed = strstr(line, "=x");
+    if (changed && changed[-2] == 'R' && sscanf(changed - 1, "%u=x%x", &reg, &value) == 2) same = same && reg < 8 && vm->reg[reg] == value;
+    const char* memory = strstr(line, "[x");
+    if (memory && sscanf(memory, "[x%x]=x%x", &address, &data) == 2 && address < VM_IO_BASE) same = same && vm_peek(vm, (uint16_t)address) == data;
+    return same;
+}
+
+static int check_trace(vm* image, const char* name, const char* keys, size_t len, uint64_t limit, const char* path, const char* decoder) {
+    /*
+        This function runs a fork of the loaded machine traced to path for CHECK_TRACE instructions (or the limit),
+        compares it with the switch engine, and decodes the trace with lc3trace (decoder), comparing every record with a machine
+        that steps one instruction at a time. It returns 1 if the traced run differs, or lc3trace doesn't print every instruction as it ran.
+    */
+
+    uint64_t n = limit < CHECK_TRACE ? limit : CHECK_TRACE;
+    check_run base, traced;
+    run_engine(&base, image, ENGINE_SWITCH, 0, keys, len, n);
+    vm* vm = fork_machine(image, &traced.io, keys, len);
+    if (!(vm->trace = trace_open(path, 0))) {
+        printf("failed to write the trace: %s\n", path);
+        exit(1);
+    }
+    int result = run_until(vm, n);
+    int written = trace_close(vm->trace);
+    vm->trace = NULL;
+    end_run(&traced, vm, result);
+    int failed = compare(name, "trace", &traced, &base);
+    free(traced.io.output);
+    free(base.io.output);
+    if (!written) {
+        printf("%s: failed to write the trace\n", name);
+        remove(path);
+        return 1;
+    }
+
+    char command[8192];
+    snprintf(command, sizeof(command), "%s '%s'", decoder, path);
+    FILE* pipe = popen(command, "r");
+    if (!pipe) {
+        printf("failed to run %s\n", decoder);
+        exit(1);
+    }
+    check_io io;
+    vm = fork_machine(image, &io, keys, len);
+    vm->engine = ENGINE_SWITCH;
+    char line[256];
+    uint64_t records = 0;
+    int same = 1;
+    while (fgets(line, sizeof(line), pipe)) {
+        if (same && !record_matches(line, vm)) {
+            printf("%s: record %llu of the trace is not the instruction that ran: %s", name, (unsigned long long)records + 1, line);
+            same = 0;
+        }
+        ++records;
+    }
+    same = pclose(pipe) == 0 && same && records == traced.instructions;
+    remove(path);
+    printf("%-20s %-16s %-8s %14llu   x%04X %12s  %s\n", name, "lc3trace", "decoded", (unsigned long long)records, vm->reg[R_PC], "-",
+        same ? "ok" : "FAILED");
+    vm_destroy(vm);
+    free(io.output);
+    return failed | !same;
+}
+
+// The GDB server of a machine, on its own thread
+typedef struct
+{
+    vm* vm;
+    int port;
+    int result; // the result of debug_gdb
+} gdb_server;
+
+static THREAD_FUNC serve_gdb(void* arg) {
+    gdb_server* g = arg;
+    g->result = debug_gdb(g->vm, g->port);
+    return THREAD_RETURN;
+}
+
+// The client of a GDB server, and the machine that runs like the debugged one
+typedef struct
+{
+    int fd;
+    const char* name;
+    int packets; // the packets the server answered
+    int failed;
+} gdb_client;
+
+static int free_port() {
+    // a TCP port of the local host that no one listens on right now, 0 if there is none
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    socklen_t size = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int port = fd >= 0 && bind(fd, (struct sockaddr*)&address, sizeof(address)) == 0
+        && getsockname(fd, (struct sockaddr*)&address, &size) == 0 ? ntohs(address.sin_port) : 0;
+    if (fd >= 0) close(fd);
+    return port;
+}
+
+static int gdb_connect(int port) {
+    // connect to the server on port, waiting up to 5 seconds for it to listen, and return the socket or -1
+    for (int tries = 0; tries < 500; ++tries) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((uint16_t)port);
+        if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) return fd;
+        close(fd);
+        thread_sleep_ms(10);
+    }
+    return -1;
+}
+
+static int gdb_send_packet(gdb_client* c, const char* packet) {
+    // send a packet to the server as $data#checksum, and return 0 if the server is gone or did not acknowledge it with +
+    char buf[256];
+    uint8_t sum = 0;
+    for (const char* p = packet; *p; ++p) sum += (uint8_t)*p;
+    int n = snprintf(buf, sizeof(buf), "$%s#%02x", packet, sum);
+    char ack;
+    return write(c->fd, buf, n) == n && read(c->fd, &ack, 1) == 1 && ack == '+';
+}
+
+static int gdb_receive_packet(gdb_client* c, char* reply, size_t size) {
+    // read the next packet of the server into reply and acknowledge it, and return 0 if the server is gone or its checksum is wrong
+    char ch;
+    do {
+        if (read(c->fd, &ch, 1) != 1) return 0;
+    } while (ch != '$');
+    size_t len = 0;
+    uint8_t sum = 0;
+    while (read(c->fd, &ch, 1) == 1 && ch != '#') {
+        if (len < size - 1) reply[len++] = ch;
+        sum += (uint8_t)ch;
+    }
+    reply[len] = 0;
+    char checksum[3] = { 0 };
+    if (read(c->fd, checksum, 2) != 2 || strtoul(checksum, NULL, 16) != sum || write(c->fd, "+", 1) != 1) return 0;
+    c->packets++;
+    return 1;
+}
+
+static void gdb_expect(gdb_client* c, const char* packet, const char* expected) {
+    // send a packet, and check that the server replies expected
+    char reply[1024];
+    if (!gdb_send_packet(c, packet) || !gdb_receive_packet(c, reply, sizeof(reply))) {
+        printf("%s: the GDB server did not answer %s\n", c->name, packet);
+        c->failed = 1;
+    } else if (strcmp(reply, expected) != 0) {
+        printf("%s: the GDB server replied %s to %s instead of %s\n", c->name, reply, packet, expected);
+        c->failed = 1;
+    }
+}
+
+static void gdb_registers(const vm* vm, char* hex) {
+    // the reply of a g packet for the machine: R0 to R7, PC and the condition flags, 16-bit little-endian
+    for (int r = 0; r < R_COUNT; ++r) {
+        uint16_t v = r == R_COND ? cond_flags(vm->reg[R_COND]) : vm->reg[r];
+        sprintf(hex + 4 * r, "%02x%02x", v & 0xFF, v >> 8);
+    }
+}
+
+static int store_address(const vm* vm) {
+    // the address the instruction at the PC stores to, -1 if it isn't ST, STR or STI
+    uint16_t pc = vm->reg[R_PC];
+    uint16_t instr = vm_peek(vm, pc);
+    switch (instr >> 12) {
+        case OP_ST: return (uint16_t)(pc + 1 + sign_extend(instr & 0x1FF, 9));
+        case OP_STR: return (uint16_t)(vm->reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6));
+        case OP_STI: return vm_peek(vm, (uint16_t)(pc + 1 + sign_extend(instr & 0x1FF, 9)));
+    }
+    return -1;
+}
+
+static int check_gdb(vm* image, const char* name, const char* keys, size_t len) {
+    /*
+        This function debugs a fork of the loaded machine with a client of the GDB remote protocol, and runs another fork,
+        the reference, one instruction at a time alongside: after every stop, the registers the server sends must be those of the reference.
+        The client steps one instruction, continues to a breakpoint CHECK_GDB_BREAK instructions ahead, continues to the next store
+        with a watchpoint on its address, writes and reads back a register and a memory word, then continues and interrupts the machine.
+        It returns 1 if a reply is not the expected one.
+    */
+
+    check_io debugged_io, reference_io;
+    vm* debugged = fork_machine(image, &debugged_io, keys, len);
+    vm* reference = fork_machine(image, &reference_io, keys, len);
+    reference->engine = ENGINE_SWITCH;
+    if (!(debugged->debugger = debug_create())) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    gdb_server server = { debugged, free_port(), VM_BUDGET };
+    thread_handle thread;
+    gdb_client c = { -1, name, 0, 0 };
+    if (!server.port || thread_start(&thread, serve_gdb, &server) != 0) {
+        printf("failed to start a GDB server\n");
+        exit(1);
+    }
+    if ((c.fd = gdb_connect(server.port)) < 0) {
+        printf("failed to connect to the GDB server on port %d\n", server.port);
+        exit(1);
+    }
+
+    char packet[64], expected[1024];
+    gdb_expect(&c, "qSupported:swbreak+", "PacketSize=1000;swbreak+");
+    gdb_expect(&c, "?", "S05");
+    gdb_registers(reference, expected);
+    gdb_expect(&c, "g", expected);
+    uint16_t pc = reference->reg[R_PC];
+    snprintf(packet, sizeof(packet), "m%x,4", 2 * pc);
+    snprintf(expected, sizeof(expected), "%02x%02x%02x%02x", vm_peek(reference, pc) & 0xFF, vm_peek(reference, pc) >> 8,
+        vm_peek(reference, pc + 1) & 0xFF, vm_peek(reference, pc + 1) >> 8);
+    gdb_expect(&c, packet, expected);
+
+    // one step
+    int running = vm_run(reference, 1) != VM_HALTED;
+    gdb_expect(&c, "s", running ? "S05" : "W00");
+
+    // a breakpoint at the PC of a machine CHECK_GDB_BREAK instructions ahead: the reference steps until it first reaches it
+    check_io probe_io = { reference_io.keys + reference_io.pos, reference_io.len - reference_io.pos, 0, NULL, 0, 0 };
+    vm_io io = { check_key_ready, check_read_key, check_write, &probe_io };
+    vm* probe = vm_fork(reference, &io);
+    if (!probe) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    probe->engine = ENGINE_SWITCH;
+    for (int i = 0; running && i < CHECK_GDB_BREAK && vm_run(probe, 1) != VM_HALTED; ++i);
+    uint16_t breakpoint = probe->reg[R_PC];
+    vm_destroy(probe);
+    free(probe_io.output);
+    if (running) {
+        while (running && reference->reg[R_PC] != breakpoint) running = vm_run(reference, 1) != VM_HALTED;
+        snprintf(packet, sizeof(packet), "Z0,%x,2", 2 * breakpoint);
+        gdb_expect(&c, packet, "OK");
+        gdb_expect(&c, "c", running ? "T05swbreak:;" : "W00");
+    }
+    if (running) {
+        gdb_registers(reference, expected);
+        gdb_expect(&c, "g", expected);
+        snprintf(packet, sizeof(packet), "z0,%x,2", 2 * breakpoint);
+        gdb_expect(&c, packet, "OK");
+    }
+
+    // a watchpoint on the address of the next store, if there is one soon
+    int watched = -1;
+    for (int i = 0; running && watched < 0 && i < CHECK_GDB_WATCH; ++i) {
+        watched = store_address(reference);
+        running = vm_run(reference, 1) != VM_HALTED;
+    }
+    if (watched >= 0) {
+        snprintf(packet, sizeof(packet), "Z2,%x,2", 2 * watched);
+        gdb_expect(&c, packet, "OK");
+        snprintf(expected, sizeof(expected), "T05watch:%x;", 2 * watched);
+        gdb_expect(&c, "c", running ? expected : "W00");
+        if (running) {
+            gdb_registers(reference, expected);
+            gdb_expect(&c, "g", expected);
+            snprintf(packet, sizeof(packet), "z2,%x,2", 2 * watched);
+            gdb_expect(&c, packet, "OK");
+        }
+    }
+
+    if (running) {
+        // a register and a memory word written and read back, then a run stopped by the interrupt byte
+        gdb_expect(&c, "P0=3412", "OK");
+        gdb_expect(&c, "p0", "3412");
+        snprintf(packet, sizeof(packet), "M%x,2:7856", 2 * 0x4000);
+        gdb_expect(&c, packet, "OK");
+        snprintf(packet, sizeof(packet), "m%x,2", 2 * 0x4000);
+        gdb_expect(&c, packet, "7856");
+        char reply[64];
+        if (!gdb_send_packet(&c, "c") || write(c.fd, "\x03", 1) != 1 || !gdb_receive_packet(&c, reply, sizeof(reply))) {
+            printf("%s: the GDB server did not answer c\n", name);
+            c.failed = 1;
+        } else if (strcmp(reply, "S02") == 0) {
+            if (write(c.fd, "$k#6b", 5) != 5) c.failed = 1;
+        } else if (strcmp(reply, "W00") != 0) {
+            // the program may halt before the interrupt reaches the server
+            printf("%s: the GDB server replied %s to an interrupt instead of S02\n", name, reply);
+            c.failed = 1;
+        }
+    }
+
+    close(c.fd);
+    thread_join(thread);
+    printf("%-20s %-16s %-8s %14d   x%04X %12s  %s\n", name, "gdb", "packets", c.packets, reference->reg[R_PC], "-", c.failed ? "FAILED" : "ok");
+    debug_free(debugged->debugger);
+    debugged->debugger = NULL;
+    vm_destroy(debugged);
+    vm_destroy(reference);
+    free(debugged_io.output);
+    free(reference_io.output);
+    return c.failed;
+}
+
+int main(int argc, const char* argv[]) {
+    static const char* engine_names[] = { "switch", "threaded", "jit" };
+    uint64_t limit = 25000000;
+    int lanes = 8;
+    const char* decoder = "./lc3trace";
+    int first = 1;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; ++first) {
+        if (strncmp(argv[first], "--limit=", 8) == 0) {
+            limit = strtoull(argv[first] + 8, NULL, 10);
+        } else if (strncmp(argv[first], "--lanes=", 8) == 0) {
+            lanes = atoi(argv[first] + 8);
+        } else if (strncmp(argv[first], "--lc3trace=", 11) == 0) {
+            decoder = argv[first] + 11;
+        } else {
+            printf("unknown option: %s\n", argv[first]);
+            exit(2);
+        }
+    }
+    if (first == argc || (argc - first) % 2 != 0 || lanes < 1) {
+        printf("lc3check [--limit=INSTRUCTIONS] [--lanes=N] [--lc3trace=PATH] image-file1 keys-file1 [image-file2 keys-file2] ...\n");
+        exit(2);
+    }
+
+    // the checkpoints, recordings and traces go in a directory that only this user can enter, like the checkpoints of the server
+    const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char dir[4096], path[4096 + 32];
+    snprintf(dir, sizeof(dir), "%s/lc3check-XXXXXX", tmp);
+    if (!mkdtemp(dir)) {
+        printf("failed to create a directory in %s\n", tmp);
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/checkpoint", dir);
+
+    int failed = 0;
+    printf("%-20s %-16s %-8s %14s %7s %12s\n", "image", "run", "result", "instructions", "pc", "output");
+    for (int j = first; j < argc; j += 2) {
+        const char* image_path = argv[j];
+        size_t len;
+        char* keys = read_file(argv[j + 1], &len);
+        if (!keys) {
+            printf("failed to read keys: %s\n", argv[j + 1]);
+            exit(1);
+        }
+        vm_io io = { check_key_ready, check_read_key, NULL, NULL };
+        vm* image = vm_create(&io);
+        if (!image) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        if (!read_image(image, image_path)) {
+            printf("failed to load image: %s\n", image_path);
+            exit(1);
+        }
+        const char* name = strrchr(image_path, '/') ? strrchr(image_path, '/') + 1 : image_path;
+
+        check_run base;
+        run_engine(&base, image, ENGINE_SWITCH, 0, keys, len, limit);
+        failed |= compare(name, "switch", &base, &base);
+        for (int engine = ENGINE_THREADED; engine <= ENGINE_JIT; ++engine) {
+            check_run run;
+            run_engine(&run, image, engine, 0, keys, len, limit);
+            if (run.engine == engine) failed |= compare(name, engine_names[engine], &run, &base); // else not available on this host
+            free(run.io.output);
+        }
+        check_run checked;
+        run_engine(&checked, image, ENGINE_SWITCH, 1, keys, len, limit);
+        failed |= compare(name, "check-routines", &checked, &base);
+        free(checked.io.output);
+        failed |= check_lockstep(image, name, keys, len, limit, lanes);
+        vm_snapshot* loaded = vm_snapshot_take(image);
+        if (!loaded) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        failed |= check_checkpoint(image, loaded, name, keys, len, limit, &base, path);
+        vm_snapshot_free(loaded);
+        failed |= check_replay(image, name, keys, len, limit, &base, path);
+        failed |= check_trace(image, name, keys, len, limit, path, decoder);
+        failed |= check_gdb(image, name, keys, len);
+        free(base.io.output);
+
+        fflush(stdout);
+        vm_destroy(image);
+        free(keys);
+    }
+    rmdir(dir);
+    if (failed) printf("some runs did not run like the switch engine\n");
+    return failed;
+}
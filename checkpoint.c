@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define PAGE_BYTES (VM_PAGE_WORDS * sizeof(uint16_t))
+
+uint64_t checkpoint_hash(const vm_snapshot* base) {
+    // the FNV-1a hash of the memory of a snapshot, which tells whether a checkpoint was taken on the same images
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (int i = 0; i < VM_PAGES; ++i) {
+        const uint16_t* words = base->pages[i]->words;
+        for (int k = 0; k < VM_PAGE_WORDS; ++k) {
+            h = (h ^ words[k]) * 0x100000001B3ull;
+        }
+    }
+    return h;
+}
+
+static int page_saved(const vm* vm, const vm_snapshot* base, int page) {
+    // a page is saved when its words are not those of the base (a page still shared with the base is not even compared)
+    return vm->pages[page] != base->pages[page] && memcmp(vm->pages[page]->words, base->pages[page]->words, PAGE_BYTES) != 0;
+}
+
+static int write_page(FILE* file, int page, const uint16_t* words) {
+    // write a page, compressed if that makes it smaller
+    checkpoint_page p = { (uint16_t)page, (uint16_t)PAGE_BYTES };
+    const void* data = words;
+#ifdef HAVE_ZLIB
+    /*
+        A page is 512 bytes: a 1 KB window and a small hash table (windowBits 10, memLevel 3) compress it as well as the default ones,
+        and keep the state of zlib to about 14 KB instead of the 256 KB that compress2 allocates (and partly clears) for every page,
+        which matters when a server hibernates thousands of machines. The stream is read back by uncompress.
+    */
+    unsigned char packed[2 * PAGE_BYTES];
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, 10, 3, Z_DEFAULT_STRATEGY) == Z_OK) {
+        z.next_in = (Bytef*)words;
+        z.avail_in = PAGE_BYTES;
+        z.next_out = packed;
+        z.avail_out = sizeof(packed);
+        if (deflate(&z, Z_FINISH) == Z_STREAM_END && z.total_out < PAGE_BYTES) {
+            p.size = (uint16_t)z.total_out;
+            data = packed;
+        }
+        deflateEnd(&z);
+    }
+#endif
+    return fwrite(&p, sizeof(p), 1, file) == 1 && fwrite(data, 1, p.size, file) == p.size;
+}
+
+int checkpoint_save(vm* vm, const vm_snapshot* base, const char* input, size_t input_len, const char* path) {
+    /*
+        This function writes the checkpoint of a machine that is not running to a file, with the memory pages that differ from base
+        and its input_len keys of pending input (the keys given to the machine that it has not read, which the caller keeps).
+        It returns 0 if the file can't be written.
+    */
+
+    checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.byte_order = CHECKPOINT_BYTE_ORDER;
+#ifdef HAVE_ZLIB
+    header.compression = CHECKPOINT_ZLIB;
+#else
+    header.compression = CHECKPOINT_RAW;
+#endif
+    for (int i = 0; i < VM_PAGES; ++i) header.pages += page_saved(vm, base, i);
+    header.running = (uint8_t)vm->running;
+    header.illegal = (uint8_t)vm->illegal;
+    header.base = checkpoint_hash(base);
+    memcpy(header.reg, vm->reg, sizeof(header.reg));
+    header.psr = vm->psr;
+    header.saved_usp = vm->saved_usp;
+    header.saved_ssp = vm->saved_ssp;
+    header.instructions = vm->instructions;
+    header.io_instructions = vm->io_instructions;
+    header.input = (uint32_t)input_len;
+    header.output = (uint32_t)vm->out.len;
+
+    FILE* file = fopen(path, "wb");
+    int ok = file && input_len <= UINT32_MAX && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(input, 1, input_len, file) == input_len && fwrite(vm->out.buffer, 1, vm->out.len, file) == vm->out.len;
+    for (int i = 0; ok && i < VM_PAGES; ++i) {
+        if (page_saved(vm, base, i)) ok = write_page(file, i, vm->pages[i]->words);
+    }
+    if (file && fclose(file) != 0) ok = 0;
+    if (!ok) remove(path);
+    return ok;
+}
+
+static vm_page* read_page(FILE* file, int compression, int* page) {
+    // read the next page of a checkpoint into a new page, NULL if it is damaged or there is not enough memory
+    checkpoint_page p;
+    unsigned char packed[PAGE_BYTES];
+    if (fread(&p, sizeof(p), 1, file) != 1 || p.page >= VM_PAGES || p.size == 0 || p.size > PAGE_BYTES) return NULL;
+    if (p.size < PAGE_BYTES && compression != CHECKPOINT_ZLIB) return NULL;
+    if (fread(packed, 1, p.size, file) != p.size) return NULL;
+    vm_page* copy = malloc(sizeof(*copy));
+    if (!copy) return NULL;
+    atomic_init(&copy->refs, 1);
+    *page = p.page;
+    if (p.size == PAGE_BYTES) {
+        memcpy(copy->words, packed, PAGE_BYTES);
+        return copy;
+    }
+#ifdef HAVE_ZLIB
+    uLongf size = PAGE_BYTES;
+    if (uncompress((Bytef*)copy->words, &size, packed, p.size) == Z_OK && size == PAGE_BYTES) return copy;
+#endif
+    free(copy);
+    return NULL;
+}
+
+int checkpoint_load(vm* vm, const vm_snapshot* base, const char* path, char** input, size_t* input_len) {
+    /*
+        This function puts a machine that is not running into the state of a checkpoint taken on the same base.
+        The pages that are not in the file are shared with base, and the console output the checkpoint held is buffered again
+        (after the output the machine still had is flushed). The pending input is returned in input (malloc'ed, free it)
+        and input_len. It returns 0, and leaves the machine as it was, if the file can't be read, was written by a host
+        of another byte order, on another base, or by a build without zlib that this one can't read, or if there is not enough memory.
+    */
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    checkpoint_header header;
+    char* keys = NULL;
+    char* output = NULL;
+    vm_page* loaded[VM_PAGES] = { NULL };
+    int ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0
+        && header.byte_order == CHECKPOINT_BYTE_ORDER && header.base == checkpoint_hash(base)
+        && header.pages <= VM_PAGES && header.output <= OUTPUT_BUFFER_SIZE;
+#ifndef HAVE_ZLIB
+    ok = ok && header.compression == CHECKPOINT_RAW;
+#endif
+    if (ok) {
+        keys = malloc(header.input + 1);
+        output = malloc(header.output + 1);
+        ok = keys && output && fread(keys, 1, header.input, file) == header.input && fread(output, 1, header.output, file) == header.output;
+    }
+    for (int i = 0; ok && i < header.pages; ++i) {
+        int page;
+        vm_page* p = read_page(file, header.compression, &page);
+        if (!p || loaded[page]) {
+            free(p); // a page saved twice is damage too
+            ok = 0;
+        } else {
+            loaded[page] = p;
+        }
+    }
+    fclose(file);
+    if (!ok) {
+        for (int i = 0; i < VM_PAGES; ++i) free(loaded[i]);
+        free(keys);
+        free(output);
+        return 0;
+    }
+
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm_set_page(vm, i, loaded[i] ? loaded[i] : base->pages[i]);
+        if (loaded[i]) vm_page_release(loaded[i]); // the machine has the only use of it
+    }
+    memcpy(vm->reg, header.reg, sizeof(vm->reg));
+    vm->psr = header.psr;
+    vm->saved_usp = header.saved_usp;
+    vm->saved_ssp = header.saved_ssp;
+    vm->running = header.running;
+    vm->illegal = header.illegal;
+    vm->instructions = header.instructions;
+    vm->io_instructions = header.io_instructions;
+    output_flush(&vm->out);
+    memcpy(vm->out.buffer, output, header.output);
+    vm->out.len = header.output;
+    free(output);
+    *input = keys;
+    *input_len = header.input;
+    return 1;
+}
+
+int checkpoint_hibernate(vm* vm, const vm_snapshot* base, const char* path) {
+    /*
+        This function writes the checkpoint of a machine that is not running, without pending input, then frees its own pages,
+        its caches and its output buffer until vm_run resumes it from the file, which then belongs to the machine:
+        it is removed once the machine is resumed or destroyed. It returns 0, and leaves the machine as it was,
+        if the checkpoint can't be written or there is not enough memory.
+    */
+
+    if (vm->hibernated) return 1;
+    vm_checkpoint* c = malloc(sizeof(*c));
+    char* name = malloc(strlen(path) + 1);
+    if (!c || !name || !checkpoint_save(vm, base, NULL, 0, path)) {
+        free(c);
+        free(name);
+        return 0;
+    }
+    c->path = strcpy(name, path);
+    c->base = base;
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm_set_page(vm, i, base->pages[i]);
+    }
+    vm_free_caches(vm);
+    vm->out.len = 0; // in the file
+    output_free(&vm->out);
+    vm->hibernated = c;
+    return 1;
+}
+
+int checkpoint_resume(vm* vm) {
+    /*
+        This function reads a hibernated machine back from its checkpoint, and returns 0 if it can't be read:
+        the machine is then still hibernated.
+    */
+
+    vm_checkpoint* c = vm->hibernated;
+    if (!c) return 1;
+    if (!vm->out.buffer && !(vm->out.buffer = malloc(OUTPUT_BUFFER_SIZE))) return 0;
+    char* input;
+    size_t input_len;
+    if (!vm_alloc_caches(vm) || !checkpoint_load(vm, c->base, c->path, &input, &input_len)) return 0;
+    free(input); // a hibernated machine has none
+    vm->hibernated = NULL;
+    remove(c->path);
+    free(c->path);
+    free(c);
+    return 1;
+}
+
+void checkpoint_free(vm* vm) {
+    // forget the checkpoint of a hibernated machine that is destroyed, and remove its file
+    vm_checkpoint* c = vm->hibernated;
+    if (!c) return;
+    remove(c->path);
+    free(c->path);
+    free(c);
+    vm->hibernated = NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+#include "snapshot.h"
+
+/*
+    Checkpoints: the state of a machine in a file, to stop a long session and resume it later, in another process if needed.
+    A checkpoint holds the registers, the PSR and the condition codes, the instruction counts, the console output still buffered
+    and the keys given to the machine that it has not read yet, and the memory pages that differ from a base snapshot,
+    which is the machine right after its images were loaded: the rest is the image, which the process that resumes has loaded too.
+    Every saved page is compressed on its own with zlib (stored as it is when that doesn't make it smaller, or with ZLIB=0).
+    The header records a hash of the base, so a checkpoint is not resumed on other images.
+
+    A machine that is not running can also be hibernated: its checkpoint is written, and the machine gives its host memory back
+    (its own pages, the decode cache, the compiled code of the JIT and the output buffer), keeping only its struct.
+    Its pages are those of the base until it is resumed: the next vm_run reads the checkpoint back first (checkpoint_resume),
+    reading and inflating only the saved pages, and the decode cache and the JIT fill again as the program runs.
+    The base must live until the machine is resumed or destroyed.
+*/
+
+#define CHECKPOINT_MAGIC "LC3CHKPT"
+#define CHECKPOINT_BYTE_ORDER 0x0102
+
+// How the pages of a checkpoint were written
+enum
+{
+    CHECKPOINT_RAW = 0,
+    CHECKPOINT_ZLIB
+};
+
+typedef struct
+{
+    char magic[8];          // CHECKPOINT_MAGIC
+    uint16_t byte_order;    // CHECKPOINT_BYTE_ORDER, in the byte order of the host that wrote the file
+    uint16_t pages;         // the number of saved pages after the header, the input and the output
+    uint8_t compression;    // CHECKPOINT_RAW or CHECKPOINT_ZLIB
+    uint8_t running;
+    uint8_t illegal;
+    uint8_t reserved;
+    uint64_t base;          // checkpoint_hash of the base snapshot
+    uint16_t reg[R_COUNT];
+    uint16_t psr, saved_usp, saved_ssp;
+    uint64_t instructions;
+    uint64_t io_instructions;
+    uint32_t input;         // the bytes of pending input after the header
+    uint32_t output;        // the bytes of buffered console output after the input
+} checkpoint_header;
+
+// Every saved page is this header followed by its size bytes: VM_PAGE_WORDS words as they are, or fewer bytes for a compressed page
+typedef struct
+{
+    uint16_t page;
+    uint16_t size;
+} checkpoint_page;
+
+// A hibernated machine (vm->hibernated)
+typedef struct vm_checkpoint
+{
+    char* path;
+    const vm_snapshot* base;
+} vm_checkpoint;
+
+uint64_t checkpoint_hash(const vm_snapshot* base);
+int checkpoint_save(vm* vm, const vm_snapshot* base, const char* input, size_t input_len, const char* path);
+int checkpoint_load(vm* vm, const vm_snapshot* base, const char* path, char** input, size_t* input_len);
+int checkpoint_hibernate(vm* vm, const vm_snapshot* base, const char* path);
+int checkpoint_resume(vm* vm);
+void checkpoint_free(vm* vm);
+
+#endif
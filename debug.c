@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifndef _WIN32
+/* For Unix: the GDB remote protocol is served over TCP */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "lc3.h"
+#include "vm.h"
+#include "debug.h"
+#include "output.h"
+#include "utils.h"
+
+vm_debugger* debug_create() {
+    /*
+        This function creates a debugger without breakpoints or watchpoints, which is not active until one is set.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm_debugger* dbg = calloc(1, sizeof(*dbg));
+    if (!dbg) return NULL;
+    dbg->breakpoints = calloc(MEMORY_MAX, 1);
+    dbg->watchpoints = calloc(MEMORY_MAX, 1);
+    if (!dbg->breakpoints || !dbg->watchpoints) {
+        debug_free(dbg);
+        return NULL;
+    }
+    return dbg;
+}
+
+void debug_free(vm_debugger* dbg) {
+    if (!dbg) return;
+    free(dbg->breakpoints);
+    free(dbg->watchpoints);
+    free(dbg);
+}
+
+int debug_breakpoint(vm_debugger* dbg, uint16_t address, int set) {
+    // set or clear the breakpoint at address, and return 1 if that changed anything
+    if (dbg->breakpoints[address] == (set != 0)) return 0;
+    dbg->breakpoints[address] = set != 0;
+    dbg->breakpoint_count += set ? 1 : -1;
+    return 1;
+}
+
+int debug_watchpoint(vm_debugger* dbg, uint16_t address, int set) {
+    // set or clear the watchpoint at address, and return 1 if that changed anything
+    if (dbg->watchpoints[address] == (set != 0)) return 0;
+    dbg->watchpoints[address] = set != 0;
+    dbg->watchpoint_count += set ? 1 : -1;
+    return 1;
+}
+
+void debug_step(vm_debugger* dbg, uint64_t steps) {
+    // stop the machine after its next steps instructions
+    dbg->steps = steps;
+}
+
+static int run_until_stop(vm* vm) {
+    /*
+        This function runs a debugged machine until it halts, reaches an illegal instruction, is stopped by the debugger (VM_BREAK)
+        or is interrupted, one DEBUG_SLICE at a time. It returns the result of the last vm_run (VM_BUDGET if the machine was interrupted).
+    */
+
+    vm_debugger* dbg = vm->debugger;
+    atomic_store(&dbg->interrupted, 0);
+    int result;
+    do {
+        result = vm_run(vm, DEBUG_SLICE);
+    } while (result == VM_BUDGET && !atomic_load(&dbg->interrupted));
+    output_flush(&vm->out);
+    return result;
+}
+
+void debug_disassemble(uint16_t pc, uint16_t instr, char* buf, size_t n) {
+    /*
+        This function writes the assembly of the instruction instr stored at pc, with the addresses of its PC offsets resolved.
+    */
+
+    static const char* regs[8] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7" };
+    static const char* names[16] = { "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR", "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP" };
+    uint16_t op = instr >> 12;
+    const char* r1 = regs[(instr >> 9) & 0x7];
+    const char* r2 = regs[(instr >> 6) & 0x7];
+    uint16_t target = pc + 1 + sign_extend(instr & 0x1FF, 9);
+    switch (op) {
+        case OP_BR:
+            if (!(instr & 0x0E00)) {
+                snprintf(buf, n, "NOP");
+            } else {
+                snprintf(buf, n, "BR%s%s%s x%04X", instr & 0x0800 ? "n" : "", instr & 0x0400 ? "z" : "", instr & 0x0200 ? "p" : "", target);
+            }
+            break;
+        case OP_ADD:
+        case OP_AND:
+            if (instr & 0x20) {
+                snprintf(buf, n, "%s %s, %s, #%d", names[op], r1, r2, (int16_t)sign_extend(instr & 0x1F, 5));
+            } else {
+                snprintf(buf, n, "%s %s, %s, %s", names[op], r1, r2, regs[instr & 0x7]);
+            }
+            break;
+        case OP_LD:
+        case OP_ST:
+        case OP_LDI:
+        case OP_STI:
+        case OP_LEA:
+            snprintf(buf, n, "%s %s, x%04X", names[op], r1, target);
+            break;
+        case OP_LDR:
+        case OP_STR:
+            snprintf(buf, n, "%s %s, %s, #%d", names[op], r1, r2, (int16_t)sign_extend(instr & 0x3F, 6));
+            break;
+        case OP_JSR:
+            if (instr & 0x0800) {
+                snprintf(buf, n, "JSR x%04X", (uint16_t)(pc + 1 + sign_extend(instr & 0x7FF, 11)));
+            } else {
+                snprintf(buf, n, "JSRR %s", r2);
+            }
+            break;
+        case OP_NOT:
+            snprintf(buf, n, "NOT %s, %s", r1, r2);
+            break;
+        case OP_JMP:
+            snprintf(buf, n, ((instr >> 6) & 0x7) == 7 ? "RET" : "JMP %s", r2);
+            break;
+        case OP_TRAP:
+            switch (instr & 0xFF) {
+                case TRAP_GETC: snprintf(buf, n, "GETC"); break;
+                case TRAP_OUT: snprintf(buf, n, "OUT"); break;
+                case TRAP_PUTS: snprintf(buf, n, "PUTS"); break;
+                case TRAP_IN: snprintf(buf, n, "IN"); break;
+                case TRAP_PUTSP: snprintf(buf, n, "PUTSP"); break;
+                case TRAP_HALT: snprintf(buf, n, "HALT"); break;
+                default: snprintf(buf, n, "TRAP x%02X", instr & 0xFF); break;
+            }
+            break;
+        case OP_RTI:
+            snprintf(buf, n, "RTI");
+            break;
+        default:
+            snprintf(buf, n, ".FILL x%04X", instr);
+            break;
+    }
+}
+
+/*
+    The console of the debugger.
+    It reads commands from the keyboard of the machine, one line at a time, and writes to out.
+    Addresses and values are hexadecimal (x3000, 0x3000 or 3000), or decimal with # (#12); counts are decimal.
+*/
+
+static const char* console_help =
+    "  c, continue          run until a breakpoint, a watchpoint, HALT or Ctrl+C\n"
+    "  s, step [N]          execute N instructions (1)\n"
+    "  b, break ADDR        set a breakpoint\n"
+    "  d, delete ADDR       clear a breakpoint\n"
+    "  w, watch ADDR        stop after the stores to ADDR\n"
+    "  u, unwatch ADDR      clear a watchpoint\n"
+    "  i, info              list the breakpoints and watchpoints\n"
+    "  r, regs              show the registers\n"
+    "  x ADDR [N]           show N words of memory (8), with their disassembly\n"
+    "  set REG VALUE        change R0-R7 or PC\n"
+    "  poke ADDR VALUE      change a word of memory\n"
+    "  q, quit              stop the program\n";
+
+static int parse_word(const char* s, uint16_t* value) {
+    // read an address or a value, 0 if s is not one
+    char* end;
+    unsigned long v;
+    if (*s == '#') {
+        long d = strtol(s + 1, &end, 10);
+        v = (unsigned long)(uint16_t)d;
+    } else {
+        if (*s == 'x' || *s == 'X') ++s;
+        v = strtoul(s, &end, 16);
+        if (v > 0xFFFF) return 0;
+    }
+    if (end == s || *end) return 0;
+    *value = (uint16_t)v;
+    return 1;
+}
+
+static int read_line(vm* vm, FILE* out, char* line, size_t n) {
+    /*
+        This function reads a line from the keyboard of the machine, echoing it since the terminal does not (see disable_input_buffering).
+        It returns 0 at the end of the input.
+    */
+
+    size_t len = 0;
+    for (;;) {
+        int c = vm->io.read_key(vm->io.user);
+        if (c == EOF) return 0;
+        if (c == '\n' || c == '\r') break;
+        if (c == 127 || c == '\b') {
+            if (len) {
+                --len;
+                fputs("\b \b", out);
+            }
+            continue;
+        }
+        if (len + 1 < n && isprint(c)) {
+            line[len++] = (char)c;
+            fputc(c, out);
+        }
+    }
+    fputc('\n', out);
+    line[len] = 0;
+    return 1;
+}
+
+static void show_location(vm* vm, FILE* out) {
+    char text[32];
+    uint16_t pc = vm->reg[R_PC];
+    debug_disassemble(pc, vm_peek(vm, pc), text, sizeof(text));
+    fprintf(out, "x%04X: x%04X  %s\n", pc, vm_peek(vm, pc), text);
+}
+
+static void show_registers(vm* vm, FILE* out) {
+    uint16_t flags = cond_flags(vm->reg[R_COND]);
+    for (int r = R_R0; r <= R_R7; ++r) {
+        fprintf(out, "R%d=x%04X%s", r, vm->reg[r], r == R_R3 || r == R_R7 ? "\n" : " ");
+    }
+    fprintf(out, "PC=x%04X COND=%s PSR=x%04X (%s, priority %d) instructions=%llu\n", vm->reg[R_PC],
+        flags == FL_NEG ? "N" : flags == FL_ZRO ? "Z" : "P", vm_psr(vm), vm->psr & PSR_USER ? "user" : "supervisor",
+        (vm->psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT, (unsigned long long)vm->instructions);
+}
+
+static int show_stop(vm* vm, FILE* out, int result) {
+    // tell why the machine stopped, and return 1 if it can go on
+    vm_debugger* dbg = vm->debugger;
+    if (result == VM_HALTED) {
+        fprintf(out, "the program halted after %llu instructions\n", (unsigned long long)vm->instructions);
+        return 0;
+    }
+    if (result == VM_ILLEGAL) return 0;
+    if (result == VM_BREAK && dbg->stop == DEBUG_BREAKPOINT) {
+        fprintf(out, "breakpoint at x%04X\n", vm->reg[R_PC]);
+    } else if (result == VM_BREAK && dbg->stop == DEBUG_WATCHPOINT) {
+        fprintf(out, "watchpoint x%04X: x%04X -> x%04X\n", dbg->watch_address, dbg->watch_old, dbg->watch_new);
+    } else if (result == VM_BUDGET) {
+        fprintf(out, "interrupted\n");
+    }
+    show_location(vm, out);
+    return 1;
+}
+
+int debug_console(vm* vm, FILE* out) {
+    /*
+        This function debugs the machine from the console, stopped before its next instruction.
+        It returns the result of the last vm_run: VM_HALTED or VM_ILLEGAL once the program has stopped, or VM_BUDGET if the user quit.
+    */
+
+    vm_debugger* dbg = vm->debugger;
+    fprintf(out, "lc3 debugger, h for help\n");
+    show_location(vm, out);
+    char line[128];
+    for (;;) {
+        fputs("(lc3db) ", out);
+        fflush(out);
+        if (!read_line(vm, out, line, sizeof(line))) return VM_BUDGET;
+
+        char cmd[16] = "", arg1[32] = "", arg2[32] = "";
+        if (sscanf(line, "%15s %31s %31s", cmd, arg1, arg2) < 1) continue;
+        uint16_t a, v;
+        if (strcmp(cmd, "c") == 0 || strcmp(cmd, "continue") == 0) {
+            int result = run_until_stop(vm);
+            if (!show_stop(vm, out, result)) return result;
+        } else if (strcmp(cmd, "s") == 0 || strcmp(cmd, "step") == 0) {
+            uint64_t steps = *arg1 ? strtoull(arg1, NULL, 10) : 1;
+            if (steps == 0) continue;
+            debug_step(dbg, steps);
+            int result = run_until_stop(vm);
+            debug_step(dbg, 0);
+            if (!show_stop(vm, out, result)) return result;
+        } else if ((strcmp(cmd, "b") == 0 || strcmp(cmd, "break") == 0) && parse_word(arg1, &a)) {
+            debug_breakpoint(dbg, a, 1);
+        } else if ((strcmp(cmd, "d") == 0 || strcmp(cmd, "delete") == 0) && parse_word(arg1, &a)) {
+            if (!debug_breakpoint(dbg, a, 0)) fprintf(out, "no breakpoint at x%04X\n", a);
+        } else if ((strcmp(cmd, "w") == 0 || strcmp(cmd, "watch") == 0) && parse_word(arg1, &a)) {
+            debug_watchpoint(dbg, a, 1);
+        } else if ((strcmp(cmd, "u") == 0 || strcmp(cmd, "unwatch") == 0) && parse_word(arg1, &a)) {
+            if (!debug_watchpoint(dbg, a, 0)) fprintf(out, "no watchpoint at x%04X\n", a);
+        } else if (strcmp(cmd, "i") == 0 || strcmp(cmd, "info") == 0) {
+            for (uint32_t i = 0; i < MEMORY_MAX; ++i) {
+                if (dbg->breakpoints[i]) fprintf(out, "breakpoint x%04X\n", i);
+                if (dbg->watchpoints[i]) fprintf(out, "watchpoint x%04X\n", i);
+            }
+        } else if (strcmp(cmd, "r") == 0 || strcmp(cmd, "regs") == 0) {
+            show_registers(vm, out);
+        } else if (strcmp(cmd, "x") == 0 && parse_word(arg1, &a)) {
+            unsigned long count = *arg2 ? strtoul(arg2, NULL, 10) : 8;
+            for (unsigned long i = 0; i < count; ++i, ++a) {
+                char text[32];
+                debug_disassemble(a, vm_peek(vm, a), text, sizeof(text));
+                fprintf(out, "x%04X: x%04X  %s\n", a, vm_peek(vm, a), text);
+            }
+        } else if (strcmp(cmd, "set") == 0 && parse_word(arg2, &v)) {
+            if ((arg1[0] == 'R' || arg1[0] == 'r') && arg1[1] >= '0' && arg1[1] <= '7' && !arg1[2]) {
+                vm->reg[arg1[1] - '0'] = v;
+            } else if (strcmp(arg1, "PC") == 0 || strcmp(arg1, "pc") == 0) {
+                vm->reg[R_PC] = v;
+                dbg->resume = 0;
+            } else {
+                fprintf(out, "unknown register: %s\n", arg1);
+            }
+        } else if (strcmp(cmd, "poke") == 0 && parse_word(arg1, &a) && parse_word(arg2, &v)) {
+            mem_write(vm, a, v);
+        } else if (strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0) {
+            return VM_BUDGET;
+        } else if (strcmp(cmd, "h") == 0 || strcmp(cmd, "help") == 0) {
+            fputs(console_help, out);
+        } else {
+            fprintf(out, "unknown command: %s (h for help)\n", line);
+        }
+    }
+}
+
+/*
+    The GDB remote serial protocol server.
+    The packets are $data#checksum, acknowledged with +. The machine is presented to the client as a target with
+    16-bit little-endian registers R0 to R7, PC and COND (the condition flags: 1 P, 2 Z, 4 N), and a byte-addressed memory
+    where the word at address a is at bytes 2a and 2a + 1 (little-endian), so that the addresses of the client are twice the LC-3 ones.
+    The supported packets are ? g G p P m M c s Z0 z0 Z1 z1 Z2 z2 D k, the q packets a client asks for when it connects,
+    and the interrupt byte (0x03) while the machine runs.
+*/
+
+#ifndef _WIN32
+
+#define GDB_PACKET_MAX 4096
+
+static int gdb_hex(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int gdb_getc(int fd) {
+    unsigned char c;
+    return read(fd, &c, 1) == 1 ? c : EOF;
+}
+
+static int gdb_receive(int fd, char* packet) {
+    /*
+        This function reads the next packet from the client into packet, and acknowledges it.
+        It returns the length of the packet, or -1 if the client is gone.
+    */
+
+    for (;;) {
+        int c;
+        while ((c = gdb_getc(fd)) != '$') {
+            if (c == EOF) return -1;
+        }
+        int len = 0;
+        uint8_t sum = 0;
+        while ((c = gdb_getc(fd)) != '#') {
+            if (c == EOF) return -1;
+            if (len < GDB_PACKET_MAX - 1) packet[len++] = (char)c;
+            sum += (uint8_t)c;
+        }
+        int hi = gdb_hex(gdb_getc(fd)), lo = gdb_hex(gdb_getc(fd));
+        packet[len] = 0;
+        if (hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum) {
+            if (write(fd, "+", 1) != 1) return -1;
+            return len;
+        }
+        if (write(fd, "-", 1) != 1) return -1; // ask the client to send the packet again
+    }
+}
+
+static int gdb_send(int fd, const char* data) {
+    /*
+        This function sends a packet to the client, again until the client acknowledges it. It returns 0 if the client is gone.
+    */
+
+    size_t len = strlen(data);
+    char* packet = malloc(len + 5);
+    if (!packet) return 0;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; ++i) sum += (uint8_t)data[i];
+    sprintf(packet, "$%s#%02x", data, sum);
+    int c;
+    do {
+        if (write(fd, packet, len + 4) != (ssize_t)len + 4) c = EOF;
+        else while ((c = gdb_getc(fd)) != '+' && c != '-' && c != EOF);
+    } while (c == '-');
+    free(packet);
+    return c == '+';
+}
+
+static int gdb_register(vm* vm, int r, uint16_t** reg) {
+    // the register number r of the client, 0 if there is none
+    if (r < 0 || r >= R_COUNT) return 0;
+    *reg = &vm->reg[r];
+    return 1;
+}
+
+static uint16_t gdb_read_register(vm* vm, int r) {
+    return r == R_COND ? cond_flags(vm->reg[R_COND]) : vm->reg[r];
+}
+
+static void gdb_write_register(vm* vm, int r, uint16_t value) {
+    if (r == R_COND) value = value & FL_NEG ? 0x8000 : value & FL_ZRO ? 0 : 1; // a result with the flag
+    if (r == R_PC) vm->debugger->resume = 0;
+    vm->reg[r] = value;
+}
+
+static int gdb_run(vm* vm, int fd, char* reply) {
+    /*
+        This function runs the machine for a c or s packet until it stops, and writes the stop reply.
+        The client can stop it with the interrupt byte, which is looked for between two slices.
+        It returns 0 once the program has halted or reached an illegal instruction.
+    */
+
+    vm_debugger* dbg = vm->debugger;
+    int result;
+    for (;;) {
+        result = vm_run(vm, DEBUG_SLICE);
+        if (result != VM_BUDGET) break;
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, 0) == 1) {
+            int c = gdb_getc(fd);
+            if (c == 0x03 || c == EOF) break;
+        }
+    }
+    output_flush(&vm->out);
+    if (result == VM_HALTED) {
+        strcpy(reply, "W00");
+        return 0;
+    }
+    if (result == VM_ILLEGAL) {
+        strcpy(reply, "X04"); // SIGILL
+        return 0;
+    }
+    if (result == VM_BREAK && dbg->stop == DEBUG_BREAKPOINT) {
+        strcpy(reply, "T05swbreak:;");
+    } else if (result == VM_BREAK && dbg->stop == DEBUG_WATCHPOINT) {
+        sprintf(reply, "T05watch:%x;", 2 * dbg->watch_address);
+    } else if (result == VM_BREAK) {
+        strcpy(reply, "S05"); // SIGTRAP, after a step
+    } else {
+        strcpy(reply, "S02"); // SIGINT
+    }
+    return 1;
+}
+
+static int gdb_session(vm* vm, int fd, int* result) {
+    /*
+        This function serves the packets of a client until it detaches, kills the program, or disconnects,
+        or the program stops. It returns 1 if the machine should go on without the debugger (D).
+    */
+
+    vm_debugger* dbg = vm->debugger;
+    char packet[GDB_PACKET_MAX];
+    char* reply = malloc(GDB_PACKET_MAX * 2 + 16);
+    if (!reply) return 0;
+    int detach = 0;
+    int len;
+    while ((len = gdb_receive(fd, packet)) >= 0) {
+        unsigned long addr = 0, count = 0;
+        int kind = 0;
+        uint16_t* reg;
+        reply[0] = 0;
+        switch (packet[0]) {
+            case '?':
+                strcpy(reply, "S05");
+                break;
+            case 'g':
+                for (int r = 0; r < R_COUNT; ++r) {
+                    uint16_t v = gdb_read_register(vm, r);
+                    sprintf(reply + 4 * r, "%02x%02x", v & 0xFF, v >> 8);
+                }
+                break;
+            case 'G':
+                for (int r = 0; r < R_COUNT && 1 + 4 * r + 3 < len; ++r) {
+                    const char* h = packet + 1 + 4 * r;
+                    gdb_write_register(vm, r, (uint16_t)(gdb_hex(h[0]) << 4 | gdb_hex(h[1]) | gdb_hex(h[2]) << 12 | gdb_hex(h[3]) << 8));
+                }
+                strcpy(reply, "OK");
+                break;
+            case 'p':
+                if (sscanf(packet + 1, "%x", &kind) == 1 && gdb_register(vm, kind, &reg)) {
+                    uint16_t v = gdb_read_register(vm, kind);
+                    sprintf(reply, "%02x%02x", v & 0xFF, v >> 8);
+                } else {
+                    strcpy(reply, "E01");
+                }
+                break;
+            case 'P': {
+                unsigned int v;
+                if (sscanf(packet + 1, "%x=%x", &kind, &v) == 2 && gdb_register(vm, kind, &reg)) {
+                    gdb_write_register(vm, kind, (uint16_t)((v >> 8 & 0xFF) | (v & 0xFF) << 8));
+                    strcpy(reply, "OK");
+                } else {
+                    strcpy(reply, "E01");
+                }
+                break;
+            }
+            case 'm':
+                if (sscanf(packet + 1, "%lx,%lx", &addr, &count) != 2 || count > GDB_PACKET_MAX) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for (unsigned long i = 0; i < count; ++i) {
+                    unsigned long b = addr + i;
+                    uint16_t word = vm_peek(vm, (uint16_t)(b >> 1));
+                    sprintf(reply + 2 * i, "%02x", b & 1 ? word >> 8 : word & 0xFF);
+                }
+                break;
+            case 'M': {
+                const char* data = strchr(packet, ':');
+                if (!data || sscanf(packet + 1, "%lx,%lx", &addr, &count) != 2 || strlen(data + 1) < 2 * count) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                for (unsigned long i = 0; i < count; ++i) {
+                    unsigned long b = addr + i;
+                    uint16_t a = (uint16_t)(b >> 1);
+                    uint8_t byte = (uint8_t)(gdb_hex(data[1 + 2 * i]) << 4 | gdb_hex(data[2 + 2 * i]));
+                    uint16_t word = vm_peek(vm, a);
+                    mem_write(vm, a, b & 1 ? (uint16_t)((word & 0x00FF) | byte << 8) : (uint16_t)((word & 0xFF00) | byte));
+                }
+                strcpy(reply, "OK");
+                break;
+            }
+            case 'c':
+            case 's':
+                if (sscanf(packet + 1, "%lx", &addr) == 1) gdb_write_register(vm, R_PC, (uint16_t)(addr >> 1));
+                if (packet[0] == 's') debug_step(dbg, 1);
+                int going = gdb_run(vm, fd, reply);
+                debug_step(dbg, 0);
+                if (!going) {
+                    *result = vm->illegal ? VM_ILLEGAL : VM_HALTED;
+                    gdb_send(fd, reply);
+                    free(reply);
+                    return 0;
+                }
+                break;
+            case 'Z':
+            case 'z':
+                if (sscanf(packet + 1, "%d,%lx,%lx", &kind, &addr, &count) != 3 || kind > 2 || (kind == 2 && count == 0)) {
+                    // read (3) and access (4) watchpoints are not supported
+                    break;
+                }
+                if (kind == 2) {
+                    for (unsigned long w = addr >> 1; w <= (addr + count - 1) >> 1 && w < MEMORY_MAX; ++w) {
+                        debug_watchpoint(dbg, (uint16_t)w, packet[0] == 'Z');
+                    }
+                } else {
+                    debug_breakpoint(dbg, (uint16_t)(addr >> 1), packet[0] == 'Z');
+                }
+                strcpy(reply, "OK");
+                break;
+            case 'D':
+                detach = 1;
+                strcpy(reply, "OK");
+                break;
+            case 'k':
+                free(reply);
+                return 0;
+            case 'H':
+                strcpy(reply, "OK");
+                break;
+            case 'q':
+                if (strncmp(packet, "qSupported", 10) == 0) {
+                    sprintf(reply, "PacketSize=%x;swbreak+", GDB_PACKET_MAX);
+                } else if (strcmp(packet, "qAttached") == 0) {
+                    strcpy(reply, "1");
+                } else if (strcmp(packet, "qfThreadInfo") == 0) {
+                    strcpy(reply, "m1");
+                } else if (strcmp(packet, "qsThreadInfo") == 0) {
+                    strcpy(reply, "l");
+                } else if (strcmp(packet, "qC") == 0) {
+                    strcpy(reply, "QC1");
+                }
+                break;
+        }
+        if (!gdb_send(fd, reply) || detach) break;
+    }
+    free(reply);
+    return detach;
+}
+
+int debug_gdb(vm* vm, int port) {
+    /*
+        This function waits for one client of the GDB remote protocol on the TCP port of the local host, and lets it debug the machine,
+        stopped before its next instruction. If the client detaches, the breakpoints and watchpoints are cleared and the machine runs on.
+        It returns the result of the last vm_run: VM_HALTED or VM_ILLEGAL once the program has stopped,
+        or VM_BUDGET if the client killed the program or disconnected.
+    */
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0) {
+        printf("failed to open a socket\n");
+        exit(1);
+    }
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 1) != 0) {
+        printf("failed to listen on port %d\n", port);
+        exit(1);
+    }
+    fprintf(stderr, "waiting for a debugger on port %d\n", port);
+    int fd = accept(server, NULL, NULL);
+    close(server);
+    if (fd < 0) return VM_BUDGET;
+
+    int result = VM_BUDGET;
+    int detached = gdb_session(vm, fd, &result);
+    close(fd);
+    if (detached) {
+        vm_debugger* dbg = vm->debugger;
+        for (uint32_t a = 0; a < MEMORY_MAX; ++a) {
+            debug_breakpoint(dbg, (uint16_t)a, 0);
+            debug_watchpoint(dbg, (uint16_t)a, 0);
+        }
+        result = run_until_stop(vm);
+    }
+    return result;
+}
+
+#else
+
+int debug_gdb(vm* vm, int port) {
+    printf("the GDB remote protocol is not available on this system\n");
+    exit(1);
+}
+
+#endif
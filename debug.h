@@ -0,0 +1,68 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "lc3.h"
+#include "vm.h"
+
+/*
+    The debugger stops a machine at PC breakpoints, after a store to a watched address, or after a number of instructions (single-step),
+    so that its registers and memory can be inspected and changed between two runs.
+
+    A machine is debugged when its debugger is set (vm->debugger), and vm_run only uses the debug engine, a loop that executes one instruction
+    at a time and checks the breakpoints and the watchpoints, while the debugger is active: when it has a breakpoint or a watchpoint,
+    or a step to do (debug_active). A debugger without any of them costs nothing: vm_run uses the usual engine at full speed.
+    The watchpoints are checked by the debug engine too: it computes the address of every ST, STR and STI from their operands
+    before executing them, so mem_write, which every engine calls, does not look at the watchpoints.
+    vm_run returns VM_BREAK when the debugger stopped the machine, and the reason is in stop.
+
+    The debugger has two front ends for the command line: a console that reads commands from the keyboard of the machine (debug_console),
+    and a server of the GDB remote serial protocol (debug_gdb), for a GDB or another client that speaks it over TCP.
+*/
+
+// Why the debugger stopped the machine
+enum
+{
+    DEBUG_NONE = 0,
+    DEBUG_BREAKPOINT, // the PC reached a breakpoint, the instruction there was not executed yet
+    DEBUG_WATCHPOINT, // the instruction before the PC wrote to a watched address (watch_address, watch_old and watch_new tell what)
+    DEBUG_STEP        // the machine executed the instructions of debug_step
+};
+
+typedef struct vm_debugger
+{
+    uint8_t* breakpoints;       // 1 for the addresses with a breakpoint (MEMORY_MAX entries)
+    uint8_t* watchpoints;       // 1 for the addresses with a watchpoint (MEMORY_MAX entries)
+    int breakpoint_count;
+    int watchpoint_count;
+    uint64_t steps;             // instructions to execute before stopping, 0 for none
+    int resume;                 // the next vm_run executes the instruction at resume_pc before it checks the breakpoints
+    uint16_t resume_pc;
+    int stop;                   // why the machine stopped (DEBUG_*)
+    uint16_t watch_address;
+    uint16_t watch_old, watch_new;
+    atomic_int interrupted;     // set by a signal handler or the GDB client to stop a machine that runs at full speed
+} vm_debugger;
+
+// Instructions run at full speed between two checks of interrupted by the front ends
+#define DEBUG_SLICE 1000000
+
+vm_debugger* debug_create();
+void debug_free(vm_debugger* dbg);
+int debug_breakpoint(vm_debugger* dbg, uint16_t address, int set);
+int debug_watchpoint(vm_debugger* dbg, uint16_t address, int set);
+void debug_step(vm_debugger* dbg, uint64_t steps);
+
+static inline int debug_active(const vm_debugger* dbg) {
+    // the debug engine is only needed while there is something to check
+    return dbg->breakpoint_count || dbg->watchpoint_count || dbg->steps;
+}
+
+void debug_disassemble(uint16_t pc, uint16_t instr, char* buf, size_t n);
+int debug_console(vm* vm, FILE* out);
+int debug_gdb(vm* vm, int port);
+
+#endif
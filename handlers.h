@@ -0,0 +1,552 @@
+/*
+    The handlers of the main loop, one for each entry kind of the decode cache.
+
+    This file has no include guard on purpose: it is included inside the body of every dispatch engine in vm.c, 
+    which define the following macros before including it:
+        HANDLER(h):  starts the handler for the decode cache entry kind h
+        NEXT():      ends a handler and continues with the next instruction
+        REDISPATCH(): executes the entry d again, after it has been decoded
+        EXIT_LOOP(): leaves the main loop after the program has halted
+        WAIT_INPUT(): leaves the main loop without executing the instruction, which is executed again when vm_run is called again
+        FUSE(n):     tells whether a superinstruction can execute n more instructions, and takes them from the budget (always 0 in step)
+        EXECUTED():  the number of instructions executed by this vm_run before the current one
+    The instructions that end a basic block (BR, JMP, JSR, JSRR, RTI and the superinstructions ending with a BR) check the interrupts.
+    The loads go through engine_read, which is mem_read that also remembers the instruction count of a read of the I/O page.
+    Inside the handlers, vm is the machine being run, reg and decode_cache are its arrays,
+    d points to the decode cache entry of the instruction being executed, and running is cleared by TRAP_HALT.
+*/
+
+HANDLER(H_NONE)
+    {
+        /*
+            The instruction at this address has not been decoded yet (or was overwritten since it was decoded).
+            Read it from memory, decode it (and the rest of its basic block) into the decode cache, and execute it using the handler it was decoded to.
+        */
+        decode_block(vm, reg[R_PC] - 1, EXECUTED());
+        REDISPATCH();
+    }
+
+HANDLER(H_BR)
+    {   
+        /*
+            The BR operation is a conditional branch. It check the value of the condition codes along with the current conditional flags,
+            and branch to the location specified by the PC offset if the condition is true.
+                Example in assembly code: 
+                    BRzp LOOP ; Branch to LOOP if the last result was zero or positive.
+
+            The conditions are identified by the state of bits [11:9] (condition codes).
+            If any of the condition codes tested is set (conditions != 0), increment the PC with the sign-extended PCoffset.
+        */
+        if (d->r1 & cond_flags(reg[R_COND])) {
+            reg[R_PC] = reg[R_PC] + d->imm;
+        }
+        if (vm->interrupts && take_interrupt(vm, EXECUTED(), 1)) {
+            // a BR back to itself waits for an interrupt: park the machine like TRAP_GETC does
+            vm->waiting_input = 1;
+            WAIT_INPUT();
+        }
+    }
+NEXT();
+
+HANDLER(H_ADD_REG)
+    {
+        /* 
+            The "ADD" operator adds the two operands whose values are stored in the register using "+".
+            In register mode, the second operand is the value stored in the register specified in the instruction.
+        */
+        reg[d->r1] = reg[d->r2] + reg[d->r3];
+
+        // Finally remember the result of the operation, the condition flags are derived from it when a BR needs them
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_ADD_IMM)
+    {
+        /* 
+            In immediate mode, the second operand of "ADD" is the sign-extended version of the constant value specified in the instruction.
+        */
+        reg[d->r1] = reg[d->r2] + d->imm;
+
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_LD)
+    {
+        /*
+            The LD operation loads the address which is calculated by sign-extending the bits[8:0], 
+            and then adding this value to the incremented PC.
+            desReg is loaded with the information from memory located at this address.
+                Example in assembly code:
+                    LD R0, LOOP ; R0 <- mem_read(LOOP)
+        */
+        reg[d->r1] = engine_read(vm, reg[R_PC] + d->imm, EXECUTED());
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_ST)
+    {   
+        /*
+            Store: store content of the register SR defined by bits [11:9] to a memory location.
+            The location is the sum of the incremented PC and the sign-extended number that specified by the last 9 bits (PCoffset9) of the instruction.
+                Example in assembly code:
+                    ST R0, LOOP ; mem_write(LOOP, R0)
+        */
+        mem_write(vm, reg[R_PC] + d->imm, reg[d->r1]); 
+    }
+NEXT();
+
+HANDLER(H_JSR)
+    {
+        /*
+            JSR case: If bit[11] = 1, the address is computed by sign-extending bits [10:0]
+                (PC offset is of 11 bits) and adding it to the incremented PC.
+                Example in assembly code:
+                    JSR LOOP ; Store the next PC address to R7, then jump to LOOP.
+        */
+
+        // Store the PC address to R7
+        reg[R_R7] = reg[R_PC];
+        reg[R_PC] = reg[R_PC] + d->imm;  
+        check_interrupts(vm, EXECUTED());
+    }
+NEXT();
+
+HANDLER(H_JSRR)
+    {
+        /*
+            JSRR case: If bit[11] = 0, the address of the subroutine is obtained from the base register.
+                Example in assembly code:
+                    JSRR R2 ; Store the next PC address to R7, then jump to the address stored in R2.
+        */
+
+        reg[R_R7] = reg[R_PC];
+        reg[R_PC] = reg[d->r2]; //SR1 is the base register
+        check_interrupts(vm, EXECUTED());
+    }
+NEXT();
+
+HANDLER(H_AND_REG)
+    {
+        /* 
+            The "AND" operator uses & to perform bitwise AND on the two operands.
+            In register mode, the second operand is the value stored in the register specified in the instruction.
+        */
+        reg[d->r1] = reg[d->r2] & reg[d->r3];
+
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_AND_IMM)
+    {
+        /* 
+            In immediate mode, the second operand of "AND" is the sign-extended version of the constant value specified in the instruction.
+        */
+        reg[d->r1] = reg[d->r2] & d->imm;
+
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_LDR)
+    {
+        /*
+            Load Base+offset: Assign value from an address to destination register which is specified by bits [11:9].
+            The address from which value is taken is calculated by the sum of sign-extended number which is specified
+            by bits [0:5] and the content stored in a register which is specified by bits [8:6] 
+                Example in assembly code:
+                    LDR R0, R1, #1 ; R0 <- mem_read(R1 + 1)
+        */
+        reg[d->r1] = engine_read(vm, reg[d->r2] + d->imm, EXECUTED());
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_STR)
+    {
+        /*
+            Store register: store content of the register SR defined by bits [11:9] to a memory location.
+                Example in assembly code:
+                    STR R0, R1, #1 ; mem_write(R1 + 1, R0)
+        */
+        mem_write(vm, reg[d->r2] + d->imm, reg[d->r1]);
+    }
+NEXT();
+
+HANDLER(H_NOT)
+    {
+        /*
+            The NOT operation performs ~ (bitwise NOT) in C or C++: takes one number and inverts all bits of it.
+        */
+        reg[d->r1] = ~reg[d->r2];
+        
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_LDI)
+    {   
+        /*
+            Load Indirect: load a value from address to a register. The address from which value is extracted can be 
+            calculated by adding the sign-extended of the rightmost 9 bits to the incremented program counter (PC).
+                Example in assembly code:
+                    LDI R0, LOOP ; R0 <- mem_read(mem_read(LOOP))
+        */
+        reg[d->r1] = engine_read(vm, engine_read(vm, reg[R_PC] + d->imm, EXECUTED()), EXECUTED());
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_LDI_POLL)
+    {
+        /*
+            The LDI of an idle loop (see idle_loop in vm.c): when it reads MR_KBSR and no key is ready, idle_wait parks the machine
+            before the read, like TRAP_GETC does, or waits for a key; the read then happens as usual, so the program sees the same KBSR.
+        */
+        uint16_t address = engine_read(vm, reg[R_PC] + d->imm, EXECUTED());
+        if (idle_wait(vm, reg[R_PC] - 1, address)) {
+            reg[R_PC]--;
+            vm->waiting_input = 1;
+            WAIT_INPUT();
+        }
+        reg[d->r1] = engine_read(vm, address, EXECUTED());
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_LDR_POLL)
+    {
+        // the LDR of an idle loop, like H_LDI_POLL
+        uint16_t address = reg[d->r2] + d->imm;
+        if (idle_wait(vm, reg[R_PC] - 1, address)) {
+            reg[R_PC]--;
+            vm->waiting_input = 1;
+            WAIT_INPUT();
+        }
+        reg[d->r1] = engine_read(vm, address, EXECUTED());
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_JSR_NATIVE)
+    {
+        /*
+            A JSR to a guest library routine (see routine.h): the JSR is made as usual, then the routine of d->r3 runs natively,
+            leaving the PC at the return address, when the budget holds the instructions it would execute, the way a superinstruction
+            takes them. FUSE(0) is 0 in step, which always interprets the routine, and so does a machine with the keyboard interrupt enabled.
+        */
+        reg[R_R7] = reg[R_PC];
+        reg[R_PC] = reg[R_PC] + d->imm;
+        check_interrupts(vm, EXECUTED());
+        uint64_t cost;
+        if (FUSE(0) && !vm->interrupts && (cost = routine_cost(vm, d->r3)) && FUSE(cost)) {
+            routine_call(vm, d->r3, cost);
+        }
+    }
+NEXT();
+
+HANDLER(H_STI)
+    {
+        /*
+            Store indirect: store content of the register SR defined by bits [11:9] to a memory location defined in bits [8:0].  
+                Example in assembly code:
+                    STI R0, LOOP ; mem_write(mem_read(LOOP), R0)
+        */
+        mem_write(vm, engine_read(vm, reg[R_PC] + d->imm, EXECUTED()), reg[d->r1]);
+    }
+NEXT();
+
+HANDLER(H_JMP)
+    {
+        /* 
+            The JMP operation makes the program unconditionally jumps to the location specified in the base register.
+                Example in assembly code:
+                    JMP R2 ; Jump to the address stored in R2.
+
+            The base register is identified at bits[8:6].
+            This also handles RES (Return from subroutine) since RES is a special case of JMP, happens when Base_R is R7.
+        */
+        reg[R_PC] = reg[d->r2];
+        check_interrupts(vm, EXECUTED());
+    }
+NEXT();
+
+HANDLER(H_LEA)
+    {   
+        /*
+            Load effective address: Load an address to a register. The address that will be loaded is equal to the sum of
+            the incremented PC and the sign-extended number which is specified by bits [8:0] of the instruction.   
+                Example in assembly code:
+                    LEA R0, LOOP ; R0 <- address of LOOP             
+        */
+        reg[d->r1] = reg[R_PC] + d->imm;
+        reg[R_COND] = reg[d->r1];
+    }
+NEXT();
+
+HANDLER(H_ADD_IMM_ADD_REG_BR)
+    {
+        /*
+            The superinstructions execute the instructions of their sequence one after the other, each with the fields of its own entry:
+            d for the first one, then d + 1 and d + 2. The first instruction is always executed. The next ones are only executed here
+            if their entries still hold the instructions of the sequence and the budget allows it (FUSE), otherwise they are dispatched as usual.
+            The PC is moved past the instructions executed here, before a BR adds its offset.
+        */
+        reg[d->r1] = reg[d->r2] + d->imm;
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* add = d + 1;
+        decoded_instr* br = d + 2;
+        if (first_handler[add->handler] == H_ADD_REG && br->handler == H_BR && FUSE(2)) {
+            reg[add->r1] = reg[add->r2] + reg[add->r3];
+            reg[R_COND] = reg[add->r1];
+            reg[R_PC] += 2;
+            if (br->r1 & cond_flags(reg[R_COND])) reg[R_PC] += br->imm;
+            check_interrupts(vm, EXECUTED());
+            vm->fusions[H_ADD_IMM_ADD_REG_BR - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_ADD_IMM_ADD_IMM_BR)
+    {
+        reg[d->r1] = reg[d->r2] + d->imm;
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* add = d + 1;
+        decoded_instr* br = d + 2;
+        if (first_handler[add->handler] == H_ADD_IMM && br->handler == H_BR && FUSE(2)) {
+            reg[add->r1] = reg[add->r2] + add->imm;
+            reg[R_COND] = reg[add->r1];
+            reg[R_PC] += 2;
+            if (br->r1 & cond_flags(reg[R_COND])) reg[R_PC] += br->imm;
+            check_interrupts(vm, EXECUTED());
+            vm->fusions[H_ADD_IMM_ADD_IMM_BR - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_ADD_IMM_BR)
+    {
+        /*
+            The counter of a loop, like: ADD R1, R1, #-1 ; BRp LOOP
+        */
+        reg[d->r1] = reg[d->r2] + d->imm;
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* br = d + 1;
+        if (br->handler == H_BR && FUSE(1)) {
+            reg[R_PC] += 1;
+            if (br->r1 & cond_flags(reg[R_COND])) reg[R_PC] += br->imm;
+            check_interrupts(vm, EXECUTED());
+            vm->fusions[H_ADD_IMM_BR - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_ADD_REG_BR)
+    {
+        reg[d->r1] = reg[d->r2] + reg[d->r3];
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* br = d + 1;
+        if (br->handler == H_BR && FUSE(1)) {
+            reg[R_PC] += 1;
+            if (br->r1 & cond_flags(reg[R_COND])) reg[R_PC] += br->imm;
+            check_interrupts(vm, EXECUTED());
+            vm->fusions[H_ADD_REG_BR - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_ADD_IMM_ADD_REG)
+    {
+        reg[d->r1] = reg[d->r2] + d->imm;
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* add = d + 1;
+        if (first_handler[add->handler] == H_ADD_REG && FUSE(1)) {
+            reg[add->r1] = reg[add->r2] + reg[add->r3];
+            reg[R_COND] = reg[add->r1];
+            reg[R_PC] += 1;
+            vm->fusions[H_ADD_IMM_ADD_REG - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_ADD_IMM_ADD_IMM)
+    {
+        reg[d->r1] = reg[d->r2] + d->imm;
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* add = d + 1;
+        if (first_handler[add->handler] == H_ADD_IMM && FUSE(1)) {
+            reg[add->r1] = reg[add->r2] + add->imm;
+            reg[R_COND] = reg[add->r1];
+            reg[R_PC] += 1;
+            vm->fusions[H_ADD_IMM_ADD_IMM - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_AND_IMM_ADD_IMM)
+    {
+        /*
+            A register cleared and set to a constant, like: AND R0, R0, #0 ; ADD R0, R0, #5
+        */
+        reg[d->r1] = reg[d->r2] & d->imm;
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* add = d + 1;
+        if (first_handler[add->handler] == H_ADD_IMM && FUSE(1)) {
+            reg[add->r1] = reg[add->r2] + add->imm;
+            reg[R_COND] = reg[add->r1];
+            reg[R_PC] += 1;
+            vm->fusions[H_AND_IMM_ADD_IMM - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_LDR_ADD_IMM)
+    {
+        /*
+            A pointer walking through memory, like: LDR R0, R1, #0 ; ADD R1, R1, #1
+            The entry of the ADD is checked after the load, since a device read by the load may have written to the memory.
+        */
+        reg[d->r1] = engine_read(vm, reg[d->r2] + d->imm, EXECUTED());
+        reg[R_COND] = reg[d->r1];
+        decoded_instr* add = d + 1;
+        if (first_handler[add->handler] == H_ADD_IMM && FUSE(1)) {
+            reg[add->r1] = reg[add->r2] + add->imm;
+            reg[R_COND] = reg[add->r1];
+            reg[R_PC] += 1;
+            vm->fusions[H_LDR_ADD_IMM - H_FUSED]++;
+        }
+    }
+NEXT();
+
+HANDLER(H_TRAP)
+    /*
+        Trap: Store the value of PC in register R_R7, then execute the instruction corresponding to travect8, which specify by the rightmost 8 bits
+        To display a signle character or string, we use output_putc() to add each character to the output buffer of the machine (output.c).
+        The buffer is written out by output_flush() according to the flush policy, 
+        so that a screen drawn with many TRAPs goes out in a single write instead of one write per character.
+    */
+    reg[R_R7] = reg[R_PC]; 
+    uint64_t trap_output = output_total(&vm->out); // for the metrics
+
+    switch (d->imm)
+    {
+        case TRAP_GETC:
+            /*
+                Read a single character from the keyboard. The ASCII code of that character will be stored in register R_R0.
+            */
+            vm->io_instructions = vm->instructions + EXECUTED();
+            if (vm->park_on_input && !vm->io.key_ready(vm->io.user)) {
+                // no key yet: give the host thread back to the scheduler instead of waiting
+                reg[R_PC]--;
+                vm->waiting_input = 1;
+                WAIT_INPUT();
+            }
+            output_before_input(&vm->out);
+            reg[R_R0] = (uint16_t)read_key(vm);
+            reg[R_COND] = reg[R_R0];
+            break;
+        case TRAP_OUT:
+            /*
+                Display the character that is currently stored in R_R0.
+            */
+            output_putc(&vm->out, (char)reg[R_R0]);
+            break;
+        case TRAP_PUTS:
+            {
+                /*
+                    Display a string onto the console monitor. The characters of string with be stored in consecutive locations in memory, the location 
+                    of the first character is defined by value in register R_RO. TRAP_PUTS will terminate when it encounter x0000 in memory. 
+                    The whole string is added to the output buffer at once (see trap_puts).
+                */
+                trap_puts(vm, reg[R_R0], 0);
+            }
+            break;
+        case TRAP_IN:
+            {   
+                /*
+                   Require user to enter a character from the keyboard. This character will be echoed onto the console display and stored in register R_R0 at the same time.
+                */
+                vm->io_instructions = vm->instructions + EXECUTED();
+                if (vm->park_on_input && !vm->io.key_ready(vm->io.user)) {
+                    // checked before the prompt, so the prompt is written once
+                    reg[R_PC]--;
+                    vm->waiting_input = 1;
+                    WAIT_INPUT();
+                }
+                const char* prompt = "Enter a character: ";
+                while (*prompt) output_putc(&vm->out, *prompt++);
+                output_before_input(&vm->out);
+                char c = read_key(vm);
+                output_putc(&vm->out, c);  // echo the entered character onto the console monitor.
+                reg[R_R0] = (uint16_t)c;  // strore the value in R_R0.
+                reg[R_COND] = reg[R_R0];
+            }
+            break;
+        case TRAP_PUTSP:
+            {
+                /* 
+                    Write a string onto the console monitor but in this case two characters are stored in each memory location (similarly to TRAP_PUTS, the characters are also 
+                    stored in consecutive memory locations). The character which is specified by the rightmost 8 bits ([7:0]) will be read first and then the character defined
+                    by the bits [15:8] is displayed. TRAP_PUTSP terminates when it encounters x0000 in the memory.
+                */
+                trap_puts(vm, reg[R_R0], 1);
+            }
+            break;
+        case TRAP_HALT:
+            {
+                /* 
+                    Halt the execution and display the message onto console monitor.
+                */
+                const char* halt = "HALT\n";
+                while (*halt) output_putc(&vm->out, *halt++);
+                output_halt(&vm->out);
+                running = 0;
+            }
+            break;
+    }
+    if (vm->metrics) metrics_trap(vm->metrics, (uint8_t)d->imm, output_total(&vm->out) - trap_output);
+    if (!running) EXIT_LOOP();
+NEXT();
+
+HANDLER(H_ILLEGAL)
+    /*
+        OP_RES (reserved) is an illegal opcode exception: the routine of VEC_ILLEGAL runs in supervisor mode (see exception in vm.c).
+        Without a routine in the vector table, the machine stops with the PC on the instruction, and vm_run returns VM_ILLEGAL:
+        the host decides what to do with it.
+    */
+    if (!exception(vm, VEC_ILLEGAL, -1)) {
+        reg[R_PC]--;
+        vm->illegal = 1;
+        running = 0;
+        EXIT_LOOP();
+    }
+NEXT();
+
+HANDLER(H_RTI)
+    {
+        /*
+            RTI (return from interrupt) ends the routine of an interrupt or an exception: it pops the PC and the PSR that were pushed
+            onto the supervisor stack, and goes back to the user stack if the PSR is in user mode.
+                Example in assembly code:
+                    RTI ; Go back to the program that was interrupted.
+            In user mode, RTI is a privilege mode violation: the routine of VEC_PRIVILEGE runs, or the machine stops like on OP_RES.
+        */
+        if (vm->psr & PSR_USER) {
+            if (!exception(vm, VEC_PRIVILEGE, -1)) {
+                reg[R_PC]--;
+                vm->illegal = 1;
+                running = 0;
+                EXIT_LOOP();
+            }
+        } else {
+            reg[R_PC] = engine_read(vm, reg[R_R6], EXECUTED());
+            uint16_t psr = engine_read(vm, reg[R_R6] + 1, EXECUTED());
+            reg[R_R6] += 2;
+            set_psr(vm, psr);
+            check_interrupts(vm, EXECUTED());
+        }
+    }
+NEXT();
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+/* For Windows: the file is read into a buffer */
+#else
+/* For Unix: the file is mapped */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "lc3.h"
+#include "vm.h"
+#include "jit.h"
+#include "image.h"
+
+static const uint8_t* image_map(const char* path, size_t* size, int* mapped) {
+    // map a whole file into memory, NULL if it can't be read or is empty
+#ifdef _WIN32
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    uint8_t* data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long n = ftell(file);
+        rewind(file);
+        if (n > 0 && (data = malloc(n)) && fread(data, 1, n, file) != (size_t)n) {
+            free(data);
+            data = NULL;
+        }
+        *size = n > 0 ? (size_t)n : 0;
+    }
+    fclose(file);
+    *mapped = 0;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        *size = st.st_size;
+    }
+    close(fd); // the mapping stays valid after the file is closed
+    *mapped = 1;
+    return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+static int image_parse(image_file* image) {
+    /*
+        This function finds the place in the memory of the image held by image->map, without loading it.
+        It returns 0 (and closes the image) if it is too short to have an origin, or is a damaged cached image.
+
+        The length is the number of words that fit between the origin and the end of the memory (MEMORY_MAX),
+        and the words after them are counted in truncated. A last odd byte is not a word and is ignored.
+    */
+
+    if (image->size < 2) {
+        image_close(image);
+        return 0;
+    }
+
+    // a cached image starts with its header, and is only used if it is complete and its words match the checksum
+    image_cache_header header;
+    if (image->size >= sizeof(header) && memcmp(image->map, IMAGE_CACHE_MAGIC, sizeof(header.magic)) == 0) {
+        memcpy(&header, image->map, sizeof(header));
+        image->cached = 1;
+        image->origin = header.origin;
+        image->length = header.length;
+        image->data = image->map + sizeof(header);
+        if (header.byte_order != IMAGE_CACHE_BYTE_ORDER || image->size != sizeof(header) + 2 * (size_t)header.length
+            || header.length > (uint32_t)(MEMORY_MAX - header.origin)
+            || image_checksum((const uint16_t*)image->data, header.length) != header.checksum) {
+            image_close(image);
+            return 0;
+        }
+        return 1;
+    }
+
+    // the origin at the start of the file tells us where the image is placed in the memory
+    image->origin = (uint16_t)(image->map[0] << 8 | image->map[1]);
+    image->data = image->map + 2;
+    uint32_t words = (uint32_t)((image->size - 2) / 2);
+    uint32_t room = MEMORY_MAX - image->origin;
+    image->length = words < room ? words : room;
+    image->truncated = words - image->length;
+    return 1;
+}
+
+int image_open(image_file* image, const char* path) {
+    /*
+        This function opens an image file and finds its place in the memory, without loading it.
+        It returns 0 if the file can't be read, is too short to have an origin, or is a damaged cached image.
+    */
+
+    memset(image, 0, sizeof(*image));
+    image->path = path;
+    image->map = image_map(path, &image->size, &image->mapped);
+    if (!image->map) return 0;
+    return image_parse(image);
+}
+
+int image_open_memory(image_file* image, const void* data, size_t size) {
+    /*
+        This function opens an image that is already in the memory of the host, in the format of an image file or of a cached image.
+        The data is not copied: it belongs to the caller and must stay valid until the image is closed.
+        It returns 0 if the image is too short to have an origin, or is a damaged cached image.
+    */
+
+    memset(image, 0, sizeof(*image));
+    image->path = "(memory)";
+    image->map = data;
+    image->size = size;
+    image->borrowed = 1;
+    if (!image->map) return 0;
+    return image_parse(image);
+}
+
+void image_close(image_file* image) {
+    // unmap the file of an image
+    if (!image->map) return;
+    if (image->borrowed) {
+        image->map = image->data = NULL;
+        return;
+    }
+#ifdef _WIN32
+    free((void*)image->map);
+#else
+    munmap((void*)image->map, image->size);
+#endif
+    image->map = image->data = NULL;
+}
+
+int image_overlap(const image_file* a, const image_file* b) {
+    // check whether two images cover a same address
+    uint32_t a_end = (uint32_t)a->origin + a->length;
+    uint32_t b_end = (uint32_t)b->origin + b->length;
+    return a->length && b->length && a->origin < b_end && b->origin < a_end;
+}
+
+void image_swap(uint16_t* words, const uint8_t* bytes, size_t n) {
+    /*
+        This function converts n big-endian words of an image file to the little-endian words of the machine (see swap16).
+        The words are swapped 16 at a time with AVX2, or 8 at a time with SSE2 or NEON, depending on what the compiler targets (-mavx2 for AVX2).
+        The words that are left are swapped four at a time: the high and low bytes of every word of a 64-bit value are exchanged
+        with two masks and two shifts, and the last ones one by one.
+    */
+
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(bytes + 2 * i));
+        _mm256_storeu_si256((__m256i*)(words + i), _mm256_or_si256(_mm256_slli_epi16(x, 8), _mm256_srli_epi16(x, 8)));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(bytes + 2 * i));
+        _mm_storeu_si128((__m128i*)(words + i), _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8) {
+        vst1q_u8((uint8_t*)(words + i), vrev16q_u8(vld1q_u8(bytes + 2 * i)));
+    }
+#endif
+    const uint64_t low = 0x00FF00FF00FF00FFull; // the low byte of every word
+    for (; i + 4 <= n; i += 4) {
+        uint64_t x;
+        memcpy(&x, bytes + 2 * i, sizeof(x));
+        x = ((x & low) << 8) | ((x >> 8) & low);
+        memcpy(words + i, &x, sizeof(x));
+    }
+    for (; i < n; ++i) {
+        words[i] = (uint16_t)(bytes[2 * i] << 8 | bytes[2 * i + 1]);
+    }
+}
+
+void image_load(vm* vm, const image_file* image) {
+    /*
+        This function loads the words of an open image into the memory of a machine, at its origin.
+        The words are swapped (or copied, for a cached image) straight into the pages of the machine, one page at a time, instead of being written one by one with mem_write.
+        Like mem_write, the decoded instructions and the compiled blocks of the addresses that are loaded are dropped,
+        which is skipped for a machine that has not run yet, so that loading does not touch the decode cache.
+    */
+
+    const uint8_t* bytes = image->data;
+    uint32_t address = image->origin;
+    uint32_t end = address + image->length;
+    while (address < end) {
+        int page = address >> VM_PAGE_SHIFT;
+        uint32_t offset = address & VM_PAGE_MASK;
+        uint32_t n = VM_PAGE_WORDS - offset; // the words left in the page of the address
+        if (n > end - address) n = end - address;
+
+        vm_page* p = vm->pages[page];
+        if (atomic_load_explicit(&p->refs, memory_order_acquire) != 1) p = vm_own_page(vm, page);
+        if (image->cached) {
+            memcpy(p->words + offset, bytes, 2 * n);
+        } else {
+            image_swap(p->words + offset, bytes, n);
+        }
+        for (uint32_t i = 0; vm->started && i < n; ++i) {
+            uint16_t a = (uint16_t)(address + i);
+            if (vm->decode_cache[a].handler != H_NONE) vm->decode_cache[a].handler = H_NONE;
+            if (vm->jit_cover[a]) jit_invalidate(vm, a);
+        }
+        address += n;
+        bytes += 2 * n;
+    }
+}
+
+uint32_t image_checksum(const uint16_t* words, size_t n) {
+    /*
+        This function computes the checksum of n words: a Fletcher-32 checksum of 16 interleaved streams of words
+        (word i goes to stream i % 16), whose sums are then folded together.
+        The streams do not depend on each other, so the compiler adds the 16 of them at once with vector instructions.
+        The sums are reduced modulo 65535 every 359 rounds, the most that can be added before they overflow 32 bits.
+    */
+
+    enum { LANES = 16 };
+    uint32_t a[LANES] = { 0 }, b[LANES] = { 0 };
+    while (n >= LANES) {
+        size_t rounds = n / LANES < 359 ? n / LANES : 359;
+        n -= rounds * LANES;
+        while (rounds--) {
+            for (int k = 0; k < LANES; ++k) {
+                a[k] += words[k];
+                b[k] += a[k];
+            }
+            words += LANES;
+        }
+        for (int k = 0; k < LANES; ++k) {
+            a[k] = (a[k] & 0xFFFF) + (a[k] >> 16);
+            b[k] = (b[k] & 0xFFFF) + (b[k] >> 16);
+        }
+    }
+    for (size_t k = 0; k < n; ++k) {
+        a[k] += words[k];
+        b[k] += a[k];
+    }
+
+    uint32_t sum_a = 0xFFFF, sum_b = 0xFFFF;
+    for (int k = 0; k < LANES; ++k) {
+        sum_a += a[k] % 65535;
+        sum_b += b[k] % 65535 + sum_a;
+    }
+    return (sum_b % 65535) << 16 | (sum_a % 65535);
+}
+
+int image_save_cache(const image_file* image, const char* path) {
+    /*
+        This function writes the cached form of an open image file that fits in the memory.
+        It returns 0 if the file can't be written.
+    */
+
+    if (image->cached || image->truncated) return 0;
+    uint16_t* words = malloc(2 * (size_t)image->length + 1);
+    if (!words) return 0;
+    image_swap(words, image->data, image->length);
+
+    image_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_CACHE_MAGIC, sizeof(header.magic));
+    header.byte_order = IMAGE_CACHE_BYTE_ORDER;
+    header.origin = image->origin;
+    header.length = image->length;
+    header.checksum = image_checksum(words, image->length);
+    header.source_size = (uint32_t)image->size;
+
+    FILE* file = fopen(path, "wb");
+    int ok = file && fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(words, 2, image->length, file) == image->length;
+    if (file && fclose(file) != 0) ok = 0;
+    if (!ok) remove(path);
+    free(words);
+    return ok;
+}
+
+int image_open_cached(image_file* image, const char* path) {
+    /*
+        This function opens an image file through its cache (the path followed by IMAGE_CACHE_SUFFIX).
+        The cache is used if it is at least as recent as the image file and made from a file of the same size.
+        Otherwise, or if the cache is damaged, the image file is opened and a new cache is written next to it (if the directory can be written).
+        It returns 0 if the image file can't be read.
+    */
+
+    size_t len = strlen(path);
+    char* cache_path = malloc(len + sizeof(IMAGE_CACHE_SUFFIX));
+    if (!cache_path) return image_open(image, path);
+    memcpy(cache_path, path, len);
+    memcpy(cache_path + len, IMAGE_CACHE_SUFFIX, sizeof(IMAGE_CACHE_SUFFIX));
+
+    struct stat source, cache;
+    int fresh = stat(path, &source) == 0 && stat(cache_path, &cache) == 0 && cache.st_mtime >= source.st_mtime;
+    if (fresh && image_open(image, cache_path)) {
+        image_cache_header header;
+        if (image->cached) memcpy(&header, image->map, sizeof(header));
+        if (image->cached && header.source_size == (uint32_t)source.st_size) {
+            image->path = path;
+            free(cache_path);
+            return 1;
+        }
+        image_close(image);
+    }
+
+    int ok = image_open(image, path);
+    if (ok && !image->cached && !image->truncated) image_save_cache(image, cache_path);
+    free(cache_path);
+    return ok;
+}
@@ -0,0 +1,62 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    The image files of LC-3 programs (.obj).
+    An image file is the origin (the address of its first word) followed by the words of the program, all 16-bit big-endian.
+
+    image_open maps the file into the memory of the host without copying it (mmap, or one read on systems without it),
+    and finds where the image goes in the memory of the machine, so that the images given to the program can be checked
+    before any of them is loaded: an image that does not fit below the end of the memory is truncated, and two images that
+    cover the same address overlap. image_load then swaps the words straight from the mapping into the pages of a machine.
+
+    A cached image (.lc3i) holds the words of an image already in the byte order of the host, after a header with its origin,
+    length and checksum, so that it is loaded with a copy and no conversion. image_open reads both formats.
+    image_open_memory opens an image of either format that the host already holds in memory, like an embedding program (see lc3vm.h).
+    image_open_cached uses the cache next to an image file (image.obj.lc3i), and writes it when it is missing or older than the image file.
+*/
+
+#define IMAGE_CACHE_MAGIC "LC3IMAGE"
+#define IMAGE_CACHE_BYTE_ORDER 0x0102
+#define IMAGE_CACHE_SUFFIX ".lc3i"
+
+typedef struct
+{
+    char magic[8];        // IMAGE_CACHE_MAGIC
+    uint16_t byte_order;  // IMAGE_CACHE_BYTE_ORDER, in the byte order of the host that wrote the file
+    uint16_t origin;      // the address of the first word
+    uint32_t length;      // the number of words after the header
+    uint32_t checksum;    // the checksum of the words (image_checksum)
+    uint32_t source_size; // the size of the image file the cache was made from
+} image_cache_header;
+
+typedef struct
+{
+    const char* path;
+    const uint8_t* map;  // the whole file
+    size_t size;         // the size of the file in bytes
+    const uint8_t* data; // the words of the image, after the origin
+    uint16_t origin;     // the address of the first word
+    uint32_t length;     // the number of words that fit in the memory
+    uint32_t truncated;  // the number of words past the end of the memory, which are not loaded
+    int mapped;          // the file is mapped (1) or read into a buffer (0)
+    int borrowed;        // the words belong to the caller of image_open_memory, and are not freed by image_close
+    int cached;          // the words are in the byte order of the host (a cached image) instead of big-endian
+} image_file;
+
+int image_open(image_file* image, const char* path);
+int image_open_memory(image_file* image, const void* data, size_t size);
+void image_close(image_file* image);
+int image_overlap(const image_file* a, const image_file* b);
+void image_load(vm* vm, const image_file* image);
+void image_swap(uint16_t* words, const uint8_t* bytes, size_t n);
+uint32_t image_checksum(const uint16_t* words, size_t n);
+int image_save_cache(const image_file* image, const char* path);
+int image_open_cached(image_file* image, const char* path);
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "input.h"
+#include "thread.h"
+
+/*
+    The ring buffer has a single producer (the reader thread) and a single consumer (the CPU).
+    head counts the keys written by the reader thread, and tail counts the keys taken by the CPU, so the buffer holds head - tail keys.
+    The counters are atomic so the CPU can check for a key without taking the lock.
+    The lock and the condition variable are only used to sleep when the buffer is full (reader) or empty (TRAP_GETC, TRAP_IN).
+*/
+static int buffer[INPUT_BUFFER_SIZE];
+static atomic_uint head;
+static atomic_uint tail;
+static atomic_int eof; // set when the standard input is closed
+static thread_mutex lock;
+static thread_cond changed;
+
+static void input_read_loop() {
+    /*
+        This function is the body of the reader thread: it reads the keys from the standard input one at a time.
+    */
+
+    for (;;) {
+        int c = getchar();
+
+        mutex_lock(&lock);
+        if (c == EOF) {
+            atomic_store(&eof, 1);
+            cond_broadcast(&changed);
+            mutex_unlock(&lock);
+            return;
+        }
+        // wait for the CPU to take a key if the buffer is full, so that no key is lost
+        while (atomic_load(&head) - atomic_load(&tail) == INPUT_BUFFER_SIZE) {
+            cond_wait(&changed, &lock);
+        }
+        buffer[atomic_load(&head) & (INPUT_BUFFER_SIZE - 1)] = c;
+        atomic_fetch_add(&head, 1);
+        cond_broadcast(&changed);
+        mutex_unlock(&lock);
+    }
+}
+
+static THREAD_FUNC input_thread(void* arg) { input_read_loop(); return THREAD_RETURN; }
+
+void input_start() {
+    /*
+        This function starts the reader thread. It is called once, after the terminal is set up.
+    */
+
+    mutex_init(&lock);
+    cond_init(&changed);
+    thread_handle thread;
+    thread_start(&thread, input_thread, NULL);
+    thread_detach(thread);
+}
+
+int input_available() {
+    /*
+        This function checks if a key can be read without waiting.
+        It returns 1 if a key is in the buffer, and also once the standard input is closed (the next read returns EOF, like getchar).
+    */
+
+    return atomic_load(&head) != atomic_load(&tail) || atomic_load(&eof);
+}
+
+void input_wait() {
+    /*
+        This function waits until a key can be read without waiting (input_available), without taking it.
+    */
+
+    mutex_lock(&lock);
+    while (atomic_load(&head) == atomic_load(&tail) && !atomic_load(&eof)) {
+        cond_wait(&changed, &lock);
+    }
+    mutex_unlock(&lock);
+}
+
+int input_getc() {
+    /*
+        This function takes the next key from the buffer, waiting for the user to press one if the buffer is empty.
+        It returns EOF when the standard input is closed and all keys have been taken.
+    */
+
+    mutex_lock(&lock);
+    while (atomic_load(&head) == atomic_load(&tail) && !atomic_load(&eof)) {
+        cond_wait(&changed, &lock);
+    }
+    int c = EOF;
+    if (atomic_load(&head) != atomic_load(&tail)) {
+        c = buffer[atomic_load(&tail) & (INPUT_BUFFER_SIZE - 1)];
+        atomic_fetch_add(&tail, 1);
+        cond_broadcast(&changed);
+    }
+    mutex_unlock(&lock);
+    return c;
+}
@@ -0,0 +1,18 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+/*
+    The keyboard input of the machine.
+    A reader thread reads the keys from the standard input as soon as they are typed and stores them in a ring buffer,
+    so the CPU never waits for the keyboard when a program polls MR_KBSR: checking for a key is a compare of two counters.
+*/
+
+// Size of the ring buffer of keys, must be a power of 2
+#define INPUT_BUFFER_SIZE 256
+
+void input_start();
+int input_available();
+void input_wait();
+int input_getc();
+
+#endif
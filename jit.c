@@ -0,0 +1,719 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "lc3.h"
+#include "vm.h"
+#include "jit.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#include <sys/mman.h>
+
+/*
+    Layout of the native code:
+        - LC-3 registers R0-R7 live in host registers for the whole time the native code runs (see host_reg).
+          They are loaded from reg[] by the enter stub and stored back by the exit stub.
+        - The stack holds the pointer to reg[] at [rsp], the instruction budget at [rsp+8] and the pointer to the machine at [rsp+16].
+        - The last flag-setting result is kept in reg[R_COND] (see cond_flags). Inside a block the compiler remembers which register holds
+          that result, so BR tests that register directly and R_COND is only written at the block exits.
+        - A block exit to a known PC is a "mov eax, pc; jmp exit" pair. When a block is compiled at that PC,
+          the mov is patched into a direct jmp to the block (chaining), and it is patched back when that block is invalidated.
+        - Every block starts by taking its number of instructions from the budget, and returns to the main loop instead
+          when the budget is smaller than that, so a loop of chained blocks stops when vm_run has executed what it was asked for.
+*/
+
+#define JIT_CODE_SIZE (4 << 20)  // size of the native code buffer
+#define JIT_BLOCK_MAX_BYTES (16 << 10) // upper bound of the native code size of one block
+#define JIT_MAX_BLOCKS 16384
+#define JIT_MAX_EXITS (2 * JIT_MAX_BLOCKS)
+
+// x86-64 register numbers
+enum
+{
+    RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// The host register holding each LC-3 register. R6 and R7 are in caller-saved registers and are saved around calls.
+static const int host_reg[8] = { RBX, RBP, R12, R13, R14, R15, R10, R11 };
+
+typedef struct
+{
+    uint16_t start;   // address of the first instruction of the block
+    uint16_t end;     // address of the last instruction of the block
+    uint8_t* code;    // native code of the block (chain entry)
+    int live;         // cleared when the block is invalidated
+} jit_block;
+
+typedef struct
+{
+    uint8_t* site;    // the "mov eax, pc" of the exit, patched into a jmp when the exit is chained
+    uint16_t target;  // PC the exit continues at
+    int block;        // block the exit belongs to, -1 when that block was invalidated
+    int linked;       // block the exit is chained to, -1 when not chained
+} jit_exit;
+
+/*
+    The JIT state of one machine. Every function of the compiler works on the context of the machine it compiles for,
+    so machines running on different threads never share code or tables.
+*/
+struct jit_context
+{
+    uint8_t* code_buf;
+    size_t code_pos;
+    size_t code_start; // first byte after the enter/exit stubs
+    uint8_t* enter_code;
+    uint8_t* exit_code;
+
+    jit_block blocks[JIT_MAX_BLOCKS];
+    int block_count;
+    jit_exit exits[JIT_MAX_EXITS];
+    int exit_count;
+
+    void* jit_entry[MEMORY_MAX];     // native code of the block that starts at each address, NULL if none
+    uint16_t block_index[MEMORY_MAX]; // index + 1 of the block that starts at each address, 0 if none
+    uint16_t jit_counts[MEMORY_MAX];  // number of times a block was interpreted at each address, JIT_NO_COMPILE if it can't be compiled
+    uint16_t cover[MEMORY_MAX];       // number of compiled blocks that contain each address (vm->jit_cover points here)
+    int invalidations;
+};
+
+#define JIT_NO_COMPILE 0xFFFF
+
+/* Emitter */
+
+static void emit8(jit_context* j, uint8_t b) { j->code_buf[j->code_pos++] = b; }
+static void emit32(jit_context* j, uint32_t v) { memcpy(j->code_buf + j->code_pos, &v, 4); j->code_pos += 4; }
+static void emit64(jit_context* j, uint64_t v) { memcpy(j->code_buf + j->code_pos, &v, 8); j->code_pos += 8; }
+
+static void emit_rex(jit_context* j, int w, int r, int b) {
+    // REX prefix, only emitted when the instruction needs it
+    if (w || r >= 8 || b >= 8) emit8(j, 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3));
+}
+
+static void emit_rr(jit_context* j, uint8_t op, int dst, int src) {
+    // 32-bit "op dst, src" with a register destination: mov (0x89), add (0x01), and (0x21)
+    emit_rex(j, 0, src, dst);
+    emit8(j, op);
+    emit8(j, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emit_alu_ri(jit_context* j, int ext, int dst, uint32_t imm) {
+    // 32-bit "op dst, imm32": add (/0), and (/4), cmp (/7)
+    emit_rex(j, 0, 0, dst);
+    emit8(j, 0x81);
+    emit8(j, 0xC0 | (ext << 3) | (dst & 7));
+    emit32(j, imm);
+}
+
+static void emit_mov_ri(jit_context* j, int dst, uint32_t imm) {
+    emit_rex(j, 0, 0, dst);
+    emit8(j, 0xB8 | (dst & 7));
+    emit32(j, imm);
+}
+
+static void emit_mov_ri64(jit_context* j, int dst, uint64_t imm) {
+    emit_rex(j, 1, 0, dst);
+    emit8(j, 0xB8 | (dst & 7));
+    emit64(j, imm);
+}
+
+static void emit_movzx16(jit_context* j, int dst, int src) {
+    emit_rex(j, 0, dst, src);
+    emit8(j, 0x0F); emit8(j, 0xB7);
+    emit8(j, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+static void emit_not(jit_context* j, int r) {
+    emit_rex(j, 0, 0, r);
+    emit8(j, 0xF7);
+    emit8(j, 0xD0 | (r & 7));
+}
+
+static void emit_test16(jit_context* j, int r) {
+    emit8(j, 0x66);
+    emit_rex(j, 0, r, r);
+    emit8(j, 0x85);
+    emit8(j, 0xC0 | ((r & 7) << 3) | (r & 7));
+}
+
+static void emit_push(jit_context* j, int r) { if (r >= 8) emit8(j, 0x41); emit8(j, 0x50 | (r & 7)); }
+static void emit_pop(jit_context* j, int r) { if (r >= 8) emit8(j, 0x41); emit8(j, 0x58 | (r & 7)); }
+
+static void emit_jmp(jit_context* j, uint8_t* target) {
+    emit8(j, 0xE9);
+    emit32(j, (uint32_t)(target - (j->code_buf + j->code_pos + 4)));
+}
+
+static size_t emit_jcc8(jit_context* j, uint8_t cc) {
+    // short conditional jump, the offset is filled in by patch8
+    emit8(j, 0x70 | cc);
+    emit8(j, 0);
+    return j->code_pos;
+}
+
+static size_t emit_jcc32(jit_context* j, uint8_t cc) {
+    // near conditional jump, the offset is filled in by patch32
+    emit8(j, 0x0F); emit8(j, 0x80 | cc);
+    emit32(j, 0);
+    return j->code_pos;
+}
+
+static void patch8(jit_context* j, size_t from) { j->code_buf[from - 1] = (uint8_t)(j->code_pos - from); }
+static void patch32(jit_context* j, size_t from) { uint32_t rel = (uint32_t)(j->code_pos - from); memcpy(j->code_buf + from - 4, &rel, 4); }
+
+static void emit_load_rsp(jit_context* j, int dst) {
+    // mov dst, [rsp] (pointer to reg[])
+    emit_rex(j, 1, dst, 0);
+    emit8(j, 0x8B);
+    emit8(j, 0x04 | ((dst & 7) << 3));
+    emit8(j, 0x24);
+}
+
+static void emit_load_vm(jit_context* j) {
+    // mov rdi, [rsp+16] (pointer to the machine, first argument of the helpers)
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x7C); emit8(j, 0x24); emit8(j, 16);
+}
+
+static void emit_call(jit_context* j, void* fn) {
+    // call a C helper, R6/R7 are saved around the call because they are in caller-saved registers
+    emit_push(j, R10);
+    emit_push(j, R11);
+    emit_mov_ri64(j, RAX, (uint64_t)fn);
+    emit8(j, 0xFF); emit8(j, 0xD0);
+    emit_pop(j, R11);
+    emit_pop(j, R10);
+}
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE, CC_G = 0xF };
+
+/* Runtime helpers called from the native code */
+
+static int jit_store(vm* vm, uint16_t address, uint16_t val) {
+    /*
+        This function performs a store of the native code.
+        It returns 1 if the store overwrote compiled code, in which case the native code must return to the main loop,
+        and also while the keyboard interrupt is enabled, which the native code does not check (see run_jit in vm.c).
+    */
+
+    int before = vm->jit->invalidations;
+    mem_write(vm, address, val);
+    return vm->jit->invalidations != before || vm->interrupts;
+}
+
+/* Compiler */
+
+typedef struct
+{
+    int block;       // index of the block being compiled
+    int flag_reg;    // LC-3 register holding the last flag-setting result, -1 if it is only in reg[R_COND]
+    int flags_saved; // whether reg[R_COND] is up to date with flag_reg
+    int count;       // number of instructions compiled so far
+    size_t refunds[JIT_MAX_INSTRS]; // the budget refunds of the store exits, patched when the length of the block is known
+    int refund_at[JIT_MAX_INSTRS];  // number of instructions executed when each store exit is taken
+    int refund_count;
+} jit_state;
+
+static void emit_save_flags(jit_context* j, jit_state* s) {
+    /*
+        This function writes the last flag-setting result to reg[R_COND], like the handlers of the interpreter do.
+    */
+
+    if (s->flag_reg < 0 || s->flags_saved) return;
+    int r = host_reg[s->flag_reg];
+    emit_load_rsp(j, RCX);
+    // mov word [rcx + 2*R_COND], r
+    emit8(j, 0x66);
+    emit_rex(j, 0, r, 0);
+    emit8(j, 0x89); emit8(j, 0x41 | ((r & 7) << 3)); emit8(j, 2 * R_COND);
+    s->flags_saved = 1;
+}
+
+static void emit_exit(jit_context* j, jit_state* s, uint16_t target) {
+    /*
+        This function emits an exit of the block to a known PC, which can later be chained to the block compiled at that PC.
+    */
+
+    emit_save_flags(j, s);
+    if (j->exit_count < JIT_MAX_EXITS) {
+        jit_exit* e = &j->exits[j->exit_count++];
+        e->site = j->code_buf + j->code_pos;
+        e->target = target;
+        e->block = s->block;
+        e->linked = -1;
+    }
+    emit_mov_ri(j, RAX, target);
+    emit_jmp(j, j->exit_code);
+}
+
+static void emit_return(jit_context* j, jit_state* s, uint16_t target) {
+    /*
+        This function emits an exit of the block to a known PC that always goes back to the main loop: it is not in j->exits,
+        so it is never chained. The stores leave the block this way, since the main loop has to check the interrupts they enabled.
+    */
+
+    emit_save_flags(j, s);
+    emit_mov_ri(j, RAX, target);
+    emit_jmp(j, j->exit_code);
+}
+
+static void emit_exit_indirect(jit_context* j, jit_state* s, int lc3_reg) {
+    /*
+        This function emits an exit of the block to the PC stored in a register (JMP, JSRR).
+        The block at that PC is looked up in j->jit_entry at run time.
+    */
+
+    emit_save_flags(j, s);
+    emit_rr(j, 0x89, RAX, host_reg[lc3_reg]);
+    emit_mov_ri64(j, RCX, (uint64_t)j->jit_entry);
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x0C); emit8(j, 0xC1); // mov rcx, [rcx + rax*8]
+    emit8(j, 0x48); emit8(j, 0x85); emit8(j, 0xC9);             // test rcx, rcx
+    emit8(j, 0x0F); emit8(j, 0x84); emit32(j, (uint32_t)(j->exit_code - (j->code_buf + j->code_pos + 4))); // jz exit
+    emit8(j, 0xFF); emit8(j, 0xE1);                           // jmp rcx
+}
+
+static void emit_load(jit_context* j, vm* vm, int lc3_reg) {
+    /*
+        This function loads the memory word at the address in eax into an LC-3 register.
+        A read of the I/O page goes to the devices through vm_io_read, every other address is read directly from its page.
+    */
+
+    emit_alu_ri(j, 7, RAX, VM_IO_BASE);
+    size_t fast = emit_jcc8(j, CC_B);
+    emit_rr(j, 0x89, RSI, RAX);
+    emit_load_vm(j);
+    emit_call(j, (void*)vm_io_read);
+    emit_movzx16(j, RAX, RAX);
+    emit8(j, 0xEB); emit8(j, 0); size_t done = j->code_pos; // jmp done
+    patch8(j, fast);
+    emit_rr(j, 0x89, RCX, RAX);
+    emit8(j, 0xC1); emit8(j, 0xE9); emit8(j, VM_PAGE_SHIFT);             // shr ecx, VM_PAGE_SHIFT
+    emit_mov_ri64(j, RDX, (uint64_t)vm->pages);
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x0C); emit8(j, 0xCA);     // mov rcx, [rdx + rcx*8] (the page)
+    emit_alu_ri(j, 4, RAX, VM_PAGE_MASK);
+    emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x44); emit8(j, 0x41); emit8(j, offsetof(vm_page, words)); // movzx eax, word [rcx + rax*2 + words]
+    patch8(j, done);
+    emit_rr(j, 0x89, host_reg[lc3_reg], RAX);
+}
+
+static void emit_load_const(jit_context* j, vm* vm, int dst, uint16_t address) {
+    // mov dst, memory[address] for an address known at compile time (never in the I/O page)
+    // the page is looked up at run time, since the machine replaces a shared page by its own copy when it writes to it
+    emit_mov_ri64(j, RCX, (uint64_t)&vm->pages[address >> VM_PAGE_SHIFT]);
+    emit8(j, 0x48); emit8(j, 0x8B); emit8(j, 0x09);                      // mov rcx, [rcx]
+    emit_rex(j, 0, dst, 0);
+    emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x81 | ((dst & 7) << 3));  // movzx dst, word [rcx + disp32]
+    emit32(j, (uint32_t)(offsetof(vm_page, words) + 2 * (address & VM_PAGE_MASK)));
+}
+
+static void emit_store(jit_context* j, jit_state* s, int lc3_reg, uint16_t next_pc) {
+    /*
+        This function stores an LC-3 register to memory[esi] through jit_store,
+        and leaves the block for the main loop if the store overwrote compiled code or the keyboard interrupt is enabled (see jit_store).
+        The instructions of the block after the store are not executed, so they are given back to the budget.
+    */
+
+    emit_rr(j, 0x89, RDX, host_reg[lc3_reg]);
+    emit_load_vm(j);
+    emit_call(j, (void*)jit_store);
+    emit8(j, 0x85); emit8(j, 0xC0); // test eax, eax
+    size_t cont = emit_jcc32(j, CC_E);
+    int saved = s->flags_saved;
+    emit8(j, 0x81); emit8(j, 0x44); emit8(j, 0x24); emit8(j, 8); emit32(j, 0); // add dword [rsp+8], refund
+    s->refunds[s->refund_count] = j->code_pos;
+    s->refund_at[s->refund_count++] = s->count + 1;
+    emit_return(j, s, next_pc);
+    s->flags_saved = saved;
+    patch32(j, cont);
+}
+
+static void emit_set_flags(jit_state* s, int lc3_reg) {
+    // the result in lc3_reg is now the one the condition flags are derived from
+    s->flag_reg = lc3_reg;
+    s->flags_saved = 0;
+}
+
+static void link_exit(jit_context* j, jit_exit* e, int target) {
+    // patch the "mov eax, pc" of the exit into "jmp block"
+    uint8_t* code = j->blocks[target].code;
+    e->site[0] = 0xE9;
+    uint32_t rel = (uint32_t)(code - (e->site + 5));
+    memcpy(e->site + 1, &rel, 4);
+    e->linked = target;
+}
+
+static void unlink_exit(jit_exit* e) {
+    // restore the "mov eax, pc" of the exit
+    uint32_t target = e->target;
+    e->site[0] = 0xB8;
+    memcpy(e->site + 1, &target, 4);
+    e->linked = -1;
+}
+
+static void jit_flush(jit_context* j) {
+    /*
+        This function drops all compiled blocks and starts again with an empty code buffer.
+        It is only called from the main loop, never while native code is running.
+    */
+
+    j->code_pos = j->code_start;
+    j->block_count = 0;
+    j->exit_count = 0;
+    memset(j->jit_entry, 0, sizeof(j->jit_entry));
+    memset(j->block_index, 0, sizeof(j->block_index));
+    memset(j->jit_counts, 0, sizeof(j->jit_counts));
+    memset(j->cover, 0, sizeof(j->cover));
+}
+
+int jit_init(vm* vm) {
+    /*
+        This function allocates the JIT context of a machine, with its native code buffer, and generates the enter and exit stubs.
+        It returns 0 if the host does not allow executable memory.
+    */
+
+    if (vm->jit) return 1;
+    jit_context* j = calloc(1, sizeof(*j));
+    if (!j) return 0;
+    void* buf = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) { free(j); return 0; }
+    j->code_buf = buf;
+    j->code_pos = 0;
+
+    // enter stub: uint32_t enter(uint16_t* regs, void* code, uint32_t budget, vm* vm), returns what is left of the budget
+    j->enter_code = j->code_buf + j->code_pos;
+    emit_push(j, RBX); emit_push(j, RBP); emit_push(j, R12); emit_push(j, R13); emit_push(j, R14); emit_push(j, R15);
+    emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xEC); emit8(j, 24);                // sub rsp, 24
+    emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0x3C); emit8(j, 0x24);              // mov [rsp], rdi
+    emit8(j, 0x89); emit8(j, 0x54); emit8(j, 0x24); emit8(j, 8);     // mov [rsp+8], edx
+    emit8(j, 0x48); emit8(j, 0x89); emit8(j, 0x4C); emit8(j, 0x24); emit8(j, 16); // mov [rsp+16], rcx
+    for (int i = 0; i < 8; ++i) {
+        // movzx host_reg[i], word [rdi + 2*i]
+        emit_rex(j, 0, host_reg[i], 0);
+        emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x47 | ((host_reg[i] & 7) << 3)); emit8(j, 2 * i);
+    }
+    emit8(j, 0xFF); emit8(j, 0xE6);                                         // jmp rsi
+
+    // exit stub: eax holds the PC to continue at
+    j->exit_code = j->code_buf + j->code_pos;
+    emit_load_rsp(j, RCX);
+    for (int i = 0; i < 8; ++i) {
+        // mov word [rcx + 2*i], host_reg[i]
+        emit8(j, 0x66);
+        emit_rex(j, 0, host_reg[i], 0);
+        emit8(j, 0x89); emit8(j, 0x41 | ((host_reg[i] & 7) << 3)); emit8(j, 2 * i);
+    }
+    emit8(j, 0x66); emit8(j, 0x89); emit8(j, 0x41); emit8(j, 2 * R_PC);          // mov [rcx + 2*R_PC], ax
+    emit8(j, 0x8B); emit8(j, 0x44); emit8(j, 0x24); emit8(j, 8);                 // mov eax, [rsp+8]
+    emit8(j, 0x48); emit8(j, 0x83); emit8(j, 0xC4); emit8(j, 24);                // add rsp, 24
+    emit_pop(j, R15); emit_pop(j, R14); emit_pop(j, R13); emit_pop(j, R12); emit_pop(j, RBP); emit_pop(j, RBX);
+    emit8(j, 0xC3);                                                      // ret
+
+    j->code_start = j->code_pos;
+    jit_flush(j);
+    vm->jit = j;
+    vm->jit_cover = j->cover;
+    return 1;
+}
+
+int jit_hot(vm* vm, uint16_t pc) {
+    /*
+        This function counts one more interpretation of the block starting at pc,
+        and returns 1 when the block has become hot enough to be compiled.
+    */
+
+    jit_context* j = vm->jit;
+    if (j->jit_counts[pc] == JIT_NO_COMPILE) return 0;
+    return ++j->jit_counts[pc] >= JIT_THRESHOLD;
+}
+
+int jit_compile(vm* vm, uint16_t pc) {
+    /*
+        This function compiles the basic block starting at pc into native code.
+        It returns 0 if the block can't be compiled (e.g. it starts with a TRAP), in which case it is left to the interpreter.
+    */
+
+    jit_context* j = vm->jit;
+    if (j->jit_entry[pc]) return 1;
+    if (j->code_pos + JIT_BLOCK_MAX_BYTES > JIT_CODE_SIZE || j->block_count == JIT_MAX_BLOCKS || j->exit_count + 2 * JIT_MAX_INSTRS > JIT_MAX_EXITS) {
+        jit_flush(j);
+    }
+
+    // the first instruction must be one that the native code can execute
+    decoded_instr d;
+    if (pc >= VM_IO_BASE) { j->jit_counts[pc] = JIT_NO_COMPILE; return 0; }
+    decode_instr(vm_peek(vm, pc), &d);
+    int device = (d.handler == H_LD || d.handler == H_LDI || d.handler == H_STI) && (uint16_t)(pc + 1 + d.imm) >= VM_IO_BASE;
+    int idle = vm->decode_cache[pc].handler == H_LDI_POLL || vm->decode_cache[pc].handler == H_LDR_POLL; // left to idle_wait in vm.c
+    int native = vm->decode_cache[pc].handler == H_JSR_NATIVE; // the call of a native routine, made by run_jit in vm.c
+    if (d.handler == H_TRAP || d.handler == H_ILLEGAL || d.handler == H_RTI || device || idle || native) {
+        j->jit_counts[pc] = JIT_NO_COMPILE;
+        return 0;
+    }
+
+    jit_state s = { j->block_count, -1, 1 };
+    jit_block* b = &j->blocks[j->block_count];
+    b->start = pc;
+    b->code = j->code_buf + j->code_pos;
+    b->live = 1;
+    int first_exit = j->exit_count;
+
+    // chain entry: take the instructions of the block from the budget, return to the main loop when the budget is too small
+    // the length of the block is filled in when the block is compiled
+    emit8(j, 0x81); emit8(j, 0x7C); emit8(j, 0x24); emit8(j, 8); emit32(j, 0);    // cmp dword [rsp+8], len
+    size_t check = j->code_pos;
+    size_t body = emit_jcc8(j, CC_AE);
+    emit_mov_ri(j, RAX, pc);
+    emit_jmp(j, j->exit_code);
+    patch8(j, body);
+    emit8(j, 0x81); emit8(j, 0x6C); emit8(j, 0x24); emit8(j, 8); emit32(j, 0);    // sub dword [rsp+8], len
+    size_t take = j->code_pos;
+
+    uint16_t addr = pc;
+    int ended = 0;
+    for (int n = 0; n < JIT_MAX_INSTRS && !ended; ++n) {
+        int executes = 1; // cleared when the instruction is left to the interpreter
+        if (addr >= VM_IO_BASE) {
+            // never compile the memory mapped registers
+            emit_exit(j, &s, addr);
+            ended = 1;
+            break;
+        }
+        decode_instr(vm_peek(vm, addr), &d);
+        uint16_t next = addr + 1;
+        int r1 = host_reg[d.r1];
+        int r2 = host_reg[d.r2];
+        int r3 = host_reg[d.r3];
+
+        switch (d.handler) {
+            case H_ADD_REG:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_rr(j, 0x01, RAX, r3);
+                emit_movzx16(j, r1, RAX);
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_ADD_IMM:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_alu_ri(j, 0, RAX, d.imm);
+                emit_movzx16(j, r1, RAX);
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_AND_REG:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_rr(j, 0x21, RAX, r3);
+                emit_rr(j, 0x89, r1, RAX);
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_AND_IMM:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_alu_ri(j, 4, RAX, d.imm);
+                emit_rr(j, 0x89, r1, RAX);
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_NOT:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_not(j, RAX);
+                emit_movzx16(j, r1, RAX);
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_LEA:
+                emit_mov_ri(j, r1, (uint16_t)(next + d.imm));
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_LD:
+                {
+                    uint16_t target = next + d.imm;
+                    if (target >= VM_IO_BASE) { emit_exit(j, &s, addr); ended = 1; executes = 0; break; } // device reads go back to the interpreter
+                    emit_load_const(j, vm, r1, target);
+                    emit_set_flags(&s, d.r1);
+                }
+                break;
+            case H_LDR:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_alu_ri(j, 0, RAX, d.imm);
+                emit_movzx16(j, RAX, RAX);
+                emit_load(j, vm, d.r1);
+                emit_set_flags(&s, d.r1);
+                break;
+            case H_LDI:
+                {
+                    uint16_t target = next + d.imm;
+                    if (target >= VM_IO_BASE) { emit_exit(j, &s, addr); ended = 1; executes = 0; break; }
+                    emit_load_const(j, vm, RAX, target);
+                    emit_load(j, vm, d.r1);
+                    emit_set_flags(&s, d.r1);
+                }
+                break;
+            case H_ST:
+                emit_mov_ri(j, RSI, (uint16_t)(next + d.imm));
+                emit_store(j, &s, d.r1, next);
+                break;
+            case H_STR:
+                emit_rr(j, 0x89, RAX, r2);
+                emit_alu_ri(j, 0, RAX, d.imm);
+                emit_movzx16(j, RSI, RAX);
+                emit_store(j, &s, d.r1, next);
+                break;
+            case H_STI:
+                {
+                    uint16_t target = next + d.imm;
+                    if (target >= VM_IO_BASE) { emit_exit(j, &s, addr); ended = 1; executes = 0; break; }
+                    emit_load_const(j, vm, RSI, target);
+                    emit_store(j, &s, d.r1, next);
+                }
+                break;
+            case H_BR:
+                {
+                    uint16_t target = next + d.imm;
+                    int nzp = d.r1;
+                    ended = 1;
+                    if (nzp == 0) { emit_exit(j, &s, next); break; }
+                    if (nzp == (FL_NEG | FL_ZRO | FL_POS)) { emit_exit(j, &s, target); break; }
+
+                    // the flags are derived from the sign of the last flag-setting result, which is tested in its register or in reg[R_COND]
+                    static const uint8_t cc[8] = { 0, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, 0 };
+                    emit_save_flags(j, &s);
+                    if (s.flag_reg >= 0) {
+                        emit_test16(j, host_reg[s.flag_reg]);
+                    } else {
+                        emit_load_rsp(j, RCX);
+                        emit8(j, 0x0F); emit8(j, 0xB7); emit8(j, 0x41); emit8(j, 2 * R_COND); // movzx eax, word [rcx + 2*R_COND]
+                        emit_test16(j, RAX);
+                    }
+                    size_t taken = emit_jcc32(j, cc[nzp]);
+                    emit_exit(j, &s, next);
+                    patch32(j, taken);
+                    emit_exit(j, &s, target);
+                }
+                break;
+            case H_JMP:
+                emit_exit_indirect(j, &s, d.r2);
+                ended = 1;
+                break;
+            case H_JSR:
+                if (vm->decode_cache[addr].handler == H_JSR_NATIVE) {
+                    // the routine runs natively from the interpreter (see routine.h)
+                    emit_exit(j, &s, addr);
+                    ended = 1;
+                    executes = 0;
+                    break;
+                }
+                emit_mov_ri(j, host_reg[R_R7], next);
+                emit_exit(j, &s, (uint16_t)(next + d.imm));
+                ended = 1;
+                break;
+            case H_JSRR:
+                emit_mov_ri(j, host_reg[R_R7], next);
+                emit_exit_indirect(j, &s, d.r2);
+                ended = 1;
+                break;
+            default:
+                // TRAP and illegal opcodes go back to the interpreter
+                emit_exit(j, &s, addr);
+                ended = 1;
+                executes = 0;
+                break;
+        }
+        s.count += executes;
+        if (!ended) addr = next;
+    }
+    if (!ended) emit_exit(j, &s, addr);
+
+    // the length of the block, and what the store exits give back of it
+    uint32_t len = (uint32_t)s.count;
+    memcpy(j->code_buf + check - 4, &len, 4);
+    memcpy(j->code_buf + take - 4, &len, 4);
+    for (int i = 0; i < s.refund_count; ++i) {
+        uint32_t refund = len - (uint32_t)s.refund_at[i];
+        memcpy(j->code_buf + s.refunds[i] - 4, &refund, 4);
+    }
+
+    b->end = addr;
+    for (uint16_t a = b->start; ; ++a) {
+        j->cover[a]++;
+        if (a == b->end) break;
+    }
+    j->jit_entry[pc] = b->code;
+    j->block_index[pc] = j->block_count + 1;
+    j->block_count++;
+
+    // chain the exits of the other blocks that lead to this block, and the exits of this block that lead to compiled blocks
+    for (int i = 0; i < j->exit_count; ++i) {
+        jit_exit* e = &j->exits[i];
+        if (e->block < 0 || e->linked >= 0) continue;
+        if (e->target == pc) {
+            link_exit(j, e, s.block);
+        } else if (i >= first_exit && j->block_index[e->target]) {
+            link_exit(j, e, j->block_index[e->target] - 1);
+        }
+    }
+    return 1;
+}
+
+uint32_t jit_run(vm* vm, uint32_t budget) {
+    /*
+        This function runs the native code of the block at the current PC, if there is one,
+        until it reaches code that is not compiled or has executed its budget of instructions.
+        It returns the number of instructions executed, 0 if that block is not compiled.
+    */
+
+    jit_context* j = vm->jit;
+    void* code = j->jit_entry[vm->reg[R_PC]];
+    if (!code) return 0;
+    uint32_t left = ((uint32_t (*)(uint16_t*, void*, uint32_t, struct vm*))j->enter_code)(vm->reg, code, budget, vm);
+    return budget - left;
+}
+
+void jit_invalidate(vm* vm, uint16_t address) {
+    /*
+        This function drops every compiled block that contains the address, after a store overwrote it.
+        The j->exits of other j->blocks chained to a dropped block are turned back into j->exits to the main loop.
+    */
+
+    jit_context* j = vm->jit;
+    for (int i = 0; i < j->block_count; ++i) {
+        jit_block* b = &j->blocks[i];
+        if (!b->live || address < b->start || address > b->end) continue;
+
+        b->live = 0;
+        j->jit_entry[b->start] = NULL;
+        j->block_index[b->start] = 0;
+        j->jit_counts[b->start] = 0;
+        for (uint16_t a = b->start; ; ++a) {
+            j->cover[a]--;
+            if (a == b->end) break;
+        }
+        for (int k = 0; k < j->exit_count; ++k) {
+            jit_exit* e = &j->exits[k];
+            if (e->linked == i) unlink_exit(e);
+            if (e->block == i) e->block = -1;
+        }
+    }
+    j->invalidations++;
+}
+
+void jit_destroy(vm* vm) {
+    /*
+        This function frees the JIT context of a machine.
+    */
+
+    if (!vm->jit) return;
+    munmap(vm->jit->code_buf, JIT_CODE_SIZE);
+    free(vm->jit);
+    vm->jit = NULL;
+}
+
+#else
+
+/*
+    No native code generator for this host: the JIT tier is not available and the interpreter is used instead.
+*/
+
+int jit_init(vm* vm) { return 0; }
+int jit_hot(vm* vm, uint16_t pc) { return 0; }
+int jit_compile(vm* vm, uint16_t pc) { return 0; }
+uint32_t jit_run(vm* vm, uint32_t budget) { return 0; }
+void jit_invalidate(vm* vm, uint16_t address) { }
+void jit_destroy(vm* vm) { }
+
+#endif
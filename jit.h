@@ -0,0 +1,36 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "lc3.h"
+#include "vm.h"
+
+/*
+    The JIT tier translates hot basic blocks of LC-3 code into native code.
+    A basic block is a straight-line run of instructions that ends at an OP_BR, OP_JMP, OP_JSR or OP_TRAP.
+
+    The main loop of the JIT tier (run_jit in vm.c) counts how many times the interpreter starts a block at each PC,
+    compiles a block after it became hot, and from then on runs the native code of the block instead of interpreting it.
+    Compiled blocks jump directly to each other, and only return to the main loop when they reach code that is not compiled
+    or when the instruction budget given to jit_run is used up.
+
+    Every machine has its own JIT context (vm->jit), created by jit_init the first time the machine runs with the JIT.
+    The native code is only generated on x86-64 hosts, on other hosts jit_init() fails and the interpreter is used.
+*/
+
+// Number of times the interpreter starts a block at a PC before that block is compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 50
+#endif
+// Maximum number of LC-3 instructions in one block
+#define JIT_MAX_INSTRS 64
+
+int jit_init(vm* vm);
+int jit_hot(vm* vm, uint16_t pc);
+int jit_compile(vm* vm, uint16_t pc);
+uint32_t jit_run(vm* vm, uint32_t budget);
+void jit_invalidate(vm* vm, uint16_t address);
+void jit_destroy(vm* vm);
+
+#endif
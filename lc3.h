@@ -0,0 +1,182 @@
+#ifndef LC3_H
+#define LC3_H
+
+#include <stdint.h>
+
+/*
+    The definitions of the LC-3 architecture shared by the interpreter (vm.c) and the JIT (jit.c).
+*/
+
+// The number of memory addresses
+#define MEMORY_MAX (1 << 16) // using bitwise operation to define macro MEMORY_MAX = 2^16 = 65536
+
+/*
+    The registers of the machine, used as indices of the reg array of a vm (vm.h).
+    The registers are used to store temporary data and addresses during the execution of the program. 
+    The registers are stored inside CPU, so that it is faster to query data from registers.
+    The CPU uses these data and addresses to perform operations.
+    8 registers are used to store data: R0-R7, and 2 registers are used to store addresses: PC and COND.
+*/
+enum
+{
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC, // program counter: memory address of the next instruction to be executed
+    R_COND, // condition flag: information about the previous operation (the result the flags are derived from, see cond_flags)
+    R_COUNT // number of registers
+};
+
+// Create an enum to store the set of 3 condition flags which indicate the sign of the previous calculation
+enum
+{
+    FL_POS = 1 << 0, // P: the result of the previous calculation is positive
+    FL_ZRO = 1 << 1, // Z: he result of the previous calculation is zero
+    FL_NEG = 1 << 2, // N: the result of the previous calculation is negative
+};
+
+/*
+    The condition flags are evaluated lazily.
+    Instead of computing N/Z/P after every ADD, AND, NOT, LD, LDR, LDI, LEA and input TRAP, 
+    the handlers only store the result of the operation into reg[R_COND].
+    The flags are computed from it by cond_flags when a BR tests them, or when the state of the machine is shown or saved.
+*/
+static inline uint16_t cond_flags(uint16_t result) {
+    // FL_POS, FL_ZRO and FL_NEG are 1 << 0, 1 << 1 and 1 << 2: a 1 in the left-most bit selects N, a zero result selects Z
+    return 1 << ((result >> 15) * 2 + (result == 0));
+}
+
+// The set of operations that the CPU can perform (opcodes) 
+enum
+{
+    OP_BR = 0, /* branch */
+    OP_ADD, /* add  */
+    OP_LD, /* load */
+    OP_ST, /* store */
+    OP_JSR, /* jump register */
+    OP_AND, /* bitwise and */
+    OP_LDR, /* load register */
+    OP_STR, /* store register */
+    OP_RTI, /* return from interrupt */
+    OP_NOT, /* bitwise not */
+    OP_LDI, /* load indirect */
+    OP_STI, /* store indirect */
+    OP_JMP, /* jump */
+    OP_RES, /* reserved (unused) */
+    OP_LEA, /* load effective address */
+    OP_TRAP /* execute trap */
+};
+
+// Create an enum to store the memory mapped registers which are not accessible from the normal register table
+// Memory mapped registers are used to communicate with the special hardware devices
+enum
+{
+    MR_KBSR = 0b1111111000000000, // keyboard status register indicates if a key has been pressed
+    MR_KBDR = 0b1111111000000010  // keyboard data register indicates which key has been pressed
+};
+
+// The bits of MR_KBSR: a key is ready (set by the keyboard), and the keyboard interrupt is enabled (set by the program)
+#define KBSR_READY (1 << 15)
+#define KBSR_IE (1 << 14)
+
+/*
+    The interrupts and exceptions.
+    The processor status register (PSR) holds the privilege of the program in bit 15 (1 in user mode, 0 in supervisor mode),
+    its priority level in bits [10:8], and the condition codes in bits [2:0].
+    An interrupt or an exception pushes the PSR and the PC onto the supervisor stack and jumps to the routine whose address is
+    in the interrupt vector table, at VECTOR_TABLE + its vector, in supervisor mode; RTI pops them back.
+    A device interrupts the program only when its priority is higher than the priority level of the program.
+*/
+#define PSR_USER (1 << 15)
+#define PSR_PRIORITY_SHIFT 8
+#define PSR_PRIORITY (0x7 << PSR_PRIORITY_SHIFT)
+#define VECTOR_TABLE 0x0100
+#define SSP_START 0x3000 // the supervisor stack grows down from below the programs
+#define KEYBOARD_PRIORITY 4
+
+enum
+{
+    VEC_PRIVILEGE = 0x00, // RTI in user mode
+    VEC_ILLEGAL = 0x01,   // the reserved opcode
+    VEC_KEYBOARD = 0x80   // a key is ready and the program enabled the keyboard interrupt (KBSR_IE)
+};
+
+// Create an enum to store the set of trap codes
+enum
+{
+    TRAP_GETC = 0b100000,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0b100001,   /* output a character */
+    TRAP_PUTS = 0b100010,  /* output a word string */
+    TRAP_IN = 0b100011,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0b100100, /* output a byte string */
+    TRAP_HALT = 0b100101  /* halt the program */
+};
+
+/*
+    The decode cache holds the decoded form of the instruction stored at each memory address.
+    Decoding an instruction (extracting the register fields and sign-extending the offsets) is done the first time 
+    the instruction at an address is executed, and the result is reused every following time the PC reaches that address.
+    An entry with handler H_NONE (the zero value) has not been decoded yet.
+*/
+enum
+{
+    H_NONE = 0, /* not decoded yet */
+    H_BR,
+    H_ADD_REG,  /* ADD with a register as the second operand */
+    H_ADD_IMM,  /* ADD with an immediate value as the second operand */
+    H_LD,
+    H_ST,
+    H_JSR,      /* JSR with a PC offset */
+    H_JSRR,     /* JSR with a base register */
+    H_AND_REG,  /* AND with a register as the second operand */
+    H_AND_IMM,  /* AND with an immediate value as the second operand */
+    H_LDR,
+    H_STR,
+    H_NOT,
+    H_LDI,
+    H_STI,
+    H_JMP,
+    H_LEA,
+    H_TRAP,
+    H_ILLEGAL,  /* OP_RES */
+    H_RTI,
+    H_LDI_POLL, /* LDI followed by a BR back to it: the idle loop of a program waiting for a key, when it reads MR_KBSR */
+    H_LDR_POLL, /* LDR followed by a BR back to it, likewise */
+    H_JSR_NATIVE, /* JSR to a guest library routine that runs natively (see routine.h), r3 holds the routine */
+
+    /*
+        Superinstructions: a sequence of the instructions above, executed by a single handler.
+        The entry of the first instruction gets the handler of the sequence, and the entries of the others keep their own
+        (see decode_block in vm.c). The longest sequences come first, they are tried first.
+    */
+    H_ADD_IMM_ADD_REG_BR, /* ADD imm ; ADD reg ; BR */
+    H_ADD_IMM_ADD_IMM_BR, /* ADD imm ; ADD imm ; BR */
+    H_ADD_IMM_BR,         /* ADD imm ; BR, the counter of a loop */
+    H_ADD_REG_BR,         /* ADD reg ; BR */
+    H_ADD_IMM_ADD_REG,    /* ADD imm ; ADD reg */
+    H_ADD_IMM_ADD_IMM,    /* ADD imm ; ADD imm */
+    H_AND_IMM_ADD_IMM,    /* AND imm ; ADD imm, a register cleared and set to a constant */
+    H_LDR_ADD_IMM,        /* LDR ; ADD imm, a pointer walking through memory */
+    H_COUNT               /* number of handlers */
+};
+
+#define H_FUSED H_ADD_IMM_ADD_REG_BR    // the first superinstruction
+#define FUSION_COUNT (H_COUNT - H_FUSED) // the number of superinstructions
+
+typedef struct
+{
+    uint8_t handler; // which handler of the main loop executes the instruction
+    uint8_t r1;      // bits [11:9]: destination register, source register of a store, or the condition codes of BR
+    uint8_t r2;      // bits [8:6]: first source register or base register
+    uint8_t r3;      // bits [2:0]: second source register
+    uint16_t imm;    // sign-extended immediate value / offset, or the trap vector of TRAP
+} decoded_instr;
+
+void decode_instr(uint16_t instr, decoded_instr* d);
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "lc3vm.h"
+#include "lc3.h"
+#include "vm.h"
+#include "image.h"
+#include "snapshot.h"
+#include "output.h"
+
+/*
+    The C API of the library (lc3vm.h), on top of the machines of vm.h.
+    An lc3vm is a vm: the API only adds the checks and conversions that keep the layout of the machine out of the header.
+*/
+
+_Static_assert((int)LC3VM_HALTED == VM_HALTED && (int)LC3VM_BUDGET == VM_BUDGET && (int)LC3VM_BLOCKED == VM_BLOCKED && (int)LC3VM_ILLEGAL == VM_ILLEGAL
+    && (int)LC3VM_BREAK == VM_BREAK && (int)LC3VM_ERROR == VM_ERROR,
+    "the results of lc3vm_run are the ones of vm_run");
+_Static_assert((int)LC3VM_ENGINE_SWITCH == ENGINE_SWITCH && (int)LC3VM_ENGINE_THREADED == ENGINE_THREADED && (int)LC3VM_ENGINE_JIT == ENGINE_JIT,
+    "the engines of lc3vm_set_engine are the ones of vm.h");
+_Static_assert((int)LC3VM_PC == R_PC && (int)LC3VM_COND == R_COND && (int)LC3VM_REGISTERS == R_COUNT, "the registers of lc3vm.h are the ones of lc3.h");
+_Static_assert((int)LC3VM_FLAG_P == FL_POS && (int)LC3VM_FLAG_Z == FL_ZRO && (int)LC3VM_FLAG_N == FL_NEG, "the flags of lc3vm.h are the ones of lc3.h");
+
+static int no_key_ready(void* user) { return 0; }
+static int no_key(void* user) { return EOF; }
+
+static vm_io to_vm_io(const lc3vm_io* io) {
+    // the hooks of a machine, with the missing ones replaced by a keyboard without keys
+    vm_io hooks = { no_key_ready, no_key, NULL, NULL, NULL };
+    if (!io) return hooks;
+    if (io->key_ready) hooks.key_ready = io->key_ready;
+    if (io->read_key) hooks.read_key = io->read_key;
+    hooks.write = io->write;
+    hooks.user = io->user;
+    hooks.wait_key = io->wait_key;
+    return hooks;
+}
+
+lc3vm* lc3vm_create(const lc3vm_io* io) {
+    /*
+        This function creates a machine with empty memory, ready to run from x3000, with its keyboard and console connected to the hooks
+        (NULL for none). It returns NULL if there is not enough memory.
+    */
+
+    vm_io hooks = to_vm_io(io);
+    return vm_create(&hooks);
+}
+
+lc3vm* lc3vm_fork(lc3vm* vm, const lc3vm_io* io) {
+    /*
+        This function creates a copy of a machine that is not running, connected to other hooks.
+        The copy shares the memory of the machine until one of them writes to it (see snapshot.h), so forking a loaded machine
+        is much cheaper than loading the images again. It returns NULL if there is not enough memory.
+    */
+
+    vm_io hooks = to_vm_io(io);
+    return vm_fork(vm, &hooks);
+}
+
+void lc3vm_destroy(lc3vm* vm) {
+    // free a machine, after writing the output that is still buffered
+    vm_destroy(vm);
+}
+
+void lc3vm_set_io(lc3vm* vm, const lc3vm_io* io) {
+    vm_io hooks = to_vm_io(io);
+    vm_set_io(vm, &hooks);
+}
+
+int lc3vm_add_device(lc3vm* vm, uint16_t first, uint16_t last, lc3vm_device_read read, lc3vm_device_write write, void* user) {
+    // map a device on the addresses first to last of the I/O page, 0 if they are not in it or the machine has too many devices
+    return vm_add_device(vm, first, last, read, write, user);
+}
+
+int lc3vm_set_engine(lc3vm* vm, int engine) {
+    // choose the engine of a machine, 0 if it is not one of LC3VM_ENGINE_*
+    if (engine != ENGINE_SWITCH && engine != ENGINE_THREADED && engine != ENGINE_JIT) return 0;
+    vm->engine = engine;
+    return 1;
+}
+
+int lc3vm_get_engine(const lc3vm* vm) {
+    // the engine of a machine, one of LC3VM_ENGINE_* (the default one of the build until lc3vm_set_engine is called)
+    return vm->engine;
+}
+
+int lc3vm_set_flush(lc3vm* vm, const char* policy) {
+    // set the flush policy of the console output, in the format of the --flush option, 0 if it is not valid
+    return output_set_policy(&vm->out, policy);
+}
+
+void lc3vm_set_check_routines(lc3vm* vm, int check) {
+    /*
+        This function sets whether every guest library routine that a machine runs natively (see routine.h) is checked against
+        the interpreter: a difference is reported on the standard error, and the machine continues from the interpreted state.
+    */
+
+    vm->check_routines = check != 0;
+}
+
+int lc3vm_load_file(lc3vm* vm, const char* path) {
+    /*
+        This function loads an image file (or a cached image) into the memory of a machine, at its origin.
+        It returns 0 if the file can't be read or does not fit in the memory.
+    */
+
+    return read_image(vm, path);
+}
+
+int lc3vm_load(lc3vm* vm, const void* image, size_t size) {
+    /*
+        This function loads an image that the program holds in memory, in the format of an image file or of a cached image,
+        so that a program can read the file once and load it into many machines.
+        It returns 0 if the image is damaged or does not fit in the memory.
+    */
+
+    image_file file;
+    if (!image_open_memory(&file, image, size)) return 0;
+    int ok = file.truncated == 0;
+    if (ok) image_load(vm, &file);
+    image_close(&file);
+    return ok;
+}
+
+int lc3vm_run(lc3vm* vm, uint64_t budget) {
+    /*
+        This function runs the program of a machine for at most budget instructions, and returns one of the LC3VM_* results.
+    */
+
+    return vm_run(vm, budget);
+}
+
+int lc3vm_step(lc3vm* vm) {
+    // execute the next instruction of a machine
+    return vm_run(vm, 1);
+}
+
+uint64_t lc3vm_instructions(const lc3vm* vm) {
+    // the number of instructions a machine has executed
+    return vm->instructions;
+}
+
+uint64_t lc3vm_routine_calls(const lc3vm* vm, uint64_t* mismatches) {
+    // the calls of guest library routines a machine ran natively, and in mismatches (unless NULL) those that differed from the interpreter
+    uint64_t calls = 0;
+    for (int r = 0; r < ROUTINE_COUNT; ++r) calls += vm->routines[r];
+    if (mismatches) *mismatches = vm->routine_mismatches;
+    return calls;
+}
+
+void lc3vm_flush(lc3vm* vm) {
+    // write the console output that is still buffered
+    output_flush(&vm->out);
+}
+
+uint16_t lc3vm_read(const lc3vm* vm, uint16_t address) {
+    // read a word of the memory, without reading the device that covers it
+    return vm_peek(vm, address);
+}
+
+void lc3vm_write(lc3vm* vm, uint16_t address, uint16_t value) {
+    // write a word of the memory like a store of the program: through the device that covers it, dropping the code decoded from the word
+    mem_write(vm, address, value);
+}
+
+uint16_t lc3vm_get_reg(const lc3vm* vm, int reg) {
+    /*
+        This function reads a register of a machine. LC3VM_COND reads the condition flags, which the machine only derives from
+        the last result when they are needed (see cond_flags). It returns 0 for a register that does not exist.
+    */
+
+    if (reg < 0 || reg >= R_COUNT) return 0;
+    if (reg == R_COND) return cond_flags(vm->reg[R_COND]);
+    return vm->reg[reg];
+}
+
+void lc3vm_set_reg(lc3vm* vm, int reg, uint16_t value) {
+    /*
+        This function writes a register of a machine. LC3VM_COND takes one of the condition flags,
+        which is stored as a result that has it (1 for P, 0 for Z, x8000 for N).
+    */
+
+    if (reg < 0 || reg >= R_COUNT) return;
+    if (reg == R_COND) {
+        value = value & FL_NEG ? 0x8000 : value & FL_ZRO ? 0 : 1;
+    }
+    vm->reg[reg] = value;
+}
@@ -0,0 +1,121 @@
+#ifndef LC3VM_H
+#define LC3VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    The C API of liblc3vm, the library of the virtual machine, for programs that run LC-3 machines in their own process
+    instead of starting ./main for every program (see the lib target of the Makefile).
+    This header only depends on the C library: a machine is an opaque lc3vm, so a program built against the API does not depend
+    on the layout of the machine (vm.h), and a machine is only touched through these functions.
+
+    A machine is created with I/O hooks, loaded with one or more images, and run for a budget of instructions at a time:
+        lc3vm* vm = lc3vm_create(&io);
+        if (!vm || !lc3vm_load_file(vm, "games/2048.obj")) ...
+        while (lc3vm_run(vm, 1000000) == LC3VM_BUDGET) ...
+        lc3vm_destroy(vm);
+    Every machine is independent, so a program can run any number of them, each on one thread at a time.
+    The command line program (main.c) runs its machine through this API, and only uses the internal headers for its front-ends that
+    reach into the machine (the scheduler and the server, the debugger, the profilers, the traces, the recordings and the checkpoints),
+    which are in the library too, for programs that use the internal API.
+*/
+
+typedef struct vm lc3vm;
+
+// The results of lc3vm_run and lc3vm_step
+enum
+{
+    LC3VM_HALTED = 0, // the program executed TRAP_HALT
+    LC3VM_BUDGET,     // the program executed the instructions it was given, and runs on when lc3vm_run is called again
+    LC3VM_BLOCKED,    // the program waits for a key (only on a machine that parks on input, like the ones of the scheduler)
+    LC3VM_ILLEGAL,    // the program reached an illegal instruction (RES, or RTI in user mode) without a routine for its exception
+                      // in the vector table at x0100; it was not executed: the PC is its address
+    LC3VM_BREAK,      // the debugger of the internal API stopped the program (see debug.h), and it runs on when lc3vm_run is called again
+    LC3VM_ERROR       // the machine was evicted to a checkpoint file by the internal API, and the file could not be read back
+};
+
+// The engines of lc3vm_set_engine
+enum
+{
+    LC3VM_ENGINE_SWITCH = 0,
+    LC3VM_ENGINE_THREADED,
+    LC3VM_ENGINE_JIT
+};
+
+/*
+    The registers of lc3vm_get_reg and lc3vm_set_reg.
+    LC3VM_COND is the condition flags of the last result: LC3VM_FLAG_P, LC3VM_FLAG_Z or LC3VM_FLAG_N.
+*/
+enum
+{
+    LC3VM_R0 = 0,
+    LC3VM_R1,
+    LC3VM_R2,
+    LC3VM_R3,
+    LC3VM_R4,
+    LC3VM_R5,
+    LC3VM_R6,
+    LC3VM_R7,
+    LC3VM_PC,
+    LC3VM_COND,
+    LC3VM_REGISTERS // number of registers
+};
+
+enum
+{
+    LC3VM_FLAG_P = 1 << 0,
+    LC3VM_FLAG_Z = 1 << 1,
+    LC3VM_FLAG_N = 1 << 2
+};
+
+/*
+    The I/O hooks connect the keyboard and the console of a machine to the program that runs it.
+        key_ready: returns 1 if a key can be read without waiting (polled by the reads of KBSR)
+        read_key: returns the next key, waiting for one if needed (TRAP_GETC, TRAP_IN, KBSR), or EOF
+        write: writes a block of console output, when the output buffer of the machine is flushed
+        wait_key: returns once key_ready would return 1, called instead of polling by a program that only waits for a key
+    user is passed to every hook. A NULL hook is a keyboard without keys (EOF), a console whose output is dropped,
+    or a program that keeps polling.
+*/
+typedef struct
+{
+    int (*key_ready)(void* user);
+    int (*read_key)(void* user);
+    void (*write)(void* user, const char* buf, size_t n);
+    void* user;
+    void (*wait_key)(void* user);
+} lc3vm_io;
+
+/*
+    A device of the I/O page (xFE00 to xFFFF) is a read hook, called instead of reading the addresses it covers,
+    and a write hook, called instead of writing them (a NULL hook leaves the access to the memory).
+*/
+typedef uint16_t (*lc3vm_device_read)(lc3vm* vm, uint16_t address, void* user);
+typedef void (*lc3vm_device_write)(lc3vm* vm, uint16_t address, uint16_t value, void* user);
+
+lc3vm* lc3vm_create(const lc3vm_io* io);
+lc3vm* lc3vm_fork(lc3vm* vm, const lc3vm_io* io);
+void lc3vm_destroy(lc3vm* vm);
+void lc3vm_set_io(lc3vm* vm, const lc3vm_io* io);
+int lc3vm_add_device(lc3vm* vm, uint16_t first, uint16_t last, lc3vm_device_read read, lc3vm_device_write write, void* user);
+int lc3vm_set_engine(lc3vm* vm, int engine);
+int lc3vm_get_engine(const lc3vm* vm);
+int lc3vm_set_flush(lc3vm* vm, const char* policy);
+void lc3vm_set_check_routines(lc3vm* vm, int check);
+
+int lc3vm_load_file(lc3vm* vm, const char* path);
+int lc3vm_load(lc3vm* vm, const void* image, size_t size);
+
+int lc3vm_run(lc3vm* vm, uint64_t budget);
+int lc3vm_step(lc3vm* vm);
+uint64_t lc3vm_instructions(const lc3vm* vm);
+uint64_t lc3vm_routine_calls(const lc3vm* vm, uint64_t* mismatches);
+void lc3vm_flush(lc3vm* vm);
+
+uint16_t lc3vm_read(const lc3vm* vm, uint16_t address);
+void lc3vm_write(lc3vm* vm, uint16_t address, uint16_t value);
+uint16_t lc3vm_get_reg(const lc3vm* vm, int reg);
+void lc3vm_set_reg(lc3vm* vm, int reg, uint16_t value);
+
+#endif
@@ -16,161 +16,574 @@
 #include <stdint.h>
 #include <signal.h>
 #include <stdlib.h>
-
+#include <string.h>
+
+#include "lc3vm.h"
+#include "vm.h"
+#include "sched.h"
+#include "batch.h"
+#include "snapshot.h"
+#include "image.h"
+#include "profile.h"
+#include "trace.h"
+#include "pmu.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "replay.h"
+#include "debug.h"
+#include "server.h"
+#include "input.h"
+#include "output.h"
 #include "utils.h"
 
-// Create an array to store memory addresses
-#define MEMORY_MAX (1 << 16) // using bitwise operation to define macro MEMORY_MAX = 2^16 = 65536
-uint16_t memory[MEMORY_MAX];
-
 /*
-    Create an array reg to store register values. 
-    The registers are used to store temporary data and addresses during the execution of the program. 
-    The registers are stored inside CPU, so that it is faster to query data from registers.
-    The CPU uses these data and addresses to perform operations.
-    8 registers are used to store data: R0-R7, and 2 registers are used to store addresses: PC and COND.
+    The command line program runs one machine attached to the console:
+    its keyboard is the standard input (input.c) and its console output goes to the standard output.
+    The machine is created, loaded, run and reported on through the API of the library (lc3vm.h); the internal headers are only used
+    by the front-ends that reach into it: the scheduler and the server, the debugger, the profilers, the traces, the recordings and the checkpoints.
 */
-enum
-{
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC, // program counter: memory address of the next instruction to be executed
-    R_COND, // condition flag: information about the previous operation
-    R_COUNT // number of registers
-};
-uint16_t reg[R_COUNT]; 
 
-// Create an enum to store the set of 3 condition flags which indicate the sign of the previous calculation
-enum
-{
-    FL_POS = 1 << 0, // P: the result of the previous calculation is positive
-    FL_ZRO = 1 << 1, // Z: he result of the previous calculation is zero
-    FL_NEG = 1 << 2, // N: the result of the previous calculation is negative
-};
+static int console_key_ready(void* user) { return input_available(); }
+static int console_read_key(void* user) { return input_getc(); }
+static void console_wait_key(void* user) { input_wait(); }
 
-// The set of operations that the CPU can perform (opcodes) 
-enum
-{
-    OP_BR = 0, /* branch */
-    OP_ADD, /* add  */
-    OP_LD, /* load */
-    OP_ST, /* store */
-    OP_JSR, /* jump register */
-    OP_AND, /* bitwise and */
-    OP_LDR, /* load register */
-    OP_STR, /* store register */
-    OP_RTI, /* unused */
-    OP_NOT, /* bitwise not */
-    OP_LDI, /* load indirect */
-    OP_STI, /* store indirect */
-    OP_JMP, /* jump */
-    OP_RES, /* reserved (unused) */
-    OP_LEA, /* load effective address */
-    OP_TRAP /* execute trap */
-};
+static lc3vm* console_vm; // the machine of the console, for flush_console
 
-void read_image_file(FILE* file) {
-    /*
-        The assembly program is translated into a binary file called image file which is then loaded into a specific location in the memory.
-        This function reads a 16-bit image file and store it into memory at the location specified by the origin field in the file.
+static void flush_console() {
+    // the output buffer is also written when the program is interrupted
+    if (console_vm) lc3vm_flush(console_vm);
+}
 
-        The first two bytes of the file are the origin.
-        The origin specifies the lowest address of the region of memory that is contained in the file.
-        The rest of the file is a sequence of 16-bit big-endian values that make up the instructions and data for the program.
+static void load_images(lc3vm* vm, int argc, const char* argv[], int list, int cache) {
+    /*
+        This function loads the image files of the command line into a machine.
+        All the files are opened and checked before any of them is loaded (see image.c), and the program exits
+        if a file can't be read, does not fit in the memory, or covers an address of another one.
+        With list (--images), the origin, last address and length of every image are printed first.
+        With cache (--cache-images), the images are read from their pre-swapped caches, which are written the first time.
     */
 
-    // the origin at the start of the file tells us where the image is placed in the memory
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file); // read origin
-    origin = swap16(origin); // swap to little endian
+    image_file* images = calloc(argc, sizeof(*images));
+    if (!images) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    int count = 0, failed = 0;
+    for (int j = 1; j < argc; ++j) {
+        if (strncmp(argv[j], "--", 2) == 0) continue; // skip the options
+        image_file* image = &images[count++];
+        if (!(cache ? image_open_cached(image, argv[j]) : image_open(image, argv[j]))) {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+        if (image->truncated) {
+            printf("image does not fit in memory: %s (origin x%04X, %u words past the end)\n", image->path, image->origin, image->truncated);
+            failed = 1;
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        for (int k = i + 1; k < count; ++k) {
+            if (!image_overlap(&images[i], &images[k])) continue;
+            printf("images overlap: %s (x%04X-x%04X) and %s (x%04X-x%04X)\n",
+                images[i].path, images[i].origin, images[i].origin + images[i].length - 1,
+                images[k].path, images[k].origin, images[k].origin + images[k].length - 1);
+            failed = 1;
+        }
+    }
+    if (failed) exit(1);
+
+    for (int i = 0; i < count; ++i) {
+        if (list) {
+            printf("image %s: origin x%04X, last x%04X, %u words\n", images[i].path, images[i].origin,
+                images[i].length ? images[i].origin + images[i].length - 1 : images[i].origin, images[i].length);
+        }
+        lc3vm_load(vm, images[i].map, images[i].size); // the file as it was checked, in either format
+        image_close(&images[i]);
+    }
+    if (list) fflush(stdout);
+    free(images);
+}
+
+/*
+    With --profile, the machine of the console is profiled (profile.c) and the hot spots are printed to the standard error
+    when the program halts or is interrupted. With --flamegraph=FILE, its call stacks are also written to FILE,
+    in the folded format of flamegraph.pl.
+*/
+
+static vm_profile* console_profile;
+static const char* flamegraph_path;
+
+static void report_profile() {
+    if (!console_profile) return;
+    profile_report(stderr, console_profile, 20);
+    if (flamegraph_path) {
+        FILE* file = fopen(flamegraph_path, "w");
+        if (!file) {
+            fprintf(stderr, "failed to write flamegraph: %s\n", flamegraph_path);
+            return;
+        }
+        profile_write_folded(file, console_profile);
+        fclose(file);
+    }
+}
+
+/*
+    With --trace=FILE, the machine of the console is traced (trace.c): every instruction it executes is written to FILE,
+    compressed by a background thread, until the program stops or is interrupted. lc3trace prints the file as text.
+*/
+
+static vm_trace* console_trace;
+
+static void close_trace() {
+    if (!console_trace) return;
+    if (!trace_close(console_trace)) fprintf(stderr, "failed to write the trace\n");
+    console_trace = NULL;
+}
+
+/*
+    With --debug, the machine of the console is debugged from the console (debug.c): it stops before its first instruction,
+    and Ctrl+C stops the program and goes back to the prompt instead of exiting. With --gdb=PORT, it is debugged by a client
+    of the GDB remote protocol that connects to the TCP port.
+*/
 
-    uint16_t max_read = MEMORY_MAX - origin; // maximum number of words we can read in case the file is too big
-    uint16_t* p = memory + origin; // pointer to the memory location of the origin (start of the image file)
-    // read the file into memory, from the pointer p
-    size_t read = fread(p, sizeof(uint16_t), max_read, file); // read is the number of words in the file
+static vm_debugger* console_debugger;
 
-    // swap all the words to little endian 
-    while (read-- > 0) // check if read is greater than 0 then decrement it
-    {
-        *p = swap16(*p);
-        ++p;
+static void interrupt_debugger(int signal) {
+    atomic_store(&console_debugger->interrupted, 1);
+}
+
+/*
+    With --metrics=FILE, the live metrics of the machines (metrics.c) are written to FILE in the Prometheus text format
+    every --metrics-interval seconds (10 by default) and when the program stops, or to the standard error with --metrics=-.
+    With --instances, every copy of the program is a machine of its own, whose metrics add up over the worker counts.
+*/
+
+static const char* metrics_path;
+static double metrics_interval = 10;
+static metrics_dump* console_dump;
+
+static void start_metrics(vm_metrics* const* list, int count) {
+    if (!(console_dump = metrics_dump_start(metrics_path, metrics_interval, list, count))) {
+        printf("not enough memory\n");
+        exit(1);
     }
 }
 
-int read_image(const char* image_path) {
+static void stop_metrics() {
+    // the last metrics are written when the console program exits, also when it is interrupted
+    if (!console_dump) return;
+    if (!metrics_dump_stop(console_dump)) fprintf(stderr, "failed to write metrics: %s\n", metrics_path);
+    console_dump = NULL;
+}
+
+static vm_metrics* new_metrics() {
+    vm_metrics* m = metrics_create();
+    if (!m) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    return m;
+}
+
+/*
+    With --record=FILE, the input events of the machine are recorded (replay.c) and written to FILE when the program stops,
+    and with --replay=FILE, the machine runs with the input events of a recording instead of the keyboard until the end of the recording.
+    With --seek=N, a replay runs its first N instructions with the console output dropped, to get to a point of a long session quickly.
+    A replay that diverges from its recording is reported on the standard error.
+*/
+
+static vm_recording* console_recording;
+static const char* record_path;
+
+static void save_recording() {
+    if (!console_recording || !record_path) return;
+    if (!replay_save(console_recording, record_path)) fprintf(stderr, "failed to write recording: %s\n", record_path);
+    record_path = NULL; // written once
+}
+
+static void report_replay() {
+    // tell whether the replay went as recorded
+    vm_recording* rec = console_recording;
+    if (!rec || !rec->playing) return;
+    if (rec->diverged) {
+        fprintf(stderr, "replay diverged at instruction %llu (event %zu of %zu)\n", (unsigned long long)rec->diverged_at, rec->pos, rec->count);
+    }
+}
+
+static int check_routines; // --check-routines
+
+static void report_routines(const lc3vm* vm) {
+    // with --check-routines, how many native routine calls were checked against the interpreter
+    if (!check_routines) return;
+    uint64_t mismatches;
+    uint64_t calls = lc3vm_routine_calls(vm, &mismatches);
+    fprintf(stderr, "%llu native routine calls checked, %llu differed from the interpreter\n",
+        (unsigned long long)calls, (unsigned long long)mismatches);
+}
+
+static int run_machine(lc3vm* vm, uint64_t budget) {
+    // run the machine of the command line, through its recording or replay if it has one
+    return console_recording ? replay_run(console_recording, budget) : lc3vm_run(vm, budget);
+}
+
+static void start_recording(lc3vm* vm, const char* replay_path, uint64_t seek) {
     /*
-        This function opens the image file and calls read_image_file to read the file.
+        This function attaches the recording or the replay of the command line to the machine, once its hooks are set up,
+        and seeks the replay. The program exits if the recording can't be read.
     */
 
-    FILE* file = fopen(image_path, "rb");
-    if (!file) { return 0; };
-    read_image_file(file);
-    fclose(file);
-    return 1;
+    if (replay_path) {
+        if (!(console_recording = replay_play(vm, replay_path, 0))) {
+            printf("failed to read recording: %s\n", replay_path);
+            exit(1);
+        }
+        if (seek) replay_seek(console_recording, seek);
+    } else if (record_path && !(console_recording = replay_record(vm))) {
+        printf("not enough memory\n");
+        exit(1);
+    }
 }
 
-// Create an enum to store the memory mapped registers which are not accessible from the normal register table
-// Memory mapped registers are used to communicate with the special hardware devices
+/*
+    With --headless, the program runs one machine without a terminal, for batches of images run by scripts and CI jobs.
+    The keyboard reads the --input file (or the standard input) and the console writes to the --output file (or the standard output),
+    which can be files or pipes: the terminal mode, the reader thread of input.c and the Ctrl+C handler are not used.
+    A key is read from the stream when the program asks for one (a MR_KBSR poll waits for the next byte), so a run with the same input
+    always executes the same instructions. After the end of the input, the keys are EOF, like on the console.
+
+    The run stops when the program halts, after --limit instructions, after --timeout seconds, or at an illegal instruction,
+    and the program exits with one of the HEADLESS_* statuses and prints a line to the standard error, like:
+        status=illegal instructions=1234 pc=x3010 instr=x8000 seconds=0.001
+*/
+
+// The exit statuses of a headless run (1 and 2 are the errors and the usage of the command line)
 enum
 {
-    MR_KBSR = 0b1111111000000000, // keyboard status register indicates if a key has been pressed
-    MR_KBDR = 0b1111111000000010  // keyboard data register indicates which key has been pressed
+    HEADLESS_HALTED = 0,  // the program executed TRAP_HALT
+    HEADLESS_BUDGET = 3,  // the program executed --limit instructions
+    HEADLESS_TIMEOUT = 4, // the program ran for --timeout seconds
+    HEADLESS_ILLEGAL = 5  // the program reached an illegal instruction (RTI or RES)
 };
 
-void mem_write(uint16_t address, uint16_t val) {
-    /*
-        This function writes a value to a memory address.
-    */
+// Number of instructions run between two checks of the time limit
+#define HEADLESS_SLICE 1000000
+
+#define NO_KEY (-2)
+
+// The keyboard and the console of a headless machine
+typedef struct
+{
+    FILE* input;
+    int next;     // the key read by a MR_KBSR poll and not taken yet, NO_KEY if none
+    FILE* output; // NULL for the standard output
+} stream_io;
+
+static int stream_key_ready(void* user) {
+    stream_io* s = user;
+    if (s->next == NO_KEY) s->next = getc(s->input);
+    return 1;
+}
+
+static int stream_read_key(void* user) {
+    stream_io* s = user;
+    int c = s->next;
+    s->next = NO_KEY;
+    return c == NO_KEY ? getc(s->input) : c;
+}
+
+static void stream_write(void* user, const char* buf, size_t n) {
+    stream_io* s = user;
+    if (s->output) {
+        fwrite(buf, 1, n, s->output);
+    } else {
+        output_write_stdout(NULL, buf, n);
+    }
+}
+
+static void open_streams(lc3vm* vm, stream_io* s, const char* input_path, const char* output_path) {
+    // connect the keyboard and the console of the machine to the --input and --output files
+    s->input = stdin;
+    s->next = NO_KEY;
+    s->output = NULL;
+    if (input_path && !(s->input = fopen(input_path, "rb"))) {
+        printf("failed to read input: %s\n", input_path);
+        exit(1);
+    }
+    if (output_path && !(s->output = fopen(output_path, "wb"))) {
+        printf("failed to write output: %s\n", output_path);
+        exit(1);
+    }
+    lc3vm_io io = { stream_key_ready, stream_read_key, stream_write, s };
+    lc3vm_set_io(vm, &io);
+}
+
+static int close_streams(lc3vm* vm, stream_io* s, const char* output_path) {
+    // close the --input and --output files, and return 0 if the output could not be written
+    int ok = 1;
+    lc3vm_flush(vm);
+    if (s->output && fclose(s->output) != 0) {
+        fprintf(stderr, "failed to write output: %s\n", output_path);
+        ok = 0;
+    }
+    if (s->input != stdin) fclose(s->input);
+    lc3vm_set_io(vm, NULL); // the streams are closed
+    return ok;
+}
+
+/*
+    With --checkpoint=FILE, a headless run writes the state of the machine to FILE when it stops (checkpoint.c),
+    and with --resume=FILE, the machine starts in the state of a checkpoint taken on the same images instead of at their start,
+    so a long session can be stopped at --limit and continued later, headless or on the console.
+    Only the pages the program changed since the images were loaded are in the file.
+*/
+
+static vm_snapshot* console_base; // the machine right after its images were loaded, that the checkpoints are taken against
+
+static int resume_checkpoint(lc3vm* vm, const char* path) {
+    // put the machine in the state of the --resume checkpoint, and return the key its headless input had read ahead, or NO_KEY
+    char* input;
+    size_t len;
+    if (!checkpoint_load(vm, console_base, path, &input, &len)) {
+        printf("failed to read checkpoint: %s\n", path);
+        exit(1);
+    }
+    int key = len ? (unsigned char)input[0] : NO_KEY;
+    free(input);
+    return key;
+}
 
-    memory[address] = val;
+static void save_checkpoint(lc3vm* vm, stream_io* s, const char* path) {
+    char key = s->next >= 0 ? (char)s->next : 0;
+    if (!checkpoint_save(vm, console_base, &key, s->next >= 0, path)) fprintf(stderr, "failed to write checkpoint: %s\n", path);
 }
 
-uint16_t mem_read(uint16_t address) {
+static int run_headless(lc3vm* vm, uint64_t limit, double timeout) {
     /*
-        This function reads a value from a memory address.
+        This function runs the machine of the command line headless, once its streams are open, and returns its exit status.
     */
 
-    // check if the address is a keyboard status register
-    if (address == MR_KBSR) {
-        if (check_key()) { // if user pressed a key
-            memory[MR_KBSR] = (1 << 15); // set MR_KBSR to 1 indicating a key is ready to be read
-            memory[MR_KBDR] = getchar(); // set MR_KBDR to the key that was pressed
-        } else {
-            memory[MR_KBSR] = 0; // set MR_KBSR to 0 indicating there is no key to be read
+    // the limit of instructions is the sum of the budgets given to vm_run, and the time limit is checked between them
+    double start = clock_seconds();
+    int result = LC3VM_BUDGET;
+    int timed_out = 0;
+    while (result == LC3VM_BUDGET && !(limit && lc3vm_instructions(vm) >= limit)) {
+        uint64_t budget = HEADLESS_SLICE;
+        if (limit && limit - lc3vm_instructions(vm) < budget) budget = limit - lc3vm_instructions(vm);
+        result = run_machine(vm, budget);
+        if (result == LC3VM_BUDGET && timeout > 0 && clock_seconds() - start >= timeout) {
+            timed_out = 1;
+            break;
         }
     }
-    return memory[address];
+    double seconds = clock_seconds() - start;
+    lc3vm_flush(vm);
+
+    int status;
+    const char* name;
+    if (result == LC3VM_HALTED) {
+        status = HEADLESS_HALTED;
+        name = "halted";
+    } else if (result == LC3VM_ILLEGAL) {
+        status = HEADLESS_ILLEGAL;
+        name = "illegal";
+    } else if (timed_out) {
+        status = HEADLESS_TIMEOUT;
+        name = "timeout";
+    } else {
+        status = HEADLESS_BUDGET;
+        name = "budget";
+    }
+    uint16_t pc = lc3vm_get_reg(vm, LC3VM_PC);
+    fprintf(stderr, "status=%s instructions=%llu pc=x%04X", name, (unsigned long long)lc3vm_instructions(vm), pc);
+    if (result == LC3VM_ILLEGAL) fprintf(stderr, " instr=x%04X", lc3vm_read(vm, pc));
+    fprintf(stderr, " seconds=%.3f\n", seconds);
+    return status;
 }
 
-// Create an enum to store the set of trap codes
-enum
+/*
+    With --instances=N, the program runs N copies of the program on the scheduler (sched.c) instead of one on the console,
+    once for every worker count given with --workers, and reports the aggregate speed of the machines.
+    The images are loaded once, and every copy is a fork of that machine that shares its memory pages until it writes to them.
+    Every copy reads the keys of the --input file (EOF after the last one), and its console output is dropped.
+
+    With --lockstep=LANES, the copies are also run in lockstep (batch.c), in batches of LANES copies run one after the other
+    on the calling thread, and the totals are printed on a line of their own: its speed is per core, like one worker of the scheduler.
+*/
+
+static void discard_output(void* user, const char* buf, size_t n) { }
+
+// The keyboard of a copy in lockstep: the keys of the --input file, then EOF like a closed input queue of the scheduler
+typedef struct
 {
-    TRAP_GETC = 0b100000,  /* get character from keyboard, not echoed onto the terminal */
-    TRAP_OUT = 0b100001,   /* output a character */
-    TRAP_PUTS = 0b100010,  /* output a word string */
-    TRAP_IN = 0b100011,    /* get character from keyboard, echoed onto the terminal */
-    TRAP_PUTSP = 0b100100, /* output a byte string */
-    TRAP_HALT = 0b100101  /* halt the program */
-};
+    const char* keys;
+    size_t len;
+    size_t pos;
+} script_io;
+
+static int script_key_ready(void* user) { return 1; }
+
+static int script_read_key(void* user) {
+    script_io* s = user;
+    return s->pos < s->len ? (unsigned char)s->keys[s->pos++] : EOF;
+}
 
-void update_flags(uint16_t r) {
+static char* read_file(const char* path, size_t* size) {
+    // read a whole file into memory, NULL if it can't be read
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    size_t cap = 4096, len = 0;
+    char* data = malloc(cap);
+    size_t n;
+    while (data && (n = fread(data + len, 1, cap - len, file)) > 0) {
+        len += n;
+        if (len == cap) data = realloc(data, cap *= 2);
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+static void run_lockstep(vm* image, vm** vms, int instances, int lanes, const char* input, size_t input_len, uint64_t limit) {
+    // run the instances in batches of lanes, and print their totals
+    script_io* scripts = calloc(instances, sizeof(*scripts));
+    if (!scripts) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    uint64_t instructions = 0;
+    double seconds = 0;
+    int halted = 0, stopped = 0, parked = 0, illegal = 0;
+    for (int first = 0; first < instances; first += lanes) {
+        int count = instances - first < lanes ? instances - first : lanes;
+        for (int i = first; i < first + count; ++i) {
+            scripts[i] = (script_io){ input, input_len, 0 };
+            vm_io io = { script_key_ready, script_read_key, discard_output, &scripts[i] };
+            if (!(vms[i] = vm_fork(image, &io))) {
+                printf("not enough memory\n");
+                exit(1);
+            }
+        }
+        vm_batch* b = batch_create(vms + first, count);
+        if (!b) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        double start = clock_seconds();
+        instructions += batch_run(b, limit ? limit : UINT64_MAX);
+        seconds += clock_seconds() - start;
+        for (int i = 0; i < count; ++i) {
+            int result = batch_result(b, i);
+            halted += result == VM_HALTED;
+            stopped += result == VM_BUDGET;
+            parked += result == VM_BLOCKED;
+            illegal += result == VM_ILLEGAL;
+        }
+        batch_free(b);
+        for (int i = first; i < first + count; ++i) vm_destroy(vms[i]);
+    }
+    printf("%8s %10d %15llu %10.3f %10.1f %8d %8d %8d %8d\n", "lockstep", instances, (unsigned long long)instructions,
+        seconds, seconds > 0 ? instructions / seconds / 1e6 : 0.0, halted, stopped, parked, illegal);
+    free(scripts);
+}
+
+static void run_instances(int argc, const char* argv[], int engine, int instances, const char* workers, int lockstep, const char* input_path, uint64_t limit, int list, int cache) {
     /*
-        This function updates the condition flags based on the value of the register.
+        This function runs the instances once for every worker count of the comma-separated list workers (0 is one worker per core),
+        and prints one line of totals per run.
     */
 
-    if (reg[r] == 0) {
-        reg[R_COND] = FL_ZRO;
-    } else if (reg[r] >> 15) { // a 1 in the left-most bit indicates negative
-        reg[R_COND] = FL_NEG;
-    } else {
-        reg[R_COND] = FL_POS;
+    size_t input_len = 0;
+    char* input = NULL;
+    if (input_path && !(input = read_file(input_path, &input_len))) {
+        printf("failed to read input: %s\n", input_path);
+        exit(1);
     }
+    vm** vms = calloc(instances, sizeof(*vms));
+    vm_io io = { NULL, NULL, discard_output, NULL };
+    vm* image = vm_create(&io);
+    if (!vms || !image) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    image->engine = engine;
+    load_images(image, argc, argv, list, cache);
+    vm_metrics** metrics = NULL;
+    if (metrics_path) {
+        if (!(metrics = calloc(instances, sizeof(*metrics)))) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < instances; ++i) metrics[i] = new_metrics();
+        start_metrics(metrics, instances);
+    }
+
+    printf("%8s %10s %15s %10s %10s %8s %8s %8s %8s\n", "workers", "instances", "instructions", "seconds", "MIPS", "halted", "stopped", "parked", "illegal");
+    while (*workers) {
+        int count = atoi(workers);
+        workers += strcspn(workers, ",");
+        if (*workers == ',') ++workers;
+
+        sched* s = sched_create(count);
+        if (!s) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < instances; ++i) {
+            vms[i] = vm_fork(image, &io);
+            if (!vms[i]) {
+                printf("not enough memory\n");
+                exit(1);
+            }
+            if (metrics) vms[i]->metrics = metrics[i];
+            sched_task* t = sched_add(s, vms[i], limit);
+            if (!t) {
+                printf("not enough memory\n");
+                exit(1);
+            }
+            sched_input(s, t, input, input_len);
+            sched_close_input(s, t);
+        }
+
+        sched_stats stats;
+        double start = clock_seconds();
+        sched_run(s, &stats);
+        double seconds = clock_seconds() - start;
+        printf("%8d %10d %15llu %10.3f %10.1f %8d %8d %8d %8d\n", sched_workers(s), instances, (unsigned long long)stats.instructions,
+            seconds, seconds > 0 ? stats.instructions / seconds / 1e6 : 0.0, stats.halted, stats.stopped, stats.parked, stats.illegal);
+        fflush(stdout);
+
+        sched_destroy(s);
+        for (int i = 0; i < instances; ++i) vm_destroy(vms[i]);
+    }
+    if (lockstep > 0) run_lockstep(image, vms, instances, lockstep, input, input_len, limit);
+    if (metrics) {
+        stop_metrics();
+        for (int i = 0; i < instances; ++i) metrics_free(metrics[i]);
+        free(metrics);
+    }
+    vm_destroy(image);
+    free(vms);
+    free(input);
+}
+
+/*
+    With --serve=[ADDRESS:]PORT, the program is not run on the console: every client that connects to the port runs
+    its own session of it (server.c), until the server is interrupted.
+*/
+
+static void interrupt_server(int signal) {
+    server_stop();
+}
+
+static void serve(vm* image, server_options* o) {
+    signal(SIGINT, interrupt_server);
+    signal(SIGTERM, interrupt_server);
+    fprintf(stderr, "serving on %s:%d\n", o->address ? o->address : "127.0.0.1", o->port);
+    server_stats stats;
+    server_run(image, o, &stats);
+    fprintf(stderr, "%llu sessions (%d at most at once, %llu refused), %llu evictions, %llu sends of %llu bytes\n",
+        (unsigned long long)stats.sessions, stats.peak, (unsigned long long)stats.refused, (unsigned long long)stats.evictions,
+        (unsigned long long)stats.sends, (unsigned long long)stats.bytes_out);
 }
 
 int main(int argc, const char* argv[]) {
@@ -182,388 +595,309 @@ int main(int argc, const char* argv[]) {
 
         Input:
             argc: the number of elements in the argv string array
-            *argv: an array of strings containing the paths to the image files
+            *argv: an array of strings containing the options (starting with --) and the paths to the image files
     */
 
+    lc3vm_io io = { console_key_ready, console_read_key, output_write_stdout, NULL, console_wait_key };
+    lc3vm* vm = lc3vm_create(&io);
+    if (!vm) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+
     // Preprocess command line inputs
-    if (argc < 2) {
+    int images = 0;
+    int instances = 0;
+    const char* workers = "0";
+    int lockstep = 0;
+    const char* input_path = NULL;
+    const char* output_path = NULL;
+    const char* replay_path = NULL;
+    uint64_t seek = 0;
+    uint64_t limit = 0;
+    double timeout = 0;
+    int headless = 0;
+    int list = 0;
+    int cache = 0;
+    int profile = 0;
+    const char* trace_path = NULL;
+    const char* checkpoint_path = NULL;
+    const char* resume_path = NULL;
+    int pmu = 0;
+    int debug = 0;
+    int gdb_port = 0;
+    char serve_address[64] = "";
+    server_options server = { NULL, 0, 0, 10000, 0, 0 };
+    for (int j = 1; j < argc; ++j) {
+        if (strcmp(argv[j], "--engine=switch") == 0) {
+            lc3vm_set_engine(vm, LC3VM_ENGINE_SWITCH);
+        } else if (strcmp(argv[j], "--engine=threaded") == 0) {
+            lc3vm_set_engine(vm, LC3VM_ENGINE_THREADED);
+        } else if (strcmp(argv[j], "--engine=jit") == 0) {
+            lc3vm_set_engine(vm, LC3VM_ENGINE_JIT);
+        } else if (strncmp(argv[j], "--flush=", 8) == 0) {
+            if (!lc3vm_set_flush(vm, argv[j] + 8)) {
+                printf("invalid flush policy: %s\n", argv[j] + 8);
+                exit(2);
+            }
+        } else if (strncmp(argv[j], "--instances=", 12) == 0) {
+            instances = atoi(argv[j] + 12);
+        } else if (strncmp(argv[j], "--workers=", 10) == 0) {
+            workers = argv[j] + 10;
+        } else if (strncmp(argv[j], "--lockstep=", 11) == 0) {
+            lockstep = atoi(argv[j] + 11);
+        } else if (strncmp(argv[j], "--input=", 8) == 0) {
+            input_path = argv[j] + 8;
+        } else if (strncmp(argv[j], "--limit=", 8) == 0) {
+            limit = strtoull(argv[j] + 8, NULL, 10);
+        } else if (strcmp(argv[j], "--headless") == 0) {
+            headless = 1;
+        } else if (strncmp(argv[j], "--output=", 9) == 0) {
+            output_path = argv[j] + 9;
+        } else if (strncmp(argv[j], "--timeout=", 10) == 0) {
+            timeout = atof(argv[j] + 10);
+        } else if (strncmp(argv[j], "--record=", 9) == 0) {
+            record_path = argv[j] + 9;
+        } else if (strncmp(argv[j], "--replay=", 9) == 0) {
+            replay_path = argv[j] + 9;
+        } else if (strncmp(argv[j], "--seek=", 7) == 0) {
+            seek = strtoull(argv[j] + 7, NULL, 10);
+        } else if (strcmp(argv[j], "--debug") == 0) {
+            debug = 1;
+        } else if (strncmp(argv[j], "--gdb=", 6) == 0) {
+            gdb_port = atoi(argv[j] + 6);
+            if (gdb_port <= 0 || gdb_port > 65535) {
+                printf("invalid port: %s\n", argv[j] + 6);
+                exit(2);
+            }
+        } else if (strncmp(argv[j], "--serve=", 8) == 0) {
+            const char* port = strrchr(argv[j] + 8, ':');
+            if (port && (size_t)(port - (argv[j] + 8)) < sizeof(serve_address)) {
+                memcpy(serve_address, argv[j] + 8, port - (argv[j] + 8));
+                serve_address[port - (argv[j] + 8)] = 0;
+                server.address = serve_address;
+            }
+            server.port = atoi(port ? port + 1 : argv[j] + 8);
+            if (server.port <= 0 || server.port > 65535) {
+                printf("invalid port: %s\n", argv[j] + 8);
+                exit(2);
+            }
+        } else if (strncmp(argv[j], "--sessions=", 11) == 0) {
+            server.max_sessions = atoi(argv[j] + 11);
+        } else if (strncmp(argv[j], "--evict=", 8) == 0) {
+            server.evict_after = atof(argv[j] + 8);
+        } else if (strcmp(argv[j], "--images") == 0) {
+            list = 1;
+        } else if (strcmp(argv[j], "--cache-images") == 0) {
+            cache = 1;
+        } else if (strcmp(argv[j], "--profile") == 0) {
+            profile = 1;
+        } else if (strncmp(argv[j], "--flamegraph=", 13) == 0) {
+            profile = 1;
+            flamegraph_path = argv[j] + 13;
+        } else if (strcmp(argv[j], "--pmu") == 0) {
+            pmu = 1;
+        } else if (strncmp(argv[j], "--trace=", 8) == 0) {
+            trace_path = argv[j] + 8;
+        } else if (strncmp(argv[j], "--checkpoint=", 13) == 0) {
+            checkpoint_path = argv[j] + 13;
+        } else if (strncmp(argv[j], "--metrics=", 10) == 0) {
+            metrics_path = argv[j] + 10;
+        } else if (strncmp(argv[j], "--metrics-interval=", 19) == 0) {
+            metrics_interval = atof(argv[j] + 19);
+        } else if (strncmp(argv[j], "--resume=", 9) == 0) {
+            resume_path = argv[j] + 9;
+        } else if (strcmp(argv[j], "--check-routines") == 0) {
+            check_routines = 1;
+        } else if (strncmp(argv[j], "--", 2) == 0) {
+            printf("unknown option: %s\n", argv[j]);
+            exit(2);
+        } else {
+            ++images;
+        }
+    }
+    if (images == 0) {
         /* show usage string */
-        printf("lc3 [image-file1] ...\n");
+        printf("lc3 [--engine=switch|threaded|jit] [--flush=newline,input,halt,size=N] [--images] [--cache-images] [--profile] [--flamegraph=FILE] [--trace=FILE] [--metrics=FILE [--metrics-interval=SECONDS]] [--check-routines] [image-file1] ...\n");
+        printf("lc3 [--record=FILE | --replay=FILE [--seek=INSTRUCTIONS]] [--headless ...] [--engine=...] [image-file1] ...\n");
+        printf("lc3 --debug | --gdb=PORT [--engine=...] [image-file1] ...\n");
+        printf("lc3 --headless [--input=FILE] [--output=FILE] [--limit=INSTRUCTIONS] [--timeout=SECONDS] [--pmu] [--checkpoint=FILE] [--engine=...] [image-file1] ...\n");
+        printf("lc3 --resume=FILE [--headless ...] [--debug] [--engine=...] [image-file1] ...\n");
+        printf("lc3 --instances=N [--workers=W1,W2,...] [--lockstep=LANES] [--input=FILE] [--limit=INSTRUCTIONS] [--engine=...] [image-file1] ...\n");
+        printf("lc3 --serve=[ADDRESS:]PORT [--workers=W] [--sessions=N] [--evict=SECONDS] [--limit=INSTRUCTIONS] [--engine=...] [--flush=...] [image-file1] ...\n");
+        exit(2);
+    }
+    if (server.port && (instances > 0 || headless || debug || gdb_port || record_path || replay_path || resume_path || profile || trace_path || metrics_path)) {
+        printf("--serve can't be used with --instances, --headless, --debug, --gdb, --record, --replay, --resume, --profile, --trace or --metrics\n");
+        exit(2);
+    }
+    if (instances > 0 && check_routines) {
+        printf("--check-routines can't be used with --instances\n");
+        exit(2);
+    }
+    if (instances > 0 && profile) {
+        printf("--profile can't be used with --instances\n");
+        exit(2);
+    }
+    if (trace_path && (instances > 0 || profile || debug || gdb_port)) {
+        printf("--trace can't be used with --instances, --profile, --debug or --gdb\n");
+        exit(2);
+    }
+    if (instances > 0 && headless) {
+        printf("--headless can't be used with --instances\n");
+        exit(2);
+    }
+    if (instances > 0 && (record_path || replay_path)) {
+        printf("--record and --replay can't be used with --instances\n");
         exit(2);
     }
+    if (record_path && replay_path) {
+        printf("--record can't be used with --replay\n");
+        exit(2);
+    }
+    if ((debug || gdb_port) && (instances > 0 || headless || record_path || replay_path)) {
+        printf("--debug and --gdb can't be used with --instances, --headless, --record or --replay\n");
+        exit(2);
+    }
+    if (debug && gdb_port) {
+        printf("--debug can't be used with --gdb\n");
+        exit(2);
+    }
+    if (pmu && !headless) {
+        printf("--pmu needs --headless\n");
+        exit(2);
+    }
+    if (checkpoint_path && !headless) {
+        printf("--checkpoint needs --headless\n");
+        exit(2);
+    }
+    if (resume_path && (instances > 0 || record_path || replay_path)) {
+        printf("--resume can't be used with --instances, --record or --replay\n");
+        exit(2);
+    }
+    if (seek && !replay_path) {
+        printf("--seek needs --replay\n");
+        exit(2);
+    }
+    if (instances > 0) {
+        run_instances(argc, argv, lc3vm_get_engine(vm), instances, workers, lockstep, input_path, limit, list, cache);
+        lc3vm_destroy(vm);
+        return 0;
+    }
+    lc3vm_set_check_routines(vm, check_routines); // also for the sessions of the server, which are forks of the machine
+
     // read the image files into memory and exit if any of the files fail to load
-    for (int j = 1; j < argc; ++j) {
-        if (!read_image(argv[j])) 
-        {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+    load_images(vm, argc, argv, list, cache);
+
+    if (server.port) {
+        server.workers = atoi(workers);
+        server.limit = limit;
+        serve(vm, &server);
+        lc3vm_destroy(vm);
+        return 0;
+    }
+
+    if ((checkpoint_path || resume_path) && !(console_base = vm_snapshot_take(vm))) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    int resume_key = resume_path ? resume_checkpoint(vm, resume_path) : NO_KEY; // the console has no use for it
+
+    if (profile && !(vm->profile = console_profile = profile_create(lc3vm_get_reg(vm, LC3VM_PC)))) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+
+    if ((debug || gdb_port) && !(vm->debugger = console_debugger = debug_create())) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+
+    if (pmu && !(vm->pmu = pmu_open())) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+
+    if (trace_path && !(vm->trace = console_trace = trace_open(trace_path, lc3vm_instructions(vm)))) {
+        printf("failed to write trace: %s\n", trace_path);
+        exit(1);
+    }
+
+    if (metrics_path) {
+        vm->metrics = new_metrics();
+        start_metrics(&vm->metrics, 1);
+    }
+
+    if (headless) {
+        stream_io s;
+        open_streams(vm, &s, input_path, output_path);
+        start_recording(vm, replay_path, seek);
+        s.next = resume_key;
+        int status = run_headless(vm, limit, timeout);
+        if (checkpoint_path) save_checkpoint(vm, &s, checkpoint_path);
+        if (vm->pmu) {
+            // with --pmu, the counters of the host read around every vm_run (pmu.c), per LC-3 instruction of the engine that ran
+            pmu_report(stderr, vm->pmu);
+            pmu_close(vm->pmu);
+            vm->pmu = NULL;
         }
+        save_recording();
+        report_replay();
+        replay_free(console_recording);
+        report_routines(vm);
+        if (!close_streams(vm, &s, output_path)) status = 1;
+        stop_metrics();
+        metrics_free(vm->metrics);
+        lc3vm_destroy(vm);
+        report_profile();
+        close_trace();
+        vm_snapshot_free(console_base);
+        return status;
     }
 
     // Setup
-    signal(SIGINT, handle_interrupt);
+    signal(SIGINT, debug ? interrupt_debugger : handle_interrupt);
+    atexit(report_profile); // registered first, so that it runs after flush_console
+    atexit(close_trace);
+    atexit(stop_metrics);
+    atexit(report_replay);
+    atexit(save_recording); // also when the program is interrupted
+    console_vm = vm;
+    atexit(flush_console);
     disable_input_buffering();
-
-    // Initialize the condition flag to Z
-    reg[R_COND] = FL_ZRO;
-
-    // Set the PC to the starting position (default 0x3000)
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
-
-    int running = 1;
-    while (running) {
-        /* Main loop */
-
-        // read the instruction from memory at the address of the PC register and increment the PC register
-        uint16_t instr = mem_read(reg[R_PC]++); 
-        uint16_t op = instr >> 12; // the opcode is specified at the left-most 4 bits of the instruction
-
-        switch (op) {
-            case OP_BR:
-                {   
-                    // Sign-extend the PC offset
-                    // The first 9 bits after the opcode specifies how much to offset the PC
-                    uint16_t PCoffset9 = sign_extend(instr & 0b111111111, 9);
-                    // the condition codes are the 3 bits after the opcode
-                    uint16_t conditions_9 = (instr >> 9) & 0b111; 
-
-                    /*
-                        The BR operation is a conditional branch. It check the value of the condition codes along with the current conditional flags,
-                        and branch to the location specified by the PC offset if the condition is true.
-                            Example in assembly code: 
-                                BRzp LOOP ; Branch to LOOP if the last result was zero or positive.
-
-                        The conditions are identified by the state of bits [11:9] (condition codes).
-                        If any of the condition codes tested is set (conditions != 0), increment the PC with the sign-extended PCoffset.
-                    */
-                    if (conditions_9 & reg[R_COND]) {
-                        reg[R_PC] = reg[R_PC] + PCoffset9;
-                    }
-                }
-                break;
-
-            case OP_ADD:
-                {
-                    // desReg: the destination of register is the left-most 3 bits after the opcode
-                    // desReg stores the result of the operation
-                    uint16_t desReg = (instr >> 9) & 0b111;
-                    // SR1: The first operand (SR1) is the 3 bits after the destination register
-                    uint16_t SR1 = (instr >> 6) & 0b111;
-                    // The 5th bit specifies if it is in immediate value mode (bit[5]==1)
-                    // The immediate case is the case when the second operand is a constant instead of a register value
-                    uint16_t imm_mode = (instr >> 5) & 0b1; 
-
-                    /* 
-                        The "ADD" operator adds the two operands whose values are stored in the register using "+".
-                        In immediate mode, the second operand is the sign-extended version of the constant value specified in the instruction.
-                        In register mode, the second operand is the value stored in the register specified in the instruction.
-                    */
-                    reg[desReg] = reg[SR1] + (imm_mode ? sign_extend(instr & 0b11111, 5) : reg[instr & 0b111]);
-
-                    // Finally update the condition flags using the result of the operation
-                    update_flags(desReg);
-
-                }
-                break;
-            
-            case OP_LD:
-                {
-                    // desReg: the destination of register is the left-most 3 bits after the opcode
-                    // desReg stores the result of the operation
-                    uint16_t desReg = (instr >> 9) & 0b111;
-                    // Sign-extend the PC offset which is stored in the right-most 9 bits
-                    uint16_t PCoffset9 = sign_extend(instr & 0b111111111, 9);
-
-                    /*
-                        The LD operation loads the address which is calculated by sign-extending the bits[8:0], 
-                        and then adding this value to the incremented PC.
-                        desReg is loaded with the information from memory located at this address.
-                            Example in assembly code:
-                                LD R0, LOOP ; R0 <- mem_read(LOOP)
-                    */
-                    reg[desReg] = mem_read(reg[R_PC] + PCoffset9);
-                    update_flags(desReg);
-                }
-                break;
-
-            case OP_ST:
-                {   
-                    /*
-                        Store: store content of the register SR defined by bits [11:9] to a memory location.
-                        The location is the sum of the incremented PC and the sign-extended number that specified by the last 9 bits (PCoffset9) of the instruction.
-                            Example in assembly code:
-                                ST R0, LOOP ; mem_write(LOOP, R0)
-                    */
-
-                    uint16_t SR = (instr >> 9) & 0b111;  //SR is defined by bits [11:9]
-                    uint16_t PCoffset9 = instr & 0b111111111;  //PCoffset is specified by bits [8:0]
-
-                    mem_write(reg[R_PC] + sign_extend(PCoffset9, 9), reg[SR]); 
-                }
-                break;
-
-            case OP_JSR:
-                {
-                    /*
-                        The condition at bit[11] specifies 2 cases of the JSR operation.
-
-                        JSRR case: If bit[11] = 0, the address of the subroutine is obtained from the base register.
-                            Example in assembly code:
-                                JSRR R2 ; Store the next PC address to R7, then jump to the address stored in R2.
-
-                        JSR case: If bit[11] = 1, the address is computed by sign-extending bits [10:0]
-                            (PC offset is of 11 bits) and adding it to the incremented PC.
-                            Example in assembly code:
-                                JSR LOOP ; Store the next PC address to R7, then jump to LOOP.
-                    */
-
-                    // Get the condition at bit[11]
-                    uint16_t conditions_11 = (instr >> 11) & 0b1;
-                    // Store the PC address to R7
-                    reg[R_R7] = reg[R_PC];
-
-                    if (conditions_11) //JSR
-                    {
-                        uint16_t PCoffset11 = sign_extend(instr & 0b11111111111, 11);
-                        reg[R_PC] = reg[R_PC] + PCoffset11;  
-                    }
-                    else //JSRR
-                    {
-                        uint16_t SR1 = (instr >> 6) & 0b111;
-                        reg[R_PC] = reg[SR1]; //SR1 is the base register
-                    }
-                }
-                break;
-
-            case OP_AND:
-                {
-                    // desReg: the destination of register is the left-most 3 bits after the opcode
-                    // desReg stores the result of the operation
-                    uint16_t desReg = (instr >> 9) & 0b111;
-                    // SR1: The first operand (SR1) is the 3 bits after the destination register
-                    uint16_t SR1 = (instr >> 6) & 0b111;
-                    // The 5th bit specifies if it is in immediate value mode (bit[5]==1)
-                    // The immediate case is the case when the second operand is a constant instead of a register value
-                    uint16_t imm_mode = (instr >> 5) & 0b1;
-                
-                    /* 
-                        The "AND" operator uses & to perform bitwise AND on the two operands.
-                        In immediate mode, the second operand is the sign-extended version of the constant value specified in the instruction.
-                        In register mode, the second operand is the value stored in the register specified in the instruction.
-                    */
-                    reg[desReg] = reg[SR1] & (imm_mode ? sign_extend(instr & 0b11111, 5) : reg[instr & 0b111]);
-
-                    update_flags(desReg);
-                }
-                break;
-
-            case OP_LDR:
-                {
-                    /*
-                        Load Base+offset: Assign value from an address to destination register which is specified by bits [11:9].
-                        The address from which value is taken is calculated by the sum of sign-extended number which is specified
-                        by bits [0:5] and the content stored in a register which is specified by bits [8:6] 
-                            Example in assembly code:
-                                LDR R0, R1, #1 ; R0 <- mem_read(R1 + 1)
-                    */
-
-                    uint16_t DR = (instr >> 9) & 0b111;  // destination register (DR) is define by bits [11:9]. 
-                    uint16_t BaseR = (instr >> 6) & 0b111;  // BaseR is defined by bits [8:6]
-                    uint16_t Offset6 = instr & 0b111111;  //  Offset6 is defined by the rightmost 6 bits of the instruction.
-
-                    reg[DR] = mem_read(reg[BaseR] + sign_extend(Offset6, 6));
-                    update_flags(DR);
-                }
-                break;
-            
-            case OP_STR:
-                {
-                    /*
-                        Store register: store content of the register SR defined by bits [11:9] to a memory location.
-                            Example in assembly code:
-                                STR R0, R1, #1 ; mem_write(R1 + 1, R0)
-                    */
-                    uint16_t SR = (instr >> 9) & 0b111;
-                    uint16_t BaseR = (instr >> 6) & 0b111;
-                    uint16_t Offset6 = instr & 0b111111;
-                    
-                    mem_write(reg[BaseR] + sign_extend(Offset6, 6), reg[SR]);
-                }
-                break;
-            
-            case OP_NOT:
-                {
-                    // desReg: the destination of register is the left-most 3 bits after the opcode
-                    uint16_t desReg = (instr >> 9) & 0b111;
-                    // SR1: The first operand (SR1) is the 3 bits after the destination register
-                    uint16_t SR1 = (instr >> 6) & 0b111;
-
-                    /*
-                        The NOT operation performs ~ (bitwise NOT) in C or C++: takes one number and inverts all bits of it.
-                    */
-                    reg[desReg] = ~reg[SR1];
-                    
-                    update_flags(desReg);
-                }
-                break;
-
-            case OP_LDI:
-                {   
-                    /*
-                        Load Indirect: load a value from address to a register. The address from which value is extracted can be 
-                        calculated by adding the sign-extended of the rightmost 9 bits to the incremented program counter (PC).
-                            Example in assembly code:
-                                LDI R0, LOOP ; R0 <- mem_read(mem_read(LOOP))
-                    */
-                    
-                    uint16_t DR = (instr >> 9) & 0b111;  // destination register (DR) is specified by bits [11:9]
-                    uint16_t PCoffset9 = instr & 0b111111111;  // PCoffset9 is specified by the rightmost 9 bits.
-
-                    // add the sign-extended value of PCoffset9 to the current PC to calculate the address where the value will be taken, load it to the destination register. 
-                    reg[DR] = mem_read(mem_read(reg[R_PC] + sign_extend(PCoffset9, 9)));
-                    update_flags(DR);
-                }
-                break;
-
-            case OP_STI:
-                {
-                    /*
-                        Store indirect: store content of the register SR defined by bits [11:9] to a memory location defined in bits [8:0].  
-                            Example in assembly code:
-                                STI R0, LOOP ; mem_write(mem_read(LOOP), R0)
-                    */
-                    uint16_t SR = (instr >> 9) & 0b111;
-                    uint16_t PCoffset9 = instr & 0b111111111;
-
-                    mem_write(mem_read(reg[R_PC] + sign_extend(PCoffset9, 9)), reg[SR]);
-                }
-                break;
-
-            case OP_JMP:
-                {
-                    // Base register is the 3 bits after the opcode
-                    uint16_t Base_R = (instr >> 6) & 0b111;
-                    /* 
-                        The JMP operation makes the program unconditionally jumps to the location specified in the base register.
-                            Example in assembly code:
-                                JMP R2 ; Jump to the address stored in R2.
-
-                        The base register is identified at bits[8:6].
-                        This also handles RES (Return from subroutine) since RES is a special case of JMP, happens when Base_R is R7.
-                    */
-                    reg[R_PC] = reg[Base_R];
-                }
-                break;
-            
-            case OP_LEA:
-                {   
-                    /*
-                        Load effective address: Load an address to a register. The address that will be loaded is equal to the sum of
-                        the incremented PC and the sign-extended number which is specified by bits [8:0] of the instruction.   
-                            Example in assembly code:
-                                LEA R0, LOOP ; R0 <- address of LOOP             
-                    */
-
-                    uint16_t DR = (instr >> 9) & 0b111;  // Destination register is the defined by bits [11:9]
-                    uint16_t PCoffset9 = instr & 0b111111111;  // PCoffset9 is defined by bits [8:0]
-
-                    reg[DR] = reg[R_PC] + sign_extend(PCoffset9, 9);
-                    update_flags(DR);
-                }
-                break;
-            
-            case OP_TRAP:
-                /*
-                    Trap: Store the value of PC in register R_R7, then execute the instruction corresponding to travect8, which specify by the rightmost 8 bits
-                    To display a signle character or string, we use putc() ot output each character to the standard output and then flush the output stream using fflush(stdout).
-                    The reason why we use this method is that putc() and fflush() provide more control and efficiency for simple character output compared to the more feature-rich printf(). 
-                */
-                reg[R_R7] = reg[R_PC]; 
-                uint16_t trapvect8 = instr & 0b11111111; // trapvect8 is specified by the bits [7:0]
-
-                switch (trapvect8)
-                {
-                    case TRAP_GETC:
-                        /*
-                            Read a single character from the keyboard. The ASCII code of that character will be stored in register R_R0.
-                        */
-                        reg[R_R0] = (uint16_t)getchar();
-                        update_flags(R_R0);
-                        break;
-                    case TRAP_OUT:
-                        /*
-                            Display the character that is currently stored in R_R0.
-                        */
-                        putc((char)reg[R_R0], stdout);
-                        fflush(stdout);
-                        break;
-                    case TRAP_PUTS:
-                        {
-                            /*
-                                Display a string (one by one character) onto the console monitor. The characters of string with be stored in consecutive locations in memory, the location 
-                                of the first character is defined by value in register R_RO. TRAP_PUTS will terminate when it encounter x0000 in memory. 
-                            */
-                            uint16_t* c = memory + reg[R_R0];
-                            while (*c)
-                            {
-                                putc((char)*c, stdout);
-                                ++c;
-                            }
-                            fflush(stdout);
-                        }
-                        break;
-                    case TRAP_IN:
-                        {   
-                            /*
-                               Require user to enter a character from the keyboard. This character will be echoed onto the console display and stored in register R_R0 at the same time.
-                            */
-                            printf("Enter a character: ");
-                            char c = getchar();
-                            putc(c, stdout);
-                            fflush(stdout);  // echo the entered character onto the console monitor.
-                            reg[R_R0] = (uint16_t)c;  // strore the value in R_R0.
-                            update_flags(R_R0);
-                        }
-                        break;
-                    case TRAP_PUTSP:
-                        {
-                            /* 
-                                Write a string onto the console monitor but in this case two characters are stored in each memory location (similarly to TRAP_PUTS, the characters are also 
-                                stored in consecutive memory locations). The character which is specified by the rightmost 8 bits ([7:0]) will be read first and then the character defined
-                                by the bits [15:8] is displayed. TRAP_PUTSP terminates when it encounters x0000 in the memory.
-                            */
-                            uint16_t* c = memory + reg[R_R0];
-                            while (*c)
-                            {
-                                char char1 = (*c) & 0xFF;
-                                putc(char1, stdout);
-                                char char2 = (*c) >> 8;
-                                if (char2) putc(char2, stdout);
-                                ++c;
-                            }
-                            fflush(stdout);
-                        }
-                        break;
-                    case TRAP_HALT:
-                        /* 
-                            Halt the execution and display the message onto console monitor.
-                        */
-                        puts("HALT");
-                        fflush(stdout);
-                        running = 0;
-                        break;
-                }
-                break;
-            
-            case OP_RTI: //Return from interrupt, which returns the CPU from an interrupt routine to the main program that was interrupted.
-            case OP_RES: //As mentioned above, this is a special case of JMP, and is already handled in JMP.
-            default:
-                abort(); // Unimplemented instruction
-                break;
-        }
+    input_start();
+    start_recording(vm, replay_path, seek);
+
+    // Run the program until it halts, or until the user quits the debugger
+    int result;
+    if (debug) {
+        result = debug_console(vm, stderr);
+    } else if (gdb_port) {
+        result = debug_gdb(vm, gdb_port);
+    } else {
+        result = run_machine(vm, UINT64_MAX);
+    }
+    if (result == LC3VM_ILLEGAL) {
+        lc3vm_flush(vm); // show everything the program printed before it crashed
+        restore_input_buffering();
+        uint16_t pc = lc3vm_get_reg(vm, LC3VM_PC);
+        fprintf(stderr, "illegal instruction x%04X at x%04X\n", lc3vm_read(vm, pc), pc);
+        save_recording();
+        report_replay();
+        close_trace(); // the trace shows how the program got there
+        abort();
     }
 
+    save_recording();
+    report_replay();
+    replay_free(console_recording);
+    console_recording = NULL;
+    console_vm = NULL;
+    lc3vm_flush(vm);
+    report_routines(vm);
+    lc3vm_destroy(vm); // also writes the output that is still buffered
+    debug_free(console_debugger);
+
     // When the program is interrupted, the terminal settings is restored back to normal.
     restore_input_buffering();
 }
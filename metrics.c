@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "thread.h"
+#include "utils.h"
+#include "vm.h"
+
+const uint32_t metrics_bucket_us[METRICS_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+vm_metrics* metrics_create() {
+    // the zeroed metrics of a machine, NULL if there is not enough memory
+    return calloc(1, sizeof(vm_metrics));
+}
+
+void metrics_free(vm_metrics* m) {
+    free(m);
+}
+
+static uint64_t to_ns(double seconds) {
+    return seconds > 0 ? (uint64_t)(seconds * 1e9) : 0;
+}
+
+void metrics_run_begin(vm_metrics* m) {
+    // called by vm_run before its engine runs; the time since the machine was parked is time blocked on input
+    double now = clock_seconds();
+    if (m->blocked_at != 0) {
+        metrics_add(&m->blocked_ns, to_ns(now - m->blocked_at));
+        m->blocked_at = 0;
+    }
+    m->run_at = now;
+    m->run_blocked = 0;
+}
+
+void metrics_run_end(vm_metrics* m, uint64_t executed, int result) {
+    // called by vm_run with the instructions the engine executed and its result
+    double now = clock_seconds();
+    metrics_add(&m->instructions, executed);
+    metrics_add(&m->run_ns, to_ns(now - m->run_at - m->run_blocked));
+    metrics_add(&m->runs, 1);
+    if (result == VM_BLOCKED) m->blocked_at = now;
+}
+
+void metrics_blocked(vm_metrics* m, double seconds) {
+    // the program waited for a key in a hook of the machine
+    metrics_add(&m->blocked_ns, to_ns(seconds));
+    m->run_blocked += seconds;
+}
+
+void metrics_key(vm_metrics* m, double waited) {
+    /*
+        This function counts a key read by the program, after waiting for it for waited seconds.
+        The latency is measured from the first key that no output followed yet.
+    */
+
+    metrics_add(&m->keys, 1);
+    if (waited > 0) metrics_blocked(m, waited);
+    if (m->key_at == 0) m->key_at = clock_seconds();
+}
+
+void metrics_output(vm_metrics* m) {
+    // the first output after a key: its latency goes to the histogram
+    double latency = clock_seconds() - m->key_at;
+    m->key_at = 0;
+    uint64_t us = (uint64_t)(latency * 1e6);
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && us > metrics_bucket_us[bucket]) ++bucket;
+    metrics_add(&m->latency[bucket], 1);
+    metrics_add(&m->latency_ns, to_ns(latency));
+}
+
+static uint64_t get(_Atomic uint64_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void family(FILE* file, const char* name, const char* type, const char* help) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void counters(FILE* file, const char* name, const char* type, const char* help, vm_metrics* const* list, int count, size_t offset, double scale) {
+    // one sample of a counter for every machine; offset is the field of the counter in vm_metrics
+    family(file, name, type, help);
+    for (int i = 0; i < count; ++i) {
+        uint64_t value = get((_Atomic uint64_t*)((char*)list[i] + offset));
+        if (scale == 1) {
+            fprintf(file, "%s{vm=\"%d\"} %llu\n", name, i, (unsigned long long)value);
+        } else {
+            fprintf(file, "%s{vm=\"%d\"} %.6f\n", name, i, value * scale);
+        }
+    }
+}
+
+void metrics_write(FILE* file, vm_metrics* const* list, int count) {
+    /*
+        This function writes the metrics of count machines in the Prometheus text format, with the index of every machine
+        as its vm label. Traps are labelled by their vector, and only the vectors a machine used are written.
+    */
+
+    #define COUNTER(name, field, help) counters(file, name, "counter", help, list, count, offsetof(vm_metrics, field), 1)
+    #define SECONDS(name, field, help) counters(file, name, "counter", help, list, count, offsetof(vm_metrics, field), 1e-9)
+    COUNTER("lc3_instructions_total", instructions, "LC-3 instructions retired.");
+    SECONDS("lc3_run_seconds_total", run_ns, "Time spent running instructions, without the waits for a key.");
+    COUNTER("lc3_runs_total", runs, "Calls of vm_run (time slices on the scheduler).");
+    family(file, "lc3_mips", "gauge", "Millions of LC-3 instructions per second of run time.");
+    for (int i = 0; i < count; ++i) {
+        uint64_t ns = get(&list[i]->run_ns);
+        fprintf(file, "lc3_mips{vm=\"%d\"} %.3f\n", i, ns ? get(&list[i]->instructions) * 1e3 / ns : 0.0);
+    }
+    family(file, "lc3_traps_total", "counter", "TRAP instructions executed, by trap vector.");
+    for (int i = 0; i < count; ++i) {
+        for (int v = 0; v < 256; ++v) {
+            uint64_t n = get(&list[i]->traps[v]);
+            if (n) fprintf(file, "lc3_traps_total{vm=\"%d\",vector=\"x%02X\"} %llu\n", i, v, (unsigned long long)n);
+        }
+    }
+    family(file, "lc3_output_bytes_total", "counter", "Console bytes written by the traps (OUT, PUTS, PUTSP, IN and HALT), by trap vector.");
+    for (int i = 0; i < count; ++i) {
+        for (int v = 0; v < 256; ++v) {
+            uint64_t n = get(&list[i]->trap_output[v]);
+            if (n) fprintf(file, "lc3_output_bytes_total{vm=\"%d\",vector=\"x%02X\"} %llu\n", i, v, (unsigned long long)n);
+        }
+    }
+    COUNTER("lc3_kbsr_polls_total", polls, "Reads of the keyboard status register.");
+    COUNTER("lc3_kbsr_empty_polls_total", empty_polls, "Reads of the keyboard status register without a key.");
+    COUNTER("lc3_keys_total", keys, "Keys read by the program.");
+    SECONDS("lc3_input_blocked_seconds_total", blocked_ns, "Time spent waiting for a key, or parked for one.");
+    family(file, "lc3_key_to_output_seconds", "histogram", "Latency from a key read by the program to the next console output.");
+    for (int i = 0; i < count; ++i) {
+        uint64_t total = 0;
+        for (int b = 0; b < METRICS_BUCKETS; ++b) {
+            total += get(&list[i]->latency[b]);
+            if (b < METRICS_BUCKETS - 1) {
+                fprintf(file, "lc3_key_to_output_seconds_bucket{vm=\"%d\",le=\"%g\"} %llu\n", i, metrics_bucket_us[b] * 1e-6, (unsigned long long)total);
+            } else {
+                fprintf(file, "lc3_key_to_output_seconds_bucket{vm=\"%d\",le=\"+Inf\"} %llu\n", i, (unsigned long long)total);
+            }
+        }
+        fprintf(file, "lc3_key_to_output_seconds_sum{vm=\"%d\"} %.6f\n", i, get(&list[i]->latency_ns) * 1e-9);
+        fprintf(file, "lc3_key_to_output_seconds_count{vm=\"%d\"} %llu\n", i, (unsigned long long)total);
+    }
+    #undef COUNTER
+    #undef SECONDS
+}
+
+/* Periodic dump */
+
+struct metrics_dump
+{
+    char* path;          // "-" for the standard error
+    double interval;
+    vm_metrics** list;
+    int count;
+    atomic_int stop;
+    int failed;          // a write failed
+    thread_handle thread;
+};
+
+static void dump(metrics_dump* d) {
+    // write the metrics once: to a temporary file renamed over the file, so a reader never sees half of them
+    if (strcmp(d->path, "-") == 0) {
+        metrics_write(stderr, d->list, d->count);
+        fprintf(stderr, "\n");
+        return;
+    }
+    size_t n = strlen(d->path) + 5;
+    char* tmp = malloc(n);
+    if (!tmp) {
+        d->failed = 1;
+        return;
+    }
+    snprintf(tmp, n, "%s.tmp", d->path);
+    FILE* file = fopen(tmp, "w");
+    if (file) metrics_write(file, d->list, d->count);
+    if (!file || fclose(file) != 0 || rename(tmp, d->path) != 0) {
+        remove(tmp);
+        d->failed = 1;
+    }
+    free(tmp);
+}
+
+static THREAD_FUNC dump_main(void* arg) {
+    // wake up every 100 ms to see if the dump is stopped, and write the metrics every interval
+    metrics_dump* d = arg;
+    double next = clock_seconds() + d->interval;
+    while (!atomic_load(&d->stop)) {
+        thread_sleep_ms(100);
+        if (clock_seconds() >= next) {
+            dump(d);
+            next += d->interval;
+        }
+    }
+    return THREAD_RETURN;
+}
+
+metrics_dump* metrics_dump_start(const char* path, double interval, vm_metrics* const* list, int count) {
+    /*
+        This function starts a thread that writes the metrics of count machines to path every interval seconds, and once more
+        when the dump is stopped. It returns NULL if there is not enough memory. The metrics must live until metrics_dump_stop.
+    */
+
+    metrics_dump* d = calloc(1, sizeof(*d));
+    if (!d) return NULL;
+    d->path = malloc(strlen(path) + 1);
+    d->list = malloc(count * sizeof(*d->list));
+    if (!d->path || !d->list) {
+        free(d->path);
+        free(d->list);
+        free(d);
+        return NULL;
+    }
+    strcpy(d->path, path);
+    memcpy(d->list, list, count * sizeof(*d->list));
+    d->count = count;
+    d->interval = interval > 0.1 ? interval : 0.1;
+    atomic_init(&d->stop, 0);
+    thread_start(&d->thread, dump_main, d);
+    return d;
+}
+
+int metrics_dump_stop(metrics_dump* d) {
+    // stop the thread, write the last metrics, and return 0 if a write failed
+    if (!d) return 1;
+    atomic_store(&d->stop, 1);
+    thread_join(d->thread);
+    dump(d);
+    int ok = !d->failed;
+    free(d->path);
+    free(d->list);
+    free(d);
+    return ok;
+}
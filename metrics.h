@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "vm.h"
+
+/*
+    Live metrics of machines, for the hosts that run them in production: the instructions they retired and the time they ran,
+    the calls of every trap vector and the console bytes they wrote, the MR_KBSR polls, the time they spent blocked on input,
+    and a histogram of the latency from a key read by the program to the next character it writes.
+
+    A machine is measured when its metrics are set (vm->metrics). Its counters are only written by the thread that runs it
+    (one thread at a time, also on the scheduler), with a relaxed load and store instead of an atomic read-modify-write,
+    so counting costs plain moves; another thread samples them at any time with relaxed loads, which never see a torn value.
+    Only the slow paths count: vm_run once per call, the TRAP handler, the reads of MR_KBSR and the waits for a key.
+
+    metrics_write writes the metrics of machines in the Prometheus text format, and a dump (metrics_dump_start) rewrites them
+    to a file at an interval, through a temporary file and a rename, for the textfile collector of the node exporter,
+    or writes them to the standard error.
+*/
+
+// The upper bounds of the buckets of the input latency histogram, in microseconds; the last bucket has no bound
+#define METRICS_BUCKETS 14
+extern const uint32_t metrics_bucket_us[METRICS_BUCKETS - 1];
+
+typedef struct vm_metrics
+{
+    _Atomic uint64_t instructions;                  // retired by vm_run
+    _Atomic uint64_t run_ns;                        // time spent in vm_run
+    _Atomic uint64_t runs;                          // calls of vm_run
+    _Atomic uint64_t traps[256];                    // TRAP instructions by trap vector
+    _Atomic uint64_t trap_output[256];              // console bytes written by the traps of every vector
+    _Atomic uint64_t polls;                         // reads of MR_KBSR
+    _Atomic uint64_t empty_polls;                   // reads of MR_KBSR without a key
+    _Atomic uint64_t keys;                          // keys read by the program (TRAP_GETC, TRAP_IN and MR_KBDR)
+    _Atomic uint64_t blocked_ns;                    // time waiting for a key: in read_key, in wait_key, or parked (VM_BLOCKED)
+    _Atomic uint64_t latency[METRICS_BUCKETS];      // keys followed by output, by latency bucket
+    _Atomic uint64_t latency_ns;                    // the sum of the latencies
+    double key_at;                                  // clock_seconds when the last key was read, 0 once output followed it
+    double blocked_at;                              // clock_seconds when vm_run returned VM_BLOCKED, 0 if it didn't
+    double run_at;                                  // clock_seconds when the current vm_run began
+    double run_blocked;                             // seconds the current vm_run waited for a key, which are not run time
+    int ended;                                      // the last read returned EOF: the input has ended, and the reads are not timed
+} vm_metrics;
+
+typedef struct metrics_dump metrics_dump;
+
+vm_metrics* metrics_create();
+void metrics_free(vm_metrics* m);
+void metrics_run_begin(vm_metrics* m);
+void metrics_run_end(vm_metrics* m, uint64_t executed, int result);
+void metrics_key(vm_metrics* m, double waited);
+void metrics_blocked(vm_metrics* m, double seconds);
+void metrics_output(vm_metrics* m);
+void metrics_write(FILE* file, vm_metrics* const* list, int count);
+metrics_dump* metrics_dump_start(const char* path, double interval, vm_metrics* const* list, int count);
+int metrics_dump_stop(metrics_dump* d);
+
+static inline void metrics_add(_Atomic uint64_t* counter, uint64_t n) {
+    // the only writer of the counter adds to it, without a locked instruction
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metrics_trap(vm_metrics* m, uint8_t vector, uint64_t output) {
+    // a trap, with the bytes it wrote to the console
+    metrics_add(&m->traps[vector], 1);
+    if (!output) return;
+    metrics_add(&m->trap_output[vector], output);
+    if (m->key_at != 0) metrics_output(m);
+}
+
+static inline void metrics_poll(vm_metrics* m, int ready) {
+    metrics_add(&m->polls, 1);
+    if (!ready) metrics_add(&m->empty_polls, 1);
+}
+
+#endif
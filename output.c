@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define write_stdout(buf, n) _write(1, buf, (unsigned int)(n))
+#else
+#include <unistd.h>
+#define write_stdout(buf, n) write(STDOUT_FILENO, buf, n)
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define OUTPUT_SSE2 1
+#elif defined(__ARM_NEON) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define OUTPUT_NEON 1
+#endif
+
+#include "output.h"
+
+int output_init(output_buffer* out, void (*write)(void* user, const char* buf, size_t n), void* user) {
+    /*
+        This function sets up an empty output buffer with the default flush policy.
+        The characters are allocated separately from the machine, so only the part of the buffer that is used takes up host memory.
+        It returns 0 if there is not enough memory.
+    */
+
+    out->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (!out->buffer) return 0;
+    out->len = 0;
+    out->flushed = 0;
+    out->threshold = OUTPUT_DEFAULT_THRESHOLD;
+    out->policy = OUTPUT_DEFAULT_POLICY;
+    out->write = write;
+    out->user = user;
+    return 1;
+}
+
+void output_free(output_buffer* out) {
+    free(out->buffer);
+    out->buffer = NULL;
+}
+
+int output_set_policy(output_buffer* out, const char* spec) {
+    /*
+        This function sets the flush policy from the value of the --flush option:
+        a comma-separated list of newline, input, halt and size=N (flush when N characters are buffered).
+        It returns 0 if the value is not valid.
+            Example: --flush=newline,size=1024
+    */
+
+    int policy = 0;
+    size_t threshold = OUTPUT_BUFFER_SIZE;
+    while (*spec) {
+        size_t n = strcspn(spec, ",");
+        if (n == 7 && strncmp(spec, "newline", n) == 0) {
+            policy |= OUTPUT_FLUSH_NEWLINE;
+        } else if (n == 5 && strncmp(spec, "input", n) == 0) {
+            policy |= OUTPUT_FLUSH_INPUT;
+        } else if (n == 4 && strncmp(spec, "halt", n) == 0) {
+            policy |= OUTPUT_FLUSH_HALT;
+        } else if (n > 5 && strncmp(spec, "size=", 5) == 0) {
+            long size = strtol(spec + 5, NULL, 10);
+            if (size < 1 || size > OUTPUT_BUFFER_SIZE) return 0;
+            threshold = (size_t)size;
+        } else {
+            return 0;
+        }
+        spec += n;
+        if (*spec == ',') ++spec;
+    }
+    out->policy = policy;
+    out->threshold = threshold;
+    return 1;
+}
+
+void output_flush(output_buffer* out) {
+    /*
+        This function hands the buffered characters to the write hook of the buffer in one call, and empties the buffer.
+    */
+
+    if (out->len && out->write) {
+        out->write(out->user, out->buffer, out->len);
+    }
+    out->flushed += out->len;
+    out->len = 0;
+}
+
+void output_write_stdout(void* user, const char* buf, size_t n) {
+    /*
+        This function is the write hook of a machine attached to the console: it writes a block to the standard output.
+        The bytes normally go out in one write, it is only repeated if the system accepts fewer bytes than requested.
+    */
+
+    size_t done = 0;
+    fflush(stdout); // anything printed with printf before the buffer (e.g. error messages) comes first
+    while (done < n) {
+        long written = (long)write_stdout(buf + done, n - done);
+        if (written <= 0) break;
+        done += (size_t)written;
+    }
+}
+
+static size_t string_words(const uint16_t* words, size_t n, int packed, char* dst, size_t* len) {
+    /*
+        This function converts the words of a string to characters, eight words at a time, until a zero word or the end of the n words.
+        A word of a string (packed = 0) is one character, its low byte. A word of a packed string (packed = 1) is two characters,
+        its low byte and then its high byte, unless the high byte is zero; on a little-endian host these are the bytes of the word in memory.
+        The characters are written to dst, which has room for 2 * n of them, and their number is stored in len.
+        It returns the number of words before the zero word, n if there is none.
+
+        With SSE2 or NEON, eight words are compared with zero at once, and narrowed to their low bytes at once (or copied as they are,
+        for a packed string whose high bytes are all set); the words that are left, the group with the zero word,
+        and a packed group with a zero high byte are done one by one.
+    */
+
+    size_t i = 0, k = 0;
+#if OUTPUT_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(words + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(x, zero))) break; // the string ends in these words
+        if (!packed) {
+            _mm_storel_epi64((__m128i*)(dst + k), _mm_packus_epi16(_mm_and_si128(x, low), zero));
+            k += 8;
+        } else if (!_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_andnot_si128(low, x), zero))) {
+            _mm_storeu_si128((__m128i*)(dst + k), x);
+            k += 16;
+        } else {
+            for (int j = 0; j < 8; ++j) { // a high byte is zero and is skipped
+                dst[k++] = (char)(words[i + j] & 0xFF);
+                if (words[i + j] >> 8) dst[k++] = (char)(words[i + j] >> 8);
+            }
+        }
+    }
+#elif OUTPUT_NEON
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t x = vld1q_u16(words + i);
+        uint64x2_t zeros = vreinterpretq_u64_u16(vceqq_u16(x, vdupq_n_u16(0)));
+        if (vgetq_lane_u64(zeros, 0) | vgetq_lane_u64(zeros, 1)) break;
+        if (!packed) {
+            vst1_u8((uint8_t*)(dst + k), vmovn_u16(x));
+            k += 8;
+        } else {
+            uint64x2_t high = vreinterpretq_u64_u16(vceqq_u16(vandq_u16(x, vdupq_n_u16(0xFF00)), vdupq_n_u16(0)));
+            if (!(vgetq_lane_u64(high, 0) | vgetq_lane_u64(high, 1))) {
+                vst1q_u8((uint8_t*)(dst + k), vreinterpretq_u8_u16(x));
+                k += 16;
+            } else {
+                for (int j = 0; j < 8; ++j) {
+                    dst[k++] = (char)(words[i + j] & 0xFF);
+                    if (words[i + j] >> 8) dst[k++] = (char)(words[i + j] >> 8);
+                }
+            }
+        }
+    }
+#endif
+    for (; i < n && words[i]; ++i) {
+        dst[k++] = (char)(words[i] & 0xFF);
+        if (packed && (words[i] >> 8)) dst[k++] = (char)(words[i] >> 8);
+    }
+    *len = k;
+    return i;
+}
+
+size_t output_string(output_buffer* out, const uint16_t* words, size_t n, int packed) {
+    /*
+        This function adds the characters of a string of TRAP_PUTS (packed = 0) or TRAP_PUTSP (packed = 1) to the buffer:
+        the words up to the first zero word among the n words (see string_words). It returns the number of words before the zero word,
+        n if the string goes on after them.
+        The characters are converted straight into the buffer, which is flushed when it runs out of room, and once at the end
+        if they reach the size threshold or hold a newline (with the newline policy), so a whole string normally goes out in one write.
+    */
+
+    size_t done = 0;
+    while (done < n) {
+        if (OUTPUT_BUFFER_SIZE - out->len < 16) output_flush(out);
+        size_t room = (OUTPUT_BUFFER_SIZE - out->len) / 2; // every word is at most two characters
+        size_t chunk = n - done < room ? n - done : room;
+        size_t len;
+        size_t words_done = string_words(words + done, chunk, packed, out->buffer + out->len, &len);
+        int newline = (out->policy & OUTPUT_FLUSH_NEWLINE) && memchr(out->buffer + out->len, '\n', len);
+        out->len += len;
+        done += words_done;
+        if (newline || out->len >= out->threshold) output_flush(out);
+        if (words_done < chunk) break; // the zero word
+    }
+    return done;
+}
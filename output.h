@@ -0,0 +1,75 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    The console output of the machine.
+    The characters written by TRAP_OUT, TRAP_PUTS, TRAP_PUTSP, TRAP_IN and TRAP_HALT are collected in one buffer per machine,
+    which is written out (e.g. to the standard output) with a single write when the flush policy says so.
+*/
+
+// Size of the output buffer, the buffer is always flushed when it is full
+#define OUTPUT_BUFFER_SIZE (64 << 10)
+// Number of buffered characters after which the buffer is flushed, unless another size is given with --flush=size=N
+#define OUTPUT_DEFAULT_THRESHOLD 4096
+
+// The events that flush the output buffer (flush policy)
+enum
+{
+    OUTPUT_FLUSH_NEWLINE = 1 << 0, // after every newline character
+    OUTPUT_FLUSH_INPUT = 1 << 1,   // before TRAP_GETC/TRAP_IN wait for a key and before every MR_KBSR poll
+    OUTPUT_FLUSH_HALT = 1 << 2,    // when the program halts
+};
+#define OUTPUT_DEFAULT_POLICY (OUTPUT_FLUSH_INPUT | OUTPUT_FLUSH_HALT)
+
+/*
+    The output buffer of one machine.
+    write is called with the buffered characters when the buffer is flushed, user is passed to it.
+*/
+typedef struct
+{
+    char* buffer;       // OUTPUT_BUFFER_SIZE characters
+    size_t len;
+    uint64_t flushed;   // characters handed to write so far
+    size_t threshold;
+    int policy;
+    void (*write)(void* user, const char* buf, size_t n);
+    void* user;
+} output_buffer;
+
+int output_init(output_buffer* out, void (*write)(void* user, const char* buf, size_t n), void* user);
+void output_free(output_buffer* out);
+int output_set_policy(output_buffer* out, const char* spec);
+void output_flush(output_buffer* out);
+void output_write_stdout(void* user, const char* buf, size_t n);
+size_t output_string(output_buffer* out, const uint16_t* words, size_t n, int packed);
+
+static inline uint64_t output_total(const output_buffer* out) {
+    // the characters written to the buffer since it was set up
+    return out->flushed + out->len;
+}
+
+static inline void output_putc(output_buffer* out, char c) {
+    // add a character to the buffer, and flush it if it ends a line or reaches the size threshold
+    out->buffer[out->len++] = c;
+    if ((c == '\n' && (out->policy & OUTPUT_FLUSH_NEWLINE)) || out->len >= out->threshold) {
+        output_flush(out);
+    }
+}
+
+static inline void output_before_input(output_buffer* out) {
+    // flush the buffer before the program reads the keyboard, so the user sees what the program is waiting for
+    if (out->len && (out->policy & OUTPUT_FLUSH_INPUT)) {
+        output_flush(out);
+    }
+}
+
+static inline void output_halt(output_buffer* out) {
+    if (out->policy & OUTPUT_FLUSH_HALT) {
+        output_flush(out);
+    }
+}
+
+#endif
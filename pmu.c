@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "pmu.h"
+
+const char* const pmu_counter_names[PMU_COUNT] = { "cycles", "instructions", "branch-misses", "L1-icache-misses", "task-clock" };
+const char* const pmu_loop_names[PMU_LOOPS] = { "switch", "threaded", "jit", "profiled", "traced", "debug" };
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config, int leader) {
+    /*
+        This function opens a counter of the calling thread, in user space only, as a member of the group of leader,
+        or as the leader of a new group when leader is -1. The group is created disabled, and pmu_open enables it at once.
+    */
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+static int read_group(const vm_pmu* p, uint64_t* values, uint64_t* enabled, uint64_t* running) {
+    // read the counters of the group at once: the number of counters, the times, then the counters in the order they joined
+    uint64_t data[3 + PMU_COUNT];
+    ssize_t n = read(p->leader, data, sizeof(data));
+    if (n < (ssize_t)(3 * sizeof(uint64_t)) || data[0] != (uint64_t)p->members) return 0;
+    *enabled = data[1];
+    *running = data[2];
+    for (int i = 0; i < PMU_COUNT; ++i) values[i] = p->fd[i] >= 0 ? data[3 + p->slot[i]] : 0;
+    return 1;
+}
+#endif
+
+vm_pmu* pmu_open() {
+    /*
+        This function opens the counters for the calling thread, and returns NULL if there is not enough memory.
+        The counters the host doesn't have, or that the process can't read, are not available (pmu_available).
+    */
+
+    vm_pmu* p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    for (int i = 0; i < PMU_COUNT; ++i) p->fd[i] = p->slot[i] = -1;
+    p->leader = -1;
+#ifdef __linux__
+    static const struct { uint32_t type; uint64_t config; } counters[PMU_COUNT] = {
+        [PMU_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        [PMU_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        [PMU_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        [PMU_L1I_MISSES] = { PERF_TYPE_HW_CACHE,
+            PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        [PMU_TASK_CLOCK] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK }
+    };
+    for (int i = 0; i < PMU_COUNT; ++i) {
+        int fd = open_counter(counters[i].type, counters[i].config, p->leader);
+        if (fd < 0) continue;
+        if (p->leader < 0) p->leader = fd;
+        p->fd[i] = fd;
+        p->slot[i] = p->members++;
+    }
+    if (p->leader >= 0) ioctl(p->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    return p;
+}
+
+static void close_counters(vm_pmu* p) {
+    // every counter is not available from now on
+#ifdef __linux__
+    for (int i = 0; i < PMU_COUNT; ++i) {
+        if (p->fd[i] >= 0) close(p->fd[i]);
+        p->fd[i] = -1;
+    }
+#endif
+    p->leader = -1;
+    p->members = 0;
+}
+
+void pmu_close(vm_pmu* p) {
+    // the machine must not use the counters anymore (vm->pmu set to NULL)
+    if (!p) return;
+    close_counters(p);
+    free(p);
+}
+
+void pmu_begin(vm_pmu* p) {
+    // called by vm_run right before its engine runs
+#ifdef __linux__
+    if (p->members && !read_group(p, p->start, &p->enabled, &p->running)) close_counters(p);
+#endif
+}
+
+void pmu_end(vm_pmu* p, int loop, uint64_t executed) {
+    /*
+        This function is called by vm_run right after the engine loop ran and executed instructions:
+        it adds what the counters counted since pmu_begin to the loop. When the kernel had to share the PMU with other
+        groups of counters and the group only ran part of the time, the counts are scaled to the whole time.
+    */
+
+    p->guest[loop] += executed;
+    p->runs[loop]++;
+#ifdef __linux__
+    uint64_t now[PMU_COUNT], enabled, running;
+    if (!p->members) return;
+    if (!read_group(p, now, &enabled, &running)) {
+        close_counters(p);
+        return;
+    }
+    double scale = running > p->running && running - p->running < enabled - p->enabled
+        ? (double)(enabled - p->enabled) / (running - p->running) : 1.0;
+    for (int i = 0; i < PMU_COUNT; ++i) {
+        if (p->fd[i] >= 0) p->counts[loop][i] += (uint64_t)((now[i] - p->start[i]) * scale);
+    }
+#endif
+}
+
+void pmu_report(FILE* file, const vm_pmu* p) {
+    /*
+        This function writes what every loop that ran counted, per LC-3 instruction, with the number of LC-3 instructions it executed.
+    */
+
+    static const char* headers[PMU_COUNT] = { "cycles", "host instr", "br misses", "L1i misses", "task ns" };
+    fprintf(file, "%-9s %14s %10s", "engine", "instructions", "runs");
+    for (int i = 0; i < PMU_COUNT; ++i) fprintf(file, " %11s", headers[i]);
+    fprintf(file, "   (host counters per LC-3 instruction)\n");
+    for (int loop = 0; loop < PMU_LOOPS; ++loop) {
+        if (!p->runs[loop]) continue;
+        fprintf(file, "%-9s %14llu %10llu", pmu_loop_names[loop], (unsigned long long)p->guest[loop], (unsigned long long)p->runs[loop]);
+        for (int i = 0; i < PMU_COUNT; ++i) {
+            if (!pmu_available(p, i) || !p->guest[loop]) {
+                fprintf(file, " %11s", "n/a");
+            } else {
+                fprintf(file, " %11.3f", (double)p->counts[loop][i] / p->guest[loop]);
+            }
+        }
+        fprintf(file, "\n");
+    }
+    for (int i = 0; i < PMU_COUNT; ++i) {
+        if (!pmu_available(p, i)) fprintf(file, "%s: not available on this host\n", pmu_counter_names[i]);
+    }
+}
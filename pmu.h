@@ -0,0 +1,70 @@
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Host performance counters around vm_run, to see what the engines cost the host per LC-3 instruction:
+    cycles, instructions, branch mispredicts and L1 instruction cache misses, read from the PMU with perf_event_open on Linux,
+    and the task clock of the thread, a software counter that the kernel provides even when the host has no PMU (like a virtual machine).
+
+    A machine is measured when its counters are set (vm->pmu): vm_run then reads them just before and just after its engine runs,
+    with a single read of the group of counters, and adds what they counted to the loop that ran, with the number of LC-3 instructions
+    it executed. The loops are the dispatch engines (ENGINE_SWITCH, ENGINE_THREADED and ENGINE_JIT) and the engines of the profiler,
+    the traces and the debugger. The counters count the user-space work of the thread that opened them only:
+    a measured machine must run on that thread (not on the scheduler).
+
+    A counter the host doesn't have, or that the kernel doesn't let the process read (see /proc/sys/kernel/perf_event_paranoid),
+    is reported as not available, and the others are still counted. On other systems, every counter is not available.
+*/
+
+// The counters
+enum
+{
+    PMU_CYCLES = 0,
+    PMU_INSTRUCTIONS,
+    PMU_BRANCH_MISSES,
+    PMU_L1I_MISSES,
+    PMU_TASK_CLOCK,   // nanoseconds
+    PMU_COUNT
+};
+
+// The loops of vm_run: the dispatch engines (ENGINE_*), then the engines of vm->profile, vm->trace and vm->debugger
+enum
+{
+    PMU_PROFILED = ENGINE_JIT + 1,
+    PMU_TRACED,
+    PMU_DEBUG,
+    PMU_LOOPS
+};
+
+extern const char* const pmu_counter_names[PMU_COUNT];
+extern const char* const pmu_loop_names[PMU_LOOPS];
+
+typedef struct vm_pmu
+{
+    int fd[PMU_COUNT];                    // -1 for a counter that is not available
+    int leader;                           // the counter whose reads give the whole group, -1 if none is available
+    int slot[PMU_COUNT];                  // the position of every counter in a read of the group
+    int members;                          // the counters of the group
+    uint64_t start[PMU_COUNT];            // the counters when the engine started
+    uint64_t enabled, running;            // the time the group was enabled and scheduled on a core when the engine started
+    uint64_t counts[PMU_LOOPS][PMU_COUNT]; // what every loop counted
+    uint64_t guest[PMU_LOOPS];            // LC-3 instructions executed by every loop
+    uint64_t runs[PMU_LOOPS];             // calls of vm_run that ran every loop
+} vm_pmu;
+
+vm_pmu* pmu_open();
+void pmu_close(vm_pmu* p);
+void pmu_begin(vm_pmu* p);
+void pmu_end(vm_pmu* p, int loop, uint64_t executed);
+void pmu_report(FILE* file, const vm_pmu* p);
+
+static inline int pmu_available(const vm_pmu* p, int counter) {
+    return p->fd[counter] >= 0;
+}
+
+#endif
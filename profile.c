@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+#include "profile.h"
+
+static const char* opcode_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR", "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+static const char* trap_name(int vector) {
+    switch (vector) {
+        case TRAP_GETC: return "GETC";
+        case TRAP_OUT: return "OUT";
+        case TRAP_PUTS: return "PUTS";
+        case TRAP_IN: return "IN";
+        case TRAP_PUTSP: return "PUTSP";
+        case TRAP_HALT: return "HALT";
+        default: return "?";
+    }
+}
+
+static int add_node(vm_profile* p, uint16_t addr, int parent) {
+    // add a node to the call tree, as the first child of parent
+    if (p->node_count == p->node_cap) {
+        p->node_cap *= 2;
+        p->nodes = realloc(p->nodes, p->node_cap * sizeof(*p->nodes));
+        if (!p->nodes) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+    }
+    int n = p->node_count++;
+    profile_node* node = &p->nodes[n];
+    node->addr = addr;
+    node->parent = parent;
+    node->child = -1;
+    node->sibling = parent >= 0 ? p->nodes[parent].child : -1;
+    node->calls = 0;
+    node->self = 0;
+    if (parent >= 0) p->nodes[parent].child = n;
+    return n;
+}
+
+vm_profile* profile_create(uint16_t entry) {
+    /*
+        This function allocates an empty profile, for a program that starts at the address entry.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm_profile* p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    p->pcs = calloc(MEMORY_MAX, sizeof(*p->pcs));
+    p->taken = calloc(MEMORY_MAX, sizeof(*p->taken));
+    p->ops = calloc(MEMORY_MAX, sizeof(*p->ops));
+    p->node_cap = 64;
+    p->nodes = malloc(p->node_cap * sizeof(*p->nodes));
+    if (!p->pcs || !p->taken || !p->ops || !p->nodes) {
+        profile_free(p);
+        return NULL;
+    }
+    p->current = add_node(p, entry, -1);
+    p->nodes[0].calls = 1;
+    return p;
+}
+
+void profile_free(vm_profile* p) {
+    if (!p) return;
+    free(p->pcs);
+    free(p->taken);
+    free(p->ops);
+    free(p->nodes);
+    free(p);
+}
+
+static void pop_to(vm_profile* p, int depth) {
+    // leave the calls of the stack above depth
+    while (p->depth > depth) {
+        p->depth--;
+        p->current = p->nodes[p->current].parent;
+    }
+}
+
+static void profile_call(vm_profile* p, uint16_t target, uint16_t ret) {
+    /*
+        This function enters the subroutine at target, called with the return address ret.
+        Programs also use JSR as a jump and leave the subroutine with a BR, without RET.
+        So a call made from a call site that is already on the stack is taken as coming back to that call site:
+        the calls above it are left first. This keeps the stack bounded, and folds recursive calls from the same call site into a single frame.
+    */
+
+    for (int i = p->depth - 1; i >= 0; --i) {
+        if (p->returns[i] == ret) {
+            pop_to(p, i);
+            p->overflow = 0;
+            break;
+        }
+    }
+    if (p->depth == PROFILE_MAX_DEPTH) {
+        p->overflow++;
+        return;
+    }
+    p->returns[p->depth++] = ret;
+    int n = p->nodes[p->current].child;
+    while (n >= 0 && p->nodes[n].addr != target) n = p->nodes[n].sibling;
+    if (n < 0) n = add_node(p, target, p->current);
+    p->nodes[n].calls++;
+    p->current = n;
+}
+
+static void profile_return(vm_profile* p, uint16_t target) {
+    /*
+        This function leaves the subroutines of the call stack up to the one that returns to target.
+        A RET that returns to none of the calls on the stack (R7 was changed by the program) leaves the stack as it is.
+    */
+
+    if (p->overflow) {
+        p->overflow--;
+        return;
+    }
+    int i = p->depth - 1;
+    while (i >= 0 && p->returns[i] != target) --i;
+    if (i < 0) return;
+    pop_to(p, i);
+}
+
+void profile_instr(vm_profile* p, uint16_t pc, uint16_t instr, int taken, const uint16_t* reg) {
+    /*
+        This function records an instruction that was executed at the address pc, with the registers after it.
+        taken tells whether a BR instruction branched.
+    */
+
+    uint16_t op = instr >> 12;
+    p->instructions++;
+    p->opcodes[op]++;
+    p->pcs[pc]++;
+    p->ops[pc] = (uint8_t)op;
+    p->nodes[p->current].self++;
+    switch (op) {
+        case OP_BR:
+            if (taken) p->taken[pc]++;
+            break;
+        case OP_TRAP:
+            p->traps[instr & 0xFF]++;
+            break;
+        case OP_JSR:
+            profile_call(p, reg[R_PC], reg[R_R7]);
+            break;
+        case OP_JMP:
+            if (((instr >> 6) & 0x7) == R_R7) profile_return(p, reg[R_PC]); // RET
+            break;
+    }
+}
+
+static const uint64_t* sort_counts;
+
+static int by_count(const void* a, const void* b) {
+    // order indices of sort_counts by decreasing count, then by increasing index
+    uint64_t x = sort_counts[*(const int*)a], y = sort_counts[*(const int*)b];
+    if (x != y) return x < y ? 1 : -1;
+    return *(const int*)a - *(const int*)b;
+}
+
+static int sorted(const uint64_t* counts, int n, int* order) {
+    // fill order with the indices of the non-zero counts, sorted by decreasing count, and return how many there are
+    int k = 0;
+    for (int i = 0; i < n; ++i) {
+        if (counts[i]) order[k++] = i;
+    }
+    sort_counts = counts;
+    qsort(order, k, sizeof(*order), by_count);
+    return k;
+}
+
+static double percent(uint64_t count, uint64_t total) {
+    return total ? 100.0 * count / total : 0.0;
+}
+
+void profile_report(FILE* file, const vm_profile* p, int top) {
+    /*
+        This function prints the hot spots of a profile: the opcodes and trap vectors by number of executions,
+        the top addresses by instructions executed (with how often their BR was taken), and the top subroutines
+        by instructions executed inside them and the subroutines they call.
+    */
+
+    int* order = malloc(MEMORY_MAX * sizeof(*order));
+    uint64_t* totals = calloc(p->node_count, sizeof(*totals));
+    uint64_t* by_addr = calloc(MEMORY_MAX, sizeof(*by_addr));
+    uint64_t* self_by_addr = calloc(MEMORY_MAX, sizeof(*self_by_addr));
+    uint64_t* calls_by_addr = calloc(MEMORY_MAX, sizeof(*calls_by_addr));
+    if (!order || !totals || !by_addr || !self_by_addr || !calls_by_addr) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+
+    fprintf(file, "profile: %llu instructions, %d call stacks\n", (unsigned long long)p->instructions, p->node_count);
+
+    fprintf(file, "\n%-8s %15s %7s\n", "opcode", "instructions", "%");
+    int n = sorted(p->opcodes, 16, order);
+    for (int i = 0; i < n; ++i) {
+        fprintf(file, "%-8s %15llu %6.2f%%\n", opcode_names[order[i]], (unsigned long long)p->opcodes[order[i]],
+            percent(p->opcodes[order[i]], p->instructions));
+    }
+
+    n = sorted(p->traps, 256, order);
+    if (n) fprintf(file, "\n%-8s %15s\n", "trap", "calls");
+    for (int i = 0; i < n; ++i) {
+        fprintf(file, "x%02X %-4s %15llu\n", order[i], trap_name(order[i]), (unsigned long long)p->traps[order[i]]);
+    }
+
+    fprintf(file, "\n%-8s %-6s %15s %7s %15s %15s\n", "address", "opcode", "instructions", "%", "BR taken", "BR not taken");
+    n = sorted(p->pcs, MEMORY_MAX, order);
+    for (int i = 0; i < n && i < top; ++i) {
+        int a = order[i];
+        fprintf(file, "x%04X    %-6s %15llu %6.2f%%", a, opcode_names[p->ops[a]], (unsigned long long)p->pcs[a], percent(p->pcs[a], p->instructions));
+        if (p->ops[a] == OP_BR) {
+            fprintf(file, " %15llu %15llu", (unsigned long long)p->taken[a], (unsigned long long)(p->pcs[a] - p->taken[a]));
+        }
+        fprintf(file, "\n");
+    }
+
+    // the total of a node is its own instructions and those of its callees; a child always comes after its parent
+    for (int i = p->node_count - 1; i >= 0; --i) {
+        totals[i] += p->nodes[i].self;
+        if (p->nodes[i].parent >= 0) totals[p->nodes[i].parent] += totals[i];
+    }
+    for (int i = 0; i < p->node_count; ++i) {
+        const profile_node* node = &p->nodes[i];
+        self_by_addr[node->addr] += node->self;
+        calls_by_addr[node->addr] += node->calls;
+        // a recursive call is already counted in the total of the outer call of the same subroutine
+        int outer = node->parent;
+        while (outer >= 0 && p->nodes[outer].addr != node->addr) outer = p->nodes[outer].parent;
+        if (outer < 0) by_addr[node->addr] += totals[i];
+    }
+    fprintf(file, "\n%-10s %12s %15s %15s %7s\n", "subroutine", "calls", "self", "total", "%");
+    n = sorted(by_addr, MEMORY_MAX, order);
+    for (int i = 0; i < n && i < top; ++i) {
+        int a = order[i];
+        fprintf(file, "x%04X      %12llu %15llu %15llu %6.2f%%\n", a, (unsigned long long)calls_by_addr[a],
+            (unsigned long long)self_by_addr[a], (unsigned long long)by_addr[a], percent(by_addr[a], p->instructions));
+    }
+
+    free(order);
+    free(totals);
+    free(by_addr);
+    free(self_by_addr);
+    free(calls_by_addr);
+}
+
+void profile_write_folded(FILE* file, const vm_profile* p) {
+    /*
+        This function writes the call stacks of a profile in the folded format of flamegraph.pl:
+        one line per call stack, with the addresses of its subroutines from the outermost one, separated by ';',
+        followed by the number of instructions executed in it.
+    */
+
+    int path[PROFILE_MAX_DEPTH + 1];
+    for (int i = 0; i < p->node_count; ++i) {
+        if (!p->nodes[i].self) continue;
+        int depth = 0;
+        for (int n = i; n >= 0 && depth <= PROFILE_MAX_DEPTH; n = p->nodes[n].parent) path[depth++] = n;
+        for (int k = depth - 1; k >= 0; --k) {
+            fprintf(file, "x%04X%s", p->nodes[path[k]].addr, k ? ";" : "");
+        }
+        fprintf(file, " %llu\n", (unsigned long long)p->nodes[i].self);
+    }
+}
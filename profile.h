@@ -0,0 +1,56 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "lc3.h"
+
+/*
+    The profiler counts what a program executes: the instructions of every opcode, the calls of every trap vector,
+    the instructions executed at every address, and how often every BR was taken or not.
+    It also rebuilds the call stack of the program from JSR/JSRR and RET, and counts the instructions executed in every call stack.
+
+    A machine is profiled when its profile is set (vm->profile): vm_run then uses the profiled engine, a loop that executes
+    one instruction at a time and records it. The other engines have no profiling code at all, so they run at full speed
+    whether the profiler is compiled in or not.
+*/
+
+// Deepest call stack recorded; the calls below it are counted in the deepest frame
+#define PROFILE_MAX_DEPTH 256
+
+// One node of the call tree: a call stack ending with a call to addr
+typedef struct
+{
+    uint16_t addr;     // the address of the subroutine
+    int parent;        // the node of the caller, -1 for the root
+    int child;         // the first node of the subroutines called from this one, -1 if none
+    int sibling;       // the next node with the same parent, -1 if none
+    uint64_t calls;    // times this call stack was entered
+    uint64_t self;     // instructions executed in this call stack, not in its callees
+} profile_node;
+
+typedef struct vm_profile
+{
+    uint64_t instructions;
+    uint64_t opcodes[16];          // instructions of every opcode (OP_BR to OP_TRAP)
+    uint64_t traps[256];           // calls of every trap vector
+    uint64_t* pcs;                 // instructions executed at every address (MEMORY_MAX entries)
+    uint64_t* taken;               // times the BR at every address was taken (MEMORY_MAX entries)
+    uint8_t* ops;                  // the opcode last executed at every address (MEMORY_MAX entries)
+
+    profile_node* nodes;           // the call tree, nodes[0] is the code the program starts in
+    int node_count, node_cap;
+    int current;                   // the node of the current call stack
+    uint16_t returns[PROFILE_MAX_DEPTH]; // the return address of every call on the stack (R7 when it was made)
+    int depth;                     // calls on the stack
+    int overflow;                  // calls deeper than PROFILE_MAX_DEPTH, not on the stack
+} vm_profile;
+
+vm_profile* profile_create(uint16_t entry);
+void profile_free(vm_profile* p);
+void profile_instr(vm_profile* p, uint16_t pc, uint16_t instr, int taken, const uint16_t* reg);
+void profile_report(FILE* file, const vm_profile* p, int top);
+void profile_write_folded(FILE* file, const vm_profile* p);
+
+#endif
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+#include "snapshot.h"
+#include "vm.h"
+
+static void log_event(vm_recording* rec, int kind, int value) {
+    /*
+        This function adds an input event of the machine to a recording, at the instruction count of the machine.
+        An event that repeats the last one, the same number of instructions after it as its previous repeat, only counts one more repeat.
+    */
+
+    uint64_t at = rec->vm->io_instructions;
+    if (rec->count) {
+        replay_event* last = &rec->events[rec->count - 1];
+        if (last->kind == kind && last->value == value && last->repeat < UINT32_MAX) {
+            if (last->repeat == 1 && at >= last->instructions) {
+                last->stride = at - last->instructions;
+                last->repeat = 2;
+                return;
+            }
+            if (at == last->instructions + last->repeat * last->stride) {
+                last->repeat++;
+                return;
+            }
+        }
+    }
+    if (rec->count == rec->cap) {
+        size_t cap = rec->cap ? rec->cap * 2 : 1024;
+        replay_event* events = realloc(rec->events, cap * sizeof(*events));
+        if (!events) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        rec->events = events;
+        rec->cap = cap;
+    }
+    replay_event e = { at, 0, 1, (int16_t)value, (uint16_t)kind };
+    rec->events[rec->count++] = e;
+}
+
+static void diverge(vm_recording* rec) {
+    rec->diverged = 1;
+    rec->diverged_at = rec->vm->io_instructions;
+}
+
+static const replay_event* next_event(vm_recording* rec) {
+    /*
+        This function returns the next event of a replay if the program asks for it now, at the instruction count it was logged at.
+        It returns NULL after the end of the log, or if the replay has diverged.
+    */
+
+    if (rec->diverged || rec->pos == rec->count) return NULL;
+    const replay_event* e = &rec->events[rec->pos];
+    if (e->instructions + rec->sub * e->stride != rec->vm->io_instructions) {
+        diverge(rec);
+        return NULL;
+    }
+    return e;
+}
+
+static void take_event(vm_recording* rec) {
+    // move past one repeat of the next event
+    if (++rec->sub == rec->events[rec->pos].repeat) {
+        rec->pos++;
+        rec->sub = 0;
+    }
+}
+
+static int record_key_ready(void* user) {
+    vm_recording* rec = user;
+    int ready = rec->io.key_ready(rec->io.user);
+    if (!ready) log_event(rec, REPLAY_NO_KEY, 0);
+    return ready;
+}
+
+static int record_read_key(void* user) {
+    vm_recording* rec = user;
+    int key = rec->io.read_key(rec->io.user);
+    log_event(rec, REPLAY_KEY, key);
+    return key;
+}
+
+static int play_key_ready(void* user) {
+    // a key is ready if the next event is a key read at this instruction count, which is taken by read_key
+    vm_recording* rec = user;
+    const replay_event* e = next_event(rec);
+    if (!e) return rec->io.key_ready(rec->io.user);
+    if (e->kind == REPLAY_KEY) return 1;
+    take_event(rec);
+    return 0;
+}
+
+static int play_read_key(void* user) {
+    vm_recording* rec = user;
+    const replay_event* e = next_event(rec);
+    if (e && e->kind != REPLAY_KEY) diverge(rec);
+    if (!e || rec->diverged) return rec->io.read_key(rec->io.user);
+    int key = e->value;
+    take_event(rec);
+    return key;
+}
+
+static void replay_write(void* user, const char* buf, size_t n) {
+    vm_recording* rec = user;
+    if (!rec->muted && rec->io.write) rec->io.write(rec->io.user, buf, n);
+}
+
+static vm_recording* attach(vm* vm, int playing) {
+    // connect a new recording or replay between a machine and its hooks
+    vm_recording* rec = calloc(1, sizeof(*rec));
+    if (!rec) return NULL;
+    rec->vm = vm;
+    rec->io = vm->io;
+    rec->playing = playing;
+    if (vm->engine == ENGINE_JIT) vm->engine = ENGINE_THREADED;
+    vm_io io = { playing ? play_key_ready : record_key_ready, playing ? play_read_key : record_read_key, replay_write, rec };
+    vm_set_io(vm, &io);
+    return rec;
+}
+
+vm_recording* replay_record(vm* vm) {
+    /*
+        This function starts recording the input of a machine: its hooks are still used, and every answer they give is logged.
+        It returns NULL if there is not enough memory.
+    */
+
+    return attach(vm, 0);
+}
+
+static int add_point(vm_recording* rec) {
+    // take a snapshot of a replayed machine that is not running, with the position of the log
+    if (rec->point_count == rec->point_cap) {
+        size_t cap = rec->point_cap ? rec->point_cap * 2 : 64;
+        replay_point* points = realloc(rec->points, cap * sizeof(*points));
+        if (!points) return 0;
+        rec->points = points;
+        rec->point_cap = cap;
+    }
+    vm_snapshot* snapshot = vm_snapshot_take(rec->vm);
+    if (!snapshot) return 0;
+    replay_point p = { snapshot, rec->pos, rec->sub };
+    rec->points[rec->point_count++] = p;
+    return 1;
+}
+
+vm_recording* replay_play(vm* vm, const char* path, uint64_t interval) {
+    /*
+        This function starts replaying the recording file at path on a machine, from the state the machine is in,
+        taking a snapshot every interval instructions (0 for none besides the one of the start).
+        It returns NULL if the file can't be read, was not written by replay_save on a host of the same byte order, or if there is not enough memory.
+    */
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    replay_header header;
+    replay_event* events = NULL;
+    int ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) == 0
+        && header.byte_order == REPLAY_BYTE_ORDER && header.event_size == sizeof(replay_event);
+    if (ok) {
+        events = malloc(header.count ? header.count * sizeof(*events) : 1);
+        ok = events && fread(events, sizeof(*events), header.count, file) == header.count;
+    }
+    fclose(file);
+    for (uint32_t i = 0; ok && i < header.count; ++i) {
+        ok = events[i].repeat >= 1 && events[i].kind <= REPLAY_KEY;
+    }
+    vm_recording* rec = ok ? attach(vm, 1) : NULL;
+    if (!rec) {
+        free(events);
+        return NULL;
+    }
+    rec->events = events;
+    rec->count = rec->cap = header.count;
+    rec->interval = interval;
+    if (!add_point(rec)) {
+        replay_free(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+int replay_save(const vm_recording* rec, const char* path) {
+    /*
+        This function writes the events of a recording (or of the log of a replay) to a file.
+        It returns 0 if the file can't be written.
+    */
+
+    replay_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.byte_order = REPLAY_BYTE_ORDER;
+    header.event_size = sizeof(replay_event);
+    header.count = (uint32_t)rec->count;
+
+    FILE* file = fopen(path, "wb");
+    int ok = file && rec->count <= UINT32_MAX && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(rec->events, sizeof(replay_event), rec->count, file) == rec->count;
+    if (file && fclose(file) != 0) ok = 0;
+    if (!ok) remove(path);
+    return ok;
+}
+
+int replay_run(vm_recording* rec, uint64_t budget) {
+    /*
+        This function runs a recorded or replayed machine like vm_run, for at most budget instructions, and returns the result of vm_run.
+        A replay stops at every multiple of its interval to take a snapshot, the first time it reaches it.
+    */
+
+    vm* vm = rec->vm;
+    int result = VM_BUDGET;
+    while (budget) {
+        uint64_t slice = budget;
+        if (rec->playing && rec->interval) {
+            uint64_t next = rec->interval - vm->instructions % rec->interval;
+            if (next == rec->interval && rec->points[rec->point_count - 1].snapshot->instructions < vm->instructions && !add_point(rec)) {
+                printf("not enough memory\n");
+                exit(1);
+            }
+            if (slice > next) slice = next;
+        }
+        uint64_t before = vm->instructions;
+        result = vm_run(vm, slice);
+        budget -= vm->instructions - before;
+        if (result != VM_BUDGET) break;
+    }
+    return result;
+}
+
+int replay_seek(vm_recording* rec, uint64_t target) {
+    /*
+        This function puts a replayed machine in its state after target instructions, as the replay from its start would have.
+        The machine goes back to the last snapshot before target if target is behind it, or if that snapshot is ahead of it,
+        and runs to target with its console output dropped (the output that was still buffered is written first).
+        It returns VM_BUDGET once the machine is at target, or the result of vm_run if the program stopped before it.
+    */
+
+    vm* vm = rec->vm;
+    output_flush(&vm->out);
+    size_t lo = 0, hi = rec->point_count;
+    while (hi - lo > 1) {
+        // the last point at or before target (the first point is the start of the replay)
+        size_t mid = (lo + hi) / 2;
+        if (rec->points[mid].snapshot->instructions <= target) lo = mid; else hi = mid;
+    }
+    const replay_point* p = &rec->points[lo];
+    if (target < vm->instructions || p->snapshot->instructions > vm->instructions) {
+        vm_snapshot_restore(vm, p->snapshot);
+        rec->pos = p->event;
+        rec->sub = p->sub;
+        rec->diverged = 0;
+    }
+    if (target < vm->instructions) return VM_BUDGET; // before the start of the replay
+    rec->muted = 1;
+    int result = vm->instructions < target ? replay_run(rec, target - vm->instructions) : VM_BUDGET;
+    output_flush(&vm->out);
+    rec->muted = 0;
+    return result;
+}
+
+void replay_free(vm_recording* rec) {
+    /*
+        This function frees a recording or a replay and connects the machine back to the hooks it had before.
+    */
+
+    if (!rec) return;
+    output_flush(&rec->vm->out);
+    vm_set_io(rec->vm, &rec->io);
+    for (size_t i = 0; i < rec->point_count; ++i) {
+        vm_snapshot_free(rec->points[i].snapshot);
+    }
+    free(rec->points);
+    free(rec->events);
+    free(rec);
+}
@@ -0,0 +1,94 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+#include "snapshot.h"
+
+/*
+    Record and replay of the input of a machine, to run a session again exactly as it happened.
+    A recording logs every input event the machine consumes, with the instruction count at which the program asked for it
+    (vm->io_instructions): every key returned by read_key (TRAP_GETC, TRAP_IN, and the key of a MR_KBSR poll),
+    and every key_ready poll that found no key (a read of MR_KBSR, or TRAP_GETC and TRAP_IN on a parked machine).
+    A poll that finds a key is always followed by the read of that key, at the same instruction count, so it is not logged on its own.
+    A replay feeds the logged answers back instead of asking the host, and checks that the program asks for every one of them
+    at the same instruction count: since the machine is deterministic, it then executes the same instructions as the recorded session.
+    If the program asks for another event (another image, or a different build of a device), the replay has diverged and stops feeding the log.
+    After the end of the log, or once it has diverged, the keys come from the hooks of the machine again, so a replay can be continued by hand.
+
+    A replay takes a snapshot of the machine every interval instructions (see snapshot.h, they share the pages of the machine),
+    so that replay_seek goes to any instruction count by restoring the last snapshot before it and running at most interval instructions,
+    with the console output dropped, instead of running the whole session again.
+
+    While a machine is recorded or replayed, it uses the threaded engine instead of the JIT, whose compiled blocks read MR_KBSR
+    without updating vm->io_instructions.
+
+    Consecutive events that are the same, like the empty polls of a program waiting for a key or the EOF keys after the end of the input,
+    are logged as a single event with a repeat count, as long as they are the same number of instructions apart.
+*/
+
+// The kinds of input events
+enum
+{
+    REPLAY_NO_KEY = 0, // key_ready returned 0
+    REPLAY_KEY         // read_key returned value (a key or EOF)
+};
+
+typedef struct
+{
+    uint64_t instructions; // the instruction count of the first repeat
+    uint64_t stride;       // the number of instructions between two repeats
+    uint32_t repeat;       // number of repeats of the event, at least 1
+    int16_t value;         // the key of REPLAY_KEY, 0 for REPLAY_NO_KEY
+    uint16_t kind;         // REPLAY_NO_KEY or REPLAY_KEY
+} replay_event;
+
+/*
+    A recording file holds a header and the events, in the byte order of the host that wrote it (like a cached image, see image.h).
+*/
+#define REPLAY_MAGIC "LC3INPUT"
+#define REPLAY_BYTE_ORDER 0x0102
+
+typedef struct
+{
+    char magic[8];       // REPLAY_MAGIC
+    uint16_t byte_order; // REPLAY_BYTE_ORDER, in the byte order of the host that wrote the file
+    uint16_t event_size; // sizeof(replay_event)
+    uint32_t count;      // the number of events after the header
+} replay_header;
+
+// A snapshot of a replayed machine, and the position in the log at that point
+typedef struct
+{
+    vm_snapshot* snapshot;
+    size_t event;   // the next event to replay
+    uint32_t sub;   // the repeats of that event already replayed
+} replay_point;
+
+typedef struct
+{
+    vm* vm;
+    vm_io io;                   // the hooks of the machine before it was recorded or replayed
+    int playing;                // 1 for a replay, 0 for a recording
+    replay_event* events;
+    size_t count, cap;
+    size_t pos;                 // the next event to replay
+    uint32_t sub;               // the repeats of that event already replayed
+    int diverged;               // the program asked for another event than the one of the log
+    uint64_t diverged_at;       // the instruction count at which it did
+    int muted;                  // the console output is dropped (while replay_seek runs the machine)
+    uint64_t interval;          // the instructions between two snapshots of a replay, 0 for none
+    replay_point* points;       // the snapshots of a replay, in the order of their instruction counts
+    size_t point_count, point_cap;
+} vm_recording;
+
+vm_recording* replay_record(vm* vm);
+vm_recording* replay_play(vm* vm, const char* path, uint64_t interval);
+int replay_save(const vm_recording* rec, const char* path);
+int replay_run(vm_recording* rec, uint64_t budget);
+int replay_seek(vm_recording* rec, uint64_t target);
+void replay_free(vm_recording* rec);
+
+#endif
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+#include "vm.h"
+#include "snapshot.h"
+#include "routine.h"
+
+// The code of the routines, as assembled from bench/arith.asm
+const vm_routine vm_routines[ROUTINE_COUNT] = {
+    [ROUTINE_MUL] = { "MUL", 7, { 0x54A0, 0x1260, 0x0403, 0x1480, 0x127F, 0x0BFD, 0xC1C0 } },
+    [ROUTINE_MULSA] = { "MULSA", 10, { 0x54A0, 0x56E0, 0x16E1, 0x5843, 0x0401, 0x1480, 0x1000, 0x16C3, 0x0BFA, 0xC1C0 } },
+    [ROUTINE_DIV] = { "DIV", 9, { 0x54A0, 0x967F, 0x16E1, 0x1003, 0x0802, 0x14A1, 0x0FFC, 0x1001, 0xC1C0 } },
+    [ROUTINE_MEMCPY] = { "MEMCPY", 9, { 0x14A0, 0x0406, 0x6640, 0x7600, 0x1021, 0x1261, 0x14BF, 0x0BFA, 0xC1C0 } },
+    [ROUTINE_MEMSET] = { "MEMSET", 7, { 0x14A0, 0x0404, 0x7200, 0x1021, 0x14BF, 0x0BFC, 0xC1C0 } },
+    [ROUTINE_STRLEN] = { "STRLEN", 8, { 0x1420, 0x5260, 0x6680, 0x0403, 0x1261, 0x14A1, 0x0FFB, 0xC1C0 } },
+    [ROUTINE_STRCPY] = { "STRCPY", 7, { 0x6440, 0x7400, 0x0403, 0x1021, 0x1261, 0x0FFA, 0xC1C0 } }
+};
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t fnv_word(uint32_t h, uint16_t word) {
+    // one word more in the FNV-1a hash h, a byte at a time, the low byte first
+    h = (h ^ (word & 0xFF)) * FNV_PRIME;
+    return (h ^ (word >> 8)) * FNV_PRIME;
+}
+
+static uint32_t fingerprint(const vm_routine* r) {
+    uint32_t h = FNV_OFFSET;
+    for (int i = 0; i < r->length; ++i) h = fnv_word(h, r->words[i]);
+    return h;
+}
+
+static int holds(const vm* vm, uint16_t address, const vm_routine* r) {
+    // the memory at address holds the code of the routine r, below the I/O page
+    if (address + r->length > VM_IO_BASE) return 0;
+    for (int i = 0; i < r->length; ++i) {
+        if (vm_peek(vm, (uint16_t)(address + i)) != r->words[i]) return 0;
+    }
+    return 1;
+}
+
+int routine_find(const vm* vm, uint16_t address) {
+    /*
+        This function returns the routine whose code is at address (ROUTINE_MUL to ROUTINE_COUNT - 1), or -1 if there is none.
+        The words at address are hashed once, and the hash after every length is compared with the fingerprints of the routines
+        of that length; a routine whose fingerprint matches is then compared word by word.
+    */
+
+    uint32_t hashes[ROUTINE_MAX_WORDS + 1];
+    uint32_t h = FNV_OFFSET;
+    int n = 0;
+    while (n < ROUTINE_MAX_WORDS && address + n < VM_IO_BASE) {
+        h = fnv_word(h, vm_peek(vm, (uint16_t)(address + n)));
+        hashes[++n] = h;
+    }
+    for (int r = 0; r < ROUTINE_COUNT; ++r) {
+        const vm_routine* routine = &vm_routines[r];
+        if (routine->length <= n && hashes[routine->length] == fingerprint(routine) && holds(vm, address, routine)) return r;
+    }
+    return -1;
+}
+
+static int below_io(uint32_t address, uint32_t words) {
+    // the words from address are all below the I/O page, without wrapping around to x0000
+    return address + words <= VM_IO_BASE;
+}
+
+static int disjoint(uint32_t a, uint32_t a_words, uint32_t b, uint32_t b_words) {
+    return a + a_words <= b || b + b_words <= a;
+}
+
+static uint32_t string_length(const vm* vm, uint16_t address) {
+    // the length of the string at address, or UINT32_MAX if it runs into the I/O page before its zero word
+    uint32_t a = address;
+    while (a < VM_IO_BASE && vm_peek(vm, (uint16_t)a) != 0) ++a;
+    return a < VM_IO_BASE ? a - address : UINT32_MAX;
+}
+
+uint64_t routine_cost(const vm* vm, int routine) {
+    /*
+        This function returns the number of instructions the routine would execute, including its RET,
+        when it is called with the registers and the memory of the machine, whose PC is at the first instruction of the routine.
+        It returns 0 if the call must be interpreted: the memory at the PC doesn't hold the routine anymore,
+        or the loop of the routine would reach the I/O page, write over its own code, or do something the native code doesn't reproduce.
+        The counts follow the loops of bench/arith.asm instruction by instruction.
+    */
+
+    const uint16_t* reg = vm->reg;
+    const vm_routine* r = &vm_routines[routine];
+    uint16_t pc = reg[R_PC];
+    if (!holds(vm, pc, r)) return 0;
+
+    switch (routine) {
+        case ROUTINE_MUL:
+            // AND, ADD, BRz, then ADD, ADD, BRnp R1 times, and RET
+            return reg[R_R1] == 0 ? 4 : 4 + 3 * (uint64_t)reg[R_R1];
+        case ROUTINE_MULSA:
+            {
+                // AND, AND, ADD, then AND, BRz, ADD, ADD, BRnp for the 16 bits of the mask, the ADD of R0 for every bit of R1 that is set, and RET
+                int bits = 0;
+                for (uint16_t m = reg[R_R1]; m; m &= m - 1) ++bits;
+                return 84 + bits;
+            }
+        case ROUTINE_DIV:
+            // AND, NOT, ADD, then ADD, BRn, ADD, BRnzp for every subtraction that leaves R0 >= 0, the last ADD, BRn, then ADD, RET
+            if ((int16_t)reg[R_R0] < 0 || (int16_t)reg[R_R1] <= 0) return 0;
+            return 7 + 4 * (uint64_t)(reg[R_R0] / reg[R_R1]);
+        case ROUTINE_MEMCPY:
+        case ROUTINE_MEMSET:
+            {
+                // ADD, BRz, then the 6 (MEMCPY) or 4 (MEMSET) instructions of the loop for every word, and RET
+                uint32_t n = reg[R_R2];
+                if (n == 0) return 3;
+                if (!below_io(reg[R_R0], n) || !disjoint(reg[R_R0], n, pc, r->length)) return 0;
+                if (routine == ROUTINE_MEMSET) return 3 + 4 * (uint64_t)n;
+                if (!below_io(reg[R_R1], n)) return 0;
+                return 3 + 6 * (uint64_t)n;
+            }
+        case ROUTINE_STRLEN:
+            {
+                // ADD, AND, then LDR, BRz, ADD, ADD, BRnzp for every word before the zero word, and LDR, BRz, RET
+                uint32_t n = string_length(vm, reg[R_R0]);
+                if (n == UINT32_MAX) return 0;
+                return 5 + 5 * (uint64_t)n;
+            }
+        case ROUTINE_STRCPY:
+            {
+                // LDR, STR, BRz, ADD, ADD, BRnzp for every word before the zero word, then LDR, STR, BRz, RET
+                // the copy must not change the string it reads (an overlapping copy), or the routine
+                uint32_t n = string_length(vm, reg[R_R1]);
+                if (n == UINT32_MAX || !below_io(reg[R_R0], n + 1)) return 0;
+                if (!disjoint(reg[R_R0], n + 1, reg[R_R1], n + 1) || !disjoint(reg[R_R0], n + 1, pc, r->length)) return 0;
+                return 4 + 6 * (uint64_t)n;
+            }
+    }
+    return 0;
+}
+
+static void run_native(vm* vm, int routine) {
+    // the state after the routine, as its loop leaves it (see routine_cost for what the loop executes), and its RET
+    uint16_t* reg = vm->reg;
+    switch (routine) {
+        case ROUTINE_MUL:
+            reg[R_R2] = (uint16_t)((uint32_t)reg[R_R0] * reg[R_R1]);
+            reg[R_R1] = 0;
+            reg[R_COND] = 0;
+            break;
+        case ROUTINE_MULSA:
+            reg[R_R2] = (uint16_t)((uint32_t)reg[R_R0] * reg[R_R1]);
+            reg[R_R4] = reg[R_R1] & 0x8000;
+            reg[R_R0] = 0;
+            reg[R_R3] = 0;
+            reg[R_COND] = 0;
+            break;
+        case ROUTINE_DIV:
+            reg[R_R2] = reg[R_R0] / reg[R_R1];
+            reg[R_R0] = reg[R_R0] % reg[R_R1];
+            reg[R_R3] = (uint16_t)-reg[R_R1];
+            reg[R_COND] = reg[R_R0];
+            break;
+        case ROUTINE_MEMCPY:
+            // one word at a time, so that an overlapping copy repeats the words like the loop does
+            for (; reg[R_R2]; --reg[R_R2]) {
+                reg[R_R3] = vm_peek(vm, reg[R_R1]++);
+                mem_write(vm, reg[R_R0]++, reg[R_R3]);
+            }
+            reg[R_COND] = 0;
+            break;
+        case ROUTINE_MEMSET:
+            for (; reg[R_R2]; --reg[R_R2]) {
+                mem_write(vm, reg[R_R0]++, reg[R_R1]);
+            }
+            reg[R_COND] = 0;
+            break;
+        case ROUTINE_STRLEN:
+            reg[R_R1] = (uint16_t)string_length(vm, reg[R_R0]);
+            reg[R_R2] = reg[R_R0] + reg[R_R1];
+            reg[R_R3] = 0;
+            reg[R_COND] = 0;
+            break;
+        case ROUTINE_STRCPY:
+            while ((reg[R_R2] = vm_peek(vm, reg[R_R1])) != 0) {
+                mem_write(vm, reg[R_R0]++, reg[R_R2]);
+                reg[R_R1]++;
+            }
+            mem_write(vm, reg[R_R0], 0);
+            reg[R_COND] = 0;
+            break;
+    }
+    reg[R_PC] = reg[R_R7];
+    vm->routines[routine]++;
+}
+
+static int same_state(vm* vm, const struct vm* interpreted, const char* name, uint16_t pc) {
+    // the registers and the memory of the machine are those of the machine that interpreted the routine, the differences are reported
+    static const char* const names[R_COUNT] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND" };
+    int same = 1;
+    for (int i = 0; i < R_COUNT; ++i) {
+        if (vm->reg[i] == interpreted->reg[i]) continue;
+        if (same) fprintf(stderr, "routine %s at x%04X: the native result differs from the interpreter\n", name, pc);
+        fprintf(stderr, "  %s is x%04X, the interpreter gives x%04X\n", names[i], vm->reg[i], interpreted->reg[i]);
+        same = 0;
+    }
+    for (int p = 0; p < VM_PAGES; ++p) {
+        // the pages that neither machine wrote since the fork are still the same page
+        if (vm->pages[p] == interpreted->pages[p]) continue;
+        for (int i = 0; i < VM_PAGE_WORDS; ++i) {
+            uint16_t native = vm->pages[p]->words[i], expected = interpreted->pages[p]->words[i];
+            if (native == expected) continue;
+            if (same) fprintf(stderr, "routine %s at x%04X: the native result differs from the interpreter\n", name, pc);
+            fprintf(stderr, "  x%04X is x%04X, the interpreter gives x%04X\n", (p << VM_PAGE_SHIFT) + i, native, expected);
+            same = 0;
+        }
+    }
+    return same;
+}
+
+void routine_call(vm* vm, int routine, uint64_t cost) {
+    /*
+        This function runs the routine natively, after routine_cost returned its cost for the current registers,
+        and leaves the PC at the return address like its RET.
+        With check_routines set, a fork of the machine interprets the routine first, and the native result is compared with it:
+        on a difference, the machine takes the registers and the pages of the fork.
+    */
+
+    if (!vm->check_routines) {
+        run_native(vm, routine);
+        return;
+    }
+
+    struct vm* interpreted = vm_fork(vm, &vm->io);
+    if (!interpreted) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    uint16_t pc = vm->reg[R_PC];
+    interpreted->engine = ENGINE_SWITCH;
+    int result = vm_run(interpreted, cost);
+    run_native(vm, routine);
+    if (result != VM_BUDGET || interpreted->instructions - vm->instructions != cost) {
+        // the interpreter halted or stopped early: the cost was wrong
+        fprintf(stderr, "routine %s at x%04X: the interpreter stopped after %llu of %llu instructions\n", vm_routines[routine].name, pc,
+            (unsigned long long)(interpreted->instructions - vm->instructions), (unsigned long long)cost);
+    } else if (same_state(vm, interpreted, vm_routines[routine].name, pc)) {
+        vm_destroy(interpreted);
+        return;
+    }
+    vm->routine_mismatches++;
+    memcpy(vm->reg, interpreted->reg, sizeof(vm->reg));
+    for (int p = 0; p < VM_PAGES; ++p) {
+        vm_set_page(vm, p, interpreted->pages[p]);
+    }
+    vm_destroy(interpreted);
+}
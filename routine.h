@@ -0,0 +1,76 @@
+#ifndef ROUTINE_H
+#define ROUTINE_H
+
+#include <stdint.h>
+
+/*
+    Native routines: the guest library routines that LC-3 programs spend their time in for lack of the instructions,
+    multiplying by repeated addition or shifts, dividing by repeated subtraction, copying and filling memory and walking strings,
+    are run by C code that leaves the machine in the state the loop of the guest would have left it in.
+
+    A routine is recognized by its code. The fingerprint of a routine is the FNV-1a hash of its words:
+    when the decoder reaches a JSR (see decode_at in vm.c), it hashes the words at the target of the JSR for every length of the table
+    and compares them to the fingerprints, then compares the words of a matching routine one by one,
+    and a JSR to a routine gets the entry H_JSR_NATIVE. The routines only use PC-relative branches, so they are found at any address.
+
+    Every call is checked again before it runs natively, since the routine may have been overwritten after the JSR was decoded:
+    routine_cost compares the words at the PC with the routine and computes, from the registers and the memory,
+    the exact number of instructions the loop of the guest would execute, including the RET. The call is left to the interpreter
+    (routine_cost returns 0) when the operands are outside of what the native code reproduces: a loop that would read or write
+    the I/O page, or write over the routine itself, or a division with a negative operand.
+    The engines that run more than one instruction per dispatch (switch, threaded and the interpreted part of the JIT) run the call natively
+    when their budget holds those instructions, the way a superinstruction runs; they count towards the budget and vm->instructions
+    like the interpreted ones. The profiled, traced and debug engines, and a machine with the keyboard interrupt enabled,
+    always interpret the routines, so every instruction is seen and the interrupts are taken at the same instruction.
+
+    With check_routines set (--check-routines), every native call is checked against the interpreter: a fork of the machine
+    interprets the routine with the switch engine, and its registers and memory are compared with the native result.
+    A difference is reported on the standard error, and the machine continues from the state of the interpreter.
+
+    A routine written with other registers, offsets or instructions is not recognized and is interpreted as before;
+    the bundled games contain none of these routines, only the synthetic bench/arith.asm does.
+
+    The routines and their registers, as written in bench/arith.asm (the other registers are left alone, R7 holds the return address):
+        MUL:     R2 = R0 * R1 by repeated addition, R1 times; R1 = 0
+        MULSA:   R2 = R0 * R1 by shift and add over the 16 bits of R1; R0 = 0, R3 = 0, R4 = R1 & x8000
+        DIV:     R2 = R0 / R1 and R0 = R0 % R1 by repeated subtraction, for R0 >= 0 and R1 > 0; R3 = -R1
+        MEMCPY:  copies R2 words from R1 to R0, forward one word at a time; R0 += R2, R1 += R2, R2 = 0, R3 = the last word copied
+        MEMSET:  stores R1 to R2 words from R0; R0 += R2, R2 = 0
+        STRLEN:  R1 = the length of the string at R0; R2 = the address of its zero word, R3 = 0
+        STRCPY:  copies the string at R1 with its zero word to R0; R0 and R1 point to the zero words, R2 = 0
+    The counts are unsigned: a count of 0 does nothing. The condition codes are those of the last instruction of the loop that sets them.
+
+    A build with -DNO_ROUTINES runs every routine on the interpreter.
+*/
+
+typedef struct vm vm;
+
+enum
+{
+    ROUTINE_MUL = 0,
+    ROUTINE_MULSA,
+    ROUTINE_DIV,
+    ROUTINE_MEMCPY,
+    ROUTINE_MEMSET,
+    ROUTINE_STRLEN,
+    ROUTINE_STRCPY,
+    ROUTINE_COUNT
+};
+
+// The longest routine, in words
+#define ROUTINE_MAX_WORDS 10
+
+typedef struct
+{
+    const char* name;
+    int length;                              // number of words, the RET included
+    uint16_t words[ROUTINE_MAX_WORDS];       // the code of the routine
+} vm_routine;
+
+extern const vm_routine vm_routines[ROUTINE_COUNT];
+
+int routine_find(const vm* vm, uint16_t address);
+uint64_t routine_cost(const vm* vm, int routine);
+void routine_call(vm* vm, int routine, uint64_t cost);
+
+#endif
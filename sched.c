@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+#include "checkpoint.h"
+#include "thread.h"
+#include "vm.h"
+
+// The states of a task
+enum
+{
+    TASK_READY = 0, // in the deque of a worker, or being run by a worker
+    TASK_PARKED,    // waiting for input, in no deque
+    TASK_DONE       // halted, stopped at an illegal instruction, reached its instruction limit, or cancelled
+};
+
+struct sched_task
+{
+    vm* vm;
+    uint64_t limit;     // number of instructions after which the task is stopped, 0 for no limit
+    int state;
+    thread_mutex lock;  // protects the input queue and the state
+    char* keys;         // the input queue: keys[pos..len) are the keys not read yet
+    size_t len;
+    size_t cap;
+    size_t pos;
+    int closed;         // set by sched_close_input, the reads after the last key return EOF
+    int cancelled;      // set by sched_cancel, the task is retired instead of running again
+    int held;           // set by sched_hold, the task is parked at the end of its slice and input does not wake it
+    sched_task* next;   // next task of the scheduler (for sched_destroy)
+    sched_task* prev;
+};
+
+/*
+    A deque of ready tasks, owned by one worker.
+    The owner pushes and pops at the bottom (the task it ran last is the first to run again, its memory is still in the cache of the core),
+    and the other workers steal from the top (the task that waited longest).
+    top and bottom count the tasks taken from the top and pushed at the bottom, the deque holds bottom - top tasks.
+    Every operation takes the lock of the deque; a task runs for a whole slice between two operations, so the locks are rarely contended.
+*/
+typedef struct
+{
+    thread_mutex lock;
+    sched_task** items;
+    size_t cap;         // power of 2
+    size_t top;
+    size_t bottom;
+} sched_deque;
+
+struct sched
+{
+    int workers;
+    sched_deque* deques;
+    sched_task* tasks;
+    int task_count;
+    unsigned wake_next;  // deque that receives the next task woken by sched_input
+
+    /*
+        lock protects ready and busy, the idle workers sleep on changed.
+        The run is over when no task is ready and no worker is running a task, since only a running task can make another one ready
+        (besides sched_input, which is not counted).
+    */
+    thread_mutex lock;
+    thread_cond changed;
+    int ready;    // number of tasks in the deques
+    int busy;     // number of workers running a task
+    int serving;  // sched_serve runs: the workers wait for tasks until stopping is set
+    int stopping;
+
+    void (*done)(vm* vm, void* user); // called when a task is retired (sched_on_done)
+    void* done_user;
+};
+
+typedef struct
+{
+    sched* s;
+    int index;
+    uint32_t seed;      // state of the random choice of the victim of a steal
+    sched_stats stats;
+} sched_worker;
+
+/* Deques */
+
+static int deque_init(sched_deque* q) {
+    // an empty deque, 0 if there is not enough memory
+    q->cap = 64;
+    q->items = malloc(q->cap * sizeof(*q->items));
+    if (!q->items) return 0;
+    mutex_init(&q->lock);
+    q->top = q->bottom = 0;
+    return 1;
+}
+
+static void deque_push(sched_deque* q, sched_task* t) {
+    mutex_lock(&q->lock);
+    if (q->bottom - q->top == q->cap) {
+        // grow the ring, keeping the tasks at the same counters
+        // (a task that can't be queued would be lost with its machine, like a page that can't be copied in vm_own_page)
+        sched_task** items = malloc(2 * q->cap * sizeof(*items));
+        if (!items) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        for (size_t i = q->top; i != q->bottom; ++i) {
+            items[i & (2 * q->cap - 1)] = q->items[i & (q->cap - 1)];
+        }
+        free(q->items);
+        q->items = items;
+        q->cap *= 2;
+    }
+    q->items[q->bottom & (q->cap - 1)] = t;
+    q->bottom++;
+    mutex_unlock(&q->lock);
+}
+
+static sched_task* deque_pop(sched_deque* q) {
+    sched_task* t = NULL;
+    mutex_lock(&q->lock);
+    if (q->bottom != q->top) {
+        q->bottom--;
+        t = q->items[q->bottom & (q->cap - 1)];
+    }
+    mutex_unlock(&q->lock);
+    return t;
+}
+
+static sched_task* deque_steal(sched_deque* q) {
+    sched_task* t = NULL;
+    mutex_lock(&q->lock);
+    if (q->bottom != q->top) {
+        t = q->items[q->top & (q->cap - 1)];
+        q->top++;
+    }
+    mutex_unlock(&q->lock);
+    return t;
+}
+
+/* Input queue of a task (the I/O hooks of its machine) */
+
+static int task_key_ready(void* user) {
+    sched_task* t = user;
+    mutex_lock(&t->lock);
+    int ready = t->pos < t->len || t->closed;
+    mutex_unlock(&t->lock);
+    return ready;
+}
+
+static int task_read_key(void* user) {
+    /*
+        This function takes the next key of the input queue.
+        The machine is parked instead of calling it when the queue is empty (park_on_input), so an empty queue only happens
+        once the input is closed, and returns EOF like the console does.
+    */
+
+    sched_task* t = user;
+    int c = EOF;
+    mutex_lock(&t->lock);
+    if (t->pos < t->len) {
+        c = (unsigned char)t->keys[t->pos++];
+        if (t->pos == t->len) t->pos = t->len = 0;
+    }
+    mutex_unlock(&t->lock);
+    return c;
+}
+
+/* Scheduler */
+
+static void make_ready(sched* s, sched_task* t, int deque) {
+    // put a task in a deque and wake an idle worker for it
+    t->state = TASK_READY;
+    deque_push(&s->deques[deque], t);
+    mutex_lock(&s->lock);
+    s->ready++;
+    cond_signal(&s->changed);
+    mutex_unlock(&s->lock);
+}
+
+sched* sched_create(int workers) {
+    /*
+        This function creates a scheduler with the given number of workers, or one worker per host core if workers is 0.
+        It returns NULL if there is not enough memory.
+    */
+
+    sched* s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->workers = workers > 0 ? workers : thread_cpu_count();
+    s->deques = calloc(s->workers, sizeof(*s->deques));
+    if (!s->deques) { free(s); return NULL; }
+    for (int i = 0; i < s->workers; ++i) {
+        if (deque_init(&s->deques[i])) continue;
+        while (i-- > 0) {
+            mutex_destroy(&s->deques[i].lock);
+            free(s->deques[i].items);
+        }
+        free(s->deques);
+        free(s);
+        return NULL;
+    }
+    mutex_init(&s->lock);
+    cond_init(&s->changed);
+    return s;
+}
+
+void sched_destroy(sched* s) {
+    /*
+        This function frees the scheduler and its tasks. The machines belong to the caller and are not freed.
+    */
+
+    if (!s) return;
+    sched_task* t = s->tasks;
+    while (t) {
+        sched_task* next = t->next;
+        mutex_destroy(&t->lock);
+        free(t->keys);
+        free(t);
+        t = next;
+    }
+    for (int i = 0; i < s->workers; ++i) {
+        mutex_destroy(&s->deques[i].lock);
+        free(s->deques[i].items);
+    }
+    free(s->deques);
+    mutex_destroy(&s->lock);
+    cond_destroy(&s->changed);
+    free(s);
+}
+
+int sched_workers(sched* s) {
+    // the number of workers of the scheduler
+    return s->workers;
+}
+
+sched_task* sched_add(sched* s, vm* vm, uint64_t limit) {
+    /*
+        This function adds a machine to the scheduler, as a ready task.
+        The keyboard of the machine is replaced by the input queue of the task (its console output is not changed).
+        The task is stopped after limit instructions, or runs until it halts if limit is 0.
+        It can be called from any thread, also while sched_serve is running (not while sched_run is).
+    */
+
+    sched_task* t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->vm = vm;
+    t->limit = limit;
+    mutex_init(&t->lock);
+    vm->io.key_ready = task_key_ready;
+    vm->io.read_key = task_read_key;
+    vm->io.user = t;
+    vm->park_on_input = 1;
+
+    mutex_lock(&s->lock);
+    t->next = s->tasks;
+    if (s->tasks) s->tasks->prev = t;
+    s->tasks = t;
+    int deque = s->task_count++ % s->workers;
+    mutex_unlock(&s->lock);
+    make_ready(s, t, deque);
+    return t;
+}
+
+void sched_input(sched* s, sched_task* t, const char* keys, size_t n) {
+    /*
+        This function appends keys to the input queue of a task, and wakes the task if it was parked waiting for them.
+        It can be called from any thread, also while sched_run is running.
+    */
+
+    mutex_lock(&t->lock);
+    if (t->len + n > t->cap) {
+        size_t cap = t->cap ? t->cap : 64;
+        while (cap < t->len + n) cap *= 2;
+        char* grown = realloc(t->keys, cap);
+        if (!grown) { mutex_unlock(&t->lock); return; }
+        t->keys = grown;
+        t->cap = cap;
+    }
+    memcpy(t->keys + t->len, keys, n);
+    t->len += n;
+    int wake = t->state == TASK_PARKED && n > 0 && !t->held;
+    if (wake) t->state = TASK_READY;
+    mutex_unlock(&t->lock);
+
+    if (wake) {
+        mutex_lock(&s->lock);
+        int deque = s->wake_next++ % s->workers;
+        mutex_unlock(&s->lock);
+        make_ready(s, t, deque);
+    }
+}
+
+void sched_close_input(sched* s, sched_task* t) {
+    /*
+        This function ends the input of a task: once its queue is empty, its machine reads EOF instead of waiting.
+    */
+
+    mutex_lock(&t->lock);
+    t->closed = 1;
+    int wake = t->state == TASK_PARKED && !t->held;
+    if (wake) t->state = TASK_READY;
+    mutex_unlock(&t->lock);
+
+    if (wake) {
+        mutex_lock(&s->lock);
+        int deque = s->wake_next++ % s->workers;
+        mutex_unlock(&s->lock);
+        make_ready(s, t, deque);
+    }
+}
+
+int sched_evict(sched* s, sched_task* t, const vm_snapshot* base, const char* path) {
+    /*
+        This function hibernates the machine of a parked task to the checkpoint file path, against base, the machine
+        its images were loaded in (see checkpoint_hibernate). The task stays parked, and wakes for its input as usual.
+        It can be called from any thread, also while sched_run is running, and returns 0 if the task is not parked
+        or the checkpoint can't be written.
+    */
+
+    mutex_lock(&t->lock);
+    int evicted = t->state == TASK_PARKED && checkpoint_hibernate(t->vm, base, path); // a parked task has no key to save
+    mutex_unlock(&t->lock);
+    return evicted;
+}
+
+void sched_on_done(sched* s, void (*done)(vm* vm, void* user), void* user) {
+    /*
+        This function sets the hook called when a task is retired: it halted, stopped at an illegal instruction, reached its limit,
+        or was cancelled. The hook is called by the worker that retired the task (or by sched_cancel for a parked task),
+        once the scheduler no longer touches the task, so the hook can hand it to sched_remove.
+        It must be set before the tasks are added.
+    */
+
+    s->done = done;
+    s->done_user = user;
+}
+
+void sched_hold(sched* s, sched_task* t, int hold) {
+    /*
+        This function holds a task back, or lets it go again: a held task is parked at the end of its current slice,
+        even if it could run on, until it is released. A host holds the tasks whose output it can't take yet.
+        It can be called from any thread.
+    */
+
+    mutex_lock(&t->lock);
+    t->held = hold;
+    int wake = !hold && t->state == TASK_PARKED; // if it still waits for a key, it parks again after a short slice
+    if (wake) t->state = TASK_READY;
+    mutex_unlock(&t->lock);
+
+    if (wake) {
+        mutex_lock(&s->lock);
+        int deque = s->wake_next++ % s->workers;
+        mutex_unlock(&s->lock);
+        make_ready(s, t, deque);
+    }
+}
+
+void sched_cancel(sched* s, sched_task* t) {
+    /*
+        This function retires a task that has not run to its end: a parked task at once, and a ready one when a worker takes it,
+        or right after the slice it is running. It can be called from any thread, also while sched_serve is running.
+    */
+
+    mutex_lock(&t->lock);
+    int retire = t->state == TASK_PARKED;
+    if (t->state != TASK_DONE) t->cancelled = 1;
+    if (retire) t->state = TASK_DONE;
+    mutex_unlock(&t->lock);
+    if (retire && s->done) s->done(t->vm, s->done_user);
+}
+
+void sched_remove(sched* s, sched_task* t) {
+    /*
+        This function frees a retired task (its machine belongs to the caller). It can be called from any thread.
+    */
+
+    mutex_lock(&s->lock);
+    if (t->prev) t->prev->next = t->next; else s->tasks = t->next;
+    if (t->next) t->next->prev = t->prev;
+    mutex_unlock(&s->lock);
+    mutex_destroy(&t->lock);
+    free(t->keys);
+    free(t);
+}
+
+static sched_task* find_task(sched_worker* w) {
+    /*
+        This function takes the next task of a worker: from the bottom of its own deque,
+        or else from the top of the deque of other workers, starting at a random one.
+    */
+
+    sched* s = w->s;
+    sched_task* t = deque_pop(&s->deques[w->index]);
+    if (t || s->workers == 1) return t;
+
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 17;
+    w->seed ^= w->seed << 5;
+    int first = (int)(w->seed % (uint32_t)s->workers);
+    for (int i = 0; i < s->workers; ++i) {
+        int victim = (first + i) % s->workers;
+        if (victim == w->index) continue;
+        t = deque_steal(&s->deques[victim]);
+        if (t) {
+            w->stats.steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void run_slice(sched_worker* w, sched_task* t) {
+    /*
+        This function runs one time slice of a task, and puts the task back in a deque, parks it, or retires it.
+    */
+
+    sched* s = w->s;
+    vm* vm = t->vm;
+    uint64_t budget = SCHED_SLICE;
+    if (t->limit && t->limit - vm->instructions < budget) budget = t->limit - vm->instructions;
+
+    int result = VM_BUDGET;
+    mutex_lock(&t->lock);
+    int cancelled = t->cancelled;
+    mutex_unlock(&t->lock);
+    if (!cancelled) {
+        uint64_t before = vm->instructions;
+        if (vm->hibernated) w->stats.resumes++; // vm_run reads it back first
+        result = vm_run(vm, budget);
+        output_flush(&vm->out); // the output of the slice is not held back while other tasks run
+        w->stats.instructions += vm->instructions - before;
+        w->stats.slices++;
+    }
+
+    /*
+        Once the task is parked, sched_input can make it ready on another worker and sched_cancel can retire it,
+        so it is not touched after its lock is released.
+    */
+    int requeue = 0;
+    int retired = 1;
+    mutex_lock(&t->lock);
+    if (cancelled) {
+    } else if (result == VM_HALTED) {
+        w->stats.halted++;
+    } else if (result == VM_ILLEGAL) {
+        w->stats.illegal++;
+    } else if (result == VM_ERROR) {
+        fprintf(stderr, "failed to resume checkpoint: %s\n", vm->hibernated->path);
+        w->stats.errors++;
+    } else if (t->limit && vm->instructions >= t->limit) {
+        w->stats.stopped++;
+    } else if (t->cancelled) {
+    } else if (t->held || (result == VM_BLOCKED && t->pos == t->len && !t->closed)) {
+        // park the task, unless its key arrived while it was running
+        retired = 0;
+        w->stats.parks++;
+    } else {
+        retired = 0;
+        requeue = 1;
+    }
+    if (retired) t->state = TASK_DONE;
+    else if (!requeue) t->state = TASK_PARKED;
+    mutex_unlock(&t->lock);
+
+    if (requeue) {
+        t->state = TASK_READY;
+        deque_push(&s->deques[w->index], t);
+    }
+    mutex_lock(&s->lock);
+    if (requeue) s->ready++;
+    s->busy--;
+    if (s->busy == 0 || requeue) cond_broadcast(&s->changed);
+    mutex_unlock(&s->lock);
+    if (retired && s->done) s->done(vm, s->done_user);
+}
+
+static THREAD_FUNC worker_main(void* arg) {
+    /*
+        This function is the body of a worker thread: it runs tasks until no task is ready and no other worker is running one,
+        or when serving, until sched_stop is called (the ready tasks stay in the deques).
+    */
+
+    sched_worker* w = arg;
+    sched* s = w->s;
+    for (;;) {
+        mutex_lock(&s->lock);
+        int stopped = s->serving && s->stopping;
+        mutex_unlock(&s->lock);
+        if (stopped) break;
+
+        sched_task* t = find_task(w);
+        if (t) {
+            mutex_lock(&s->lock);
+            s->ready--;
+            s->busy++;
+            mutex_unlock(&s->lock);
+            run_slice(w, t);
+            continue;
+        }
+
+        // nothing to take: sleep until a task becomes ready, or leave when the run is over (or the serving is stopped)
+        mutex_lock(&s->lock);
+        while (s->ready == 0 && (s->serving ? !s->stopping : s->busy > 0)) {
+            cond_wait(&s->changed, &s->lock);
+        }
+        int over = s->serving ? s->stopping : s->ready == 0 && s->busy == 0;
+        mutex_unlock(&s->lock);
+        if (over) break;
+    }
+    return THREAD_RETURN;
+}
+
+static void run_workers(sched* s, sched_stats* stats);
+
+void sched_run(sched* s, sched_stats* stats) {
+    /*
+        This function runs the tasks on the workers until every task has halted, reached its limit, or is parked waiting for input.
+        The parked tasks continue in the next call after sched_input or sched_close_input woke them.
+        The totals of the run are stored in stats if it is not NULL.
+    */
+
+    run_workers(s, stats);
+}
+
+void sched_serve(sched* s, sched_stats* stats) {
+    /*
+        This function runs the tasks on the workers like sched_run, but the workers wait for new tasks and input
+        when no task can run, until another thread calls sched_stop. The totals are stored in stats if it is not NULL.
+    */
+
+    mutex_lock(&s->lock);
+    s->serving = 1;
+    s->stopping = 0;
+    mutex_unlock(&s->lock);
+    run_workers(s, stats);
+    mutex_lock(&s->lock);
+    s->serving = 0;
+    mutex_unlock(&s->lock);
+}
+
+void sched_stop(sched* s) {
+    // make sched_serve return once its workers have finished their slices
+    mutex_lock(&s->lock);
+    s->stopping = 1;
+    cond_broadcast(&s->changed);
+    mutex_unlock(&s->lock);
+}
+
+static void run_workers(sched* s, sched_stats* stats) {
+    // run worker_main on the workers, the calling thread being the first one, and add up their totals
+
+    sched_worker* workers = calloc(s->workers, sizeof(*workers));
+    thread_handle* threads = calloc(s->workers, sizeof(*threads));
+    if (!workers || !threads) { free(workers); free(threads); return; }
+
+    for (int i = 0; i < s->workers; ++i) {
+        workers[i].s = s;
+        workers[i].index = i;
+        workers[i].seed = 2463534242u + 0x9E3779B9u * (uint32_t)i;
+    }
+    for (int i = 1; i < s->workers; ++i) {
+        thread_start(&threads[i], worker_main, &workers[i]);
+    }
+    worker_main(&workers[0]); // the calling thread is the first worker
+    for (int i = 1; i < s->workers; ++i) {
+        thread_join(threads[i]);
+    }
+
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        for (int i = 0; i < s->workers; ++i) {
+            stats->instructions += workers[i].stats.instructions;
+            stats->slices += workers[i].stats.slices;
+            stats->steals += workers[i].stats.steals;
+            stats->parks += workers[i].stats.parks;
+            stats->resumes += workers[i].stats.resumes;
+            stats->halted += workers[i].stats.halted;
+            stats->stopped += workers[i].stats.stopped;
+            stats->illegal += workers[i].stats.illegal;
+            stats->errors += workers[i].stats.errors;
+        }
+        for (sched_task* t = s->tasks; t; t = t->next) {
+            if (t->state == TASK_PARKED) stats->parked++;
+        }
+    }
+    free(workers);
+    free(threads);
+}
@@ -0,0 +1,68 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+#include "snapshot.h"
+
+/*
+    The scheduler runs many machines on a pool of worker threads, one per host core by default.
+
+    Each machine added to the scheduler becomes a task. A worker runs a task for a time slice
+    (a budget of SCHED_SLICE instructions given to vm_run), then puts it back at the bottom of its own deque of ready tasks.
+    A worker takes its next task from the bottom of its own deque, and when that is empty it steals from the top of the deque of another worker,
+    so the tasks spread over the workers without a shared run queue.
+
+    The keyboard of a task is its input queue, filled by the host with sched_input.
+    A task that waits for a key (TRAP_GETC, TRAP_IN, or a slice spent polling MR_KBSR) is parked: it is in no deque
+    and costs no worker time until sched_input gives it a key, or sched_close_input ends its input (the next reads return EOF).
+    A parked task can also be evicted with sched_evict: its machine is hibernated to a checkpoint file (see checkpoint.h)
+    and holds almost no host memory, and the worker that runs it next resumes it from the file first.
+
+    sched_run returns once no task can run. A host that keeps adding tasks and giving them input, like the server (server.h),
+    uses sched_serve instead, whose workers wait for work until sched_stop is called; tasks are then added from any thread,
+    held back with sched_hold (while their output can't be sent), ended with sched_cancel,
+    and freed with sched_remove once the done hook (sched_on_done) said they are retired.
+*/
+
+// Number of instructions a task runs before its worker moves to the next task
+#ifndef SCHED_SLICE
+#define SCHED_SLICE 100000
+#endif
+
+typedef struct sched sched;
+typedef struct sched_task sched_task;
+
+// The totals of one run of the scheduler (sched_run)
+typedef struct
+{
+    uint64_t instructions; // instructions executed by all tasks
+    uint64_t slices;       // time slices run
+    uint64_t steals;       // tasks taken from the deque of another worker
+    uint64_t parks;        // times a task was parked to wait for input
+    uint64_t resumes;      // evicted tasks resumed from their checkpoint
+    int halted;            // tasks that halted
+    int stopped;           // tasks that reached their instruction limit
+    int illegal;           // tasks that stopped at an illegal instruction
+    int errors;            // evicted tasks whose checkpoint could not be read back
+    int parked;            // tasks still waiting for input when the run ended
+} sched_stats;
+
+sched* sched_create(int workers);
+void sched_destroy(sched* s);
+int sched_workers(sched* s);
+sched_task* sched_add(sched* s, vm* vm, uint64_t limit);
+void sched_input(sched* s, sched_task* t, const char* keys, size_t n);
+void sched_close_input(sched* s, sched_task* t);
+int sched_evict(sched* s, sched_task* t, const vm_snapshot* base, const char* path);
+void sched_run(sched* s, sched_stats* stats);
+void sched_serve(sched* s, sched_stats* stats);
+void sched_stop(sched* s);
+void sched_on_done(sched* s, void (*done)(vm* vm, void* user), void* user);
+void sched_hold(sched* s, sched_task* t, int hold);
+void sched_cancel(sched* s, sched_task* t);
+void sched_remove(sched* s, sched_task* t);
+
+#endif
@@ -0,0 +1,881 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "server.h"
+#include "sched.h"
+#include "snapshot.h"
+#include "thread.h"
+#include "utils.h"
+#include "vm.h"
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define SERVER_EPOLL
+#endif
+
+#define SERVER_BACKLOG 512
+#define SERVER_EVENTS 256
+#define SERVER_DETECT_MS 200             // a connection that sends nothing for this long is raw TCP
+#define SERVER_HANDSHAKE_SECONDS 10      // time a WebSocket client has to send its HTTP request
+#define SESSION_MAX_REQUEST 8192         // bytes of the HTTP request of a WebSocket client
+#define SESSION_MAX_FRAME 65536          // payload of a WebSocket frame from a client
+#define SESSION_HOLD_BYTES (64 << 10)    // output queued for a slow client before its machine is held back (sched_hold)
+#define SESSION_MAX_PENDING (4 << 20)    // output queued before the client is disconnected (the rest of a slice of a held machine)
+
+// The protocol of a connection
+enum
+{
+    SESSION_DETECT = 0, // nothing was read yet
+    SESSION_HANDSHAKE,  // reading the HTTP request of a WebSocket client
+    SESSION_RAW,
+    SESSION_WEBSOCKET
+};
+
+typedef struct server server;
+
+/*
+    A session is owned by the event loop, except for the fields under lock, which the worker running its machine also uses
+    (the output hook and the done hook). The socket is closed only when the session is freed, after its machine is retired,
+    so a worker never writes to a descriptor that was reused for another connection.
+*/
+typedef struct session
+{
+    server* srv;
+    int fd;
+    int id;
+    int protocol;
+    double opened;              // clock_seconds when the connection was accepted
+    double active;              // clock_seconds of the last input
+    char* in;                   // bytes read and not handled yet: the HTTP request, or part of a WebSocket frame
+    size_t in_len;
+    size_t in_cap;
+    vm* vm;                     // NULL until the protocol is known
+    sched_task* task;
+    int evicted;
+    int writing;                // the socket is watched for writing
+    int held;                   // the machine is held back until its queued output is sent
+    int ended;                  // a raw client shut its side of the connection down: the input of the machine is closed
+    int gone;                   // the event loop has let the connection go (the machine is cancelled)
+    int closed;                 // in the closed list of the server, freed after the current events
+
+    thread_mutex lock;
+    char* pending;              // output the socket did not take yet
+    size_t pending_len;
+    size_t pending_cap;
+    int hangup;                 // the output is dropped: the client is gone, or too slow
+    int retired;                // the machine is done
+    int notified;               // in the notify list of the server (under the notify lock)
+    struct session* next_notify;
+
+    struct session* prev;       // all the sessions of the server
+    struct session* next;
+} session;
+
+struct server
+{
+    vm* image;
+    vm_snapshot* base;          // the image, that the checkpoints of the evicted sessions are taken against
+    server_options o;
+    sched* s;
+    sched_stats sched_stats;
+    thread_handle thread;       // runs sched_serve
+    int listener;
+    int wake[2];                // a byte in the pipe wakes the event loop up, to look at the notify list or stop
+#ifdef SERVER_EPOLL
+    int epoll;
+#else
+    struct pollfd* polls;
+    session** polled;
+    int poll_cap;
+#endif
+    session* sessions;
+    session* closed;            // sessions freed once the events of the current wait are handled
+    int count;
+    int detecting;              // sessions whose protocol is not known yet
+    int next_id;
+    char checkpoint_dir[4096];  // the private directory of the checkpoint files, made when sessions are evicted
+
+    thread_mutex notify_lock;
+    session* notified;          // sessions with news from a worker: output queued, or the machine retired
+
+    server_stats stats;
+    _Atomic uint64_t sends;     // counted by the workers
+    _Atomic uint64_t bytes_out;
+};
+
+static volatile sig_atomic_t stop_requested;
+static int stop_pipe = -1;
+
+void server_stop() {
+    // ask the event loop to stop; it can be called from a signal handler
+    stop_requested = 1;
+    if (stop_pipe >= 0 && write(stop_pipe, "", 1) < 0) return; // a full pipe wakes the loop up as well
+}
+
+/* WebSocket handshake (RFC 6455): the accept key is the base64 of the SHA-1 of the client key and a fixed GUID */
+
+static uint32_t rol(uint32_t x, int n) {
+    return x << n | x >> (32 - n);
+}
+
+static void sha1(const uint8_t* data, size_t len, uint8_t digest[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    size_t blocks = (len + 8) / 64 + 1;
+    for (size_t b = 0; b < blocks; ++b) {
+        uint8_t block[64];
+        for (int i = 0; i < 64; ++i) {
+            size_t at = b * 64 + i;
+            if (at < len) block[i] = data[at];
+            else if (at == len) block[i] = 0x80;
+            else block[i] = 0;
+        }
+        if (b == blocks - 1) {
+            uint64_t bits = (uint64_t)len * 8;
+            for (int i = 0; i < 8; ++i) block[63 - i] = (uint8_t)(bits >> (8 * i));
+        }
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        }
+        for (int i = 16; i < 80; ++i) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i) {
+            uint32_t f, k;
+            if (i < 20) { f = (bb & c) | (~bb & d); k = 0x5A827999; }
+            else if (i < 40) { f = bb ^ c ^ d; k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (bb & c) | (bb & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = bb ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = rol(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rol(bb, 30); bb = a; a = t;
+        }
+        h[0] += a; h[1] += bb; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; ++i) digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+static void base64(const uint8_t* data, size_t len, char* text) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16 | (i + 1 < len ? data[i + 1] << 8 : 0) | (i + 2 < len ? data[i + 2] : 0);
+        *text++ = digits[v >> 18 & 63];
+        *text++ = digits[v >> 12 & 63];
+        *text++ = i + 1 < len ? digits[v >> 6 & 63] : '=';
+        *text++ = i + 2 < len ? digits[v & 63] : '=';
+    }
+    *text = 0;
+}
+
+static int websocket_accept(const char* request, char accept[29]) {
+    // find the Sec-WebSocket-Key header of the request, and compute the Sec-WebSocket-Accept of the reply; 0 if there is none
+    static const char header[] = "sec-websocket-key:";
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    for (const char* line = strstr(request, "\r\n"); line && line[2]; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, header, sizeof(header) - 1) != 0) continue;
+        const char* key = line + 2 + sizeof(header) - 1;
+        while (*key == ' ' || *key == '\t') ++key;
+        size_t n = strcspn(key, " \t\r\n");
+        if (n == 0 || n > 64) return 0;
+        char text[64 + sizeof(guid)];
+        memcpy(text, key, n);
+        memcpy(text + n, guid, sizeof(guid));
+        uint8_t digest[20];
+        sha1((const uint8_t*)text, n + sizeof(guid) - 1, digest);
+        base64(digest, 20, accept);
+        return 1;
+    }
+    return 0;
+}
+
+/* The events of the sockets: epoll on Linux, poll elsewhere */
+
+// the data of the listening socket and of the wake pipe, the other events are sessions
+static char listener_event, wake_event;
+
+typedef struct
+{
+    void* data;
+    int readable;
+    int writable;
+    int failed;     // error or hang up
+} server_event;
+
+static void watch(server* srv, int fd, void* data, int add, int readable, int writable) {
+#ifdef SERVER_EPOLL
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+    ev.data.ptr = data;
+    epoll_ctl(srv->epoll, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+#else
+    (void)srv; (void)fd; (void)data; (void)add; (void)readable; (void)writable; // the poll list is built from the sessions at every wait
+#endif
+}
+
+static void unwatch(server* srv, int fd) {
+#ifdef SERVER_EPOLL
+    struct epoll_event ev;
+    epoll_ctl(srv->epoll, EPOLL_CTL_DEL, fd, &ev);
+#else
+    (void)srv; (void)fd;
+#endif
+}
+
+static int wait_events(server* srv, server_event* events, int max, int timeout_ms) {
+    // wait for events of the sockets for at most timeout_ms, and return the number of events stored
+#ifdef SERVER_EPOLL
+    struct epoll_event list[SERVER_EVENTS];
+    int n = epoll_wait(srv->epoll, list, max < SERVER_EVENTS ? max : SERVER_EVENTS, timeout_ms);
+    for (int i = 0; i < n; ++i) {
+        events[i].data = list[i].data.ptr;
+        events[i].readable = (list[i].events & EPOLLIN) != 0;
+        events[i].writable = (list[i].events & EPOLLOUT) != 0;
+        events[i].failed = (list[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+    }
+    return n < 0 ? 0 : n;
+#else
+    if (srv->poll_cap < srv->count + 2) {
+        int cap = (srv->count + 2) * 2;
+        struct pollfd* polls = realloc(srv->polls, cap * sizeof(*polls));
+        if (polls) srv->polls = polls;
+        session** polled = realloc(srv->polled, cap * sizeof(*polled));
+        if (polled) srv->polled = polled;
+        if (!polls || !polled) return 0;
+        srv->poll_cap = cap;
+    }
+    int count = 0;
+    srv->polls[count].fd = srv->listener;
+    srv->polls[count].events = POLLIN;
+    srv->polled[count++] = (session*)&listener_event;
+    srv->polls[count].fd = srv->wake[0];
+    srv->polls[count].events = POLLIN;
+    srv->polled[count++] = (session*)&wake_event;
+    for (session* c = srv->sessions; c; c = c->next) {
+        if (c->gone) continue;
+        srv->polls[count].fd = c->fd;
+        srv->polls[count].events = (c->ended ? 0 : POLLIN) | (c->writing ? POLLOUT : 0);
+        srv->polled[count++] = c;
+    }
+    int n = poll(srv->polls, count, timeout_ms), stored = 0;
+    for (int i = 0; i < count && n > 0 && stored < max; ++i) {
+        short r = srv->polls[i].revents;
+        if (!r) continue;
+        events[stored].data = srv->polled[i];
+        events[stored].readable = (r & POLLIN) != 0;
+        events[stored].writable = (r & POLLOUT) != 0;
+        events[stored].failed = (r & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+        ++stored;
+    }
+    return stored;
+#endif
+}
+
+/* Output, from the workers (and the replies of the event loop) */
+
+static void notify(session* c) {
+    // tell the event loop to look at the session
+    server* srv = c->srv;
+    mutex_lock(&srv->notify_lock);
+    int wake = !srv->notified;
+    if (!c->notified) {
+        c->notified = 1;
+        c->next_notify = srv->notified;
+        srv->notified = c;
+    }
+    mutex_unlock(&srv->notify_lock);
+    if (wake && write(srv->wake[1], "", 1) < 0) return; // a full pipe wakes the loop up as well
+}
+
+static int queue(session* c, const char* data, size_t n) {
+    // keep output the socket did not take, under the lock of the session; 0 once the client is too slow
+    if (c->pending_len + n > SESSION_MAX_PENDING) return 0;
+    if (c->pending_len + n > c->pending_cap) {
+        size_t cap = c->pending_cap ? c->pending_cap : 4096;
+        while (cap < c->pending_len + n) cap *= 2;
+        char* pending = realloc(c->pending, cap);
+        if (!pending) return 0;
+        c->pending = pending;
+        c->pending_cap = cap;
+    }
+    memcpy(c->pending + c->pending_len, data, n);
+    c->pending_len += n;
+    return 1;
+}
+
+static void send_locked(session* c, const char* head, size_t head_len, const char* data, size_t len) {
+    /*
+        This function sends a header (the WebSocket framing, or nothing) and data to the client in one call, under the lock of the session.
+        What the socket does not take is queued, and the event loop is told to send it when the socket is writable.
+        Output behind queued output is queued too, so the client receives everything in order.
+    */
+
+    if (c->hangup) return;
+    size_t sent = 0;
+    if (c->pending_len == 0) {
+        struct iovec iov[2] = { { (void*)head, head_len }, { (void*)data, len } };
+        ssize_t n = writev(c->fd, iov, 2);
+        atomic_fetch_add_explicit(&c->srv->sends, 1, memory_order_relaxed);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            c->hangup = 1;
+            notify(c);
+            return;
+        }
+        if (n > 0) sent = (size_t)n;
+    }
+    if (sent == head_len + len) return;
+    int queued = 1;
+    if (sent < head_len) {
+        queued = queue(c, head + sent, head_len - sent) && queue(c, data, len);
+    } else {
+        queued = queue(c, data + (sent - head_len), len - (sent - head_len));
+    }
+    if (!queued) c->hangup = 1;
+    notify(c);
+}
+
+static size_t frame_header(char* head, int opcode, size_t len) {
+    // the header of a final, unmasked WebSocket frame from the server
+    head[0] = (char)(0x80 | opcode);
+    if (len < 126) {
+        head[1] = (char)len;
+        return 2;
+    }
+    if (len < 65536) {
+        head[1] = 126;
+        head[2] = (char)(len >> 8);
+        head[3] = (char)len;
+        return 4;
+    }
+    head[1] = 127;
+    for (int i = 0; i < 8; ++i) head[2 + i] = (char)((uint64_t)len >> (56 - 8 * i));
+    return 10;
+}
+
+static void session_send(session* c, int opcode, const char* data, size_t len) {
+    // send data as one frame of a WebSocket client, or as it is to a raw one
+    char head[10];
+    size_t head_len = c->protocol == SESSION_WEBSOCKET ? frame_header(head, opcode, len) : 0;
+    mutex_lock(&c->lock);
+    send_locked(c, head, head_len, data, len);
+    mutex_unlock(&c->lock);
+}
+
+static void session_write(void* user, const char* buf, size_t n) {
+    // the console of a session: one flush of its output buffer is one send
+    session* c = user;
+    session_send(c, 2, buf, n);
+    atomic_fetch_add_explicit(&c->srv->bytes_out, n, memory_order_relaxed);
+}
+
+static void session_done(vm* vm, void* user) {
+    // the done hook of the scheduler: the session is the user of the console hook of its machine
+    session* c = vm->out.user;
+    mutex_lock(&c->lock);
+    c->retired = 1;
+    mutex_unlock(&c->lock);
+    notify(c);
+}
+
+/* Sessions, on the event loop */
+
+static void session_close(session* c) {
+    /*
+        This function ends a session whose machine is retired (or that never had one). The session is freed by server_reap,
+        after the events of the current wait: the ones after this call may still be for it.
+    */
+
+    server* srv = c->srv;
+    if (!c->gone) unwatch(srv, c->fd);
+    c->gone = 1;
+    c->closed = 1;
+    if (c->protocol == SESSION_DETECT || c->protocol == SESSION_HANDSHAKE) srv->detecting--;
+    if (c->prev) c->prev->next = c->next; else srv->sessions = c->next;
+    if (c->next) c->next->prev = c->prev;
+    srv->count--;
+    c->next = srv->closed;
+    srv->closed = c;
+}
+
+static void session_free(session* c) {
+    // free a closed session, and close its connection
+    server* srv = c->srv;
+    mutex_lock(&srv->notify_lock);
+    if (c->notified) {
+        session** p = &srv->notified;
+        while (*p != c) p = &(*p)->next_notify;
+        *p = c->next_notify;
+    }
+    mutex_unlock(&srv->notify_lock);
+
+    c->hangup = 1; // the last flush of vm_destroy is dropped
+    if (c->task) sched_remove(srv->s, c->task);
+    vm_destroy(c->vm);
+    close(c->fd);
+    mutex_destroy(&c->lock);
+    free(c->pending);
+    free(c->in);
+    free(c);
+}
+
+static void session_hangup(session* c) {
+    // let the connection go: its machine is cancelled, and the session is freed once the machine is retired
+    if (c->gone) return;
+    c->gone = 1;
+    unwatch(c->srv, c->fd);
+    mutex_lock(&c->lock);
+    c->hangup = 1;
+    mutex_unlock(&c->lock);
+    if (c->task) sched_cancel(c->srv->s, c->task); // calls session_done at once if the machine is parked
+    else session_close(c);
+}
+
+static int session_start(session* c, int protocol) {
+    // give the session its machine, forked from the image, once its protocol is known; 0 if there is not enough memory
+    server* srv = c->srv;
+    srv->detecting--;
+    c->protocol = protocol;
+    vm_io io = { NULL, NULL, session_write, c };
+    c->vm = vm_fork(srv->image, &io);
+    if (!c->vm) return 0;
+    c->task = sched_add(srv->s, c->vm, srv->o.limit);
+    return c->task != NULL;
+}
+
+static void session_keys(session* c, const char* keys, size_t n) {
+    if (n == 0) return;
+    c->active = clock_seconds();
+    c->evicted = 0; // the worker resumes it
+    sched_input(c->srv->s, c->task, keys, n);
+}
+
+static int session_buffer(session* c, const char* data, size_t n) {
+    // keep bytes that are not handled yet; 0 if there is not enough memory
+    if (c->in_len + n > c->in_cap) {
+        size_t cap = c->in_cap ? c->in_cap : 1024;
+        while (cap < c->in_len + n) cap *= 2;
+        char* in = realloc(c->in, cap + 1);
+        if (!in) return 0;
+        c->in = in;
+        c->in_cap = cap;
+    }
+    memcpy(c->in + c->in_len, data, n);
+    c->in_len += n;
+    c->in[c->in_len] = 0;
+    return 1;
+}
+
+static void session_consume(session* c, size_t n) {
+    memmove(c->in, c->in + n, c->in_len - n);
+    c->in_len -= n;
+}
+
+static int session_handshake(session* c) {
+    // answer the HTTP request of a WebSocket client once it is complete; 0 if the connection must be closed
+    char* end = strstr(c->in, "\r\n\r\n");
+    if (!end) return c->in_len <= SESSION_MAX_REQUEST;
+    char accept[29];
+    if (!websocket_accept(c->in, accept)) {
+        static const char reply[] = "HTTP/1.1 426 Upgrade Required\r\nUpgrade: websocket\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        session_send(c, 0, reply, sizeof(reply) - 1);
+        return 0;
+    }
+    char reply[160];
+    int n = snprintf(reply, sizeof(reply), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    session_send(c, 0, reply, n); // the protocol is still SESSION_HANDSHAKE: not framed
+    session_consume(c, end + 4 - c->in);
+    return session_start(c, SESSION_WEBSOCKET);
+}
+
+static int session_frames(session* c) {
+    /*
+        This function handles the complete WebSocket frames read from the client: the payload of the data frames are keys,
+        a ping is answered, and a close frame is echoed before the connection is closed.
+        It returns 0 if the connection must be closed.
+    */
+
+    while (c->in_len >= 2) {
+        uint8_t* p = (uint8_t*)c->in;
+        int opcode = p[0] & 15;
+        if (!(p[1] & 0x80)) return 0; // the frames of a client are masked
+        uint64_t len = p[1] & 127;
+        size_t head = 2;
+        if (len == 126) {
+            if (c->in_len < 4) return 1;
+            len = (uint64_t)p[2] << 8 | p[3];
+            head = 4;
+        } else if (len == 127) {
+            if (c->in_len < 10) return 1;
+            len = 0;
+            for (int i = 0; i < 8; ++i) len = len << 8 | p[2 + i];
+            head = 10;
+        }
+        if (len > SESSION_MAX_FRAME) return 0;
+        if (c->in_len < head + 4 + len) return 1;
+        uint8_t* mask = p + head;
+        char* payload = (char*)p + head + 4;
+        for (uint64_t i = 0; i < len; ++i) payload[i] ^= mask[i & 3];
+
+        if (opcode <= 2) {
+            session_keys(c, payload, (size_t)len);
+        } else if (opcode == 8) {
+            session_send(c, 8, payload, len >= 2 ? 2 : 0);
+            return 0;
+        } else if (opcode == 9) {
+            session_send(c, 10, payload, (size_t)len);
+        } else if (opcode != 10) {
+            return 0;
+        }
+        session_consume(c, head + 4 + (size_t)len);
+    }
+    return 1;
+}
+
+static int session_data(session* c, const char* data, size_t n) {
+    // handle bytes read from the client; 0 if the connection must be closed
+    if (c->protocol == SESSION_RAW) {
+        session_keys(c, data, n);
+        return 1;
+    }
+    if (!session_buffer(c, data, n)) return 0;
+    if (c->protocol == SESSION_DETECT) {
+        size_t k = c->in_len < 4 ? c->in_len : 4;
+        if (memcmp(c->in, "GET ", k) != 0) {
+            if (!session_start(c, SESSION_RAW)) return 0;
+            session_keys(c, c->in, c->in_len);
+            c->in_len = 0;
+            return 1;
+        }
+        if (k < 4) return 1;
+        c->protocol = SESSION_HANDSHAKE;
+    }
+    if (c->protocol == SESSION_HANDSHAKE && !session_handshake(c)) return 0;
+    return c->protocol != SESSION_WEBSOCKET || session_frames(c);
+}
+
+static void session_read(session* c) {
+    // read everything the client sent, until the socket would block
+    char buf[4096];
+    for (;;) {
+        ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            if (!session_data(c, buf, (size_t)n)) break;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n < 0 || c->ended || c->protocol == SESSION_HANDSHAKE || c->protocol == SESSION_WEBSOCKET) break;
+
+        // a raw client that shuts its side down ends the input, like the end of an --input file, and still gets the output
+        if (c->protocol == SESSION_DETECT) {
+            if (!session_start(c, SESSION_RAW)) break;
+            session_keys(c, c->in, c->in_len);
+            c->in_len = 0;
+        }
+        c->ended = 1;
+        sched_close_input(c->srv->s, c->task);
+        watch(c->srv, c->fd, c, 0, 0, c->writing);
+        return;
+    }
+    session_hangup(c); // the end of the connection, an error, or a protocol error
+}
+
+static void session_flush(session* c) {
+    /*
+        This function sends the queued output when the socket is writable, and frees a session whose machine is retired
+        once its output is sent: a halted program closes its connection.
+    */
+
+    mutex_lock(&c->lock);
+    while (c->pending_len && !c->hangup) {
+        ssize_t n = send(c->fd, c->pending, c->pending_len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->hangup = 1;
+            break;
+        }
+        memmove(c->pending, c->pending + n, c->pending_len - n);
+        c->pending_len -= n;
+    }
+    int writing = c->pending_len && !c->hangup;
+    int hold = c->pending_len >= SESSION_HOLD_BYTES;
+    int hangup = c->hangup;
+    int done = c->retired && (!writing || hangup);
+    mutex_unlock(&c->lock);
+
+    if (done) {
+        session_close(c);
+        return;
+    }
+    if (hangup) {
+        session_hangup(c);
+        return;
+    }
+    if (!c->gone && writing != c->writing) {
+        c->writing = writing;
+        watch(c->srv, c->fd, c, 0, !c->ended, writing);
+    }
+    if (c->task && hold != c->held) {
+        // the machine runs while the client keeps up; its output is not queued without bound
+        c->held = hold;
+        sched_hold(c->srv->s, c->task, hold);
+    }
+}
+
+static void session_retired(session* c) {
+    // the machine of a live connection halted, or reached its limit: a WebSocket client is sent a close frame first
+    if (!c->gone && c->protocol == SESSION_WEBSOCKET) {
+        static const char normal[2] = { 0x03, (char)0xE8 }; // status 1000
+        session_send(c, 8, normal, 2);
+    }
+    session_flush(c);
+}
+
+/* The event loop */
+
+static void server_accept(server* srv) {
+    // accept the waiting connections
+    for (;;) {
+        int fd = accept(srv->listener, NULL, NULL);
+        if (fd < 0) return;
+        if (srv->count >= srv->o.max_sessions) {
+            srv->stats.refused++;
+            close(fd);
+            continue;
+        }
+        session* c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)); // the flushes are already batched
+        c->srv = srv;
+        c->fd = fd;
+        c->id = srv->next_id++;
+        c->opened = c->active = clock_seconds();
+        mutex_init(&c->lock);
+        c->next = srv->sessions;
+        if (srv->sessions) srv->sessions->prev = c;
+        srv->sessions = c;
+        srv->count++;
+        srv->detecting++;
+        srv->stats.sessions++;
+        if (srv->count > srv->stats.peak) srv->stats.peak = srv->count;
+        watch(srv, fd, c, 1, 1, 0);
+    }
+}
+
+static void server_notified(server* srv) {
+    // handle the news from the workers
+    char buf[256];
+    while (read(srv->wake[0], buf, sizeof(buf)) > 0);
+    mutex_lock(&srv->notify_lock);
+    session* list = srv->notified;
+    srv->notified = NULL;
+    for (session* c = list; c; c = c->next_notify) c->notified = 0;
+    mutex_unlock(&srv->notify_lock);
+
+    while (list) {
+        session* c = list;
+        list = list->next_notify;
+        if (c->closed) continue;
+        mutex_lock(&c->lock);
+        int retired = c->retired;
+        mutex_unlock(&c->lock);
+        if (retired) session_retired(c);
+        else session_flush(c);
+    }
+}
+
+static void server_tick(server* srv, double now) {
+    // start the raw sessions that sent nothing, and evict the idle ones
+    for (session* c = srv->sessions, *next; c; c = next) {
+        next = c->next;
+        if (c->protocol == SESSION_DETECT && now - c->opened >= SERVER_DETECT_MS / 1e3) {
+            if (!session_start(c, SESSION_RAW)) session_hangup(c);
+        } else if (c->protocol == SESSION_HANDSHAKE && now - c->opened >= SERVER_HANDSHAKE_SECONDS) {
+            session_hangup(c);
+        } else if (srv->o.evict_after > 0 && c->task && !c->evicted && !c->gone && now - c->active >= srv->o.evict_after) {
+            char path[sizeof(srv->checkpoint_dir) + 32];
+            snprintf(path, sizeof(path), "%s/session-%d.ckpt", srv->checkpoint_dir, c->id);
+            if (sched_evict(srv->s, c->task, srv->base, path)) {
+                c->evicted = 1;
+                srv->stats.evictions++;
+            } else {
+                c->active = now; // running: try again later
+            }
+        }
+    }
+}
+
+static void server_reap(server* srv) {
+    while (srv->closed) {
+        session* c = srv->closed;
+        srv->closed = c->next;
+        session_free(c);
+    }
+}
+
+static THREAD_FUNC serve_main(void* arg) {
+    server* srv = arg;
+    sched_serve(srv->s, &srv->sched_stats);
+    return THREAD_RETURN;
+}
+
+static int open_listener(const server_options* o) {
+    // the listening socket, exits if it can't be opened
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("failed to open a socket\n");
+        exit(1);
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)o->port);
+    if (o->address && inet_pton(AF_INET, o->address, &address.sin_addr) != 1) {
+        printf("invalid address: %s\n", o->address);
+        exit(2);
+    }
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        printf("failed to listen on port %d\n", o->port);
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void server_run(vm* image, const server_options* o, server_stats* stats) {
+    /*
+        This function serves sessions of the program loaded in image on the TCP port of o, until server_stop is called
+        (from a signal handler, or another thread). The totals of the run are stored in stats if it is not NULL.
+        It exits if the port can't be listened on.
+    */
+
+    server* srv = calloc(1, sizeof(*srv));
+    if (!srv) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    srv->image = image;
+    srv->o = *o;
+    if (srv->o.max_sessions <= 0) srv->o.max_sessions = 1 << 30;
+    if (srv->o.evict_after > 0) {
+        /*
+            The checkpoint files go in a directory that only this user can enter (mkdtemp makes it with mode 0700),
+            so no other user can guess their names and put a link in their place, or read the memory of a session.
+        */
+        const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        snprintf(srv->checkpoint_dir, sizeof(srv->checkpoint_dir), "%s/lc3-server-XXXXXX", tmp);
+        if (!mkdtemp(srv->checkpoint_dir)) {
+            printf("failed to create a checkpoint directory in %s\n", tmp);
+            exit(1);
+        }
+    }
+    srv->listener = open_listener(o);
+    srv->s = sched_create(o->workers);
+    srv->base = o->evict_after > 0 ? vm_snapshot_take(image) : NULL;
+    if (!srv->s || (o->evict_after > 0 && !srv->base) || pipe(srv->wake) != 0) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    fcntl(srv->wake[0], F_SETFL, fcntl(srv->wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(srv->wake[1], F_SETFL, fcntl(srv->wake[1], F_GETFL) | O_NONBLOCK);
+    mutex_init(&srv->notify_lock);
+    sched_on_done(srv->s, session_done, srv);
+    signal(SIGPIPE, SIG_IGN); // a client that is gone is seen by the failing send
+#ifdef SERVER_EPOLL
+    srv->epoll = epoll_create1(0);
+    if (srv->epoll < 0) {
+        printf("failed to create an epoll instance\n");
+        exit(1);
+    }
+#endif
+    watch(srv, srv->listener, &listener_event, 1, 1, 0);
+    watch(srv, srv->wake[0], &wake_event, 1, 1, 0);
+    stop_requested = 0;
+    stop_pipe = srv->wake[1];
+    thread_start(&srv->thread, serve_main, srv);
+
+    server_event events[SERVER_EVENTS];
+    double tick = clock_seconds();
+    while (!stop_requested) {
+        int n = wait_events(srv, events, SERVER_EVENTS, srv->detecting ? SERVER_DETECT_MS / 4 : 1000);
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data == &listener_event) {
+                server_accept(srv);
+            } else if (events[i].data == &wake_event) {
+                server_notified(srv);
+            } else {
+                session* c = events[i].data; // not freed before server_reap
+
+                if (c->gone) continue;
+                if (events[i].readable || events[i].failed) session_read(c);
+                if (!c->gone && events[i].writable) session_flush(c);
+            }
+        }
+        double now = clock_seconds();
+        if (srv->detecting || now - tick >= 1) {
+            server_tick(srv, now);
+            tick = now;
+        }
+        server_reap(srv);
+    }
+
+    // stop the workers, then free the sessions: no machine is running any more
+    stop_pipe = -1;
+    sched_stop(srv->s);
+    thread_join(srv->thread);
+    while (srv->sessions) session_close(srv->sessions);
+    server_reap(srv);
+    if (stats) {
+        *stats = srv->stats;
+        stats->sends = atomic_load(&srv->sends);
+        stats->bytes_out = atomic_load(&srv->bytes_out);
+    }
+    sched_destroy(srv->s); // removes the checkpoint files of the machines still evicted
+    if (srv->checkpoint_dir[0]) rmdir(srv->checkpoint_dir);
+    vm_snapshot_free(srv->base);
+    close(srv->listener);
+    close(srv->wake[0]);
+    close(srv->wake[1]);
+#ifdef SERVER_EPOLL
+    close(srv->epoll);
+#else
+    free(srv->polls);
+    free(srv->polled);
+#endif
+    mutex_destroy(&srv->notify_lock);
+    free(srv);
+}
+
+#else
+
+void server_run(vm* image, const server_options* o, server_stats* stats) {
+    printf("the server is not available on this system\n");
+    exit(1);
+}
+
+void server_stop() {
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    The server hosts many sessions of one program in a single process: every TCP connection gets its own machine,
+    forked from the loaded image (its pages are shared copy-on-write, see snapshot.h), and runs on the scheduler (sched.h).
+
+    One thread runs the event loop (epoll on Linux, poll elsewhere): it accepts the connections, reads what the clients send
+    and gives it to the machines as keys (sched_input), and ends the machines of the clients that disconnect.
+    The scheduler workers run the machines; the console output of a machine is written to its socket by the worker
+    when the output buffer is flushed, in one send per flush (see output.h). Output a slow client can't take yet is queued
+    for the event loop, which sends it when the socket is writable, and holds the machine back while 64 KB are queued.
+
+    A client speaks raw TCP (its bytes are the keys, e.g. socat -,raw,echo=0 tcp:localhost:PORT), or WebSocket:
+    a connection that starts with an HTTP GET is upgraded, the data frames it sends are the keys,
+    and every flush of the output is sent as one binary frame. A connection that sends nothing in its first 200 ms is raw.
+
+    A session whose machine halts is closed once its output is sent. A session parked on input for evict_after seconds
+    is evicted: its machine is hibernated to a checkpoint file (see checkpoint.h) until the client types again,
+    so idle sessions hold almost no memory.
+*/
+
+typedef struct
+{
+    const char* address;    // IPv4 address to listen on, NULL for the local host
+    int port;
+    int workers;            // scheduler workers, 0 for one per core
+    int max_sessions;       // connections accepted at once, the next ones are turned away
+    double evict_after;     // seconds a session is parked before it is evicted, 0 to keep every machine in memory
+    uint64_t limit;         // instructions after which a session is ended, 0 for no limit
+} server_options;
+
+// The totals of one run of the server
+typedef struct
+{
+    uint64_t sessions;      // connections accepted
+    uint64_t refused;       // connections turned away because max_sessions were open
+    uint64_t evictions;     // sessions hibernated to a checkpoint file
+    uint64_t sends;         // send calls for the output of the machines
+    uint64_t bytes_out;     // output bytes written by the machines, without the WebSocket framing
+    int peak;               // most sessions open at once
+} server_stats;
+
+void server_run(vm* image, const server_options* o, server_stats* stats);
+void server_stop();
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "vm.h"
+
+vm_snapshot* vm_snapshot_take(vm* vm) {
+    /*
+        This function takes a snapshot of a machine that is not running.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm_snapshot* snapshot = malloc(sizeof(*snapshot));
+    if (!snapshot) return NULL;
+    for (int i = 0; i < VM_PAGES; ++i) {
+        snapshot->pages[i] = vm->pages[i];
+        atomic_fetch_add_explicit(&vm->pages[i]->refs, 1, memory_order_relaxed);
+    }
+    memcpy(snapshot->reg, vm->reg, sizeof(snapshot->reg));
+    snapshot->psr = vm->psr;
+    snapshot->saved_usp = vm->saved_usp;
+    snapshot->saved_ssp = vm->saved_ssp;
+    snapshot->running = vm->running;
+    snapshot->illegal = vm->illegal;
+    snapshot->instructions = vm->instructions;
+    return snapshot;
+}
+
+void vm_snapshot_restore(vm* vm, const vm_snapshot* snapshot) {
+    /*
+        This function puts a machine that is not running back into the state of a snapshot.
+        Only the pages that differ from the snapshot are swapped, and only their decoded instructions and compiled code are dropped.
+        The snapshot can be restored again later.
+    */
+
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm_set_page(vm, i, snapshot->pages[i]);
+    }
+    memcpy(vm->reg, snapshot->reg, sizeof(vm->reg));
+    vm->psr = snapshot->psr;
+    vm->saved_usp = snapshot->saved_usp;
+    vm->saved_ssp = snapshot->saved_ssp;
+    vm->running = snapshot->running;
+    vm->illegal = snapshot->illegal;
+    vm->instructions = snapshot->instructions;
+}
+
+void vm_snapshot_free(vm_snapshot* snapshot) {
+    if (!snapshot) return;
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm_page_release(snapshot->pages[i]);
+    }
+    free(snapshot);
+}
+
+vm* vm_fork_snapshot(const vm_snapshot* snapshot, const vm_io* io) {
+    /*
+        This function creates a machine in the state of a snapshot, with its keyboard and console connected to the I/O hooks.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm* child = vm_create(io);
+    if (!child) return NULL;
+    vm_snapshot_restore(child, snapshot);
+    return child;
+}
+
+vm* vm_fork(vm* parent, const vm_io* io) {
+    /*
+        This function creates a machine in the state of a machine that is not running.
+        The new machine uses the same engine, flush policy, devices and routine checking (see routine.h), and its keyboard and console are connected to the I/O hooks.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm* child = vm_create(io);
+    if (!child) return NULL;
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm_set_page(child, i, parent->pages[i]);
+    }
+    memcpy(child->reg, parent->reg, sizeof(child->reg));
+    child->psr = parent->psr;
+    child->saved_usp = parent->saved_usp;
+    child->saved_ssp = parent->saved_ssp;
+    child->running = parent->running;
+    child->illegal = parent->illegal;
+    child->instructions = parent->instructions;
+    child->engine = parent->engine;
+    child->check_routines = parent->check_routines;
+    child->out.policy = parent->out.policy;
+    child->out.threshold = parent->out.threshold;
+    memcpy(child->devices, parent->devices, sizeof(child->devices));
+    child->device_count = parent->device_count;
+    return child;
+}
@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+/*
+    Snapshots and forks of machines.
+    A snapshot is the state of a machine at one point: its registers and its memory pages.
+    Taking a snapshot does not copy the memory: the snapshot shares the pages of the machine,
+    and the machine copies a page the first time it writes to it afterwards (copy-on-write, see vm_page).
+    A fork is a new machine that starts from the state of another one and shares its pages in the same way,
+    so a fork costs a page table and grows by one page for every page it writes.
+*/
+
+typedef struct
+{
+    vm_page* pages[VM_PAGES];
+    uint16_t reg[R_COUNT];
+    uint16_t psr, saved_usp, saved_ssp;
+    int running;
+    int illegal;
+    uint64_t instructions;
+} vm_snapshot;
+
+vm_snapshot* vm_snapshot_take(vm* vm);
+void vm_snapshot_restore(vm* vm, const vm_snapshot* snapshot);
+void vm_snapshot_free(vm_snapshot* snapshot);
+vm* vm_fork(vm* parent, const vm_io* io);
+vm* vm_fork_snapshot(const vm_snapshot* snapshot, const vm_io* io);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+/*
+    The threads, locks and condition variables used by the keyboard reader (input.c), the scheduler (sched.c) and the background writers of traces and metrics.
+    The Windows or POSIX version is selected when compiling.
+*/
+
+#ifdef _WIN32
+#include <Windows.h>
+typedef CRITICAL_SECTION thread_mutex;
+typedef CONDITION_VARIABLE thread_cond;
+typedef HANDLE thread_handle;
+#define THREAD_FUNC DWORD WINAPI
+#define THREAD_RETURN 0
+#define mutex_init(m) InitializeCriticalSection(m)
+#define mutex_destroy(m) DeleteCriticalSection(m)
+#define mutex_lock(m) EnterCriticalSection(m)
+#define mutex_unlock(m) LeaveCriticalSection(m)
+#define cond_init(c) InitializeConditionVariable(c)
+#define cond_destroy(c) ((void)(c))
+#define cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define cond_signal(c) WakeConditionVariable(c)
+#define cond_broadcast(c) WakeAllConditionVariable(c)
+#define thread_start(t, fn, arg) (*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL))
+#define thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+#define thread_detach(t) CloseHandle(t)
+#define thread_sleep_ms(ms) Sleep(ms)
+
+static inline int thread_cpu_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_mutex_t thread_mutex;
+typedef pthread_cond_t thread_cond;
+typedef pthread_t thread_handle;
+#define THREAD_FUNC void*
+#define THREAD_RETURN NULL
+#define mutex_init(m) pthread_mutex_init(m, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(m)
+#define mutex_lock(m) pthread_mutex_lock(m)
+#define mutex_unlock(m) pthread_mutex_unlock(m)
+#define cond_init(c) pthread_cond_init(c, NULL)
+#define cond_destroy(c) pthread_cond_destroy(c)
+#define cond_wait(c, m) pthread_cond_wait(c, m)
+#define cond_signal(c) pthread_cond_signal(c)
+#define cond_broadcast(c) pthread_cond_broadcast(c)
+#define thread_start(t, fn, arg) pthread_create(t, NULL, fn, arg)
+#define thread_join(t) pthread_join(t, NULL)
+#define thread_detach(t) pthread_detach(t)
+#define thread_sleep_ms(ms) usleep((ms) * 1000)
+
+static inline int thread_cpu_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "trace.h"
+
+// Size of the buffer the compressed records are written from
+#define TRACE_OUT_SIZE (1 << 16)
+// Number of records encoded at a time
+#define TRACE_CHUNK 4096
+
+// trace_encode and trace_decode see a record as six 16-bit words
+_Static_assert(sizeof(trace_record) == 12, "trace_record has padding");
+
+void trace_model_init(trace_model* m) {
+    // nothing was seen yet: every PC is predicted to be followed by the next address, and the first record at a PC to be all zeros
+    memset(m->last, 0, sizeof(m->last));
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a) m->next[a] = (uint16_t)(a + 1);
+    m->pc = 0xFFFF;
+}
+
+size_t trace_encode(trace_model* m, const trace_record* records, size_t count, unsigned char* out) {
+    // encode count records into out, which has room for TRACE_ENCODED_MAX bytes per record, and return the bytes written
+    unsigned char* p = out;
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t words[6], seen[6];
+        memcpy(words, &records[i], sizeof(words));
+        memcpy(seen, &m->last[records[i].pc], sizeof(seen));
+        unsigned char* mask = p++;
+        *mask = 0;
+        if (words[0] != m->next[m->pc]) {
+            *mask = 1;
+            memcpy(p, &words[0], 2);
+            p += 2;
+            m->next[m->pc] = words[0];
+        }
+        for (int k = 1; k < 6; ++k) {
+            if (words[k] == seen[k]) continue;
+            *mask |= 1 << k;
+            memcpy(p, &words[k], 2);
+            p += 2;
+        }
+        m->last[records[i].pc] = records[i];
+        m->pc = words[0];
+    }
+    return p - out;
+}
+
+size_t trace_decode(trace_model* m, const unsigned char* in, size_t size, trace_record* records, size_t count, size_t* used) {
+    /*
+        This function decodes at most count records from the size bytes of in, and returns the number of records decoded.
+        used is set to the bytes they took: the bytes after them start a record that is not whole yet, or are left for the next call.
+    */
+
+    const unsigned char* p = in;
+    const unsigned char* end = in + size;
+    size_t n = 0;
+    while (n < count && p < end) {
+        unsigned char mask = *p;
+        size_t length = 1;
+        for (int k = 0; k < 6; ++k) length += (mask >> k & 1) * 2;
+        if ((size_t)(end - p) < length) break;
+        ++p;
+        uint16_t words[6];
+        uint16_t pc = m->next[m->pc];
+        if (mask & 1) {
+            memcpy(&pc, p, 2);
+            p += 2;
+            m->next[m->pc] = pc;
+        }
+        memcpy(words, &m->last[pc], sizeof(words));
+        words[0] = pc;
+        for (int k = 1; k < 6; ++k) {
+            if (!(mask >> k & 1)) continue;
+            memcpy(&words[k], p, 2);
+            p += 2;
+        }
+        memcpy(&records[n], words, sizeof(words));
+        m->last[pc] = records[n++];
+        m->pc = pc;
+    }
+    *used = p - in;
+    return n;
+}
+
+/*
+    The background thread of a trace.
+    It takes the published records from the ring, one or two runs of records at a time (before and after its end),
+    and gives them back to the engine once they are encoded.
+*/
+
+typedef struct trace_writer
+{
+    vm_trace* t;
+    trace_model model;
+    unsigned char encoded[TRACE_CHUNK * TRACE_ENCODED_MAX];
+#ifdef HAVE_ZLIB
+    z_stream z;
+    unsigned char out[TRACE_OUT_SIZE];
+#endif
+} trace_writer;
+
+static void write_out(trace_writer* w, const void* data, size_t size) {
+    // after a failed write, the records are still taken from the ring (and dropped), so the machine keeps running
+    if (!w->t->failed && fwrite(data, 1, size, w->t->file) != size) w->t->failed = 1;
+}
+
+static void write_bytes(trace_writer* w, const unsigned char* data, size_t size, int finish) {
+    // compress encoded records, or write them as they are
+#ifdef HAVE_ZLIB
+    w->z.next_in = (unsigned char*)data;
+    w->z.avail_in = (unsigned)size;
+    int status;
+    do {
+        w->z.next_out = w->out;
+        w->z.avail_out = TRACE_OUT_SIZE;
+        status = deflate(&w->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        write_out(w, w->out, TRACE_OUT_SIZE - w->z.avail_out);
+    } while (w->z.avail_in || (finish && status != Z_STREAM_END) || (!finish && !w->z.avail_out));
+#else
+    write_out(w, data, size);
+#endif
+}
+
+static void write_records(trace_writer* w, const trace_record* records, size_t count) {
+    for (size_t i = 0; i < count; i += TRACE_CHUNK) {
+        size_t n = count - i < TRACE_CHUNK ? count - i : TRACE_CHUNK;
+        write_bytes(w, w->encoded, trace_encode(&w->model, records + i, n, w->encoded), 0);
+    }
+}
+
+static THREAD_FUNC trace_thread(void* arg) {
+    trace_writer* w = arg;
+    vm_trace* t = w->t;
+    size_t pos = 0;
+    for (;;) {
+        size_t end = atomic_load_explicit(&t->published, memory_order_acquire);
+        if (end == pos) {
+            // nothing to take: sleep until trace_publish or trace_close, which wake the thread when reader_waits is set
+            mutex_lock(&t->lock);
+            atomic_store(&t->reader_waits, 1);
+            while ((end = atomic_load(&t->published)) == pos && !t->closing) cond_wait(&t->data, &t->lock);
+            atomic_store(&t->reader_waits, 0);
+            int done = end == pos;
+            mutex_unlock(&t->lock);
+            if (done) break;
+        }
+        while (pos < end) {
+            size_t at = pos & (TRACE_RING - 1);
+            size_t count = end - pos < TRACE_RING - at ? end - pos : TRACE_RING - at;
+            write_records(w, t->ring + at, count);
+            pos += count;
+            atomic_store(&t->taken, pos);
+            if (atomic_load(&t->writer_waits)) {
+                mutex_lock(&t->lock);
+                cond_signal(&t->room);
+                mutex_unlock(&t->lock);
+            }
+        }
+    }
+    write_bytes(w, w->encoded, 0, 1);
+    return THREAD_RETURN;
+}
+
+vm_trace* trace_open(const char* path, uint64_t start) {
+    /*
+        This function creates the trace file path, writes its header, and starts the background thread of the trace.
+        start is the instruction count of the machine the trace is for, before its first record.
+        It returns NULL if the file can't be created, or if there is not enough memory.
+    */
+
+    vm_trace* t = calloc(1, sizeof(*t));
+    trace_writer* w = calloc(1, sizeof(*w));
+    if (!t || !w || !(t->ring = malloc(TRACE_RING * sizeof(trace_record)))) goto fail;
+    if (!(t->file = fopen(path, "wb"))) goto fail;
+    w->t = t;
+    trace_model_init(&w->model);
+#ifdef HAVE_ZLIB
+    if (deflateInit(&w->z, Z_BEST_SPEED) != Z_OK) goto fail;
+#endif
+
+    trace_header header = { TRACE_MAGIC, TRACE_BYTE_ORDER, sizeof(trace_record), TRACE_RAW, 0, start };
+#ifdef HAVE_ZLIB
+    header.compression = TRACE_ZLIB;
+#endif
+    if (fwrite(&header, sizeof(header), 1, t->file) != 1) goto fail;
+
+    t->limit = TRACE_RING;
+    atomic_init(&t->published, 0);
+    atomic_init(&t->taken, 0);
+    atomic_init(&t->writer_waits, 0);
+    atomic_init(&t->reader_waits, 0);
+    mutex_init(&t->lock);
+    cond_init(&t->room);
+    cond_init(&t->data);
+    thread_start(&t->thread, trace_thread, w);
+    t->writer = w;
+    return t;
+
+fail:
+    if (t && t->file) fclose(t->file);
+    if (t) free(t->ring);
+    free(t);
+    free(w);
+    return NULL;
+}
+
+void trace_publish(vm_trace* t) {
+    // hand the records written so far to the background thread
+    atomic_store(&t->published, t->head);
+    if (atomic_load(&t->reader_waits)) {
+        mutex_lock(&t->lock);
+        cond_signal(&t->data);
+        mutex_unlock(&t->lock);
+    }
+}
+
+void trace_wait_room(vm_trace* t) {
+    /*
+        This function is called by the engine when head reached limit: it waits until the background thread
+        took records from the ring, if the ring is full, and moves limit to the end of the free slots.
+    */
+
+    trace_publish(t);
+    if (t->head - atomic_load(&t->taken) == TRACE_RING) {
+        mutex_lock(&t->lock);
+        atomic_store(&t->writer_waits, 1);
+        while (t->head - atomic_load(&t->taken) == TRACE_RING) cond_wait(&t->room, &t->lock);
+        atomic_store(&t->writer_waits, 0);
+        mutex_unlock(&t->lock);
+    }
+    t->limit = atomic_load(&t->taken) + TRACE_RING;
+}
+
+int trace_close(vm_trace* t) {
+    /*
+        This function writes the records that are left to the trace file, stops the background thread, closes the file and frees the trace.
+        The machine must not use the trace anymore (vm->trace set to NULL).
+        It returns 0 if the file could not be written entirely.
+    */
+
+    if (!t) return 1;
+    trace_publish(t);
+    mutex_lock(&t->lock);
+    t->closing = 1;
+    cond_signal(&t->data);
+    mutex_unlock(&t->lock);
+    thread_join(t->thread);
+
+    trace_writer* w = t->writer;
+#ifdef HAVE_ZLIB
+    deflateEnd(&w->z);
+#endif
+    int ok = !t->failed;
+    if (fclose(t->file) != 0) ok = 0;
+    mutex_destroy(&t->lock);
+    cond_destroy(&t->room);
+    cond_destroy(&t->data);
+    free(t->ring);
+    free(w);
+    free(t);
+    return ok;
+}
@@ -0,0 +1,134 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "lc3.h"
+#include "thread.h"
+
+/*
+    Execution traces: a record of every instruction a machine executes, with the register it changed and the memory word it read or wrote.
+    A machine is traced when its trace is set (vm->trace): vm_run then uses the traced engine, a loop that executes one instruction
+    at a time and records it. The other engines have no tracing code, like with the profiler (see profile.h).
+
+    The engine writes the records to a ring buffer in memory, with plain stores, and publishes them every TRACE_PUBLISH records
+    with a single atomic store. A background thread takes them from the ring, encodes them (see trace_model), compresses them with zlib
+    (when the library was built with it, see make ZLIB=0) and writes them to the trace file, so the machine never waits for the disk
+    unless the ring is full. The ring has a single writer, the thread that runs the machine, and a single reader, the background thread:
+    they only share the two positions in the ring, and sleep on a condition variable only when the ring is full or empty.
+
+    lc3trace (tracedump.c) decodes a trace file and prints its records as text, with the disassembly of every instruction.
+*/
+
+// Number of records in the ring buffer, a power of 2
+#define TRACE_RING (1 << 16)
+// Number of records the engine writes before it publishes them to the background thread
+#define TRACE_PUBLISH 1024
+
+// The memory access of a record
+enum
+{
+    TRACE_NONE = 0,  // the instruction read or wrote no memory (the traps are not recorded as accesses)
+    TRACE_LOAD,      // LD, LDR or LDI read data at address (the final read of LDI, not its pointer)
+    TRACE_STORE      // ST, STR or STI wrote data at address
+};
+
+// The register of a record that no register changed
+#define TRACE_NO_REG 0xFF
+
+typedef struct
+{
+    uint16_t pc;      // the address of the instruction
+    uint16_t instr;   // the instruction
+    uint16_t value;   // the new value of reg
+    uint16_t address; // the address of the memory access
+    uint16_t data;    // the word it read or wrote
+    uint8_t reg;      // the lowest of R0 to R7 the instruction changed, TRACE_NO_REG if none
+    uint8_t access;   // TRACE_NONE, TRACE_LOAD or TRACE_STORE
+} trace_record;
+
+/*
+    The records are encoded against what the previous ones predict, since a program runs the same instructions again and again:
+    the PC of a record is predicted to be the one that followed the PC of the previous record the last time it ran
+    (the next address at first), and its other fields to be those of the last record at the same PC.
+    An encoded record is a byte whose bit 0 is set when the PC is not the predicted one, and whose bit k (1 to 5) is set
+    when the k-th 16-bit word of the record (instr, value, address, data, then reg and access) is not the predicted one,
+    followed by those words: a loop costs 2 or 3 bytes per instruction instead of sizeof(trace_record).
+    The background thread encodes the records, and trace_decode turns them back into records.
+*/
+
+// The most bytes of an encoded record: the byte and the six words
+#define TRACE_ENCODED_MAX (1 + sizeof(trace_record))
+
+typedef struct
+{
+    trace_record last[MEMORY_MAX]; // the last record at every PC
+    uint16_t next[MEMORY_MAX];     // the PC that followed every PC the last time
+    uint16_t pc;                   // the PC of the previous record
+} trace_model;
+
+void trace_model_init(trace_model* m);
+size_t trace_encode(trace_model* m, const trace_record* records, size_t count, unsigned char* out);
+size_t trace_decode(trace_model* m, const unsigned char* in, size_t size, trace_record* records, size_t count, size_t* used);
+
+/*
+    A trace file holds a header, then the encoded records in the byte order of the host that wrote it (like a recording, see replay.h),
+    compressed as a single zlib stream when compression is TRACE_ZLIB.
+    The first record is the instruction after the first start instructions of the machine.
+*/
+#define TRACE_MAGIC "LC3TRACE"
+#define TRACE_BYTE_ORDER 0x0102
+
+// The compressions of a trace file
+enum
+{
+    TRACE_RAW = 0,
+    TRACE_ZLIB
+};
+
+typedef struct
+{
+    char magic[8];        // TRACE_MAGIC
+    uint16_t byte_order;  // TRACE_BYTE_ORDER, in the byte order of the host that wrote the file
+    uint16_t record_size; // sizeof(trace_record)
+    uint16_t compression; // TRACE_RAW or TRACE_ZLIB
+    uint16_t reserved;
+    uint64_t start;       // the instruction count of the machine before the first record
+} trace_header;
+
+typedef struct vm_trace
+{
+    trace_record* ring;      // TRACE_RING records
+    size_t head;             // the records written by the engine, not all published yet
+    size_t limit;            // head can grow up to limit before the engine looks at how far the background thread is
+    atomic_size_t published; // the records the background thread can take
+    atomic_size_t taken;     // the records the background thread has written to the file
+    atomic_int writer_waits; // the engine sleeps until the ring has room
+    atomic_int reader_waits; // the background thread sleeps until records are published
+    int closing;             // set by trace_close, under the lock
+    int failed;              // the background thread could not write the file
+    FILE* file;
+    thread_mutex lock;
+    thread_cond room, data;
+    thread_handle thread;
+    struct trace_writer* writer; // the state of the background thread (trace.c)
+} vm_trace;
+
+vm_trace* trace_open(const char* path, uint64_t start);
+int trace_close(vm_trace* t);
+void trace_publish(vm_trace* t);
+void trace_wait_room(vm_trace* t);
+
+static inline trace_record* trace_next(vm_trace* t) {
+    // the slot of the next record, which the engine fills before calling trace_commit
+    if (t->head == t->limit) trace_wait_room(t);
+    return &t->ring[t->head & (TRACE_RING - 1)];
+}
+
+static inline void trace_commit(vm_trace* t) {
+    if (++t->head % TRACE_PUBLISH == 0) trace_publish(t);
+}
+
+#endif
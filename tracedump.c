@@ -0,0 +1,182 @@
+/*
+    The decoder of execution traces (see trace.h): it reads a trace file written by ./main --trace and prints its records as text,
+    one line per instruction with its instruction count, its address, the instruction and its disassembly,
+    the register it changed with its new value, and the memory word it loaded or stored:
+                 105  x3004  x6040  LDR R0, R1, #0          R0=x0048  load  [x4000]=x0048
+    --first=N skips the records before instruction count N, --count=N prints at most N records,
+    and --pc=ADDR only prints the instructions at address ADDR (hexadecimal).
+
+    Usage: lc3trace [--first=INSTRUCTIONS] [--count=RECORDS] [--pc=ADDR] trace-file
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "lc3.h"
+#include "trace.h"
+#include "debug.h"
+
+// Number of records decoded and printed at a time
+#define DUMP_RECORDS 4096
+
+typedef struct
+{
+    uint64_t first;  // the first instruction count printed
+    uint64_t count;  // the most records printed, 0 for all
+    int pc;          // the only address printed, -1 for all
+    uint64_t next;   // the instruction count of the next record
+    uint64_t printed;
+} dump_filter;
+
+static void print_record(const trace_record* r, uint64_t instruction) {
+    char text[32];
+    char changed[16] = "";
+    char memory[32] = "";
+    debug_disassemble(r->pc, r->instr, text, sizeof(text));
+    if (r->reg != TRACE_NO_REG) snprintf(changed, sizeof(changed), "R%d=x%04X", r->reg, r->value);
+    if (r->access != TRACE_NONE) {
+        snprintf(memory, sizeof(memory), "%-5s [x%04X]=x%04X", r->access == TRACE_LOAD ? "load" : "store", r->address, r->data);
+    }
+    printf("%20llu  x%04X  x%04X  %-22s %-9s %s\n", (unsigned long long)instruction, r->pc, r->instr, text, changed, memory);
+}
+
+static int dump_records(dump_filter* f, const trace_record* records, size_t n) {
+    // print the records that pass the filter, and return 0 once --count records were printed
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t instruction = ++f->next;
+        if (instruction < f->first || (f->pc >= 0 && records[i].pc != f->pc)) continue;
+        print_record(&records[i], instruction);
+        if (++f->printed == f->count) return 0;
+    }
+    return 1;
+}
+
+static int dump_bytes(dump_filter* f, trace_model* m, unsigned char* bytes, size_t* have) {
+    /*
+        This function decodes and prints the records of the have bytes of bytes, and moves the bytes of a record
+        that is not whole yet to the start of bytes, with have set to their number. It returns 0 once --count records were printed.
+    */
+
+    static trace_record records[DUMP_RECORDS];
+    size_t pos = 0;
+    for (;;) {
+        size_t used;
+        size_t n = trace_decode(m, bytes + pos, *have - pos, records, DUMP_RECORDS, &used);
+        pos += used;
+        if (!n) break;
+        if (!dump_records(f, records, n)) return 0;
+    }
+    *have -= pos;
+    memmove(bytes, bytes + pos, *have);
+    return 1;
+}
+
+// Size of the buffer of encoded records, which also holds the start of a record that is not whole yet
+#define DUMP_BYTES (1 << 16)
+
+static int dump_raw(FILE* file, dump_filter* f, trace_model* m) {
+    // the records of an uncompressed trace; it returns 0 if the file ends in the middle of a record
+    static unsigned char bytes[DUMP_BYTES];
+    size_t have = 0, n;
+    while ((n = fread(bytes + have, 1, DUMP_BYTES - have, file)) > 0) {
+        have += n;
+        if (!dump_bytes(f, m, bytes, &have)) return 1;
+    }
+    return have == 0;
+}
+
+#ifdef HAVE_ZLIB
+static int dump_zlib(FILE* file, dump_filter* f, trace_model* m) {
+    // the records of a compressed trace; it returns 0 if the stream is damaged or ends early (a traced program that was killed)
+    static unsigned char in[1 << 16];
+    static unsigned char bytes[DUMP_BYTES];
+    z_stream z = { 0 };
+    if (inflateInit(&z) != Z_OK) return 0;
+    int status = Z_OK;
+    size_t have = 0;
+    while (status == Z_OK) {
+        if (!z.avail_in) {
+            z.avail_in = (unsigned)fread(in, 1, sizeof(in), file);
+            z.next_in = in;
+            if (!z.avail_in) break;
+        }
+        z.next_out = bytes + have;
+        z.avail_out = (unsigned)(DUMP_BYTES - have);
+        status = inflate(&z, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) break;
+        have = DUMP_BYTES - z.avail_out;
+        if (!dump_bytes(f, m, bytes, &have)) {
+            inflateEnd(&z);
+            return 1;
+        }
+    }
+    inflateEnd(&z);
+    return status == Z_STREAM_END && have == 0;
+}
+#endif
+
+int main(int argc, const char* argv[]) {
+    dump_filter f = { 0, 0, -1, 0, 0 };
+    const char* path = NULL;
+    for (int j = 1; j < argc; ++j) {
+        if (strncmp(argv[j], "--first=", 8) == 0) {
+            f.first = strtoull(argv[j] + 8, NULL, 10);
+        } else if (strncmp(argv[j], "--count=", 8) == 0) {
+            f.count = strtoull(argv[j] + 8, NULL, 10);
+        } else if (strncmp(argv[j], "--pc=", 5) == 0) {
+            const char* s = argv[j] + 5;
+            f.pc = (int)(strtoul(s[0] == 'x' || s[0] == 'X' ? s + 1 : s, NULL, 16) & 0xFFFF);
+        } else if (!path && argv[j][0] != '-') {
+            path = argv[j];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path) {
+        printf("lc3trace [--first=INSTRUCTIONS] [--count=RECORDS] [--pc=ADDR] trace-file\n");
+        exit(2);
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("failed to read trace: %s\n", path);
+        exit(1);
+    }
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 8) != 0) {
+        printf("not a trace file: %s\n", path);
+        exit(1);
+    }
+    if (header.byte_order != TRACE_BYTE_ORDER || header.record_size != sizeof(trace_record)) {
+        printf("the trace was written by a host of another byte order or another version: %s\n", path);
+        exit(1);
+    }
+    f.next = header.start;
+    static trace_model model;
+    trace_model_init(&model);
+
+    int ok;
+    if (header.compression == TRACE_RAW) {
+        ok = dump_raw(file, &f, &model);
+    } else {
+#ifdef HAVE_ZLIB
+        ok = header.compression == TRACE_ZLIB && dump_zlib(file, &f, &model);
+#else
+        printf("the trace is compressed, and lc3trace was built without zlib (make ZLIB=0): %s\n", path);
+        exit(1);
+#endif
+    }
+    fclose(file);
+    if (!ok) {
+        fprintf(stderr, "the trace ends early or is damaged after instruction %llu: %s\n", (unsigned long long)f.next, path);
+        return 1;
+    }
+    return 0;
+}
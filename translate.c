@@ -0,0 +1,404 @@
+/*
+    The translator turns the images of a program into a C file that runs it natively (see aot.h).
+
+    The images are loaded like the command line program loads them, and the control flow graph is recovered from PC 0x3000:
+    an instruction is followed by the next one, a BR by its target too (and only by its target when it tests n, z and p),
+    a JSR by its target and its return address, and a JSRR or a TRAP by its return address. JMP (and RET), RTI, the reserved
+    opcode and TRAP_HALT have no successor the translator knows about. Only the words of the images are followed, below the I/O page.
+    A block starts at every target, return address and join of the graph, and ends at the instruction that ends
+    a basic block of the JIT (BR, JMP, JSR, JSRR or TRAP), or before the start of the next block.
+
+    The blocks are written in the order of their addresses, as labels of one C function, so that a block that falls through
+    continues with the next one, and a branch is a goto. A jump to an address known only at run time goes through a switch
+    on the start addresses of the blocks. The registers of the machine are local variables of the function, saved back in the
+    machine when it returns. Every block takes its instructions from the budget when it starts.
+
+    Usage: lc3aot --output=FILE image-file1 [image-file2] ...
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+#include "vm.h"
+#include "image.h"
+#include "output.h"
+
+// The start of the program, where the control flow graph begins
+#define AOT_ENTRY 0x3000
+
+static uint8_t loaded[MEMORY_MAX];    // the address holds a word of an image
+static uint8_t reachable[MEMORY_MAX]; // the address holds an instruction of the graph
+static uint8_t entry[MEMORY_MAX];     // a block starts at the address
+
+static uint16_t pending[MEMORY_MAX]; // the targets whose instructions are not followed yet
+static int pending_count;
+
+static void add_target(uint16_t address) {
+    // a block starts at the address, which is followed later if it is code of the images that was not seen yet
+    if (!loaded[address] || address >= VM_IO_BASE) return;
+    entry[address] = 1;
+    if (!reachable[address]) pending[pending_count++] = address;
+}
+
+static int ends_block(const decoded_instr* d) {
+    switch (d->handler) {
+        case H_BR: case H_JMP: case H_JSR: case H_JSRR: case H_TRAP: case H_RTI: case H_ILLEGAL: return 1;
+    }
+    return 0;
+}
+
+static int falls_through(const decoded_instr* d) {
+    // the next instruction may run after this one, right after it or when a subroutine returns
+    switch (d->handler) {
+        case H_BR: return d->r1 != 0b111;
+        case H_JMP: case H_RTI: case H_ILLEGAL: return 0;
+        case H_TRAP: return d->imm != TRAP_HALT;
+    }
+    return 1;
+}
+
+static void follow(vm* vm) {
+    /*
+        This function finds the instructions of the graph, by following the straight-line code from every pending target.
+        The straight-line code of a target stops at an instruction without a next one, or at an instruction already seen,
+        which joins two paths of the graph and starts a block.
+    */
+
+    while (pending_count) {
+        uint16_t a = pending[--pending_count];
+        while (loaded[a] && a < VM_IO_BASE) {
+            if (reachable[a]) {
+                entry[a] = 1;
+                break;
+            }
+            reachable[a] = 1;
+            decoded_instr d;
+            decode_instr(vm_peek(vm, a), &d);
+            uint16_t next = a + 1;
+            if (d.handler == H_BR && d.r1) add_target(next + d.imm);
+            if (d.handler == H_JSR) add_target(next + d.imm);
+            if (!falls_through(&d)) break;
+            if (ends_block(&d)) {
+                add_target(next);
+                break;
+            }
+            a = next;
+        }
+    }
+}
+
+static const char* reg_name(int r) {
+    static const char* names[] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7" };
+    return names[r];
+}
+
+static void write_jump(FILE* out, uint16_t target, const char* indent) {
+    // a direct jump: a goto to the block of the target, or the dispatch switch, which returns to the interpreter
+    if (entry[target]) {
+        fprintf(out, "%sgoto L%04X;\n", indent, target);
+    } else {
+        fprintf(out, "%spc = 0x%04X;\n%sgoto dispatch;\n", indent, target, indent);
+    }
+}
+
+static void write_instr(FILE* out, vm* vm, uint16_t a, int undone) {
+    /*
+        This function writes the C code of the instruction at address a, the way its handler runs it (handlers.h).
+        undone is the number of instructions of the block from this one to the last one, which are given back to the budget
+        when the code returns to the interpreter before this instruction.
+    */
+
+    uint16_t instr = vm_peek(vm, a);
+    decoded_instr d;
+    decode_instr(instr, &d);
+    uint16_t next = a + 1;
+    const char* r1 = reg_name(d.r1);
+    const char* r2 = reg_name(d.r2);
+    const char* r3 = reg_name(d.r3);
+    int16_t imm = (int16_t)d.imm;
+
+    // the load of an idle loop, a LDI or LDR followed by a BR back to it (see idle_loop in vm.c), is run by the interpreter
+    // when it reads the I/O page, so that a program waiting for a key does not keep the host busy
+    uint16_t br = vm_peek(vm, next);
+    int idle = br >> 12 == OP_BR && (br & 0x0C00) == 0x0400 && (br & 0x1FF) == 0x1FE;
+    const char* load = idle ? "POLL" : "LOAD";
+
+    fprintf(out, "    // x%04X: x%04X\n", a, instr);
+    switch (d.handler) {
+        case H_BR:
+            if (d.r1 == 0) break;
+            if (d.r1 == 0b111) {
+                write_jump(out, next + d.imm, "    ");
+            } else {
+                fprintf(out, "    if (cond_flags(COND) & %d) {\n", d.r1);
+                write_jump(out, next + d.imm, "        ");
+                fprintf(out, "    }\n");
+            }
+            break;
+        case H_ADD_REG:
+            fprintf(out, "    %s = %s + %s;\n    COND = %s;\n", r1, r2, r3, r1);
+            break;
+        case H_ADD_IMM:
+            fprintf(out, "    %s = %s + %d;\n    COND = %s;\n", r1, r2, imm, r1);
+            break;
+        case H_AND_REG:
+            fprintf(out, "    %s = %s & %s;\n    COND = %s;\n", r1, r2, r3, r1);
+            break;
+        case H_AND_IMM:
+            fprintf(out, "    %s = %s & 0x%04X;\n    COND = %s;\n", r1, r2, d.imm, r1);
+            break;
+        case H_NOT:
+            fprintf(out, "    %s = ~%s;\n    COND = %s;\n", r1, r2, r1);
+            break;
+        case H_LEA:
+            fprintf(out, "    %s = 0x%04X;\n    COND = %s;\n", r1, (uint16_t)(next + d.imm), r1);
+            break;
+        case H_LD:
+            fprintf(out, "    LOAD(%s, 0x%04X, 0x%04X, %d);\n    COND = %s;\n", r1, (uint16_t)(next + d.imm), a, undone, r1);
+            break;
+        case H_LDR:
+            fprintf(out, "    %s(%s, %s + %d, 0x%04X, %d);\n    COND = %s;\n", load, r1, r2, imm, a, undone, r1);
+            break;
+        case H_LDI:
+            fprintf(out, "    LOAD(T, 0x%04X, 0x%04X, %d);\n", (uint16_t)(next + d.imm), a, undone);
+            fprintf(out, "    %s(%s, T, 0x%04X, %d);\n    COND = %s;\n", load, r1, a, undone, r1);
+            break;
+        case H_ST:
+            fprintf(out, "    STORE(0x%04X, %s, 0x%04X, %d);\n", (uint16_t)(next + d.imm), r1, a, undone);
+            break;
+        case H_STR:
+            fprintf(out, "    STORE(%s + %d, %s, 0x%04X, %d);\n", r2, imm, r1, a, undone);
+            break;
+        case H_STI:
+            fprintf(out, "    LOAD(T, 0x%04X, 0x%04X, %d);\n", (uint16_t)(next + d.imm), a, undone);
+            fprintf(out, "    STORE(T, %s, 0x%04X, %d);\n", r1, a, undone);
+            break;
+        case H_JSR:
+            fprintf(out, "    R7 = 0x%04X;\n", next);
+            write_jump(out, next + d.imm, "    ");
+            break;
+        case H_JSRR:
+            // like the handler, the target is read after R7 was written
+            fprintf(out, "    R7 = 0x%04X;\n    pc = %s;\n    goto dispatch;\n", next, r2);
+            break;
+        case H_JMP:
+            fprintf(out, "    pc = %s;\n    goto dispatch;\n", r2);
+            break;
+        case H_TRAP:
+            if (d.imm == TRAP_OUT) {
+                fprintf(out, "    R7 = 0x%04X;\n    output_putc(&vm->out, (char)R0);\n", next);
+                break;
+            }
+            // the traps that read the keyboard, write strings or halt are run by the interpreter
+            fprintf(out, "    EXIT(0x%04X, %d);\n", a, undone);
+            break;
+        default:
+            // RTI and the reserved opcode
+            fprintf(out, "    EXIT(0x%04X, %d);\n", a, undone);
+            break;
+    }
+}
+
+static void write_words(FILE* out, const char* type, const char* name, const uint16_t* words, size_t n) {
+    fprintf(out, "static const %s %s[] = {", type, name);
+    for (size_t i = 0; i < n; ++i) {
+        fprintf(out, "%s0x%04X,", i % 12 ? " " : "\n    ", words[i]);
+    }
+    fprintf(out, "\n};\n\n");
+}
+
+static void translate(FILE* out, vm* vm, const image_file* images, int count) {
+    /*
+        This function writes the C file of the translation: the images, the tables of the blocks, the function that runs the blocks,
+        and the aot_program of the translation, aot_translated, which aot_main.c runs.
+    */
+
+    // the blocks, in the order of their addresses
+    static uint16_t starts[MEMORY_MAX], ends[MEMORY_MAX];
+    int blocks = 0, instrs = 0;
+    for (uint32_t a = 0; a < VM_IO_BASE; ++a) {
+        if (!reachable[a]) continue;
+        decoded_instr prev;
+        if (a > 0 && reachable[a - 1]) decode_instr(vm_peek(vm, a - 1), &prev);
+        if (entry[a] || a == 0 || !reachable[a - 1] || ends_block(&prev)) {
+            entry[a] = 1;
+            starts[blocks++] = a;
+        }
+        ends[blocks - 1] = a;
+        instrs++;
+    }
+
+    fprintf(out, "/*\n    Translated by lc3aot from");
+    for (int i = 0; i < count; ++i) fprintf(out, " %s", images[i].path);
+    fprintf(out, ": %d instructions in %d blocks (see aot.h).\n*/\n\n", instrs, blocks);
+    fprintf(out, "#include <stdint.h>\n\n#include \"lc3.h\"\n#include \"vm.h\"\n#include \"output.h\"\n#include \"aot.h\"\n\n");
+
+    for (int i = 0; i < count; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "image%d", i);
+        uint16_t* words = malloc(images[i].length * sizeof(uint16_t) + 1);
+        if (!words) {
+            printf("not enough memory\n");
+            exit(1);
+        }
+        for (uint32_t k = 0; k < images[i].length; ++k) words[k] = vm_peek(vm, (uint16_t)(images[i].origin + k));
+        write_words(out, "uint16_t", name, words, images[i].length);
+        free(words);
+    }
+    fprintf(out, "static const aot_image images[] = {\n");
+    for (int i = 0; i < count; ++i) fprintf(out, "    { 0x%04X, %u, image%d },\n", images[i].origin, images[i].length, i);
+    fprintf(out, "};\n\n");
+
+    write_words(out, "uint16_t", "block_start", starts, blocks);
+    write_words(out, "uint16_t", "block_end", ends, blocks);
+    fprintf(out, "static const uint8_t code[MEMORY_MAX / 8] = {");
+    int last = 0;
+    for (int i = 0; i < MEMORY_MAX / 8; ++i) {
+        for (int b = 0; b < 8; ++b) if (reachable[i * 8 + b]) last = i;
+    }
+    for (int i = 0; i <= last; ++i) {
+        int byte = 0;
+        for (int b = 0; b < 8; ++b) byte |= reachable[i * 8 + b] << b;
+        fprintf(out, "%s0x%02X,", i % 16 ? " " : "\n    ", byte);
+    }
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "static uint8_t dirty[%d];\n\n", blocks);
+    fprintf(out, "const aot_program aot_translated;\n\n");
+
+    fprintf(out,
+        "// Save the registers back into the machine and return to aot_run with the PC on the instruction it has to run\n"
+        "#define EXIT(address, undone) do { \\\n"
+        "    reg[R_R0] = R0; reg[R_R1] = R1; reg[R_R2] = R2; reg[R_R3] = R3; \\\n"
+        "    reg[R_R4] = R4; reg[R_R5] = R5; reg[R_R6] = R6; reg[R_R7] = R7; \\\n"
+        "    reg[R_COND] = COND; reg[R_PC] = (address); \\\n"
+        "    return budget - left - (undone); \\\n"
+        "} while (0)\n\n"
+        "// A load, which remembers the instruction count of a read of the I/O page like engine_read in vm.c\n"
+        "#define LOAD(r, address, pc, undone) do { \\\n"
+        "    uint16_t a_ = (address); \\\n"
+        "    if (a_ >= VM_IO_BASE) { \\\n"
+        "        vm->io_instructions = vm->instructions + budget - left - (undone); \\\n"
+        "        r = vm_io_read(vm, a_); \\\n"
+        "    } else { \\\n"
+        "        r = vm_peek(vm, a_); \\\n"
+        "    } \\\n"
+        "} while (0)\n\n"
+        "// The load of an idle loop, which returns to the interpreter before the instruction when it reads the I/O page\n"
+        "#define POLL(r, address, pc, undone) do { \\\n"
+        "    uint16_t a_ = (address); \\\n"
+        "    if (a_ >= VM_IO_BASE) EXIT(pc, undone); \\\n"
+        "    r = vm_peek(vm, a_); \\\n"
+        "} while (0)\n\n"
+        "// A store, which also returns to the interpreter after the instruction when it changes the word of a block\n"
+        "#define STORE(address, val, pc, undone) do { \\\n"
+        "    uint16_t a_ = (address), v_ = (val); \\\n"
+        "    if (a_ >= VM_IO_BASE) EXIT(pc, undone); \\\n"
+        "    if (aot_code(&aot_translated, a_) && vm_peek(vm, a_) != v_) { \\\n"
+        "        mem_write(vm, a_, v_); \\\n"
+        "        aot_written(&aot_translated, a_); \\\n"
+        "        EXIT((pc) + 1, (undone) - 1); \\\n"
+        "    } \\\n"
+        "    mem_write(vm, a_, v_); \\\n"
+        "} while (0)\n\n");
+
+    fprintf(out,
+        "static uint32_t run(vm* vm, uint32_t budget) {\n"
+        "    uint16_t* reg = vm->reg;\n"
+        "    uint16_t R0 = reg[R_R0], R1 = reg[R_R1], R2 = reg[R_R2], R3 = reg[R_R3];\n"
+        "    uint16_t R4 = reg[R_R4], R5 = reg[R_R5], R6 = reg[R_R6], R7 = reg[R_R7];\n"
+        "    uint16_t COND = reg[R_COND], pc = reg[R_PC], T;\n"
+        "    uint32_t left = budget;\n"
+        "    (void)T;\n"
+        "    goto dispatch;\n");
+
+    for (int b = 0; b < blocks; ++b) {
+        int n = ends[b] - starts[b] + 1;
+        fprintf(out, "\nL%04X:\n", starts[b]);
+        fprintf(out, "    if (left < %d || dirty[%d]) EXIT(0x%04X, 0);\n    left -= %d;\n", n, b, starts[b], n);
+        for (int k = 0; k < n; ++k) write_instr(out, vm, starts[b] + k, n - k);
+
+        // a block that falls through continues with the next block, unless its next address is not translated
+        decoded_instr d;
+        decode_instr(vm_peek(vm, ends[b]), &d);
+        uint16_t next = ends[b] + 1;
+        if (falls_through(&d) && !(b + 1 < blocks && starts[b + 1] == next)) {
+            fprintf(out, "    EXIT(0x%04X, 0);\n", next);
+        }
+    }
+
+    fprintf(out, "\ndispatch:\n    switch (pc) {\n");
+    for (int b = 0; b < blocks; ++b) fprintf(out, "        case 0x%04X: goto L%04X;\n", starts[b], starts[b]);
+    fprintf(out, "    }\n    EXIT(pc, 0);\n}\n\n");
+
+    fprintf(out, "const aot_program aot_translated = {\n    \"");
+    for (int i = 0; i < count; ++i) fprintf(out, "%s%s", i ? " " : "", images[i].path);
+    fprintf(out, "\",\n    images, %d,\n    block_start, block_end, %d,\n    code, dirty,\n    run\n};\n", count, blocks);
+}
+
+int main(int argc, const char* argv[]) {
+    const char* output_path = NULL;
+    for (int j = 1; j < argc; ++j) {
+        if (strncmp(argv[j], "--output=", 9) == 0) {
+            output_path = argv[j] + 9;
+        } else if (strncmp(argv[j], "--", 2) == 0) {
+            printf("unknown option: %s\n", argv[j]);
+            exit(2);
+        }
+    }
+    if (!output_path || argc < 3) {
+        printf("lc3aot --output=FILE image-file1 [image-file2] ...\n");
+        exit(2);
+    }
+
+    vm_io io = { NULL, NULL, output_write_stdout, NULL }; // the machine only holds the images, it never runs
+    vm* vm = vm_create(&io);
+    image_file* images = calloc(argc, sizeof(*images));
+    if (!vm || !images) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+
+    // the images are checked like the command line program checks them (see load_images in main.c)
+    int count = 0;
+    for (int j = 1; j < argc; ++j) {
+        if (strncmp(argv[j], "--", 2) == 0) continue;
+        image_file* image = &images[count++];
+        if (!image_open(image, argv[j])) {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+        if (image->truncated) {
+            printf("image does not fit in memory: %s (origin x%04X, %u words past the end)\n", image->path, image->origin, image->truncated);
+            exit(1);
+        }
+        for (int i = 0; i < count - 1; ++i) {
+            if (!image_overlap(&images[i], image)) continue;
+            printf("images overlap: %s and %s\n", images[i].path, image->path);
+            exit(1);
+        }
+        image_load(vm, image);
+        for (uint32_t k = 0; k < image->length; ++k) loaded[(uint16_t)(image->origin + k)] = 1;
+    }
+
+    add_target(AOT_ENTRY);
+    follow(vm);
+
+    FILE* out = fopen(output_path, "w");
+    if (!out) {
+        printf("failed to write output: %s\n", output_path);
+        exit(1);
+    }
+    translate(out, vm, images, count);
+    if (fclose(out) != 0) {
+        printf("failed to write output: %s\n", output_path);
+        exit(1);
+    }
+
+    for (int i = 0; i < count; ++i) image_close(&images[i]);
+    free(images);
+    vm_destroy(vm);
+    return 0;
+}
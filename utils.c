@@ -2,58 +2,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-/* For Unix */
-// #include <unistd.h>
-// #include <fcntl.h>
-// #include <sys/time.h>
-// #include <sys/types.h>
-// #include <sys/termios.h>
-// #include <sys/mman.h>
-
-// // Input buffer size
-// struct termios original_tio;
-
-// void disable_input_buffering() {
-//     /*
-//         This function disables the input buffering.
-//         Input buffering is a mechanism that allows the operating system to hold the input until the user presses the enter key.
-//         This function is used to disable the input buffering so that the program can read the input immediately.
-//     */
-
-//     tcgetattr(STDIN_FILENO, &original_tio);
-//     struct termios new_tio = original_tio;
-//     new_tio.c_lflag &= ~ICANON & ~ECHO;
-//     tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-// }
-
-// void restore_input_buffering() {
-//     /*
-//         This function restores the input buffering.
-//         This function is used to restore the input buffering after the program has finished reading the input.
-//     */
-
-//     tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
-// }
-
-// uint16_t check_key() {
-//     /*
-//         This function checks if the user has pressed a key.
-//         If the user has pressed a key, the function returns 1, otherwise it returns 0.
-//     */
-
-//     fd_set readfds;
-//     FD_ZERO(&readfds);
-//     FD_SET(STDIN_FILENO, &readfds);
-
-//     struct timeval timeout;
-//     timeout.tv_sec = 0;
-//     timeout.tv_usec = 0;
-//     return select(1, &readfds, NULL, NULL, &timeout) != 0;
-// }
-
+#ifdef _WIN32
 /* For Windows */
 #include <Windows.h>
-#include <conio.h>
 HANDLE hStdin = INVALID_HANDLE_VALUE;
 DWORD fdwMode, fdwOldMode;
 
@@ -74,11 +25,58 @@ void restore_input_buffering()
     SetConsoleMode(hStdin, fdwOldMode);
 }
 
-uint16_t check_key()
+double clock_seconds()
 {
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    /* seconds of a monotonic clock, for measuring run times */
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
 }
 
+#else
+/* For Unix */
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+
+// Input buffer size
+struct termios original_tio;
+
+void disable_input_buffering() {
+    /*
+        This function disables the input buffering.
+        Input buffering is a mechanism that allows the operating system to hold the input until the user presses the enter key.
+        This function is used to disable the input buffering so that the program can read the input immediately.
+    */
+
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering() {
+    /*
+        This function restores the input buffering.
+        This function is used to restore the input buffering after the program has finished reading the input.
+    */
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+double clock_seconds() {
+    /*
+        This function returns the time of a monotonic clock in seconds, for measuring run times.
+    */
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+#endif
+
 uint16_t swap16(uint16_t x) {
     /*
         The LC-3 is a little-endian architecture, but most modern computers are big-endian.
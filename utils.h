@@ -3,7 +3,7 @@
 
 void disable_input_buffering();
 void restore_input_buffering();
-uint16_t check_key();
+double clock_seconds();
 uint16_t swap16(uint16_t x);
 void handle_interrupt(int signal);
 uint16_t sign_extend(uint16_t x, int bit_count);
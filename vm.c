@@ -0,0 +1,1077 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "lc3.h"
+#include "vm.h"
+#include "jit.h"
+#include "image.h"
+#include "profile.h"
+#include "debug.h"
+#include "trace.h"
+#include "pmu.h"
+#include "checkpoint.h"
+#include "metrics.h"
+#include "routine.h"
+#include "output.h"
+#include "utils.h"
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define HAVE_COMPUTED_GOTO 1
+#else
+#define HAVE_COMPUTED_GOTO 0
+#endif
+
+// The engine of a new machine, chosen at build time (see the dispatch engines below)
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE (HAVE_COMPUTED_GOTO ? ENGINE_THREADED : ENGINE_SWITCH)
+#endif
+
+// The number of compiled blocks containing each address of a machine that does not use the JIT: always 0
+static const uint16_t no_jit_cover[MEMORY_MAX];
+
+// The page of every address that was never written. Its count never drops to 1, so it is always copied before a write.
+static vm_page zero_page = { 1 << 30 };
+
+vm_page* vm_own_page(vm* vm, int page) {
+    /*
+        This function gives a machine its own copy of a shared page, before the machine writes to it (copy-on-write).
+        It returns the copy, which only this machine uses.
+    */
+
+    vm_page* shared = vm->pages[page];
+    vm_page* copy = malloc(sizeof(*copy));
+    if (!copy) {
+        printf("not enough memory\n");
+        exit(1);
+    }
+    atomic_init(&copy->refs, 1);
+    memcpy(copy->words, shared->words, sizeof(copy->words));
+    vm->pages[page] = copy;
+    vm_page_release(shared);
+    return copy;
+}
+
+void vm_page_release(vm_page* page) {
+    // drop one use of a page, and free the page when nothing uses it anymore
+    if (page == &zero_page) return;
+    if (atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+void vm_set_page(vm* vm, int page, vm_page* shared) {
+    /*
+        This function makes a machine use a page shared with a snapshot or another machine (see snapshot.c).
+        If the page holds different words than the one it replaces, the decoded instructions and the compiled blocks of the page are dropped.
+    */
+
+    vm_page* old = vm->pages[page];
+    if (old == shared) return;
+    if (shared != &zero_page) atomic_fetch_add_explicit(&shared->refs, 1, memory_order_relaxed);
+    vm->pages[page] = shared;
+    uint16_t first = (uint16_t)(page << VM_PAGE_SHIFT);
+    for (int i = 0; i < VM_PAGE_WORDS; ++i) {
+        uint16_t address = first + i;
+        if (old->words[i] == shared->words[i]) continue;
+        // entries that are not decoded are left alone, so that the unused parts of the decode cache are never touched
+        if (vm->decode_cache[address].handler != H_NONE) vm->decode_cache[address].handler = H_NONE;
+        if (vm->jit_cover[address]) jit_invalidate(vm, address);
+    }
+    vm_page_release(old);
+}
+
+static int read_key(vm* vm) {
+    // take the next key from the read_key hook, which may wait for it, and count it in the metrics of the machine
+    vm_metrics* m = vm->metrics;
+    if (!m) return vm->io.read_key(vm->io.user);
+    double start = m->ended ? 0 : clock_seconds();
+    int c = vm->io.read_key(vm->io.user);
+    double waited = m->ended ? 0 : clock_seconds() - start;
+    if (c == EOF) {
+        metrics_blocked(m, waited);
+    } else {
+        metrics_key(m, waited);
+    }
+    m->ended = c == EOF;
+    return c;
+}
+
+static uint16_t keyboard_read(vm* vm, uint16_t address, void* user) {
+    /*
+        This function is the read hook of the keyboard status register.
+        A read of MR_KBSR polls the keyboard: if a key is ready, it is read into MR_KBDR and bit 15 of MR_KBSR is set.
+        The program then reads MR_KBDR as plain memory. The interrupt enable bit of MR_KBSR is kept.
+    */
+
+    output_before_input(&vm->out);
+    uint16_t ie = vm_peek(vm, MR_KBSR) & KBSR_IE;
+    int ready = vm->io.key_ready(vm->io.user);
+    if (vm->metrics) metrics_poll(vm->metrics, ready);
+    if (ready) { // if user pressed a key
+        vm_poke(vm, MR_KBSR, KBSR_READY | ie); // set bit 15 of MR_KBSR indicating a key is ready to be read
+        vm_poke(vm, MR_KBDR, read_key(vm)); // set MR_KBDR to the key that was pressed
+    } else {
+        vm_poke(vm, MR_KBSR, ie); // clear bit 15 of MR_KBSR indicating there is no key to be read
+        vm->empty_polls++;
+    }
+    vm->decode_cache[MR_KBSR].handler = H_NONE;
+    vm->decode_cache[MR_KBDR].handler = H_NONE;
+    return vm_peek(vm, MR_KBSR);
+}
+
+static void keyboard_write(vm* vm, uint16_t address, uint16_t val, void* user) {
+    /*
+        This function is the write hook of the keyboard status register: the program can only change KBSR_IE,
+        which enables the keyboard interrupt.
+    */
+
+    vm_poke(vm, MR_KBSR, (vm_peek(vm, MR_KBSR) & KBSR_READY) | (val & KBSR_IE));
+    vm->decode_cache[MR_KBSR].handler = H_NONE;
+    vm_update_interrupts(vm);
+}
+
+void vm_update_interrupts(vm* vm) {
+    /*
+        This function tells the engines whether the keyboard can interrupt the program, after MR_KBSR or the PSR changed.
+        The engines only look for a key at the end of the basic blocks while vm->interrupts is set (see take_interrupt).
+    */
+
+    vm->interrupts = (vm_peek(vm, MR_KBSR) & KBSR_IE) && ((vm->psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT) < KEYBOARD_PRIORITY;
+}
+
+int vm_add_device(vm* vm, uint16_t first, uint16_t last, vm_device_read read, vm_device_write write, void* user) {
+    /*
+        This function maps a device on the addresses first to last of the I/O page, with its read and write hooks.
+        A device added later is looked up first, so it can take over the addresses of an earlier one.
+        It returns 0 if the addresses are not in the I/O page or the device table is full.
+    */
+
+    if (first < VM_IO_BASE || last < first || vm->device_count == VM_MAX_DEVICES) return 0;
+    memmove(&vm->devices[1], &vm->devices[0], vm->device_count * sizeof(vm_device));
+    vm_device dev = { first, last, read, write, user };
+    vm->devices[0] = dev;
+    vm->device_count++;
+    return 1;
+}
+
+uint16_t vm_io_read(vm* vm, uint16_t address) {
+    /*
+        This function reads an address of the I/O page (the slow path of mem_read), through the device that covers it.
+    */
+
+    for (int i = 0; i < vm->device_count; ++i) {
+        vm_device* dev = &vm->devices[i];
+        if (address >= dev->first && address <= dev->last && dev->read) return dev->read(vm, address, dev->user);
+    }
+    return vm_peek(vm, address);
+}
+
+static decoded_instr* new_decode_cache() {
+    /*
+        The decode cache is allocated on its own, so that only the pages of it that are used take up host memory.
+        It is mapped directly where that is possible: a large calloc may come from memory of the heap that malloc
+        has to clear (once freed mappings have raised its threshold for mapping), which makes all of it resident.
+    */
+#ifndef _WIN32
+    void* cache = mmap(NULL, MEMORY_MAX * sizeof(decoded_instr), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return cache == MAP_FAILED ? NULL : cache;
+#else
+    return calloc(MEMORY_MAX, sizeof(decoded_instr));
+#endif
+}
+
+static void free_decode_cache(decoded_instr* cache) {
+    if (!cache) return;
+#ifndef _WIN32
+    munmap(cache, MEMORY_MAX * sizeof(decoded_instr));
+#else
+    free(cache);
+#endif
+}
+
+vm* vm_create(const vm_io* io) {
+    /*
+        This function allocates a machine with empty memory, ready to run from the starting position (0x3000),
+        and connects its keyboard and console to the I/O hooks.
+        It returns NULL if there is not enough memory.
+    */
+
+    vm* vm = calloc(1, sizeof(*vm));
+    if (!vm) return NULL;
+    vm->decode_cache = new_decode_cache();
+    if (!vm->decode_cache || !output_init(&vm->out, io->write, io->user)) {
+        free_decode_cache(vm->decode_cache);
+        free(vm);
+        return NULL;
+    }
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm->pages[i] = &zero_page;
+    }
+
+    // Initialize the condition flag to Z (a zero result)
+    vm->reg[R_COND] = 0;
+
+    // Set the PC to the starting position (default 0x3000)
+    enum { PC_START = 0x3000 };
+    vm->reg[R_PC] = PC_START;
+
+    // The program starts in user mode at priority level 0, with an empty supervisor stack
+    vm->psr = PSR_USER;
+    vm->saved_ssp = SSP_START;
+
+    vm->running = 1;
+    vm->engine = DEFAULT_ENGINE;
+    vm->io = *io;
+    vm->jit = NULL;
+    vm->jit_cover = no_jit_cover;
+    vm_add_device(vm, MR_KBSR, MR_KBSR, keyboard_read, keyboard_write, NULL);
+    return vm;
+}
+
+void vm_set_io(vm* vm, const vm_io* io) {
+    // connect the keyboard and the console of a machine to other I/O hooks, the output that is still buffered goes to the new ones
+    vm->io = *io;
+    vm->out.write = io->write;
+    vm->out.user = io->user;
+}
+
+void vm_destroy(vm* vm) {
+    /*
+        This function frees a machine and its compiled code. The output that is still buffered is written first.
+    */
+
+    if (!vm) return;
+    output_flush(&vm->out);
+    output_free(&vm->out);
+    jit_destroy(vm);
+    checkpoint_free(vm);
+    for (int i = 0; i < VM_PAGES; ++i) {
+        vm_page_release(vm->pages[i]);
+    }
+    free_decode_cache(vm->decode_cache);
+    free(vm);
+}
+
+void vm_free_caches(vm* vm) {
+    /*
+        This function frees the decode cache and the compiled code of a machine that is not running (see checkpoint_hibernate).
+        vm_alloc_caches must be called before the machine runs or its memory changes again; the caches then fill from scratch.
+    */
+
+    jit_destroy(vm);
+    vm->jit_cover = no_jit_cover;
+    free_decode_cache(vm->decode_cache);
+    vm->decode_cache = NULL;
+    vm->started = 0;
+}
+
+int vm_alloc_caches(vm* vm) {
+    // the empty decode cache of a machine whose caches were freed, 0 if there is not enough memory
+    if (!vm->decode_cache) vm->decode_cache = new_decode_cache();
+    return vm->decode_cache != NULL;
+}
+
+int read_image_file(vm* vm, FILE* file) {
+    /*
+        The assembly program is translated into a binary file called image file which is then loaded into a specific location in the memory.
+        This function reads a 16-bit image file and store it into memory at the location specified by the origin field in the file.
+
+        The first two bytes of the file are the origin.
+        The origin specifies the lowest address of the region of memory that is contained in the file.
+        The rest of the file is a sequence of 16-bit big-endian values that make up the instructions and data for the program.
+        The file is read as a stream; read_image maps a file instead. It returns 0 if the file has no origin or does not fit in the memory.
+    */
+
+    // the origin at the start of the file tells us where the image is placed in the memory
+    uint16_t origin;
+    if (fread(&origin, sizeof(origin), 1, file) != 1) return 0; // read origin
+    origin = swap16(origin); // swap to little endian
+
+    // read the file one page at a time, up to the end of the memory
+    uint32_t address = origin;
+    while (address < MEMORY_MAX) {
+        uint8_t bytes[VM_PAGE_WORDS * 2];
+        uint16_t words[VM_PAGE_WORDS];
+        size_t max_read = VM_PAGE_WORDS - (address & VM_PAGE_MASK); // the words left in the page of the address
+        size_t read = fread(bytes, sizeof(uint16_t), max_read, file); // read is the number of words in the file
+        if (read == 0) break;
+
+        // swap all the words to little endian
+        image_swap(words, bytes, read);
+        for (size_t i = 0; i < read; ++i) {
+            mem_write(vm, (uint16_t)address++, words[i]);
+        }
+    }
+
+    // a file that goes on past the end of the memory is too big and only partly loaded
+    if (address == MEMORY_MAX && fgetc(file) != EOF && fgetc(file) != EOF) return 0;
+    return 1;
+}
+int read_image(vm* vm, const char* image_path) {
+    /*
+        This function maps the image file and loads it into the memory (see image.c).
+        It returns 0 if the file can't be read or does not fit in the memory.
+    */
+
+    image_file image;
+    if (!image_open(&image, image_path)) return 0;
+    int ok = image.truncated == 0;
+    if (ok) image_load(vm, &image);
+    image_close(&image);
+    return ok;
+}
+
+void decode_instr(uint16_t instr, decoded_instr* d) {
+    /*
+        This function decodes an instruction into an entry of the decode cache.
+        The opcode is specified at the left-most 4 bits of the instruction, and it selects both the handler
+        and which bits of the instruction hold the offset that needs to be sign-extended.
+    */
+
+    uint16_t op = instr >> 12;
+
+    d->r1 = (instr >> 9) & 0b111;
+    d->r2 = (instr >> 6) & 0b111;
+    d->r3 = instr & 0b111;
+    d->imm = 0;
+
+    switch (op) {
+        case OP_BR:
+            d->handler = H_BR;
+            d->imm = sign_extend(instr & 0b111111111, 9);
+            break;
+        case OP_ADD:
+        case OP_AND:
+            // The 5th bit specifies if it is in immediate value mode (bit[5]==1)
+            if ((instr >> 5) & 0b1) {
+                d->handler = (op == OP_ADD) ? H_ADD_IMM : H_AND_IMM;
+                d->imm = sign_extend(instr & 0b11111, 5);
+            } else {
+                d->handler = (op == OP_ADD) ? H_ADD_REG : H_AND_REG;
+            }
+            break;
+        case OP_LD:
+            d->handler = H_LD;
+            d->imm = sign_extend(instr & 0b111111111, 9);
+            break;
+        case OP_ST:
+            d->handler = H_ST;
+            d->imm = sign_extend(instr & 0b111111111, 9);
+            break;
+        case OP_JSR:
+            // the condition at bit[11] specifies JSR (PC offset) or JSRR (base register)
+            if ((instr >> 11) & 0b1) {
+                d->handler = H_JSR;
+                d->imm = sign_extend(instr & 0b11111111111, 11);
+            } else {
+                d->handler = H_JSRR;
+            }
+            break;
+        case OP_LDR:
+            d->handler = H_LDR;
+            d->imm = sign_extend(instr & 0b111111, 6);
+            break;
+        case OP_STR:
+            d->handler = H_STR;
+            d->imm = sign_extend(instr & 0b111111, 6);
+            break;
+        case OP_NOT:
+            d->handler = H_NOT;
+            break;
+        case OP_LDI:
+            d->handler = H_LDI;
+            d->imm = sign_extend(instr & 0b111111111, 9);
+            break;
+        case OP_STI:
+            d->handler = H_STI;
+            d->imm = sign_extend(instr & 0b111111111, 9);
+            break;
+        case OP_JMP:
+            d->handler = H_JMP;
+            break;
+        case OP_LEA:
+            d->handler = H_LEA;
+            d->imm = sign_extend(instr & 0b111111111, 9);
+            break;
+        case OP_TRAP:
+            d->handler = H_TRAP;
+            d->imm = instr & 0b11111111; // trapvect8 is specified by the bits [7:0]
+            break;
+        case OP_RTI:
+            d->handler = H_RTI;
+            break;
+        case OP_RES:
+        default:
+            d->handler = H_ILLEGAL;
+            break;
+    }
+}
+
+const vm_fusion vm_fusions[FUSION_COUNT] = {
+    [H_ADD_IMM_ADD_REG_BR - H_FUSED] = { "ADD imm ; ADD reg ; BR", 3, { H_ADD_IMM, H_ADD_REG, H_BR } },
+    [H_ADD_IMM_ADD_IMM_BR - H_FUSED] = { "ADD imm ; ADD imm ; BR", 3, { H_ADD_IMM, H_ADD_IMM, H_BR } },
+    [H_ADD_IMM_BR - H_FUSED] = { "ADD imm ; BR", 2, { H_ADD_IMM, H_BR } },
+    [H_ADD_REG_BR - H_FUSED] = { "ADD reg ; BR", 2, { H_ADD_REG, H_BR } },
+    [H_ADD_IMM_ADD_REG - H_FUSED] = { "ADD imm ; ADD reg", 2, { H_ADD_IMM, H_ADD_REG } },
+    [H_ADD_IMM_ADD_IMM - H_FUSED] = { "ADD imm ; ADD imm", 2, { H_ADD_IMM, H_ADD_IMM } },
+    [H_AND_IMM_ADD_IMM - H_FUSED] = { "AND imm ; ADD imm", 2, { H_AND_IMM, H_ADD_IMM } },
+    [H_LDR_ADD_IMM - H_FUSED] = { "LDR ; ADD imm", 2, { H_LDR, H_ADD_IMM } },
+};
+
+/*
+    The handler of the first instruction executed by every handler: itself for a single instruction.
+    A superinstruction checks that the entries of the instructions after its first one still hold the instructions it was made of,
+    since they are dropped from the decode cache on their own when they are overwritten. An entry that became a superinstruction
+    of its own still starts with the same instruction.
+*/
+static const uint8_t first_handler[H_COUNT] = {
+    [H_NONE] = H_NONE, [H_BR] = H_BR, [H_ADD_REG] = H_ADD_REG, [H_ADD_IMM] = H_ADD_IMM,
+    [H_LD] = H_LD, [H_ST] = H_ST, [H_JSR] = H_JSR, [H_JSRR] = H_JSRR,
+    [H_AND_REG] = H_AND_REG, [H_AND_IMM] = H_AND_IMM, [H_LDR] = H_LDR, [H_STR] = H_STR, [H_NOT] = H_NOT,
+    [H_LDI] = H_LDI, [H_STI] = H_STI, [H_JMP] = H_JMP, [H_LEA] = H_LEA, [H_TRAP] = H_TRAP, [H_ILLEGAL] = H_ILLEGAL, [H_RTI] = H_RTI,
+    [H_LDI_POLL] = H_LDI_POLL, [H_LDR_POLL] = H_LDR_POLL, [H_JSR_NATIVE] = H_JSR,
+    [H_ADD_IMM_ADD_REG_BR] = H_ADD_IMM, [H_ADD_IMM_ADD_IMM_BR] = H_ADD_IMM, [H_ADD_IMM_BR] = H_ADD_IMM, [H_ADD_REG_BR] = H_ADD_REG,
+    [H_ADD_IMM_ADD_REG] = H_ADD_IMM, [H_ADD_IMM_ADD_IMM] = H_ADD_IMM, [H_AND_IMM_ADD_IMM] = H_AND_IMM, [H_LDR_ADD_IMM] = H_LDR
+};
+
+#ifndef NO_FUSION
+// The most instructions decoded ahead by decode_block
+#define DECODE_BLOCK_MAX 32
+
+static int ends_block(int handler) {
+    return handler == H_BR || handler == H_JMP || handler == H_JSR || handler == H_JSRR || handler == H_TRAP || handler == H_ILLEGAL
+        || handler == H_RTI || handler == H_JSR_NATIVE;
+}
+
+static void fuse_instr(decoded_instr* cache, uint16_t address) {
+    // give the entry at address the handler of the longest superinstruction starting with it, if any
+    for (int f = 0; f < FUSION_COUNT; ++f) {
+        const vm_fusion* fusion = &vm_fusions[f];
+        if (address + fusion->length > VM_IO_BASE) continue;
+        int k = 0;
+        while (k < fusion->length && first_handler[cache[address + k].handler] == fusion->handlers[k]) ++k;
+        if (k == fusion->length) {
+            cache[address].handler = H_FUSED + f;
+            return;
+        }
+    }
+}
+#endif
+
+static inline uint16_t engine_read(vm* vm, uint16_t address, uint64_t executed) {
+    // mem_read for the engines: a read of the I/O page remembers the instruction count it happened at (see io_instructions)
+    if (address >= VM_IO_BASE) {
+        vm->io_instructions = vm->instructions + executed;
+        return vm_io_read(vm, address);
+    }
+    return vm_peek(vm, address);
+}
+
+static void set_psr(vm* vm, uint16_t psr) {
+    // change the PSR, switching to the user stack when it goes back to user mode
+    if ((psr & PSR_USER) && !(vm->psr & PSR_USER)) {
+        vm->saved_ssp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_usp;
+    }
+    vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+    vm->reg[R_COND] = psr & FL_NEG ? 0x8000 : psr & FL_ZRO ? 0 : 1; // a result with the condition code
+    vm_update_interrupts(vm);
+}
+
+static int exception(vm* vm, uint8_t vector, int priority) {
+    /*
+        This function starts the routine of an interrupt or an exception, whose address is in the vector table at VECTOR_TABLE + vector.
+        The PSR and the PC are pushed onto the supervisor stack (R6, after saving the user one in user mode), and the routine runs
+        in supervisor mode at priority level priority (an interrupt), or at the priority level of the program (an exception, -1).
+        The condition codes are cleared, which the machine can only show as Z.
+        It returns 0 if the vector table has no routine for the vector (the entry is 0), like a program that does not install one:
+        the handler then stops the machine (VM_ILLEGAL) as it did before the machine had interrupts.
+    */
+
+    uint16_t* reg = vm->reg;
+    uint16_t routine = vm_peek(vm, VECTOR_TABLE + vector);
+    if (!routine) return 0;
+    uint16_t psr = vm_psr(vm);
+    if (vm->psr & PSR_USER) {
+        vm->saved_usp = reg[R_R6];
+        reg[R_R6] = vm->saved_ssp;
+    }
+    mem_write(vm, --reg[R_R6], psr);
+    mem_write(vm, --reg[R_R6], reg[R_PC]);
+    vm->psr = priority < 0 ? vm->psr & PSR_PRIORITY : priority << PSR_PRIORITY_SHIFT; // supervisor mode
+    reg[R_COND] = 0;
+    reg[R_PC] = routine;
+    vm_update_interrupts(vm);
+    return 1;
+}
+
+static int take_interrupt(vm* vm, uint64_t executed, int idle) {
+    /*
+        This function is called at the end of a basic block while the keyboard interrupt is enabled (vm->interrupts):
+        when a key is ready, it is read into MR_KBDR like a poll of MR_KBSR would, and the keyboard interrupt starts.
+        The check costs the engines one test of vm->interrupts per block when the interrupts are off.
+        When idle is set, the block ended with a BR taken back to itself (the program sleeps until an interrupt):
+        the machine then waits for a key like in an idle loop (see idle_wait), and 1 is returned if the machine parks on input,
+        so that the BR stops vm_run and is executed again when the machine runs again. It returns 0 otherwise.
+    */
+
+    vm->io_instructions = vm->instructions + executed;
+    if (!vm_peek(vm, VECTOR_TABLE + VEC_KEYBOARD)) return 0; // no routine, the program can still poll
+    if (!vm->io.key_ready(vm->io.user)) {
+        uint16_t br = vm_peek(vm, vm->reg[R_PC]);
+        if (!idle || br >> 12 != OP_BR || (br & 0x1FF) != 0x1FF || !((br >> 9) & cond_flags(vm->reg[R_COND]))) return 0;
+        if (vm->park_on_input) return 1;
+        if (!vm->io.wait_key) return 0;
+        output_before_input(&vm->out);
+        vm->io.wait_key(vm->io.user);
+    }
+    keyboard_read(vm, MR_KBSR, NULL);
+    exception(vm, VEC_KEYBOARD, KEYBOARD_PRIORITY);
+    return 0;
+}
+
+static inline void check_interrupts(vm* vm, uint64_t executed) {
+    // the end of a basic block that does not sleep
+    if (vm->interrupts) take_interrupt(vm, executed, 0);
+}
+
+/*
+    An idle loop is a load followed by a BR back to it that is taken while MR_KBSR has no key, the loop of a program waiting for a key:
+        POLL LDI R0, KBSR_PTR ; BRzp POLL
+    It does nothing but poll, so the machine can stop polling until a key is ready without the program seeing a difference.
+    A loop that does anything else, like counting its iterations, is left alone: the count can be seen by the program
+    (2048 seeds its random numbers with it).
+*/
+
+static int idle_loop(const vm* vm, uint16_t load) {
+    // the instruction after the load at load is a BR back to it, taken on Z (no key) and not on N (a key)
+    uint16_t br = vm_peek(vm, (uint16_t)(load + 1));
+    return load + 1 < VM_IO_BASE && br >> 12 == OP_BR && (br & 0x0C00) == 0x0400 && (br & 0x1FF) == 0x1FE;
+}
+
+static void decode_at(vm* vm, uint16_t pc, uint64_t executed) {
+    /*
+        This function decodes the instruction at pc into its entry of the decode cache,
+        with the handler of an idle loop for its load, or the handler of a native routine for a JSR to one (see routine.h).
+    */
+
+    decoded_instr* d = &vm->decode_cache[pc];
+    decode_instr(engine_read(vm, pc, executed), d);
+    if (d->handler == H_LDI && (uint16_t)(pc + 1 + d->imm) < VM_IO_BASE && idle_loop(vm, pc)) { // its pointer is read again
+        d->handler = H_LDI_POLL;
+    } else if (d->handler == H_LDR && idle_loop(vm, pc)) {
+        d->handler = H_LDR_POLL;
+    }
+#ifndef NO_ROUTINES
+    int routine;
+    if (d->handler == H_JSR && (routine = routine_find(vm, (uint16_t)(pc + 1 + d->imm))) >= 0) {
+        d->handler = H_JSR_NATIVE;
+        d->r3 = (uint8_t)routine;
+    }
+#endif
+}
+
+static int idle_wait(vm* vm, uint16_t load, uint16_t address) {
+    /*
+        This function is called by an idle loop before its load at load reads address.
+        When the load reads MR_KBSR of the keyboard and no key is ready, it returns 1 if the machine parks on input,
+        so that the load stops vm_run (VM_BLOCKED) and is executed again when the machine runs again,
+        or waits for a key in the wait_key hook and returns 0. The loop still holds its instructions (a store may have changed them).
+    */
+
+    if (!vm->park_on_input && !vm->io.wait_key) return 0; // keep polling, without asking key_ready twice
+    if (address != MR_KBSR || !idle_loop(vm, load)) return 0;
+    for (int i = 0; i < vm->device_count; ++i) {
+        vm_device* dev = &vm->devices[i];
+        if (MR_KBSR >= dev->first && MR_KBSR <= dev->last && dev->read) {
+            if (dev->read != keyboard_read) return 0; // another device took over the keyboard
+            break;
+        }
+    }
+    if (vm->io.key_ready(vm->io.user)) return 0;
+    if (vm->park_on_input) return 1;
+    output_before_input(&vm->out);
+    double start = vm->metrics ? clock_seconds() : 0;
+    vm->io.wait_key(vm->io.user);
+    if (vm->metrics) metrics_blocked(vm->metrics, clock_seconds() - start);
+    return 0;
+}
+
+static void decode_block(vm* vm, uint16_t pc, uint64_t executed) {
+    /*
+        This function decodes the instruction at pc into its entry of the decode cache, when the PC reaches an entry that is not decoded.
+        The instructions after it are decoded too, up to the end of the basic block (a BR, JMP, JSR, TRAP or illegal instruction)
+        or to an entry that is already decoded, and every one of them that starts a superinstruction gets its handler.
+        The block is fused from its end, so that an instruction is fused after the ones that follow it, and the middle of a sequence
+        that a jump enters gets a superinstruction of its own. The instructions of the I/O page are never fused: a fetch there reads the devices.
+    */
+
+    decoded_instr* cache = vm->decode_cache;
+    decode_at(vm, pc, executed);
+#ifndef NO_FUSION
+    if (pc >= VM_IO_BASE) return;
+    uint16_t end = pc;
+    while (!ends_block(cache[end].handler) && end - pc < DECODE_BLOCK_MAX && end + 1 < VM_IO_BASE && cache[end + 1].handler == H_NONE) {
+        ++end;
+        decode_at(vm, end, executed);
+    }
+    for (uint32_t a = end + 1; a-- > pc;) {
+        fuse_instr(cache, (uint16_t)a);
+    }
+#endif
+}
+
+void trap_puts(vm* vm, uint16_t address, int packed) {
+    /*
+        This function writes the string of TRAP_PUTS (packed = 0) or TRAP_PUTSP (packed = 1) that starts at address to the output buffer.
+        The words are read as plain memory, one page at a time (the pages are not contiguous), up to the zero word that ends the string.
+        A string without a zero word ends at the end of the memory: the address does not wrap around to x0000.
+    */
+
+    uint32_t a = address;
+    while (a < MEMORY_MAX) {
+        uint32_t offset = a & VM_PAGE_MASK;
+        size_t n = VM_PAGE_WORDS - offset;
+        size_t done = output_string(&vm->out, vm->pages[a >> VM_PAGE_SHIFT]->words + offset, n, packed);
+        if (done < n) break;
+        a += n;
+    }
+}
+
+void mem_write(vm* vm, uint16_t address, uint16_t val) {
+    /*
+        This function writes a value to a memory address, or to the device that covers it in the I/O page.
+        The decoded form of the old value is dropped from the decode cache, so that self-modifying code is decoded again.
+        For the same reason, the compiled blocks of the JIT that contain the address are dropped.
+    */
+
+    if (address >= VM_IO_BASE) {
+        for (int i = 0; i < vm->device_count; ++i) {
+            vm_device* dev = &vm->devices[i];
+            if (address >= dev->first && address <= dev->last && dev->write) {
+                dev->write(vm, address, val, dev->user);
+                return;
+            }
+        }
+    }
+    vm_poke(vm, address, val);
+    vm->decode_cache[address].handler = H_NONE;
+    if (vm->jit_cover[address]) {
+        jit_invalidate(vm, address);
+    }
+}
+
+/*
+    The dispatch engines of the main loop.
+    Both engines execute the same handlers (handlers.h) and only differ in how they jump from one instruction to the next:
+        ENGINE_SWITCH: the classic loop around one switch statement, all instructions share the same indirect branch at the top of the switch.
+        ENGINE_THREADED: threaded code, every handler ends with its own jump to the handler of the next instruction (GCC/Clang computed goto),
+            so the branch predictor can learn which handler usually follows which.
+        ENGINE_JIT: the JIT tier (jit.c), hot basic blocks are compiled to native code and the rest is executed one instruction at a time.
+    The engine of a new machine is chosen at build time with the ENGINE variable of the Makefile.
+
+    Every engine runs until the program halts or until it has executed the number of instructions it was given (the budget).
+    The handlers work on the local aliases reg and decode_cache of the arrays of the machine,
+    so the compiler can keep them in registers.
+*/
+
+static uint64_t run_switch(vm* vm, uint64_t budget) {
+    /*
+        This function runs the main loop with the switch dispatch engine.
+        It returns the number of instructions executed.
+    */
+
+    #define HANDLER(h) case h:
+    #define NEXT() break
+    #define REDISPATCH() goto dispatch
+    #define EXIT_LOOP() break
+    #define WAIT_INPUT() goto out
+    #define FUSE(n) (remaining > (n) ? (remaining -= (n), 1) : 0)
+    #define EXECUTED() (budget - remaining)
+
+    uint16_t* reg = vm->reg;
+    decoded_instr* decode_cache = vm->decode_cache;
+    uint64_t remaining = budget;
+    int running = 1;
+    while (running && remaining) {
+        /* Main loop */
+
+        // fetch the decoded instruction at the address of the PC register and increment the PC register
+        // the instruction is read from memory and decoded only the first time it is reached (handler H_NONE)
+        decoded_instr* d = &decode_cache[reg[R_PC]++];
+    dispatch:
+        switch (d->handler) {
+            #include "handlers.h"
+        }
+        --remaining;
+    }
+out:
+    vm->running = running;
+    return budget - remaining;
+
+    #undef HANDLER
+    #undef NEXT
+    #undef REDISPATCH
+    #undef EXIT_LOOP
+    #undef WAIT_INPUT
+    #undef FUSE
+    #undef EXECUTED
+}
+
+#if HAVE_COMPUTED_GOTO
+static uint64_t run_threaded(vm* vm, uint64_t budget) {
+    /*
+        This function runs the main loop with the threaded dispatch engine.
+        The address of the code of every handler is stored in the labels table, indexed by the handler of the decode cache entry.
+        It returns the number of instructions executed.
+    */
+
+    static void* labels[H_COUNT] = {
+        [H_NONE] = &&op_H_NONE, [H_BR] = &&op_H_BR,
+        [H_ADD_REG] = &&op_H_ADD_REG, [H_ADD_IMM] = &&op_H_ADD_IMM,
+        [H_LD] = &&op_H_LD, [H_ST] = &&op_H_ST, [H_JSR] = &&op_H_JSR, [H_JSRR] = &&op_H_JSRR,
+        [H_AND_REG] = &&op_H_AND_REG, [H_AND_IMM] = &&op_H_AND_IMM,
+        [H_LDR] = &&op_H_LDR, [H_STR] = &&op_H_STR, [H_NOT] = &&op_H_NOT,
+        [H_LDI] = &&op_H_LDI, [H_STI] = &&op_H_STI, [H_JMP] = &&op_H_JMP,
+        [H_LEA] = &&op_H_LEA, [H_TRAP] = &&op_H_TRAP, [H_ILLEGAL] = &&op_H_ILLEGAL, [H_RTI] = &&op_H_RTI,
+        [H_LDI_POLL] = &&op_H_LDI_POLL, [H_LDR_POLL] = &&op_H_LDR_POLL, [H_JSR_NATIVE] = &&op_H_JSR_NATIVE,
+        [H_ADD_IMM_ADD_REG_BR] = &&op_H_ADD_IMM_ADD_REG_BR, [H_ADD_IMM_ADD_IMM_BR] = &&op_H_ADD_IMM_ADD_IMM_BR,
+        [H_ADD_IMM_BR] = &&op_H_ADD_IMM_BR, [H_ADD_REG_BR] = &&op_H_ADD_REG_BR,
+        [H_ADD_IMM_ADD_REG] = &&op_H_ADD_IMM_ADD_REG, [H_ADD_IMM_ADD_IMM] = &&op_H_ADD_IMM_ADD_IMM,
+        [H_AND_IMM_ADD_IMM] = &&op_H_AND_IMM_ADD_IMM, [H_LDR_ADD_IMM] = &&op_H_LDR_ADD_IMM
+    };
+
+    // the budget is counted down before the jump to the next handler
+    #define HANDLER(h) op_##h:
+    #define NEXT() if (--remaining == 0) goto out; d = &decode_cache[reg[R_PC]++]; goto *labels[d->handler]
+    #define REDISPATCH() goto *labels[d->handler]
+    #define EXIT_LOOP() { --remaining; goto out; }
+    #define WAIT_INPUT() goto out
+    #define FUSE(n) (remaining > (n) ? (remaining -= (n), 1) : 0)
+    #define EXECUTED() (budget - remaining)
+
+    uint16_t* reg = vm->reg;
+    decoded_instr* decode_cache = vm->decode_cache;
+    uint64_t remaining = budget;
+    int running = 1;
+    decoded_instr* d;
+    if (remaining == 0) return 0;
+    d = &decode_cache[reg[R_PC]++];
+    goto *labels[d->handler];
+    #include "handlers.h"
+
+out:
+    vm->running = running;
+    return budget - remaining;
+
+    #undef HANDLER
+    #undef NEXT
+    #undef REDISPATCH
+    #undef EXIT_LOOP
+    #undef WAIT_INPUT
+    #undef FUSE
+    #undef EXECUTED
+}
+#else
+static uint64_t run_threaded(vm* vm, uint64_t budget) {
+    /*
+        Computed goto is a GCC/Clang extension, other compilers fall back to the switch engine.
+    */
+
+    return run_switch(vm, budget);
+}
+#endif
+
+static int step(vm* vm, uint64_t executed) {
+    /*
+        This function executes the single instruction at the address of the PC register,
+        after executed instructions of the current vm_run.
+        It returns 0 if the program has halted, or if it waits for a key (vm->waiting_input is set).
+    */
+
+    #define HANDLER(h) case h:
+    #define NEXT() return 1
+    #define REDISPATCH() goto dispatch
+    #define EXIT_LOOP() return 0
+    #define WAIT_INPUT() return 0
+    #define FUSE(n) 0 // one instruction at a time
+    #define EXECUTED() executed
+
+    uint16_t* reg = vm->reg;
+    decoded_instr* decode_cache = vm->decode_cache;
+    int running = 1;
+    decoded_instr* d = &decode_cache[reg[R_PC]++];
+dispatch:
+    switch (d->handler) {
+        #include "handlers.h"
+    }
+    return running;
+
+    #undef HANDLER
+    #undef NEXT
+    #undef REDISPATCH
+    #undef EXIT_LOOP
+    #undef WAIT_INPUT
+    #undef FUSE
+    #undef EXECUTED
+}
+
+static uint64_t run_jit(vm* vm, uint64_t budget) {
+    /*
+        This function runs the main loop with the JIT tier.
+        Each iteration either runs compiled blocks, starting at the address of the PC register,
+        or interprets one basic block (up to and including its BR, JMP, JSR or TRAP) and counts it towards compiling it.
+        The last instructions of the budget, fewer than a block may hold, are always interpreted.
+        While the keyboard interrupt is enabled, the threaded engine runs the rest of the budget instead,
+        since the compiled blocks do not check the interrupts (a store that enables them leaves the native code).
+        It returns the number of instructions executed.
+    */
+
+    if (!vm->jit && !jit_init(vm)) {
+        fprintf(stderr, "the JIT is not available on this host, using the interpreter\n");
+        vm->engine = ENGINE_THREADED;
+        return run_threaded(vm, budget);
+    }
+
+    uint16_t* reg = vm->reg;
+    uint64_t remaining = budget;
+    int running = 1;
+    while (running && remaining) {
+        if (vm->interrupts) {
+            remaining -= run_threaded(vm, remaining);
+            goto out;
+        }
+        if (remaining >= JIT_MAX_INSTRS) {
+            uint32_t executed = jit_run(vm, remaining > UINT32_MAX ? UINT32_MAX : (uint32_t)remaining);
+            if (executed) { remaining -= executed; continue; }
+            if (jit_hot(vm, reg[R_PC]) && jit_compile(vm, reg[R_PC])) continue;
+        }
+
+        int block_end;
+        do {
+            decoded_instr* d = &vm->decode_cache[reg[R_PC]];
+            if (d->handler == H_NONE) {
+                decode_at(vm, reg[R_PC], budget - remaining);
+            }
+            block_end = d->handler == H_BR || d->handler == H_JMP || d->handler == H_JSR || d->handler == H_JSRR
+                || d->handler == H_TRAP || d->handler == H_ILLEGAL || d->handler == H_RTI || d->handler == H_JSR_NATIVE;
+            int native = d->handler == H_JSR_NATIVE;
+            running = step(vm, budget - remaining);
+            if (vm->waiting_input) goto out; // the instruction was not executed, and the program has not halted
+            --remaining;
+            if (native && !vm->interrupts) {
+                // step made the JSR to a native routine, which runs here when the rest of the budget holds it, like the handler does it
+                uint64_t cost = routine_cost(vm, d->r3);
+                if (cost && remaining > cost) {
+                    routine_call(vm, d->r3, cost);
+                    remaining -= cost;
+                }
+            }
+        } while (running && remaining && !block_end);
+    }
+    vm->running = running;
+out:
+    return budget - remaining;
+}
+
+static uint64_t run_profiled(vm* vm, uint64_t budget) {
+    /*
+        This function runs the main loop with the profiled engine: one instruction at a time with step,
+        recording every instruction in the profile of the machine (profile.c).
+        It is only used when the machine is profiled, so the other engines have no profiling code.
+        It returns the number of instructions executed.
+    */
+
+    uint16_t* reg = vm->reg;
+    uint64_t remaining = budget;
+    int running = 1;
+    while (running && remaining) {
+        uint16_t pc = reg[R_PC];
+        decoded_instr* d = &vm->decode_cache[pc];
+        if (d->handler == H_NONE) {
+            decode_at(vm, pc, budget - remaining);
+        }
+        uint16_t instr = vm_peek(vm, pc);
+        int taken = d->handler == H_BR && (d->r1 & cond_flags(reg[R_COND]));
+        running = step(vm, budget - remaining);
+        if (vm->waiting_input) goto out; // the instruction was not executed
+        --remaining;
+        profile_instr(vm->profile, pc, instr, taken, reg);
+    }
+    vm->running = running;
+out:
+    return budget - remaining;
+}
+
+static uint64_t run_traced(vm* vm, uint64_t budget) {
+    /*
+        This function runs the main loop with the traced engine: one instruction at a time with step,
+        writing a record of every instruction to the trace of the machine (trace.h).
+        The address of a memory access is computed from the operands of its instruction before it executes, like run_debug does;
+        the pointer of an LDI or STI is read without its device, so a pointer in the I/O page is only seen as the memory holds it.
+        It is only used when the machine is traced, so the other engines have no tracing code.
+        It returns the number of instructions executed.
+    */
+
+    vm_trace* t = vm->trace;
+    uint16_t* reg = vm->reg;
+    uint64_t remaining = budget;
+    int running = 1;
+    while (running && remaining) {
+        uint16_t pc = reg[R_PC];
+        decoded_instr* d = &vm->decode_cache[pc];
+        if (d->handler == H_NONE) {
+            decode_at(vm, pc, budget - remaining);
+        }
+        trace_record* r = trace_next(t);
+        r->pc = pc;
+        r->instr = vm_peek(vm, pc);
+        r->access = TRACE_NONE;
+        r->address = r->data = 0;
+        switch (first_handler[d->handler]) {
+            case H_LD: r->access = TRACE_LOAD; r->address = pc + 1 + d->imm; break;
+            case H_LDR: case H_LDR_POLL: r->access = TRACE_LOAD; r->address = reg[d->r2] + d->imm; break;
+            case H_LDI: case H_LDI_POLL: r->access = TRACE_LOAD; r->address = vm_peek(vm, (uint16_t)(pc + 1 + d->imm)); break;
+            case H_ST: r->access = TRACE_STORE; r->address = pc + 1 + d->imm; break;
+            case H_STR: r->access = TRACE_STORE; r->address = reg[d->r2] + d->imm; break;
+            case H_STI: r->access = TRACE_STORE; r->address = vm_peek(vm, (uint16_t)(pc + 1 + d->imm)); break;
+        }
+        uint16_t before[8];
+        memcpy(before, reg, sizeof(before));
+        uint8_t r1 = d->r1; // a store can overwrite the entry of its own instruction
+        running = step(vm, budget - remaining);
+        if (vm->waiting_input) goto out; // the instruction was not executed, its record is not committed
+        --remaining;
+        if (r->access != TRACE_NONE) r->data = reg[r1];
+        r->reg = TRACE_NO_REG;
+        r->value = 0;
+        for (int i = 0; i < 8; ++i) {
+            if (reg[i] != before[i]) {
+                r->reg = i;
+                r->value = reg[i];
+                break;
+            }
+        }
+        trace_commit(t);
+    }
+    vm->running = running;
+out:
+    trace_publish(t);
+    return budget - remaining;
+}
+
+static uint64_t run_debug(vm* vm, uint64_t budget) {
+    /*
+        This function runs the main loop with the debug engine: one instruction at a time with step, stopping before an instruction
+        at a breakpoint, after a store to a watched address, or after the steps of the debugger of the machine (debug.h).
+        The address of a store is computed from the operands of its ST, STR or STI before it executes; the pointer of an STI
+        is read without its device, so a pointer in the I/O page is only seen as the memory holds it.
+        It is only used while the debugger is active, so the other engines have no debugging code.
+        It returns the number of instructions executed.
+    */
+
+    vm_debugger* dbg = vm->debugger;
+    uint16_t* reg = vm->reg;
+    uint64_t remaining = budget;
+    int running = 1;
+    while (running && remaining) {
+        uint16_t pc = reg[R_PC];
+        if (dbg->breakpoints[pc] && !(dbg->resume && dbg->resume_pc == pc)) {
+            dbg->stop = DEBUG_BREAKPOINT;
+            dbg->resume = 1; // the next vm_run starts with this instruction
+            dbg->resume_pc = pc;
+            break;
+        }
+        dbg->resume = 0;
+        decoded_instr* d = &vm->decode_cache[pc];
+        if (d->handler == H_NONE) {
+            decode_at(vm, pc, budget - remaining);
+        }
+        int address = -1; // the address this instruction stores to, if any
+        switch (first_handler[d->handler]) {
+            case H_ST: address = (uint16_t)(pc + 1 + d->imm); break;
+            case H_STR: address = (uint16_t)(reg[d->r2] + d->imm); break;
+            case H_STI: address = vm_peek(vm, (uint16_t)(pc + 1 + d->imm)); break;
+        }
+        uint16_t old = address >= 0 ? vm_peek(vm, (uint16_t)address) : 0;
+        running = step(vm, budget - remaining);
+        if (vm->waiting_input) goto out; // the instruction was not executed
+        --remaining;
+        if (address >= 0 && dbg->watchpoints[address]) {
+            dbg->stop = DEBUG_WATCHPOINT;
+            dbg->watch_address = (uint16_t)address;
+            dbg->watch_old = old;
+            dbg->watch_new = vm_peek(vm, (uint16_t)address);
+            break;
+        }
+        if (dbg->steps && --dbg->steps == 0) {
+            dbg->stop = DEBUG_STEP;
+            break;
+        }
+    }
+    vm->running = running;
+out:
+    return budget - remaining;
+}
+
+int vm_run(vm* vm, uint64_t budget) {
+    /*
+        This function runs the program of the machine with its engine, for at most budget instructions.
+        It returns VM_HALTED once the program has halted, VM_ILLEGAL once it has reached an illegal instruction,
+        or VM_BUDGET if the budget was used up first, in which case calling vm_run again continues the program where it stopped.
+        When park_on_input is set, it returns VM_BLOCKED if the program waits for a key (see VM_IDLE_POLL_RATIO).
+        It returns VM_BREAK if the debugger of the machine stopped it (see debug.h).
+        It returns VM_ERROR without running anything if the machine is hibernated and its checkpoint can't be read back:
+        the machine stays hibernated, and the caller reports it (a scheduler retires that one task).
+    */
+
+    if (vm->hibernated && !checkpoint_resume(vm)) return VM_ERROR;
+    if (!vm->running) return vm->illegal ? VM_ILLEGAL : VM_HALTED;
+    vm->started = 1;
+    vm->waiting_input = 0;
+    vm_update_interrupts(vm); // also after an image, a snapshot or a fork wrote MR_KBSR or the PSR
+    vm->empty_polls = 0;
+
+    uint64_t executed;
+    int loop; // the loop that runs, for the performance counters
+    if (vm->debugger) vm->debugger->stop = DEBUG_NONE;
+    if (vm->pmu) pmu_begin(vm->pmu);
+    if (vm->metrics) metrics_run_begin(vm->metrics);
+    if (vm->debugger && debug_active(vm->debugger)) {
+        executed = run_debug(vm, budget);
+        loop = PMU_DEBUG;
+    } else if (vm->profile) {
+        executed = run_profiled(vm, budget);
+        loop = PMU_PROFILED;
+    } else if (vm->trace) {
+        executed = run_traced(vm, budget);
+        loop = PMU_TRACED;
+    } else {
+        if (vm->engine == ENGINE_JIT) {
+            executed = run_jit(vm, budget);
+        } else if (vm->engine == ENGINE_THREADED) {
+            executed = run_threaded(vm, budget);
+        } else {
+            executed = run_switch(vm, budget);
+        }
+        loop = vm->engine; // the threaded engine when the JIT is not available
+    }
+    if (vm->pmu) pmu_end(vm->pmu, loop, executed);
+    vm->instructions += executed;
+    int result = VM_BUDGET;
+    if (!vm->running) {
+        result = vm->illegal ? VM_ILLEGAL : VM_HALTED;
+    } else if (vm->debugger && vm->debugger->stop != DEBUG_NONE) {
+        result = VM_BREAK;
+    } else if (vm->park_on_input && (vm->waiting_input || (vm->empty_polls && vm->empty_polls * VM_IDLE_POLL_RATIO >= executed))) {
+        result = VM_BLOCKED;
+    }
+    if (vm->metrics) metrics_run_end(vm->metrics, executed, result);
+    return result;
+}
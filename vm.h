@@ -0,0 +1,206 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "lc3.h"
+#include "output.h"
+#include "routine.h"
+
+/*
+    A virtual machine: the whole state of one LC-3 computer.
+    Every function of the interpreter takes the machine it works on, so that any number of machines can live in one process.
+*/
+
+// The engines that execute the instructions of a machine (see vm_run)
+enum
+{
+    ENGINE_SWITCH = 0,
+    ENGINE_THREADED,
+    ENGINE_JIT
+};
+
+// The reasons why vm_run returns
+enum
+{
+    VM_HALTED = 0, // the program executed TRAP_HALT
+    VM_BUDGET,     // the program executed the number of instructions it was given, and can be resumed
+    VM_BLOCKED,    // the program waits for a key (only when park_on_input is set), and can be resumed once key_ready returns 1
+    VM_ILLEGAL,    // the program reached an illegal instruction (RES, or RTI in user mode) without a routine for its exception
+                   // in the vector table; it was not executed: reg[R_PC] is its address
+    VM_BREAK,      // the debugger stopped the program at a breakpoint, a watchpoint or after its steps (see debug.h), and it can be resumed
+    VM_ERROR       // the machine is hibernated and its checkpoint could not be read back (see checkpoint_resume): it is still hibernated
+};
+
+/*
+    A machine whose budget went mostly into polling an empty MR_KBSR is also blocked:
+    vm_run returns VM_BLOCKED when at least one instruction in VM_IDLE_POLL_RATIO was an empty poll.
+*/
+#define VM_IDLE_POLL_RATIO 16
+
+/*
+    The I/O hooks connect the keyboard and the console of the machine to the host.
+        key_ready: returns 1 if a key can be read without waiting (polled by MR_KBSR reads)
+        read_key: returns the next key, waiting for one if needed (TRAP_GETC, TRAP_IN, MR_KBDR), or EOF
+        write: writes a block of console output (called when the output buffer of the machine is flushed)
+        wait_key: optional, returns once key_ready would return 1, so a program that waits for a key in an idle loop
+                  (see H_LDI_POLL) does not keep the host thread busy; NULL to keep polling
+    user is passed to every hook.
+*/
+typedef struct
+{
+    int (*key_ready)(void* user);
+    int (*read_key)(void* user);
+    void (*write)(void* user, const char* buf, size_t n);
+    void* user;
+    void (*wait_key)(void* user);
+} vm_io;
+
+/*
+    The memory of a machine is split into VM_PAGES pages of VM_PAGE_WORDS words.
+    A page can be shared by several machines (see snapshot.h): refs counts the machines and snapshots that use it,
+    and a machine copies a shared page the first time it writes to it (copy-on-write), so a shared page is never written.
+    Pages that were never written are all the same zero page.
+*/
+#define VM_PAGE_SHIFT 8
+#define VM_PAGE_WORDS (1 << VM_PAGE_SHIFT)
+#define VM_PAGE_MASK (VM_PAGE_WORDS - 1)
+#define VM_PAGES (MEMORY_MAX >> VM_PAGE_SHIFT)
+
+typedef struct
+{
+    atomic_int refs;
+    uint16_t words[VM_PAGE_WORDS];
+} vm_page;
+
+/*
+    The superinstructions (H_FUSED to H_COUNT - 1): the handlers of the instructions they are made of, in order.
+    The interpreter engines execute a sequence found in a basic block with the handler of its superinstruction,
+    one dispatch instead of one per instruction, unless the build sets NO_FUSION.
+*/
+#define FUSION_MAX_LENGTH 3
+
+typedef struct
+{
+    const char* name;
+    int length;
+    uint8_t handlers[FUSION_MAX_LENGTH];
+} vm_fusion;
+
+extern const vm_fusion vm_fusions[FUSION_COUNT]; // indexed by the handler of the superinstruction minus H_FUSED
+
+typedef struct jit_context jit_context;
+typedef struct vm_profile vm_profile;
+typedef struct vm_debugger vm_debugger;
+typedef struct vm_trace vm_trace;
+typedef struct vm_pmu vm_pmu;
+typedef struct vm_checkpoint vm_checkpoint;
+typedef struct vm_metrics vm_metrics;
+typedef struct vm vm;
+
+/*
+    The I/O page, from VM_IO_BASE to the end of the memory, holds the memory mapped registers of the devices.
+    A device covers the addresses first to last of the I/O page: its read hook is called instead of reading the memory,
+    and its write hook instead of writing it (a NULL hook leaves the memory access as it is).
+    Loads and stores below VM_IO_BASE never look at the devices.
+    Every machine has the keyboard (MR_KBSR, read as MR_KBDR), and vm_add_device adds more, like a timer or a display.
+*/
+#define VM_IO_BASE 0xFE00
+#define VM_MAX_DEVICES 8
+
+typedef uint16_t (*vm_device_read)(vm* vm, uint16_t address, void* user);
+typedef void (*vm_device_write)(vm* vm, uint16_t address, uint16_t val, void* user);
+
+typedef struct
+{
+    uint16_t first, last;
+    vm_device_read read;
+    vm_device_write write;
+    void* user;
+} vm_device;
+
+struct vm
+{
+    vm_page* pages[VM_PAGES];                // the memory of the machine
+    uint16_t reg[R_COUNT];                   // the registers of the machine
+    decoded_instr* decode_cache;             // the decoded form of the instruction stored at each memory address (MEMORY_MAX entries)
+    int running;                             // cleared when the program halts or reaches an illegal instruction
+    int illegal;                             // set when the program stopped at an illegal instruction (VM_ILLEGAL)
+    int engine;                              // the engine vm_run uses (ENGINE_SWITCH, ENGINE_THREADED or ENGINE_JIT)
+    uint16_t psr;                            // the privilege and the priority level of the PSR, the condition codes are reg[R_COND]
+    uint16_t saved_usp, saved_ssp;           // R6 of the stack that is not in use: the user one in supervisor mode and the other way round
+    int interrupts;                          // the keyboard interrupt is enabled and the priority level of the program is below its own
+    uint64_t instructions;                   // number of instructions executed so far
+    uint64_t io_instructions;                // value of instructions when the last TRAP_GETC, TRAP_IN or read of the I/O page began
+                                             // (exact in the interpreter engines, not updated by the compiled blocks of the JIT)
+    int started;                             // vm_run was called, so the decode cache and the JIT may hold entries
+    int park_on_input;                       // return VM_BLOCKED instead of waiting in read_key when no key is ready
+    int waiting_input;                       // set when TRAP_GETC or TRAP_IN stopped vm_run to wait for a key
+    uint64_t empty_polls;                    // number of MR_KBSR reads without a key during the last vm_run
+    uint64_t fusions[FUSION_COUNT];          // times every superinstruction executed its whole sequence (see vm_fusions)
+    uint64_t routines[ROUTINE_COUNT];        // times every guest library routine ran natively (see routine.h)
+    int check_routines;                      // interpret every native routine on a fork too, and compare the results
+    uint64_t routine_mismatches;             // native routines whose result differed from the interpreter
+    vm_io io;
+    output_buffer out;                       // the buffered console output
+    jit_context* jit;                        // the compiled blocks of the JIT tier, NULL until the JIT is used
+    const uint16_t* jit_cover;               // number of compiled blocks containing each address (see jit.h)
+    vm_profile* profile;                     // when set, vm_run uses the profiled engine and records every instruction (see profile.h)
+    vm_trace* trace;                         // when set, vm_run uses the traced engine and writes a record of every instruction (see trace.h)
+    vm_pmu* pmu;                             // when set, vm_run reads the host performance counters around its engine (see pmu.h)
+    vm_debugger* debugger;                   // when set, vm_run uses the debug engine while it has something to check (see debug.h)
+    vm_metrics* metrics;                     // when set, vm_run and the traps count the live metrics of the machine (see metrics.h)
+    vm_checkpoint* hibernated;               // when set, the machine is in a checkpoint file, and vm_run resumes it first (see checkpoint.h)
+    vm_device devices[VM_MAX_DEVICES];       // the devices of the I/O page
+    int device_count;
+};
+
+vm* vm_create(const vm_io* io);
+void vm_destroy(vm* vm);
+void vm_set_io(vm* vm, const vm_io* io);
+int read_image_file(vm* vm, FILE* file);
+int read_image(vm* vm, const char* image_path);
+int vm_run(vm* vm, uint64_t budget);
+
+void mem_write(vm* vm, uint16_t address, uint16_t val);
+uint16_t vm_io_read(vm* vm, uint16_t address);
+void trap_puts(vm* vm, uint16_t address, int packed);
+int vm_add_device(vm* vm, uint16_t first, uint16_t last, vm_device_read read, vm_device_write write, void* user);
+void vm_update_interrupts(vm* vm);
+void vm_free_caches(vm* vm);
+int vm_alloc_caches(vm* vm);
+
+vm_page* vm_own_page(vm* vm, int page);
+void vm_page_release(vm_page* page);
+void vm_set_page(vm* vm, int page, vm_page* shared);
+
+static inline uint16_t vm_peek(const vm* vm, uint16_t address) {
+    // read a memory word without the side effects of mem_read (the devices are not read)
+    return vm->pages[address >> VM_PAGE_SHIFT]->words[address & VM_PAGE_MASK];
+}
+
+static inline uint16_t vm_psr(const vm* vm) {
+    // the whole PSR, with the condition codes of the last result
+    return vm->psr | cond_flags(vm->reg[R_COND]);
+}
+
+static inline uint16_t mem_read(vm* vm, uint16_t address) {
+    // read a memory word; only the addresses of the I/O page go to the devices
+    if (address >= VM_IO_BASE) return vm_io_read(vm, address);
+    return vm_peek(vm, address);
+}
+
+static inline void vm_poke(vm* vm, uint16_t address, uint16_t val) {
+    // write a memory word without the bookkeeping of mem_write, copying its page first if it is shared
+    // (a write of the value the word already holds leaves a shared page shared)
+    vm_page* page = vm->pages[address >> VM_PAGE_SHIFT];
+    if (atomic_load_explicit(&page->refs, memory_order_acquire) != 1) {
+        if (page->words[address & VM_PAGE_MASK] == val) return;
+        page = vm_own_page(vm, address >> VM_PAGE_SHIFT);
+    }
+    page->words[address & VM_PAGE_MASK] = val;
+}
+
+#endif